@@ -2,20 +2,21 @@
  * MIT License
  * Copyright (c) 2018-2023 Mahyar Koshkouei
  *
- * Performs a benchmark of Peanut-GB with a specified ROM.
- * Plays the ROM five times and prints the FPS for each play.
+ * Performs a benchmark of Walnut-CGB with the specified ROMs.
+ * Plays each ROM five times and prints the FPS for each play, followed by the
+ * average.
  */
 #ifndef ENABLE_LCD
 # define ENABLE_LCD 1
 #endif
 
 /* Sound is disabled for this project. */
-#ifndef ENABLE_LCD
+#ifndef ENABLE_SOUND
 # define ENABLE_SOUND 0
 #endif
 
 /* Import emulator library. */
-#include "../../peanut_gb.h"
+#include "../../walnut_cgb.h"
 
 #include <errno.h>
 #include <string.h>
@@ -27,6 +28,7 @@ struct priv_t
 {
 	/* Pointer to allocated memory holding GB file. */
 	uint8_t *rom;
+	size_t rom_size;
 	/* Pointer to allocated memory holding save file. */
 	uint8_t *cart_ram;
 
@@ -43,6 +45,26 @@ static uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr)
 	return p->rom[addr];
 }
 
+/**
+ * Returns two bytes from the ROM file at the given address.
+ */
+static uint16_t gb_rom_read_16bit(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	return p->rom[addr] | (p->rom[addr + 1] << 8);
+}
+
+/**
+ * Returns four bytes from the ROM file at the given address.
+ */
+static uint32_t gb_rom_read_32bit(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	return (uint32_t)p->rom[addr] | ((uint32_t)p->rom[addr + 1] << 8) |
+		((uint32_t)p->rom[addr + 2] << 16) |
+		((uint32_t)p->rom[addr + 3] << 24);
+}
+
 /**
  * Returns a byte from the cartridge RAM at the given address.
  */
@@ -65,7 +87,7 @@ static void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
 /**
  * Returns a pointer to the allocated space containing the ROM. Must be freed.
  */
-static uint8_t *read_rom_to_ram(const char *file_name)
+static uint8_t *read_rom_to_ram(const char *file_name, size_t *size)
 {
 	FILE *rom_file = fopen(file_name, "rb");
 	size_t rom_size;
@@ -87,6 +109,7 @@ static uint8_t *read_rom_to_ram(const char *file_name)
 	}
 
 	fclose(rom_file);
+	*size = rom_size;
 	return rom;
 }
 
@@ -125,34 +148,18 @@ static void lcd_draw_line(struct gb_s *gb, const uint8_t pixels[160],
 
 	for (unsigned int x = 0; x < LCD_WIDTH; x++)
 	{
-#if PEANUT_GB_16BIT_COLOUR
 		priv->fb[line][x] = palette[pixels[x] & 3];
-#else
-		priv->fb[line][x] = palette[pixels[x]];
-#endif
 	}
 }
 #endif
 
-int main(int argc, char **argv)
+/**
+ * Plays a ROM five times and returns the average FPS.
+ */
+static double benchmark_rom(const char *rom_file_name,
+		uint_fast32_t frames_per_run, int dualfetch)
 {
-	uint_fast32_t frames_per_run = 64 * 1024;
-	char *rom_file_name = NULL;
-
-	for(int i = 1; i < argc; i++) {
-		if(strcmp(argv[i], "--frames") == 0)
-			if (++i == argc)
-				frames_per_run = 0;
-			else
-				frames_per_run = atoi(argv[i]);
-		else
-			rom_file_name = argv[i];
-	}
-
-	if(!rom_file_name || !frames_per_run) {
-		fprintf(stderr, "Syntax: %s [--frames <f>] <ROM>\n", argv[0]);
-		exit(EXIT_FAILURE);
-	}
+	double total_fps = 0;
 
 	for(unsigned int i = 0; i < 5; i++)
 	{
@@ -166,23 +173,28 @@ int main(int argc, char **argv)
 		enum gb_init_error_e ret;
 
 		/* Copy input ROM file to allocated memory. */
-		if((priv.rom = read_rom_to_ram(rom_file_name)) == NULL)
+		if((priv.rom = read_rom_to_ram(rom_file_name, &priv.rom_size)) == NULL)
 		{
 			printf("%d: %s\n", __LINE__, strerror(errno));
 			exit(EXIT_FAILURE);
 		}
 
 		/* Initialise context. */
-		ret = gb_init(&gb, &gb_rom_read, &gb_cart_ram_read,
+		ret = gb_init(&gb, &gb_rom_read, &gb_rom_read_16bit,
+				&gb_rom_read_32bit, &gb_cart_ram_read,
 				&gb_cart_ram_write, &gb_error, &priv);
 
 		if(ret != GB_INIT_NO_ERROR)
 		{
-			fprintf(stderr, "Peanut-GB failed to initialise: %d\n",
+			fprintf(stderr, "Walnut-CGB failed to initialise: %d\n",
 					ret);
 			exit(EXIT_FAILURE);
 		}
 
+#if WALNUT_GB_PAGE_TABLE
+		gb_set_rom_direct(&gb, priv.rom, priv.rom_size);
+#endif
+
 		printf("Run %u: ", i);
 		if(gb_get_save_size_s(&gb, &save_size) != 0)
 		{
@@ -191,6 +203,9 @@ int main(int argc, char **argv)
 		}
 
 		priv.cart_ram = malloc(save_size);
+#if WALNUT_GB_PAGE_TABLE
+		gb_set_cart_ram_direct(&gb, priv.cart_ram, save_size);
+#endif
 
 #if ENABLE_LCD
 		gb_init_lcd(&gb, &lcd_draw_line);
@@ -203,7 +218,10 @@ int main(int argc, char **argv)
 		{
 			/* Execute CPU cycles until the screen has to be
 			 * redrawn. */
-			gb_run_frame(&gb);
+			if(dualfetch)
+				gb_run_frame_dualfetch(&gb);
+			else
+				gb_run_frame(&gb);
 		}
 		while(++frames < frames_per_run);
 
@@ -212,11 +230,57 @@ int main(int argc, char **argv)
 				(double)(clock() - start_time) / CLOCKS_PER_SEC;
 			double fps = frames / duration;
 			printf("%f FPS, dur: %f\n", fps, duration);
+			total_fps += fps;
 		}
 
 		free(priv.cart_ram);
 		free(priv.rom);
 	}
 
+	return total_fps / 5;
+}
+
+int main(int argc, char **argv)
+{
+	uint_fast32_t frames_per_run = 64 * 1024;
+	int dualfetch = 1;
+	int roms = 0;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--frames") == 0)
+			if (++i == argc)
+				frames_per_run = 0;
+			else
+				frames_per_run = atoi(argv[i]);
+		else if(strcmp(argv[i], "--single") == 0)
+			dualfetch = 0;
+		else
+			roms++;
+	}
+
+	if(!roms || !frames_per_run) {
+		fprintf(stderr, "Syntax: %s [--frames <f>] [--single] <ROM>...\n",
+				argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	for(int i = 1; i < argc; i++)
+	{
+		double fps;
+
+		if(strcmp(argv[i], "--frames") == 0)
+		{
+			i++;
+			continue;
+		}
+		else if(strcmp(argv[i], "--single") == 0)
+			continue;
+
+		printf("%s (%s):\n", argv[i],
+				dualfetch ? "gb_run_frame_dualfetch" : "gb_run_frame");
+		fps = benchmark_rom(argv[i], frames_per_run, dualfetch);
+		printf("Average: %f FPS\n", fps);
+	}
+
 	return EXIT_SUCCESS;
 }
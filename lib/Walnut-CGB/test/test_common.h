@@ -0,0 +1,149 @@
+/**
+ * Setup shared by the tests that run a ROM file on emulator contexts: the
+ * cartridge callbacks, loading the ROM and initialising a context.
+ *
+ * Include after walnut_cgb.h. The private data of each context starts with a
+ * struct test_cart, followed by whatever the test needs, for example:
+ *
+ *	struct priv
+ *	{
+ *		struct test_cart cart;
+ *		uint8_t fb[LCD_HEIGHT][LCD_WIDTH];
+ *	};
+ *
+ * init_context() leaves the LCD callbacks to the test.
+ */
+#ifndef TEST_COMMON_H
+#define TEST_COMMON_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct test_cart
+{
+	/* Printed with errors; may be NULL. */
+	const char *name;
+	uint8_t *rom;
+	size_t rom_sz;
+	uint8_t *cart_ram;
+	size_t cart_ram_sz;
+};
+
+/**
+ * Return byte from ROM.
+ */
+static uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct test_cart *c = gb->direct.priv;
+	return addr < c->rom_sz ? c->rom[addr] : 0xFF;
+}
+
+static uint16_t gb_rom_read_16bit(struct gb_s *gb, const uint_fast32_t addr)
+{
+	return gb_rom_read(gb, addr) | (gb_rom_read(gb, addr + 1) << 8);
+}
+
+static uint32_t gb_rom_read_32bit(struct gb_s *gb, const uint_fast32_t addr)
+{
+	return (uint32_t)gb_rom_read_16bit(gb, addr) |
+		((uint32_t)gb_rom_read_16bit(gb, addr + 2) << 16);
+}
+
+static uint8_t gb_cart_ram_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct test_cart *c = gb->direct.priv;
+	return addr < c->cart_ram_sz ? c->cart_ram[addr] : 0xFF;
+}
+
+static void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
+		const uint8_t val)
+{
+	struct test_cart *c = gb->direct.priv;
+
+	if(addr < c->cart_ram_sz)
+		c->cart_ram[addr] = val;
+}
+
+/**
+ * An error on any context ends the test.
+ */
+static void gb_error(struct gb_s *gb, const enum gb_error_e gb_err,
+		const uint16_t val)
+{
+	const struct test_cart *c = gb->direct.priv;
+
+	if(c->name != NULL)
+		printf("%s: ", c->name);
+	printf("error %d at %04X\n", gb_err, val);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * Returns a pointer to the allocated space containing the ROM. Must be freed.
+ */
+static uint8_t *read_rom_to_ram(const char *file_name, size_t *sz)
+{
+	FILE *rom_file = fopen(file_name, "rb");
+	size_t rom_size;
+	uint8_t *rom = NULL;
+
+	if(rom_file == NULL)
+		return NULL;
+
+	fseek(rom_file, 0, SEEK_END);
+	rom_size = ftell(rom_file);
+	rewind(rom_file);
+	rom = malloc(rom_size);
+
+	if(fread(rom, sizeof(uint8_t), rom_size, rom_file) != rom_size)
+	{
+		free(rom);
+		fclose(rom_file);
+		return NULL;
+	}
+
+	fclose(rom_file);
+	*sz = rom_size;
+	return rom;
+}
+
+/**
+ * Initialises gb to run rom with the private data c, and allocates its cart
+ * RAM, which the caller frees.
+ */
+static int init_context(struct gb_s *gb, struct test_cart *c,
+		const char *name, uint8_t *rom, size_t rom_sz)
+{
+	enum gb_init_error_e ret;
+
+	memset(c, 0, sizeof(*c));
+	c->name = name;
+	c->rom = rom;
+	c->rom_sz = rom_sz;
+
+	ret = gb_init(gb, &gb_rom_read, &gb_rom_read_16bit,
+			&gb_rom_read_32bit, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, c);
+
+	if(ret != GB_INIT_NO_ERROR)
+	{
+		fprintf(stderr, "Walnut-CGB failed to initialise: %d\n", ret);
+		return -1;
+	}
+
+#if WALNUT_GB_PAGE_TABLE
+	gb_set_rom_direct(gb, rom, rom_sz);
+#endif
+
+	if(gb_get_save_size_s(gb, &c->cart_ram_sz) != 0)
+		return -1;
+
+	c->cart_ram = calloc(c->cart_ram_sz ? c->cart_ram_sz : 1, 1);
+#if WALNUT_GB_PAGE_TABLE
+	gb_set_cart_ram_direct(gb, c->cart_ram, c->cart_ram_sz);
+#endif
+	return 0;
+}
+
+#endif /* TEST_COMMON_H */
@@ -0,0 +1,159 @@
+/**
+ * Runs a ROM on two emulator contexts: one draws its lines as it runs, the
+ * other records them with gb_set_line_log() and a second thread draws them
+ * with gb_draw_logged_lines(). The drawing thread compares each frame it
+ * finishes with the same frame from the first context, and the first frame
+ * that differs is reported with the lines that differ. The log is small, so the
+ * emulation thread also waits for the drawing thread within frames.
+ *
+ * Build with the LCD options under test, for example:
+ *	make test_deferred CFLAGS=-DWALNUT_GB_TILE_CACHE=0
+ */
+#define ENABLE_SOUND 0
+#define ENABLE_LCD 1
+#define WALNUT_GB_DEFERRED_LCD 1
+
+#include "../walnut_cgb.h"
+#include "test_common.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+/* Frames the emulation thread may run ahead of the drawing thread. */
+#define FRAMES_AHEAD	8
+
+struct priv
+{
+	struct test_cart cart;
+	uint16_t fb[LCD_HEIGHT][LCD_WIDTH];
+};
+
+static struct gb_s gb_ref, gb_def, gb_render;
+static struct priv priv_ref, priv_def;
+static struct gb_line_log_s line_log;
+
+/* Frames of gb_ref, written before gb_def runs the same frame. */
+static uint16_t ref_frames[FRAMES_AHEAD][LCD_HEIGHT][LCD_WIDTH];
+/* Written by the drawing thread only. */
+static unsigned long frames_checked;
+
+/* Distinct colours for each DMG layer and shade. */
+static const uint16_t dmg_palette[12] = {
+	0x7FFF, 0x5294, 0x294A, 0x0000,
+	0x7C00, 0x5000, 0x2800, 0x0400,
+	0x03FF, 0x0294, 0x014A, 0x0021
+};
+
+static uint16_t *lcd_line_rgb565(struct gb_s *gb, const uint_fast8_t line)
+{
+	struct priv *p = gb->direct.priv;
+	return p->fb[line];
+}
+
+/**
+ * Draws the logged frames and compares them with the reference frames until
+ * all frames are checked. A difference ends the test.
+ */
+static void *draw_thread(void *arg)
+{
+	unsigned long frames = *(const unsigned long *)arg;
+
+	while(frames_checked < frames)
+	{
+		unsigned long frame = frames_checked;
+		unsigned line, lines = 0;
+
+		if(!gb_draw_logged_lines(&gb_render, &line_log))
+		{
+			sched_yield();
+			continue;
+		}
+
+		for(line = 0; line < LCD_HEIGHT; line++)
+		{
+			if(memcmp(priv_def.fb[line],
+					ref_frames[frame % FRAMES_AHEAD][line],
+					sizeof(priv_def.fb[line])) == 0)
+				continue;
+
+			if(lines++ == 0)
+				printf("Frame %lu differs:\n", frame);
+			if(lines <= 8)
+				printf("  line %u\n", line);
+		}
+
+		if(lines != 0)
+		{
+			printf("  %u lines differ\n", lines);
+			exit(EXIT_FAILURE);
+		}
+
+		__atomic_store_n(&frames_checked, frame + 1, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	uint8_t *rom;
+	size_t rom_sz;
+	unsigned long frames = 3600, frame;
+	pthread_t thread;
+	int ret = EXIT_FAILURE;
+
+	if(argc != 2 && argc != 3)
+	{
+		printf("Usage: %s ROM [FRAMES]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if(argc == 3)
+		frames = strtoul(argv[2], NULL, 10);
+
+	if((rom = read_rom_to_ram(argv[1], &rom_sz)) == NULL)
+	{
+		perror("ROM read failed");
+		return EXIT_FAILURE;
+	}
+
+	if(init_context(&gb_ref, &priv_ref.cart, NULL, rom, rom_sz) ||
+			init_context(&gb_def, &priv_def.cart, NULL, rom, rom_sz))
+		goto out;
+
+	gb_init_lcd_rgb565(&gb_ref, &lcd_line_rgb565);
+	gb_set_palette_rgb565(&gb_ref, dmg_palette);
+	gb_init_lcd_rgb565(&gb_def, &lcd_line_rgb565);
+	gb_set_palette_rgb565(&gb_def, dmg_palette);
+
+	gb_set_line_log(&gb_def, &gb_render, &line_log);
+
+	if(pthread_create(&thread, NULL, draw_thread, &frames) != 0)
+	{
+		perror("pthread_create");
+		goto out;
+	}
+
+	for(frame = 0; frame < frames; frame++)
+	{
+		/* Keep the reference frame until it has been checked. */
+		while(frame - __atomic_load_n(&frames_checked,
+					__ATOMIC_ACQUIRE) >= FRAMES_AHEAD)
+			sched_yield();
+
+		gb_run_frame_dualfetch(&gb_ref);
+		memcpy(ref_frames[frame % FRAMES_AHEAD], priv_ref.fb,
+				sizeof(priv_ref.fb));
+		gb_run_frame_dualfetch(&gb_def);
+	}
+
+	pthread_join(thread, NULL);
+	printf("%lu frames, no differences\n", frames);
+	ret = EXIT_SUCCESS;
+
+out:
+	free(priv_ref.cart.cart_ram);
+	free(priv_def.cart.cart_ram);
+	free(rom);
+	return ret;
+}
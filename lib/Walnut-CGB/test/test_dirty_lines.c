@@ -0,0 +1,199 @@
+/**
+ * Runs a ROM on two emulator contexts that only draw the lines that changed.
+ * The reference context is made to draw every line of every frame with
+ * gb_redraw_lines(), and the frame buffers of both contexts are compared after
+ * each frame. The first frame that differs is reported with the lines that
+ * differ.
+ *
+ * A line the core asks for is filled with a colour no palette has the first
+ * time in a frame, as a front-end that reuses its line memory would have it,
+ * so a line that is not drawn whole shows up.
+ *
+ * Without a ROM, a built-in one is run that leaves the screen as it is but
+ * changes BGP in the middle of a line every fourth frame, so that line is
+ * drawn again from the middle right after being skipped as unchanged.
+ *
+ * Build with the LCD options under test, for example:
+ *	make test_dirty_lines CFLAGS=-DWALNUT_GB_TILE_CACHE=0
+ */
+#define ENABLE_SOUND 0
+#define ENABLE_LCD 1
+#define WALNUT_GB_DIRTY_LINES 1
+
+/* As on the ESP32 front-end. */
+#ifndef WALNUT_GB_LINE_SPANS
+# define WALNUT_GB_LINE_SPANS 1
+#endif
+
+#include "../walnut_cgb.h"
+#include "test_common.h"
+
+struct priv
+{
+	struct test_cart cart;
+	uint16_t fb[LCD_HEIGHT][LCD_WIDTH];
+	/* Lines asked for in this frame. */
+	bool requested[LCD_HEIGHT];
+};
+
+static struct gb_s gb_ref, gb_dirty;
+static struct priv priv_ref, priv_dirty;
+
+/* Distinct colours for each DMG layer and shade. */
+static const uint16_t dmg_palette[12] = {
+	0x7FFF, 0x5294, 0x294A, 0x0000,
+	0x7C00, 0x5000, 0x2800, 0x0400,
+	0x03FF, 0x0294, 0x014A, 0x0021
+};
+#define POISON 0xF81F
+
+/* Code of the built-in ROM, run from 0x150. */
+static const uint8_t mid_line_code[] = {
+	0x31, 0xFE, 0xFF,	/* ld sp, $FFFE */
+	0x3E, 0xE4,		/* ld a, $E4 */
+	0xE0, 0x47,		/* ldh (BGP), a */
+	0x0E, 0x00,		/* ld c, 0 */
+				/* frame: */
+	0xF0, 0x44,		/* ldh a, (LY) */
+	0xFE, 0x3C,		/* cp 60 */
+	0x20, 0xFA,		/* jr nz, frame */
+	0x79,			/* ld a, c */
+	0xE6, 0x03,		/* and 3 */
+	0x20, 0x16,		/* jr nz, vblank */
+				/* mode3: */
+	0xF0, 0x41,		/* ldh a, (STAT) */
+	0xE6, 0x03,		/* and 3 */
+	0xFE, 0x03,		/* cp 3 */
+	0x20, 0xF8,		/* jr nz, mode3 */
+	0x3E, 0x1B,		/* ld a, $1B */
+	0xE0, 0x47,		/* ldh (BGP), a */
+				/* hblank: */
+	0xF0, 0x41,		/* ldh a, (STAT) */
+	0xE6, 0x03,		/* and 3 */
+	0x20, 0xFA,		/* jr nz, hblank */
+	0x3E, 0xE4,		/* ld a, $E4 */
+	0xE0, 0x47,		/* ldh (BGP), a */
+				/* vblank: */
+	0xF0, 0x44,		/* ldh a, (LY) */
+	0xFE, 0x90,		/* cp 144 */
+	0x20, 0xFA,		/* jr nz, vblank */
+	0x0C,			/* inc c */
+	0x18, 0xD6		/* jr frame */
+};
+
+static uint16_t *lcd_line_rgb565(struct gb_s *gb, const uint_fast8_t line)
+{
+	struct priv *p = gb->direct.priv;
+
+	if(!p->requested[line])
+	{
+		unsigned x;
+
+		for(x = 0; x < LCD_WIDTH; x++)
+			p->fb[line][x] = POISON;
+		p->requested[line] = true;
+	}
+
+	return p->fb[line];
+}
+
+/**
+ * Returns a pointer to the built-in ROM. Must be freed.
+ */
+static uint8_t *mid_line_rom(size_t *sz)
+{
+	const size_t rom_size = 0x8000;
+	uint8_t *rom = calloc(rom_size, 1);
+	uint8_t chk = 0;
+	unsigned i;
+
+	/* nop; jp $0150 */
+	rom[0x100] = 0x00;
+	rom[0x101] = 0xC3;
+	rom[0x102] = 0x50;
+	rom[0x103] = 0x01;
+	memcpy(&rom[0x150], mid_line_code, sizeof(mid_line_code));
+
+	for(i = 0x134; i < ROM_HEADER_CHECKSUM_LOC; i++)
+		chk = chk - rom[i] - 1;
+	rom[ROM_HEADER_CHECKSUM_LOC] = chk;
+
+	*sz = rom_size;
+	return rom;
+}
+
+int main(int argc, char *argv[])
+{
+	uint8_t *rom;
+	size_t rom_sz;
+	unsigned long frames = 3600, frame;
+	struct gb_line_stats_s stats;
+	unsigned skipped;
+	int ret = EXIT_FAILURE;
+
+	if(argc > 3)
+	{
+		printf("Usage: %s [ROM [FRAMES]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if(argc == 3)
+		frames = strtoul(argv[2], NULL, 10);
+
+	if(argc == 1)
+		rom = mid_line_rom(&rom_sz);
+	else if((rom = read_rom_to_ram(argv[1], &rom_sz)) == NULL)
+	{
+		perror("ROM read failed");
+		return EXIT_FAILURE;
+	}
+
+	if(init_context(&gb_ref, &priv_ref.cart, NULL, rom, rom_sz) ||
+			init_context(&gb_dirty, &priv_dirty.cart, NULL, rom, rom_sz))
+		goto out;
+
+	gb_init_lcd_rgb565(&gb_ref, &lcd_line_rgb565);
+	gb_set_palette_rgb565(&gb_ref, dmg_palette);
+	gb_init_lcd_rgb565(&gb_dirty, &lcd_line_rgb565);
+	gb_set_palette_rgb565(&gb_dirty, dmg_palette);
+
+	for(frame = 0; frame < frames; frame++)
+	{
+		unsigned line, lines = 0;
+
+		memset(priv_ref.requested, 0, sizeof(priv_ref.requested));
+		memset(priv_dirty.requested, 0, sizeof(priv_dirty.requested));
+		gb_redraw_lines(&gb_ref);
+		gb_run_frame_dualfetch(&gb_ref);
+		gb_run_frame_dualfetch(&gb_dirty);
+
+		for(line = 0; line < LCD_HEIGHT; line++)
+		{
+			if(memcmp(priv_dirty.fb[line], priv_ref.fb[line],
+					sizeof(priv_ref.fb[line])) == 0)
+				continue;
+
+			if(lines++ == 0)
+				printf("Frame %lu differs:\n", frame);
+			if(lines <= 8)
+				printf("  line %u\n", line);
+		}
+
+		if(lines != 0)
+		{
+			printf("  %u lines differ\n", lines);
+			goto out;
+		}
+	}
+
+	skipped = gb_get_line_stats(&gb_dirty, &stats, false);
+	printf("%lu frames, no differences, %u%% of lines skipped\n", frames,
+			skipped);
+	ret = EXIT_SUCCESS;
+
+out:
+	free(priv_ref.cart.cart_ram);
+	free(priv_dirty.cart.cart_ram);
+	free(rom);
+	return ret;
+}
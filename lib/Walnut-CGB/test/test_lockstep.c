@@ -0,0 +1,229 @@
+/**
+ * Runs a ROM on two emulator contexts in lockstep: one is stepped with
+ * __gb_step_cpu_x() as in gb_run_frame(), the other with the dual fetch
+ * __gb_step_cpu() as in gb_run_frame_dualfetch(). Each dual fetch step runs two
+ * instructions, so the reference is stepped twice and both contexts are
+ * compared after every instruction pair. The first pair that leaves them
+ * different is reported with its opcodes, PC and ROM bank.
+ *
+ * Build with the dual fetch options under test, for example:
+ *	make test_lockstep CFLAGS=-DWALNUT_GB_16_BIT_OPS=1
+ */
+#define ENABLE_SOUND 0
+#define ENABLE_LCD 1
+
+/* These shortcuts are only taken at the start of a step, which is every
+ * instruction for one core but every other instruction for the other. */
+#ifndef WALNUT_GB_IDLE_SKIP
+# define WALNUT_GB_IDLE_SKIP 0
+#endif
+#ifndef WALNUT_GB_COPY_LOOPS
+# define WALNUT_GB_COPY_LOOPS 0
+#endif
+
+#include "../walnut_cgb.h"
+#include "test_common.h"
+
+struct priv
+{
+	struct test_cart cart;
+	uint8_t fb[LCD_HEIGHT][LCD_WIDTH];
+};
+
+static struct gb_s gb_ref, gb_dual;
+static struct priv priv_ref, priv_dual;
+/* Set to print the differences found by compare(). */
+static bool report;
+
+static void lcd_draw_line(struct gb_s *gb, const uint8_t *pixels,
+		const uint_fast8_t line)
+{
+	struct priv *p = gb->direct.priv;
+	memcpy(p->fb[line], pixels, LCD_WIDTH);
+}
+
+/**
+ * Reads the byte at addr without the side effects of reading IO registers.
+ */
+static uint8_t peek(struct gb_s *gb, uint16_t addr)
+{
+	if(addr >= OAM_ADDR && addr < HRAM_ADDR)
+		return 0xFF;
+
+	return __gb_read(gb, addr);
+}
+
+static unsigned diff_val(const char *name, unsigned a, unsigned b)
+{
+	if(a == b)
+		return 0;
+
+	if(report)
+		printf("  %-14s %8X %8X\n", name, a, b);
+	return 1;
+}
+
+static unsigned diff_mem(const char *name, unsigned base,
+		const uint8_t *a, const uint8_t *b, size_t sz)
+{
+	size_t i, count = 0, first = 0;
+
+	if(memcmp(a, b, sz) == 0)
+		return 0;
+
+	for(i = 0; i < sz; i++)
+	{
+		if(a[i] == b[i])
+			continue;
+
+		if(count++ == 0)
+			first = i;
+	}
+
+	if(count == 0)
+		return 0;
+
+	if(report)
+		printf("  %-6s[%04X]   %8X %8X  (%zu bytes differ)\n", name,
+			(unsigned)(base + first), a[first], b[first], count);
+	return 1;
+}
+
+/**
+ * Returns the number of differences between the contexts, printing them if
+ * report is set.
+ */
+static unsigned compare(void)
+{
+	const struct gb_s *a = &gb_ref, *b = &gb_dual;
+	unsigned n = 0;
+
+	n += diff_val("A", a->cpu_reg.a, b->cpu_reg.a);
+	n += diff_val("F", a->cpu_reg.f.reg, b->cpu_reg.f.reg);
+	n += diff_val("BC", a->cpu_reg.bc.reg, b->cpu_reg.bc.reg);
+	n += diff_val("DE", a->cpu_reg.de.reg, b->cpu_reg.de.reg);
+	n += diff_val("HL", a->cpu_reg.hl.reg, b->cpu_reg.hl.reg);
+	n += diff_val("SP", a->cpu_reg.sp.reg, b->cpu_reg.sp.reg);
+	n += diff_val("PC", a->cpu_reg.pc.reg, b->cpu_reg.pc.reg);
+	n += diff_val("IME", a->gb_ime, b->gb_ime);
+	n += diff_val("HALT", a->gb_halt, b->gb_halt);
+	n += diff_val("irq_pending", a->irq_pending, b->irq_pending);
+
+	n += diff_val("lcd_count", a->counter.lcd_count, b->counter.lcd_count);
+	n += diff_val("div_count", a->counter.div_count, b->counter.div_count);
+	n += diff_val("tima_count", a->counter.tima_count,
+			b->counter.tima_count);
+	n += diff_val("pending", a->counter.pending_cycles,
+			b->counter.pending_cycles);
+
+	n += diff_val("rom_bank", a->selected_rom_bank, b->selected_rom_bank);
+	n += diff_val("ram_bank", a->cart_ram_bank, b->cart_ram_bank);
+	n += diff_val("ram_enable", a->enable_cart_ram, b->enable_cart_ram);
+	n += diff_val("mode_select", a->cart_mode_select,
+			b->cart_mode_select);
+#if WALNUT_FULL_GBC_SUPPORT
+	n += diff_val("wram_bank", a->cgb.wramBank, b->cgb.wramBank);
+	n += diff_val("vram_bank", a->cgb.vramBank, b->cgb.vramBank);
+	n += diff_mem("BGPAL", 0, a->cgb.BGPalette, b->cgb.BGPalette,
+			sizeof(a->cgb.BGPalette));
+	n += diff_mem("OBJPAL", 0, a->cgb.OAMPalette, b->cgb.OAMPalette,
+			sizeof(a->cgb.OAMPalette));
+#endif
+
+	n += diff_mem("WRAM", WRAM_0_ADDR, a->wram, b->wram, WRAM_SIZE);
+	n += diff_mem("VRAM", VRAM_ADDR, a->vram, b->vram, VRAM_SIZE);
+	n += diff_mem("OAM", OAM_ADDR, a->oam, b->oam, OAM_SIZE);
+	n += diff_mem("IO", IO_ADDR, a->hram_io, b->hram_io, HRAM_IO_SIZE);
+	n += diff_mem("CRAM", CART_RAM_ADDR, priv_ref.cart.cart_ram,
+			priv_dual.cart.cart_ram, priv_ref.cart.cart_ram_sz);
+	n += diff_mem("LCD", 0, &priv_ref.fb[0][0], &priv_dual.fb[0][0],
+			sizeof(priv_ref.fb));
+
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	uint8_t *rom;
+	size_t rom_sz;
+	unsigned long frames = 3600, frame;
+	unsigned long pairs = 0;
+	int ret = EXIT_FAILURE;
+
+	if(argc != 2 && argc != 3)
+	{
+		printf("Usage: %s ROM [FRAMES]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if(argc == 3)
+		frames = strtoul(argv[2], NULL, 10);
+
+	if((rom = read_rom_to_ram(argv[1], &rom_sz)) == NULL)
+	{
+		perror("ROM read failed");
+		return EXIT_FAILURE;
+	}
+
+	if(init_context(&gb_ref, &priv_ref.cart, "gb_run_frame", rom, rom_sz) ||
+		init_context(&gb_dual, &priv_dual.cart,
+			"gb_run_frame_dualfetch", rom, rom_sz))
+		goto out;
+
+	gb_init_lcd(&gb_ref, &lcd_draw_line);
+	gb_init_lcd(&gb_dual, &lcd_draw_line);
+
+	for(frame = 0; frame < frames; frame++)
+	{
+		gb_ref.gb_frame = false;
+		gb_dual.gb_frame = false;
+
+		do
+		{
+			uint16_t pc[2], bank[2];
+			uint8_t op[2];
+			bool irq = gb_ref.gb_ime &&
+				(gb_ref.hram_io[IO_IF] & gb_ref.hram_io[IO_IE] &
+				 ANY_INTR);
+			unsigned i;
+
+			__gb_step_cpu(&gb_dual);
+
+			for(i = 0; i < 2; i++)
+			{
+				pc[i] = gb_ref.cpu_reg.pc.reg;
+				bank[i] = (pc[i] >= ROM_N_ADDR && pc[i] < VRAM_ADDR) ?
+					__gb_rom_bank(&gb_ref) : 0;
+				op[i] = peek(&gb_ref, pc[i]);
+				__gb_step_cpu_x(&gb_ref);
+			}
+
+			pairs++;
+
+			if(compare() == 0)
+				continue;
+
+			printf("Difference after instruction pair %lu (frame %lu)%s:\n",
+					pairs, frame,
+					irq ? ", interrupt pending" : "");
+			for(i = 0; i < 2; i++)
+				printf("  %02X:%04X  opcode %02X\n", bank[i], pc[i],
+						op[i]);
+			printf("  %-14s %8s %8s\n", "", "single", "dual");
+			report = true;
+			compare();
+			goto out;
+		}
+		while(!gb_dual.gb_frame);
+	}
+
+	printf("%lu frames, %lu instruction pairs, no differences\n",
+			frames, pairs);
+	ret = EXIT_SUCCESS;
+
+out:
+	free(priv_ref.cart.cart_ram);
+	free(priv_dual.cart.cart_ram);
+	free(rom);
+	return ret;
+}
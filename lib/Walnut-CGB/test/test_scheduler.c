@@ -0,0 +1,118 @@
+/**
+ * Runs a ROM on two emulator contexts: one schedules its events as usual,
+ * passing the lines of VBlank in one interval, the other runs its events after
+ * every instruction, which passes every line on its own. After each
+ * instruction LY and STAT, as the CPU reads them, and the end of the frame
+ * must be the same in both. The first instruction that leaves them different
+ * is reported.
+ *
+ * Build with the options under test, for example:
+ *	make test_scheduler CFLAGS=-DWALNUT_GB_DIRTY_LINES=1
+ */
+#define ENABLE_SOUND 0
+#define ENABLE_LCD 1
+
+/* These shortcuts run many instructions at once, up to the next event. */
+#ifndef WALNUT_GB_IDLE_SKIP
+# define WALNUT_GB_IDLE_SKIP 0
+#endif
+#ifndef WALNUT_GB_COPY_LOOPS
+# define WALNUT_GB_COPY_LOOPS 0
+#endif
+
+#include "../walnut_cgb.h"
+#include "test_common.h"
+
+struct priv
+{
+	struct test_cart cart;
+	uint8_t fb[LCD_HEIGHT][LCD_WIDTH];
+};
+
+static struct gb_s gb_ref, gb_lazy;
+static struct priv priv_ref, priv_lazy;
+
+static void lcd_draw_line(struct gb_s *gb, const uint8_t *pixels,
+		const uint_fast8_t line)
+{
+	struct priv *p = gb->direct.priv;
+	memcpy(p->fb[line], pixels, LCD_WIDTH);
+}
+
+int main(int argc, char *argv[])
+{
+	uint8_t *rom;
+	size_t rom_sz;
+	unsigned long frames = 60, frame;
+	unsigned long steps = 0;
+	int ret = EXIT_FAILURE;
+
+	if(argc != 2 && argc != 3)
+	{
+		printf("Usage: %s ROM [FRAMES]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if(argc == 3)
+		frames = strtoul(argv[2], NULL, 10);
+
+	if((rom = read_rom_to_ram(argv[1], &rom_sz)) == NULL)
+	{
+		perror("ROM read failed");
+		return EXIT_FAILURE;
+	}
+
+	if(init_context(&gb_ref, &priv_ref.cart, "every instruction",
+			rom, rom_sz) ||
+		init_context(&gb_lazy, &priv_lazy.cart, "scheduled",
+			rom, rom_sz))
+		goto out;
+
+	gb_init_lcd(&gb_ref, &lcd_draw_line);
+	gb_init_lcd(&gb_lazy, &lcd_draw_line);
+
+	for(frame = 0; frame < frames; frame++)
+	{
+		gb_ref.gb_frame = false;
+		gb_lazy.gb_frame = false;
+
+		do
+		{
+			const uint16_t pc = gb_ref.cpu_reg.pc.reg;
+			uint8_t ly[2], stat[2];
+
+			gb_ref.counter.next_event = 0;
+			__gb_step_cpu_x(&gb_ref);
+			__gb_step_cpu_x(&gb_lazy);
+			steps++;
+
+			ly[0] = __gb_read(&gb_ref, IO_ADDR + IO_LY);
+			ly[1] = __gb_read(&gb_lazy, IO_ADDR + IO_LY);
+			stat[0] = __gb_read(&gb_ref, IO_ADDR + IO_STAT);
+			stat[1] = __gb_read(&gb_lazy, IO_ADDR + IO_STAT);
+
+			if(ly[0] == ly[1] && stat[0] == stat[1] &&
+					gb_ref.gb_frame == gb_lazy.gb_frame)
+				continue;
+
+			printf("Difference after instruction %lu (frame %lu) at %04X:\n",
+					steps, frame, pc);
+			printf("  %-10s %10s %10s\n", "", "every", "scheduled");
+			printf("  %-10s %10u %10u\n", "LY", ly[0], ly[1]);
+			printf("  %-10s %10X %10X\n", "STAT", stat[0], stat[1]);
+			printf("  %-10s %10d %10d\n", "frame end", gb_ref.gb_frame,
+					gb_lazy.gb_frame);
+			goto out;
+		}
+		while(!gb_ref.gb_frame);
+	}
+
+	printf("%lu frames, %lu instructions, no differences\n", frames, steps);
+	ret = EXIT_SUCCESS;
+
+out:
+	free(priv_ref.cart.cart_ram);
+	free(priv_lazy.cart.cart_ram);
+	free(rom);
+	return ret;
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+/*
+ * Double-buffered frame for the external TFT.
+ *
+ * The core draws frame N+1 into one buffer while frame N is sent from the
+ * other. present() waits for the previous transfer to finish (the fence),
+ * starts sending the buffer that was just drawn and swaps, so the core never
+ * draws into a buffer that is still being sent.
+ *
+ * With WALNUT_GB_DIRTY_LINES the core only draws the lines that changed and
+ * expects the rest to be there from the last frame, so after the swap the
+ * changed rows are copied into the new draw buffer too. Both buffers then hold
+ * the frame on the display, and the next present() compares each drawn row
+ * with it to find the columns that changed. Only those spans are sent, merged
+ * into a few rectangles.
+ *
+ * Free of Arduino calls, so it also builds on the host against SpiSinkSim
+ * (spi_sink_sim.h); see test/test_frame_buffers.cpp. A Sink provides:
+ *   void push(int x, int y, int w, int h, const uint16_t* src, int stride)
+ *       start sending the w x h rectangle at x, y; rows of src are stride
+ *       pixels apart and must stay unchanged until wait()
+ *   void wait()
+ *       wait for every push so far
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+template <typename Sink, int W, int H>
+class FrameBuffers {
+public:
+  // Most rectangles sent per frame; a transfer has to finish before the next
+  // one starts, so present() blocks on all but the last
+  static const int MAX_RECTS = 4;
+  // Extra pixels sent rather than start another rectangle
+  static const int RECT_COST = W / 2;
+  // Percentage of the frame changed above which the changed rows are sent
+  // whole as one rectangle
+  static const int FULL_PUSH_PERCENT = 60;
+
+  explicit FrameBuffers(Sink& sink) : sink_(sink) {}
+
+  // b may be nullptr, in which case present() waits for every transfer
+  void begin(uint16_t* a, uint16_t* b) {
+    fb_[0] = a;
+    fb_[1] = b;
+    draw_ = 0;
+    if (b) memcpy(b, a, sizeof(uint16_t) * W * H);
+    memset(rows_, 0, sizeof(rows_));
+  }
+
+  bool double_buffered() const { return fb_[1] != nullptr; }
+
+  // Buffer the core draws the next frame into
+  uint16_t* draw_buffer() const { return fb_[draw_]; }
+
+  // Notes that row y of the draw buffer was drawn
+  void mark_row(int y) { rows_[y / 32] |= 1u << (y % 32); }
+
+  // Sends what changed since the last present and swaps the buffers
+  void present() {
+    uint16_t* shown = fb_[draw_];
+    const uint16_t* prev = fb_[1] ? fb_[draw_ ^ 1] : nullptr;
+    int first = -1, last = -1;
+    long changed = 0;
+
+    for (int y = 0; y < H; y++) {
+      if (!row_marked(y)) continue;
+      if (!changed_span(shown + y * W, prev ? prev + y * W : nullptr, y)) {
+        rows_[y / 32] &= ~(1u << (y % 32));
+        continue;
+      }
+      if (first < 0) first = y;
+      last = y;
+      changed += x1_[y] - x0_[y] + 1;
+    }
+    if (first < 0) {
+      memset(rows_, 0, sizeof(rows_));
+      return;
+    }
+
+    // Fence: the other buffer is not read any more once this returns
+    sink_.wait();
+
+    if (changed * 100 > (long)W * H * FULL_PUSH_PERCENT) {
+      sink_.push(0, first, W, last - first + 1, shown + first * W, W);
+    } else {
+      push_rects(shown, first, last);
+    }
+
+    if (fb_[1]) {
+      draw_ ^= 1;
+      // The new draw buffer is a frame behind by the rows just drawn
+      for (int y = first; y <= last; y++)
+        if (row_marked(y))
+          memcpy(fb_[draw_] + y * W + x0_[y], shown + y * W + x0_[y],
+                 sizeof(uint16_t) * (x1_[y] - x0_[y] + 1));
+    } else {
+      sink_.wait();
+    }
+
+    memset(rows_, 0, sizeof(rows_));
+  }
+
+private:
+  struct Rect { int x0, x1, y0, y1; };
+
+  bool row_marked(int y) const { return rows_[y / 32] & (1u << (y % 32)); }
+
+  static int area(const Rect& r) { return (r.x1 - r.x0 + 1) * (r.y1 - r.y0 + 1); }
+
+  // Finds the columns of row y that differ from the previous frame; false if
+  // none do. Without a previous frame the whole row counts as changed.
+  bool changed_span(const uint16_t* row, const uint16_t* prev, int y) {
+    int x0 = 0, x1 = W - 1;
+    if (prev) {
+      while (x0 < W && row[x0] == prev[x0]) x0++;
+      if (x0 == W) return false;
+      while (row[x1] == prev[x1]) x1--;
+    }
+    x0_[y] = (int16_t)x0;
+    x1_[y] = (int16_t)x1;
+    return true;
+  }
+
+  // Merges the changed spans of rows first..last into at most MAX_RECTS
+  // rectangles, growing one over unchanged pixels while that is cheaper than
+  // starting another, and sends them
+  void push_rects(const uint16_t* shown, int first, int last) {
+    Rect rects[MAX_RECTS];
+    int n = 0;
+
+    for (int y = first; y <= last; y++) {
+      if (!row_marked(y)) continue;
+      Rect row = { x0_[y], x1_[y], y, y };
+      if (n > 0) {
+        Rect& r = rects[n - 1];
+        Rect grown = { r.x0 < row.x0 ? r.x0 : row.x0, r.x1 > row.x1 ? r.x1 : row.x1,
+                       r.y0, y };
+        if (n == MAX_RECTS || area(grown) <= area(r) + area(row) + RECT_COST) {
+          r = grown;
+          continue;
+        }
+      }
+      rects[n++] = row;
+    }
+
+    for (int i = 0; i < n; i++) {
+      const Rect& r = rects[i];
+      sink_.push(r.x0, r.y0, r.x1 - r.x0 + 1, r.y1 - r.y0 + 1,
+                 shown + r.y0 * W + r.x0, W);
+    }
+  }
+
+  Sink& sink_;
+  uint16_t* fb_[2] = { nullptr, nullptr };
+  int draw_ = 0;
+  uint32_t rows_[(H + 31) / 32] = {};
+  // Changed columns of each marked row
+  int16_t x0_[H] = {};
+  int16_t x1_[H] = {};
+};
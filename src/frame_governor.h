@@ -0,0 +1,125 @@
+#pragma once
+
+/*
+ * Chooses how many frames to skip between drawn ones, so the emulation keeps
+ * real time with as many frames drawn as that allows.
+ *
+ * The emulation loop adds the time each frame kept it busy, and every WINDOW
+ * frames the governor looks at the load: that time as a percentage of real
+ * time. Skip goes up at once when a window is over HIGH_LOAD percent. The
+ * load of two windows run at different skips gives the cost of a draw, and
+ * skip comes down a step when that predicts the lower skip stays under
+ * HIGH_LOAD less a margin; until there is an estimate, when the load is under
+ * LOW_LOAD. Either way it must have held for `hold` windows, and hold doubles
+ * each time a lower skip runs over straight away, so the governor does not
+ * keep flipping between two values.
+ *
+ * Free of Arduino calls, so it also builds on the host; see
+ * test/test_frame_governor.cpp.
+ */
+
+#include <stdint.h>
+
+class FrameGovernor {
+public:
+  static const int WINDOW = 30;     // Frames per decision, about half a second
+  static const int HIGH_LOAD = 95;  // Percent of real time
+  static const int LOW_LOAD = 75;
+  static const int MARGIN = 5;
+  static const int MIN_HOLD = 2;    // Windows
+  static const int MAX_HOLD = 64;
+
+  FrameGovernor(uint32_t frame_us, int min_skip, int max_skip)
+      : frame_us_(frame_us), min_skip_(min_skip), max_skip_(max_skip) {}
+
+  void begin(int skip) {
+    skip_ = skip < min_skip_ ? min_skip_ : skip > max_skip_ ? max_skip_ : skip;
+    hold_ = MIN_HOLD;
+    calm_ = 0;
+    just_lowered_ = false;
+    draw_cost_ = -1;
+    last_load_ = -1;
+    window_skip_ = skip_;
+    last_window_skip_ = skip_;
+    frames_ = 0;
+    busy_us_ = 0;
+    draws_at_start_ = 0;
+    started_ = false;
+  }
+
+  int skip() const { return skip_; }
+
+  // Percentage of real time the last window kept the loop busy
+  int load() const { return last_load_; }
+
+  // Adds a frame that kept the loop busy for busy_us. draws is the running
+  // count of frames drawn. Returns true when skip changed.
+  bool frame_done(uint32_t busy_us, uint32_t draws) {
+    if (!started_) {
+      started_ = true;
+      draws_at_start_ = draws;
+    }
+    busy_us_ += busy_us;
+    if (++frames_ < WINDOW) return false;
+
+    const int load = (int)(busy_us_ * 100 / ((uint64_t)frame_us_ * WINDOW));
+    // Frames drawn per thousand
+    const int drawn = (int)((draws - draws_at_start_) * 1000 / WINDOW);
+    frames_ = 0;
+    busy_us_ = 0;
+    draws_at_start_ = draws;
+
+    // Only windows at different skips, as the draws of one skip vary by a
+    // frame or so with where the window starts
+    if (last_load_ >= 0 && window_skip_ != last_window_skip_ &&
+        drawn != last_drawn_) {
+      int cost = (load - last_load_) * 1000 / (drawn - last_drawn_);
+      if (cost < 0) cost = 0;
+      draw_cost_ = draw_cost_ < 0 ? cost : (draw_cost_ * 3 + cost) / 4;
+    }
+    last_load_ = load;
+    last_drawn_ = drawn;
+    last_window_skip_ = window_skip_;
+
+    if (load > HIGH_LOAD) {
+      if (just_lowered_ && hold_ < MAX_HOLD) hold_ *= 2;
+      if (skip_ < max_skip_) skip_++;
+      calm_ = 0;
+    } else if (skip_ > min_skip_ && lower_fits(load)) {
+      if (++calm_ >= hold_) {
+        skip_--;
+        calm_ = 0;
+      }
+    } else {
+      calm_ = 0;
+    }
+    just_lowered_ = skip_ < window_skip_;
+    const bool changed = skip_ != window_skip_;
+    window_skip_ = skip_;
+    return changed;
+  }
+
+private:
+  // Whether one skip fewer is expected to keep real time; skip_ > 0
+  bool lower_fits(int load) const {
+    if (draw_cost_ < 0) return load < LOW_LOAD;
+    // Drawn frames go from 1 in skip+1 to 1 in skip
+    return load + draw_cost_ / (skip_ * (skip_ + 1)) < HIGH_LOAD - MARGIN;
+  }
+
+  const uint32_t frame_us_;
+  const int min_skip_, max_skip_;
+  int skip_ = 0;
+  int hold_ = MIN_HOLD;
+  int calm_ = 0;            // Windows in a row the lower skip looked fine
+  bool just_lowered_ = false;
+  int draw_cost_ = -1;      // Load added were every frame drawn; -1 unknown
+  int last_load_ = -1;
+  int last_drawn_ = 0;      // Frames drawn per thousand in the last window
+  int window_skip_ = 0;     // Skip the current window runs at
+  int last_window_skip_ = 0;
+  int frames_ = 0;
+  uint64_t busy_us_ = 0;
+  uint32_t draws_at_start_ = 0;
+  bool started_ = false;
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+/*
+ * Paces frames to absolute deadlines at the Game Boy's 59.7275 Hz.
+ *
+ * Frame n starts at start + n * period, with the period kept as a fraction of
+ * microseconds, so rounding never adds up. A frame that overruns delays no
+ * other: the frames after it start without waiting until the schedule is met
+ * again. Only when more than MAX_CATCH_UP frames behind does the pacer give
+ * the time up and start over from now, so a long stall (SD access, a debugger)
+ * is not followed by a burst of fast frames.
+ *
+ * DeadlineTimer sleeps until a deadline: a one-shot esp_timer that wakes the
+ * task on the ESP32, clock_nanosleep() with TIMER_ABSTIME on the host. See
+ * test/test_frame_pacer.cpp.
+ */
+
+#include <stdint.h>
+
+class FramePacer {
+public:
+  static const int MAX_CATCH_UP = 4;  // Frames
+
+  // The frame period is num / den microseconds
+  FramePacer(uint64_t num, uint64_t den) : num_(num), den_(den) {}
+
+  void begin(uint64_t now_us) {
+    start_us_ = now_us;
+    frame_ = 0;
+    resyncs_ = 0;
+  }
+
+  // Ends the frame, at now_us; returns when the next one should start, which
+  // is in the past while catching up
+  uint64_t frame_done(uint64_t now_us) {
+    // Every den frames the period adds up to whole microseconds, so the
+    // start moves on there to keep frame_ * num_ small
+    if (++frame_ == den_) {
+      start_us_ += num_;
+      frame_ = 0;
+    }
+    const uint64_t deadline = start_us_ + frame_ * num_ / den_;
+    if (now_us > deadline + MAX_CATCH_UP * num_ / den_) {
+      start_us_ = now_us;
+      frame_ = 0;
+      resyncs_++;
+      return now_us;
+    }
+    return deadline;
+  }
+
+  // Times the schedule was given up since begin()
+  uint32_t resyncs() const { return resyncs_; }
+
+private:
+  const uint64_t num_, den_;
+  uint64_t start_us_ = 0;
+  uint64_t frame_ = 0;
+  uint32_t resyncs_ = 0;
+};
+
+#if defined(ESP_PLATFORM)
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+class DeadlineTimer {
+public:
+  // Call from the task that sleeps
+  bool begin() {
+    task_ = xTaskGetCurrentTaskHandle();
+    esp_timer_create_args_t args = {};
+    args.callback = &DeadlineTimer::wake;
+    args.arg = this;
+    args.name = "frame_pacer";
+    return esp_timer_create(&args, &timer_) == ESP_OK;
+  }
+
+  uint64_t now_us() const { return (uint64_t)esp_timer_get_time(); }
+
+  void sleep_until(uint64_t deadline_us) {
+    const uint64_t now = now_us();
+    if (deadline_us <= now) return;
+    if (!timer_ || esp_timer_start_once(timer_, deadline_us - now) != ESP_OK) {
+      while (now_us() < deadline_us) {}
+      return;
+    }
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  }
+
+private:
+  static void wake(void* arg) { xTaskNotifyGive(((DeadlineTimer*)arg)->task_); }
+
+  TaskHandle_t task_ = nullptr;
+  esp_timer_handle_t timer_ = nullptr;
+};
+#else
+#include <errno.h>
+#include <time.h>
+
+class DeadlineTimer {
+public:
+  bool begin() { return true; }
+
+  uint64_t now_us() const {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+  }
+
+  void sleep_until(uint64_t deadline_us) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)(deadline_us / 1000000u);
+    ts.tv_nsec = (long)(deadline_us % 1000000u) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {}
+  }
+};
+#endif
@@ -8,18 +8,32 @@
  * - Faster than FreeRTOS Queues.
  * - Auto-downmix Stereo -> Mono for M5Cardputer speaker.
  * * CONFIG:
- * - SRAM Safe (Single Buffer).
- * - Frame Skip 1:4.
+ * - Double Buffer, pushed to the TFT with DMA (single buffer if RAM is short),
+ *   or a ring of strips pushed while the frame is emulated (USE_STRIP_BUFFER).
+ * - Frame Skip chosen by a governor to keep full speed, remembered per ROM.
  */
 
 #define ENABLE_SOUND 1
 #define ENABLE_LCD   1
+// The core writes byte-swapped RGB565 lines, ready for pushImage
+#define WALNUT_GB_RGB565_BIGENDIAN 1
+// Draw lines on core 0 from a per-line log while core 1 emulates
+#define WALNUT_GB_DEFERRED_LCD 1
+// Only draw and push the lines that changed; the framebuffer keeps the rest
+#define WALNUT_GB_DIRTY_LINES 1
+// Palette and scroll writes made mid-line change the rest of the line
+#define WALNUT_GB_LINE_SPANS 1
 
 #define MAX_FILES 400
 #define INDEX_FILENAME ".roms.idx"
 
-// Frame Skip 4 (Draw 1, Skip 4)
-#define FRAME_SKIP_COUNT 5  // set 4 if sound enabled
+// Frames skipped between drawn ones, chosen by the governor within these
+// bounds; the start is remembered per ROM in "<rom>.skip"
+#define FRAME_SKIP_MIN   0
+#define FRAME_SKIP_MAX   8
+#define FRAME_SKIP_START 5
+// Skip held this long is saved as the ROM's start
+#define FRAME_SKIP_SAVE_MS 10000
 
 #include <Arduino.h>
 #include <stdint.h>
@@ -46,6 +60,18 @@ extern "C" void    audio_write(uint16_t addr, uint8_t val);
 
 #include "tft_setup.h"
 #include <TFT_eSPI.h>
+#include <esp_heap_caps.h>
+#include "frame_buffers.h"
+#include "strip_buffer.h"
+#include "frame_governor.h"
+#include "frame_pacer.h"
+
+// TFT_eSPI has no DMA path for the 18-bit ILI9488, which is pushed blocking
+#if defined(ILI9488_DRIVER)
+  #define USE_TFT_DMA 0
+#else
+  #define USE_TFT_DMA 1
+#endif
 
 #if ENABLE_SOUND
   // Original APU includes
@@ -74,6 +100,26 @@ extern "C" void    audio_write(uint16_t addr, uint8_t val);
 
 #define FB_SIZE (LCD_WIDTH * DEST_H * 2)
 
+// Draw into a ring of STRIP_COUNT strips of STRIP_LINES lines, each pushed
+// as soon as the core moves past it, instead of into whole framebuffers.
+// Needs 10 KB instead of up to 90 KB and shows lines most of a frame sooner,
+// but every changed line is pushed at full width. TFT_eSPI runs one DMA at a
+// time, so a third strip would never be used.
+#define USE_STRIP_BUFFER 0
+#define STRIP_LINES 16
+#define STRIP_COUNT 2
+
+// -------------------------
+// Idle loop skipping
+// -------------------------
+#if WALNUT_GB_IDLE_SKIP
+// ROM titles (as returned by gb_get_rom_name) that run with idle loop
+// skipping disabled. Keep the list nullptr terminated.
+static const char* const IDLE_SKIP_OPTOUT[] = {
+  nullptr
+};
+#endif
+
 SPIClass SPI2;
 TFT_eSPI tft = TFT_eSPI();
 
@@ -96,8 +142,8 @@ uint16_t CURRENT_PALETTE_RGB565[12];
 static inline void update_palette() { for (int i = 0; i < 12; i++) CURRENT_PALETTE_RGB565[i] = rgb888_to_rgb565(gboriginal_palette[i]); }
 #else
 uint32_t gboriginal_palette[] = { 0x7B8210, 0x5A7942, 0x39594A, 0x294139 };
-uint16_t CURRENT_PALETTE_RGB565[4];
-static inline void update_palette() { for (int i = 0; i < 4; i++) CURRENT_PALETTE_RGB565[i] = rgb888_to_rgb565(gboriginal_palette[i]); }
+uint16_t CURRENT_PALETTE_RGB565[12];
+static inline void update_palette() { for (int i = 0; i < 12; i++) CURRENT_PALETTE_RGB565[i] = rgb888_to_rgb565(gboriginal_palette[i & 3]); }
 #endif
 
 // -------------------------
@@ -117,10 +163,36 @@ static inline void uiStatusScreen(const String& l0, const String& l1 = "", const
 // PERF DEBUG
 // -------------------------
 static inline uint64_t now_us() { return (uint64_t)esp_timer_get_time(); }
+// Running totals; the report prints what they gained in the last second
 static volatile uint32_t dbg_frames = 0;
 static volatile uint32_t dbg_draws = 0;
+static volatile uint32_t dbg_emulate_us = 0;
+static volatile uint32_t dbg_present_us = 0;
+static volatile uint32_t dbg_audio_us = 0;
 static uint32_t dbg_last_report_ms = 0;
 
+#if WALNUT_GB_DIRTY_LINES
+// Running totals of the lines drawn and skipped. Only the task that draws
+// the lines moves its context's counters in here, so the report never resets
+// counters that another core is updating
+static volatile uint32_t dbg_lines_drawn = 0;
+static volatile uint32_t dbg_lines_skipped = 0;
+
+static void dbg_count_lines(struct gb_s* gb) {
+  struct gb_line_stats_s ls;
+  gb_get_line_stats(gb, &ls, true);
+  dbg_lines_drawn += ls.drawn;
+  dbg_lines_skipped += ls.skipped;
+}
+#endif
+
+// Frames skipped between drawn ones, set by the governor each frame
+static volatile int g_frame_skip = FRAME_SKIP_START;
+static FrameGovernor g_governor((uint32_t)(1000000.0 / VERTICAL_SYNC), FRAME_SKIP_MIN, FRAME_SKIP_MAX);
+// A frame is SCREEN_REFRESH_CYCLES of the DMG clock, kept as an exact fraction
+static FramePacer g_pacer((uint64_t)SCREEN_REFRESH_CYCLES * 1000000u, (uint64_t)DMG_CLOCK_FREQ);
+static DeadlineTimer g_frame_timer;
+
 #if ENABLE_SOUND
 static minigb_apu_ctx g_apu;
 // Buffer to hold raw stereo samples from APU
@@ -479,10 +551,31 @@ static void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr, const u
 }
 static void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16_t val) {
   struct priv_t *priv = (struct priv_t *)gb->direct.priv;
+#if WALNUT_GB_PAGE_TABLE
+  // The page table must not point into the buffers freed below
+  gb_set_rom_direct(gb, NULL, 0);
+  gb_set_cart_ram_direct(gb, NULL, 0);
+#endif
   if (priv) { if (priv->cart_ram) free(priv->cart_ram); if (priv->rom) free(priv->rom); priv->cart_ram = NULL; priv->rom = NULL; }
 }
 
-static uint8_t *read_rom_to_ram(const char *file_name) {
+// Frame skip the governor settled on last time this ROM ran
+static int load_frame_skip(const String& romPath) {
+  const String path = romPath + ".skip";
+  int skip = FRAME_SKIP_START;
+  if (SD.exists(path)) {
+    File f = SD.open(path, FILE_READ);
+    if (f) { String s = f.readString(); s.trim(); f.close(); if (s.length()) skip = s.toInt(); }
+  }
+  return skip;
+}
+
+static void save_frame_skip(const String& romPath, int skip) {
+  File f = SD.open(romPath + ".skip", FILE_WRITE);
+  if (f) { f.print(skip); f.close(); }
+}
+
+static uint8_t *read_rom_to_ram(const char *file_name, size_t *out_size) {
   uiStatusScreen("Loading ROM to RAM...", file_name);
   Serial.printf("[Gemini] Opening ROM: %s\n", file_name);
 
@@ -520,62 +613,204 @@ static uint8_t *read_rom_to_ram(const char *file_name) {
 
   rom_file.close();
   Serial.println("[Gemini] ROM loaded successfully.");
+  *out_size = rom_size;
   return readRom;
 }
 
 #if ENABLE_LCD
-static void lcd_draw_line(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line) {
-  if (!g_do_rendering) return;
+// Pixels of narrow rectangles packed for DMA per frame (8 KB)
+#define TFT_STAGING_PIXELS 4096
+
+// Sends framebuffer rectangles to the external TFT, centred; lines are
+// already byte-swapped by the core
+struct TftSink {
+  volatile uint32_t bytes = 0;     // Sent since the last perf report
+  volatile uint32_t transfers = 0;
+
+  void push(int x, int y, int w, int h, const uint16_t* src, int stride) {
+    const int x0 = (tft.width() - LCD_WIDTH) / 2;
+    const int y0 = (tft.height() - DEST_H) / 2;
+  #if USE_TFT_DMA && !USE_STRIP_BUFFER
+    // DMA reads one contiguous block, so narrow rectangles are packed into
+    // the staging buffer, and sent as whole rows once it is full
+    if (w != stride && staged_ + w * h > TFT_STAGING_PIXELS) {
+      src -= x;
+      x = 0;
+      w = stride;
+    }
+    if (w != stride) {
+      uint16_t* packed = &staging_[staged_];
+      for (int r = 0; r < h; r++) memcpy(packed + r * w, src + r * stride, w * 2);
+      staged_ += w * h;
+      src = packed;
+    }
+  #endif
+  #if USE_TFT_DMA
+    tft.pushImageDMA(x0 + x, y0 + y, w, h, (uint16_t*)src);
+  #else
+    tft.startWrite();
+    tft.setAddrWindow(x0 + x, y0 + y, w, h);
+    for (int r = 0; r < h; r++) tft.pushPixels(src + r * stride, w);
+    tft.endWrite();
+  #endif
+    bytes += w * h * 2;
+    transfers++;
+  }
+
+  void wait() {
+  #if USE_TFT_DMA
+    tft.dmaWait();
+  #endif
+  #if USE_TFT_DMA && !USE_STRIP_BUFFER
+    staged_ = 0;
+  #endif
+  }
+
+private:
+  // Strips are always pushed at full width
+  #if USE_TFT_DMA && !USE_STRIP_BUFFER
+  int staged_ = 0;
+  alignas(4) uint16_t staging_[TFT_STAGING_PIXELS];
+  #endif
+};
+
+static TftSink g_tft_sink;
+#if USE_STRIP_BUFFER
+typedef StripBuffer<TftSink, LCD_WIDTH, DEST_H, STRIP_LINES, STRIP_COUNT> Strips;
+static Strips g_strips(g_tft_sink);
+#else
+// The core draws into draw_buffer() while the other buffer is sent
+static FrameBuffers<TftSink, LCD_WIDTH, DEST_H> g_frames(g_tft_sink);
+#endif
+
+// Returns the framebuffer line the core draws RGB565 pixels to, or nullptr
+// to skip the line (frames that are not presented set no_render instead, so
+// the core does not call this at all)
+static uint16_t* lcd_line_rgb565(struct gb_s *gb, const uint_fast8_t line) {
 
   uint16_t* fb_ptr = ((priv_t *)gb->direct.priv)->fb;
-  if (!fb_ptr) return;
+  if (!fb_ptr) return nullptr;
 
   #if USE_NATIVE_GB_HEIGHT
   const int yplot = (int)line;
   #else
   const int yplot = (int)line * DEST_H / LCD_HEIGHT;
+  // Only the last line of each row is shown, so a skipped unchanged line
+  // can't leave a row drawn by the line above it
+  if ((int)(line + 1) * DEST_H / LCD_HEIGHT == yplot) return nullptr;
   #endif
-  if (yplot < 0 || yplot >= DEST_H) return;
+  if (yplot < 0 || yplot >= DEST_H) return nullptr;
 
-  uint16_t* line_ptr = &fb_ptr[yplot * LCD_WIDTH];
+  #if USE_STRIP_BUFFER
+  return g_strips.line(yplot);
+  #else
+  g_frames.mark_row(yplot);
+  return &fb_ptr[yplot * LCD_WIDTH];
+  #endif
+}
 
-  if (gb->cgb.cgbMode) {
-    for (unsigned int x = 0; x < LCD_WIDTH; x++) line_ptr[x] = gb->cgb.fixPalette[pixels[x]];
-  }
-  #if WALNUT_GB_12_COLOUR
-  else {
-    for (unsigned int x = 0; x < LCD_WIDTH; x++) line_ptr[x] = CURRENT_PALETTE_RGB565[ ((pixels[x] & 18) >> 1) | (pixels[x] & 3) ];
-  }
+// Starts sending the frame just drawn and moves the core to the other buffer
+// (with strips, sends the last strip; the others are on their way already)
+static inline void present_frame_external(priv_t* p) {
+  if (!p->fb) return;
+  #if USE_STRIP_BUFFER
+  g_strips.end_frame();
   #else
-  else {
-    for (unsigned int x = 0; x < LCD_WIDTH; x++) line_ptr[x] = CURRENT_PALETTE_RGB565[(pixels[x]) & 3];
-  }
+  g_frames.present();
+  p->fb = g_frames.draw_buffer();
   #endif
 }
+#endif
 
-static inline void present_frame_external(uint16_t* fb) {
-  if (!fb) return;
-  const int screenW = tft.width();
-  const int screenH = tft.height();
-  const int x0 = (screenW - LCD_WIDTH) / 2;
-  const int y0 = (screenH - DEST_H) / 2;
+// -------------------------
+// Deferred rendering (core 0)
+// -------------------------
+#if WALNUT_GB_DEFERRED_LCD
+static struct gb_s* g_render = nullptr;           // Context the logged lines are drawn in
+static struct gb_line_log_s* g_line_log = nullptr;
+static TaskHandle_t g_render_task = nullptr;
+
+// Draws the lines logged by the emulation loop and presents every
+// (g_frame_skip + 1)th frame, while the next frame is emulated on core 1
+static void render_task(void* arg) {
+  priv_t* p = (priv_t*)arg;
+  int skip_counter = 0;
 
-  tft.setSwapBytes(true);
-  tft.pushImage(x0, y0, LCD_WIDTH, DEST_H, fb);
-  tft.setSwapBytes(false);
+  for (;;) {
+    g_do_rendering = (skip_counter == 0);
+    g_render->direct.no_render = !g_do_rendering;
+    while (!gb_draw_logged_lines(g_render, g_line_log)) ulTaskNotifyTake(pdTRUE, 1);
+    #if WALNUT_GB_DIRTY_LINES
+    dbg_count_lines(g_render);
+    #endif
+
+    if (g_do_rendering) {
+      const uint64_t t = now_us();
+      present_frame_external(p);
+      dbg_present_us += (uint32_t)(now_us() - t);
+      dbg_draws++;
+    }
+
+    skip_counter++;
+    if (skip_counter > g_frame_skip) skip_counter = 0;
+  }
 }
 #endif
 
+static inline bool render_deferred() {
+#if WALNUT_GB_DEFERRED_LCD
+  return g_render_task != nullptr;
+#else
+  return false;
+#endif
+}
+
 // Report debug stats every second
-static void dbg_report_1hz() {
+static void dbg_report_1hz(struct gb_s* gb) {
+  static uint32_t last_frames, last_draws, last_emulate_us, last_present_us, last_audio_us;
   uint32_t now = millis();
   if (now - dbg_last_report_ms < 1000) return;
   dbg_last_report_ms = now;
 
+  const uint32_t frames = dbg_frames - last_frames;
+  const uint32_t draws = dbg_draws - last_draws;
+  const uint32_t per_frame = frames ? frames : 1;
+  const uint32_t per_draw = draws ? draws : 1;
   Serial.printf("\n[Gemini] ===== 1s PERF =====\n");
-  Serial.printf("[Gemini] LOGIC FPS: %lu  DRAW FPS: %lu\n", (unsigned long)dbg_frames, (unsigned long)dbg_draws);
-  dbg_frames = 0;
-  dbg_draws = 0;
+  Serial.printf("[Gemini] LOGIC FPS: %lu  DRAW FPS: %lu\n", (unsigned long)frames, (unsigned long)draws);
+  Serial.printf("[Gemini] SKIP: %d  LOAD: %d%%  RESYNCS: %lu  EMU: %lu us  AUDIO: %lu us  PRESENT: %lu us/draw\n",
+                g_frame_skip, g_governor.load(), (unsigned long)g_pacer.resyncs(),
+                (unsigned long)((dbg_emulate_us - last_emulate_us) / per_frame),
+                (unsigned long)((dbg_audio_us - last_audio_us) / per_frame),
+                (unsigned long)((dbg_present_us - last_present_us) / per_draw));
+  last_frames = dbg_frames;
+  last_draws = dbg_draws;
+  last_emulate_us = dbg_emulate_us;
+  last_present_us = dbg_present_us;
+  last_audio_us = dbg_audio_us;
+#if ENABLE_LCD
+  Serial.printf("[Gemini] TFT: %lu KB  %lu pushes\n", (unsigned long)(g_tft_sink.bytes / 1024), (unsigned long)g_tft_sink.transfers);
+  g_tft_sink.bytes = 0;
+  g_tft_sink.transfers = 0;
+#endif
+#if WALNUT_GB_DIRTY_LINES
+  static uint32_t last_lines_drawn, last_lines_skipped;
+  // With deferred rendering the render task counts the lines
+  if (!render_deferred()) dbg_count_lines(gb);
+  const uint32_t lines_drawn = dbg_lines_drawn - last_lines_drawn;
+  const uint32_t lines_skipped = dbg_lines_skipped - last_lines_skipped;
+  const uint32_t lines = lines_drawn + lines_skipped;
+  last_lines_drawn += lines_drawn;
+  last_lines_skipped += lines_skipped;
+  Serial.printf("[Gemini] LINES: %lu%% skipped  %lu drawn\n",
+                (unsigned long)(lines ? (uint64_t)lines_skipped * 100 / lines : 0), (unsigned long)lines_drawn);
+#endif
+#if WALNUT_GB_IDLE_SKIP
+  struct gb_idle_stats_s is;
+  gb_get_idle_stats(gb, &is, true);
+  Serial.printf("[Gemini] IDLE SKIP: %lu loops  %lu cycles\n", (unsigned long)is.skips, (unsigned long)is.cycles);
+#endif
+  (void)gb;
 }
 
 void setup() {
@@ -597,8 +832,10 @@ void setup() {
   // Audio setup with GBC SOUND ENGINE
 #if ENABLE_SOUND
   uiStatusScreen("Booting...", "Init Audio (RingBuffer)...");
-  // Init GBC sound engine
-  gbc_sound_init(32768);
+  // Init GBC sound engine at the rate the APU produces samples when frames
+  // are paced at VERTICAL_SYNC (AUDIO_SAMPLES is rounded down from 32768 Hz),
+  // so the ring buffer neither fills nor drains
+  gbc_sound_init((int)(AUDIO_SAMPLES * VERTICAL_SYNC + 0.5));
   minigb_apu_audio_init(&g_apu);
 #endif
 
@@ -606,6 +843,11 @@ void setup() {
   tft.init();
   tft.setRotation(3);
   tft.fillScreen(TFT_BLACK);
+#if USE_TFT_DMA
+  // The TFT has its own SPI bus, so it is kept selected for DMA pushes
+  tft.initDMA();
+  tft.startWrite();
+#endif
   
   uiStatusScreen("Booting...", "Init SD...");
   SPI2.begin(M5.getPin(m5::pin_name_t::sd_spi_sclk), M5.getPin(m5::pin_name_t::sd_spi_miso), M5.getPin(m5::pin_name_t::sd_spi_mosi), M5.getPin(m5::pin_name_t::sd_spi_ss));
@@ -618,18 +860,41 @@ void setup() {
   static struct gb_s gb;
   static struct priv_t priv;
   
-  Serial.println("[Gemini] Allocating Single Framebuffer...");
-  priv.fb = (uint16_t*)malloc(FB_SIZE);
+#if USE_STRIP_BUFFER
+  Serial.println("[Gemini] Allocating Strips...");
+  // Only used to tell that there is somewhere to draw; lines go to g_strips
+  priv.fb = (uint16_t*)heap_caps_malloc(Strips::SIZE, MALLOC_CAP_DMA);
+#else
+  Serial.println("[Gemini] Allocating Framebuffers...");
+  priv.fb = (uint16_t*)heap_caps_malloc(FB_SIZE, MALLOC_CAP_DMA);
+#endif
   if (!priv.fb) {
       Serial.println("[Gemini] CRITICAL: FB malloc failed!");
       uiStatusScreen("Error", "FB Alloc Fail");
       while(1) delay(1000);
   }
 
-  priv.rom = read_rom_to_ram(romPath.c_str());
+  size_t rom_size = 0;
+  priv.rom = read_rom_to_ram(romPath.c_str(), &rom_size);
   if (!priv.rom) { uiStatusScreen("Error", "ROM read failed"); while (1) delay(1000); }
 
   gb_init(&gb, &gb_rom_read, &gb_rom_read_16bit, &gb_rom_read_32bit, &gb_cart_ram_read, &gb_cart_ram_write, &gb_error, &priv);
+#if WALNUT_GB_PAGE_TABLE
+  // ROM stays in RAM for the whole session, so let the core read it directly
+  gb_set_rom_direct(&gb, priv.rom, rom_size);
+#endif
+#if WALNUT_GB_IDLE_SKIP
+  {
+    char title[17];
+    gb_get_rom_name(&gb, title);
+    for (const char* const* t = IDLE_SKIP_OPTOUT; *t; t++) {
+      if (strcmp(title, *t) == 0) {
+        gb.direct.idle_skip = false;
+        Serial.printf("[Gemini] Idle loop skipping disabled for %s\n", title);
+      }
+    }
+  }
+#endif
   
   gb.direct.interlace = 1;
 
@@ -638,16 +903,64 @@ void setup() {
     priv.cart_ram = (uint8_t*)malloc((size_t)save_size);
     memset(priv.cart_ram, 0, (size_t)save_size);
   } else priv.cart_ram = NULL;
+#if WALNUT_GB_PAGE_TABLE
+  // Same buffer as gb_cart_ram_read/write, so banked RAM is a plain pointer access
+  gb_set_cart_ram_direct(&gb, priv.cart_ram, priv.cart_ram ? (uint_fast32_t)save_size : 0);
+#endif
 
 #if ENABLE_LCD
-  gb_init_lcd(&gb, &lcd_draw_line);
+  gb_init_lcd_rgb565(&gb, &lcd_line_rgb565);
+  gb_set_palette_rgb565(&gb, CURRENT_PALETTE_RGB565);
+#endif
+
+#if WALNUT_GB_DEFERRED_LCD
+  // A second context to draw in, so this needs ~90 KB more; without it the
+  // lines are drawn on this core as before
+  g_render = (struct gb_s*)malloc(sizeof(struct gb_s));
+  g_line_log = (struct gb_line_log_s*)malloc(sizeof(struct gb_line_log_s));
+  if (g_render && g_line_log) {
+    gb_set_line_log(&gb, g_render, g_line_log);
+    if (xTaskCreatePinnedToCore(render_task, "gb_render", 4096, &priv, 1, &g_render_task, 0) != pdPASS) {
+      gb_set_line_log(&gb, NULL, NULL);
+      g_render_task = nullptr;
+    }
+  }
+  if (g_render_task) {
+    Serial.println("[Gemini] Deferred rendering on core 0");
+  } else {
+    Serial.println("[Gemini] Deferred rendering unavailable, drawing inline");
+    free(g_render);
+    free(g_line_log);
+    g_render = nullptr;
+    g_line_log = nullptr;
+  }
+#endif
+
+#if ENABLE_LCD && USE_STRIP_BUFFER
+  g_strips.begin(priv.fb);
+  Serial.printf("[Gemini] %d Strips of %d lines\n", STRIP_COUNT, STRIP_LINES);
+#elif ENABLE_LCD
+  // The second buffer is allocated last, so running short of RAM only
+  // costs the overlap of pushing and emulating
+  memset(priv.fb, 0, FB_SIZE);
+  g_frames.begin(priv.fb, (uint16_t*)heap_caps_malloc(FB_SIZE, MALLOC_CAP_DMA));
+  Serial.println(g_frames.double_buffered() ? "[Gemini] Double Framebuffer"
+                                            : "[Gemini] Single Framebuffer");
 #endif
 
   M5Cardputer.Display.clearDisplay();
 
-  const uint32_t frame_budget_us = 16666;
   int skip_counter = 0;
   int input_throttle = 0;
+
+  int saved_skip = load_frame_skip(romPath);
+  g_governor.begin(saved_skip);
+  g_frame_skip = g_governor.skip();
+  uint32_t skip_held_since_ms = millis();
+  Serial.printf("[Gemini] Frame skip starts at %d\n", g_frame_skip);
+
+  if (!g_frame_timer.begin()) Serial.println("[Gemini] Frame timer unavailable, pacing by busy-wait");
+  g_pacer.begin(g_frame_timer.now_us());
   
   while (1) {
     uint32_t now = micros();
@@ -672,15 +985,25 @@ void setup() {
         }
     }
 
-    // 2. Decide if we render
-    g_do_rendering = (skip_counter == 0);
+    // 2. Decide if we render (the render task decides when deferred)
+    if (!render_deferred()) {
+      g_do_rendering = (skip_counter == 0);
+      // Skipped frames run without drawing any lines
+      gb.direct.no_render = !g_do_rendering;
+    }
 
     // 3. Run Emulator
+    uint32_t t = micros();
     gb_run_frame_dualfetch(&gb);
+    dbg_emulate_us += micros() - t;
     dbg_frames++;
+#if WALNUT_GB_DEFERRED_LCD
+    if (render_deferred()) xTaskNotifyGive(g_render_task);
+#endif
 
     // 4. Audio - GBC SOUND ENGINE INTEGRATION
 #if ENABLE_SOUND
+    t = micros();
     // 1. Generate stereo samples from APU to g_apuStereoBuffer
     minigb_apu_audio_callback(&g_apu, (audio_sample_t*)g_apuStereoBuffer);
     
@@ -695,27 +1018,40 @@ void setup() {
 
     // 3. Submit mono samples to the ring buffer
     gbc_sound_submit(g_apuMonoBuffer, AUDIO_SAMPLES);
+    dbg_audio_us += micros() - t;
 #endif
 
     // 5. Draw
-    if (g_do_rendering) {
+    if (!render_deferred() && g_do_rendering) {
 #if ENABLE_LCD
-      present_frame_external(priv.fb);
+      t = micros();
+      present_frame_external(&priv);
+      dbg_present_us += micros() - t;
       dbg_draws++;
 #endif
     }
 
     // Advance skip counter
     skip_counter++;
-    if (skip_counter > FRAME_SKIP_COUNT) skip_counter = 0;
+    if (skip_counter > g_frame_skip) skip_counter = 0;
 
     uint32_t end_frame = micros();
     uint32_t elapsed = end_frame - now;
-    if (elapsed < frame_budget_us) {
-       delayMicroseconds(frame_budget_us - elapsed);
+
+    // 6. Choose the frame skip from the time this frame kept the loop busy
+    if (g_governor.frame_done(elapsed, dbg_draws)) {
+      g_frame_skip = g_governor.skip();
+      skip_held_since_ms = millis();
+    } else if (g_frame_skip != saved_skip && millis() - skip_held_since_ms > FRAME_SKIP_SAVE_MS) {
+      saved_skip = g_frame_skip;
+      save_frame_skip(romPath, saved_skip);
     }
+
+    // 7. Sleep until this frame's end in the schedule; time lost to an
+    // overrun is made up over the next frames
+    g_frame_timer.sleep_until(g_pacer.frame_done(g_frame_timer.now_us()));
     
-    dbg_report_1hz();
+    dbg_report_1hz(&gb);
   }
 }
 
@@ -0,0 +1,64 @@
+#pragma once
+
+/*
+ * Simulated SPI display for host builds of FrameBuffers (frame_buffers.h).
+ *
+ * Like a DMA transfer, a push only reads the rows when it completes, which is
+ * at the next wait() or push(). Rows changed in between reach the panel as
+ * they are then, so a frame drawn into a buffer that is still being sent shows
+ * up as a torn panel, and is counted in torn even if a later push puts the
+ * panel right.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+template <int W, int H>
+struct SpiSinkSim {
+  uint16_t panel[W * H] = {};
+  uint32_t transfers = 0;
+  uint32_t bytes = 0;
+  uint32_t torn = 0;   // Pushes whose rows changed before they completed
+
+  // Like a single DMA channel, a push first waits for the one before it
+  void push(int x, int y, int w, int h, const uint16_t* src, int stride) {
+    wait();
+    pending_ = src;
+    pending_x_ = x;
+    pending_y_ = y;
+    pending_w_ = w;
+    pending_h_ = h;
+    pending_stride_ = stride;
+    pending_sum_ = sum();
+  }
+
+  void wait() {
+    if (!pending_) return;
+    if (sum() != pending_sum_) torn++;
+    for (int r = 0; r < pending_h_; r++)
+      memcpy(&panel[(pending_y_ + r) * W + pending_x_],
+             pending_ + r * pending_stride_, sizeof(uint16_t) * pending_w_);
+    transfers++;
+    bytes += sizeof(uint16_t) * pending_w_ * pending_h_;
+    pending_ = nullptr;
+  }
+
+  bool busy() const { return pending_ != nullptr; }
+
+private:
+  uint32_t sum() const {
+    uint32_t s = 0;
+    for (int r = 0; r < pending_h_; r++)
+      for (int x = 0; x < pending_w_; x++)
+        s = s * 31 + pending_[r * pending_stride_ + x];
+    return s;
+  }
+
+  const uint16_t* pending_ = nullptr;
+  int pending_x_ = 0;
+  int pending_y_ = 0;
+  int pending_w_ = 0;
+  int pending_h_ = 0;
+  int pending_stride_ = 0;
+  uint32_t pending_sum_ = 0;
+};
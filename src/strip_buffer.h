@@ -0,0 +1,96 @@
+#pragma once
+
+/*
+ * Ring of strips the core draws lines into, sent to the display while the
+ * lines below are still being emulated ("racing the beam").
+ *
+ * Each strip holds LINES rows of the frame. When the core asks for a row in
+ * a different strip, the rows drawn into the current one are sent and the
+ * next slot of the ring is used. So only COUNT * LINES rows are kept instead
+ * of a whole frame, and most of a frame is on the display by the time its last
+ * line is drawn.
+ *
+ * Rows the core does not draw (WALNUT_GB_DIRTY_LINES skips unchanged lines)
+ * are left as they are on the display, so each run of drawn rows is sent as
+ * a rectangle of its own.
+ *
+ * A row from line() holds whatever strip used the slot before, so the core
+ * must draw it whole the first time it asks for it in a strip. Asking again
+ * within the strip, as a mid-line register write does with
+ * WALNUT_GB_LINE_SPANS, gives the same row as drawn so far; the core draws a
+ * line it skipped as unchanged whole before such a write draws part of it.
+ *
+ * Uses the Sink of FrameBuffers (frame_buffers.h), which must also wait for
+ * each push to finish before starting the next, as a single DMA channel
+ * does. The rows of a strip are then free once the next strip's push has
+ * returned, which is before the ring comes back round to them with COUNT of
+ * 2 or more. A third strip only helps a sink that queues pushes. See
+ * test/test_strip_buffer.cpp.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+template <typename Sink, int W, int H, int LINES, int COUNT>
+class StripBuffer {
+public:
+  static const int SIZE = W * LINES * COUNT * 2;  // Bytes of memory for begin()
+
+  explicit StripBuffer(Sink& sink) : sink_(sink) {}
+
+  // mem holds SIZE bytes the sink can send from
+  void begin(uint16_t* mem) {
+    mem_ = mem;
+    strip_ = -1;
+    slot_ = 0;
+    rows_ = 0;
+  }
+
+  // Returns row y to draw into, sending the strip before it if y is in
+  // another one
+  uint16_t* line(int y) {
+    const int strip = y / LINES;
+    if (strip != strip_) {
+      flush();
+      slot_ = (slot_ + 1) % COUNT;
+      strip_ = strip;
+    }
+    const int row = y % LINES;
+    rows_ |= 1u << row;
+    return slot_row(row);
+  }
+
+  // Sends the rest of the frame
+  void end_frame() {
+    flush();
+    // The next frame's first strip goes in a new slot even if it is the
+    // same strip, as this one may still be sent from
+    strip_ = -1;
+  }
+
+private:
+  static_assert(LINES <= 32, "drawn rows of a strip are kept in 32 bits");
+  static_assert(COUNT >= 2, "a strip is drawn while the one before is sent");
+
+  // Sends the rows of the current strip drawn since the last call
+  void flush() {
+    if (strip_ < 0 || rows_ == 0) return;
+    int row = 0;
+    while (row < LINES) {
+      if (!(rows_ & (1u << row))) { row++; continue; }
+      int end = row + 1;
+      while (end < LINES && (rows_ & (1u << end))) end++;
+      sink_.push(0, strip_ * LINES + row, W, end - row, slot_row(row), W);
+      row = end;
+    }
+    rows_ = 0;
+  }
+
+  uint16_t* slot_row(int row) const { return mem_ + (slot_ * LINES + row) * W; }
+
+  Sink& sink_;
+  uint16_t* mem_ = nullptr;
+  int strip_ = -1;          // Strip of the frame in the current slot
+  int slot_ = 0;
+  uint32_t rows_ = 0;       // Rows of the current strip drawn
+};
@@ -0,0 +1,140 @@
+/**
+ * Runs FrameBuffers (src/frame_buffers.h) against the simulated SPI display
+ * (src/spi_sink_sim.h). Each frame changes random rows and, like
+ * WALNUT_GB_DIRTY_LINES, only those rows are drawn. The panel must show each
+ * frame exactly once its transfer has completed, with double buffering and
+ * without. A frame drawn into a buffer that is still being sent would tear
+ * the panel.
+ *
+ * Build on the host with:
+ *	make test_frame_buffers
+ */
+#include "frame_buffers.h"
+#include "spi_sink_sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define W	160
+#define H	144
+
+typedef SpiSinkSim<W, H> Sink;
+
+static uint16_t image[2][W * H];
+static uint16_t buf_a[W * H], buf_b[W * H];
+static Sink sink;
+
+/* Changes random rows of image next from image prev, and draws them. */
+static void draw_frame(FrameBuffers<Sink, W, H>& frames, unsigned frame,
+		const uint16_t* prev, uint16_t* next)
+{
+	/* Some frames change most of the screen, most only a little. */
+	const int odds = frame % 16 == 0 ? 1 : 8;
+	const int span_x = rand() % W;
+	const int span_w = 1 + rand() % 24;
+
+	memcpy(next, prev, sizeof(image[0]));
+
+	for(int y = 0; y < H; y++)
+	{
+		if(rand() % odds != 0 && frame != 0)
+			continue;
+
+		switch(rand() % 3)
+		{
+		case 0:
+			for(int x = 0; x < W; x++)
+				next[y * W + x] = (uint16_t)(frame * 31 + y * 7 + x);
+			break;
+
+		case 1:
+			for(int x = span_x; x < W && x < span_x + span_w; x++)
+				next[y * W + x] = (uint16_t)(frame * 31 + y * 7 + x);
+			break;
+
+		default:
+			/* Drawn again unchanged. */
+			break;
+		}
+
+		memcpy(frames.draw_buffer() + y * W, &next[y * W],
+				sizeof(uint16_t) * W);
+		frames.mark_row(y);
+	}
+}
+
+static int check_panel(unsigned frame, const uint16_t* expected)
+{
+	if(memcmp(sink.panel, expected, sizeof(sink.panel)) == 0)
+		return 0;
+
+	for(int y = 0; y < H; y++)
+	{
+		if(memcmp(&sink.panel[y * W], &expected[y * W],
+				sizeof(uint16_t) * W) != 0)
+		{
+			printf("Frame %u differs from line %d\n", frame, y);
+			break;
+		}
+	}
+
+	return -1;
+}
+
+static int run(bool double_buffered, unsigned frames_to_run)
+{
+	FrameBuffers<Sink, W, H> frames(sink);
+	unsigned frame;
+
+	sink = Sink();
+	memset(image, 0, sizeof(image));
+	frames.begin(buf_a, double_buffered ? buf_b : NULL);
+
+	for(frame = 0; frame < frames_to_run; frame++)
+	{
+		const uint16_t* prev = image[(frame + 1) % 2];
+		uint16_t* next = image[frame % 2];
+
+		draw_frame(frames, frame, prev, next);
+
+		/* Finish sending the previous frame only now, as its transfers
+		 * may still be running while this frame is drawn. */
+		sink.wait();
+		if(double_buffered && frame != 0 && check_panel(frame - 1, prev))
+			return -1;
+
+		frames.present();
+
+		if(!double_buffered && check_panel(frame, next))
+			return -1;
+	}
+
+	sink.wait();
+	if(check_panel(frame - 1, image[(frame - 1) % 2]))
+		return -1;
+
+	if(sink.torn != 0)
+	{
+		printf("%u frames drawn into a buffer being sent\n", sink.torn);
+		return -1;
+	}
+
+	printf("%s: %u frames, %lu transfers, %lu bytes, no differences\n",
+			double_buffered ? "double" : "single", frames_to_run,
+			(unsigned long)sink.transfers, (unsigned long)sink.bytes);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned frames = 1000;
+
+	if(argc == 2)
+		frames = strtoul(argv[1], NULL, 10);
+
+	if(run(true, frames) || run(false, frames))
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,102 @@
+/**
+ * Runs FrameGovernor (src/frame_governor.h) on a simulated loop where each
+ * frame costs a fixed time to emulate, plus a fixed time when it is drawn,
+ * give or take a little. For each case the governor must settle on the
+ * lowest skip that keeps real time, or the highest it may use when none
+ * does, and then stay there.
+ *
+ * Build on the host with:
+ *	make test_frame_governor
+ */
+#include "frame_governor.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define FRAME_US	16743
+#define MIN_SKIP	0
+#define MAX_SKIP	8
+#define FRAMES		6000
+
+struct load_case
+{
+	const char *name;
+	uint32_t emulate_us;
+	uint32_t draw_us;
+	int start_skip;
+};
+
+/* Lowest skip that keeps the average frame under limit percent of real time,
+ * or MAX_SKIP. */
+static int needed_skip(const struct load_case *c, int limit)
+{
+	for(int skip = MIN_SKIP; skip < MAX_SKIP; skip++)
+	{
+		const uint32_t avg = c->emulate_us + c->draw_us / (skip + 1);
+
+		if(avg * 100 < (uint32_t)FRAME_US * limit)
+			return skip;
+	}
+
+	return MAX_SKIP;
+}
+
+static int run(const struct load_case *c, FrameGovernor &gov, bool restart)
+{
+	uint32_t draws = 0;
+	int counter = 0, changes = 0;
+	const int want_low = needed_skip(c, FrameGovernor::HIGH_LOAD -
+			FrameGovernor::MARGIN);
+	const int want_high = needed_skip(c, FrameGovernor::HIGH_LOAD);
+
+	if(restart)
+		gov.begin(c->start_skip);
+
+	for(int frame = 0; frame < FRAMES; frame++)
+	{
+		const bool drawn = counter == 0;
+		uint32_t busy = c->emulate_us + (drawn ? c->draw_us : 0);
+
+		busy = busy * (95 + rand() % 11) / 100;
+		draws += drawn;
+
+		if(++counter > gov.skip())
+			counter = 0;
+
+		if(gov.frame_done(busy, draws) && frame >= FRAMES / 2)
+			changes++;
+	}
+
+	/* Between the skip that fits with margin and the one that just fits. */
+	if(gov.skip() < want_high || gov.skip() > want_low || changes > 2)
+	{
+		printf("%s: skip %d, expected %d to %d, %d changes late on\n",
+				c->name, gov.skip(), want_high, want_low, changes);
+		return -1;
+	}
+
+	printf("%s: skip %d, load %d%%\n", c->name, gov.skip(), gov.load());
+	return 0;
+}
+
+int main(void)
+{
+	static const struct load_case cases[] = {
+		{ "light",      6000,  4000, MAX_SKIP },
+		{ "heavy draw", 9000, 25000, 0 },
+		{ "tight",     12000, 14000, 2 },
+		{ "too slow",  17000,  5000, 0 },
+		/* Run on from the case before, as when a game changes scene. */
+		{ "lighter",    4000,  9000, -1 },
+		{ "heavier",   10000, 20000, -1 },
+	};
+	FrameGovernor gov(FRAME_US, MIN_SKIP, MAX_SKIP);
+
+	for(unsigned i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+	{
+		if(run(&cases[i], gov, cases[i].start_skip >= 0))
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,123 @@
+/**
+ * Checks FramePacer (src/frame_pacer.h) on a simulated clock: deadlines stay
+ * on the exact 59.7275 Hz schedule over a long run, an overrun is caught up
+ * without moving the schedule, and falling too far behind starts it over.
+ * Then paces a few frames with DeadlineTimer for real.
+ *
+ * Build on the host with:
+ *	make test_frame_pacer
+ */
+#include "frame_pacer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* 70224 cycles of a 4194304 Hz clock, in microseconds. */
+#define PERIOD_NUM	(70224ull * 1000000ull)
+#define PERIOD_DEN	4194304ull
+
+static uint64_t scheduled(uint64_t start, uint64_t frame)
+{
+	return start + frame * PERIOD_NUM / PERIOD_DEN;
+}
+
+/* Frames that finish in time are followed by one at its place in the
+ * schedule, crossing the points where the start moves on. */
+static int check_schedule(void)
+{
+	FramePacer pacer(PERIOD_NUM, PERIOD_DEN);
+	const uint64_t start = 1000;
+	const uint64_t frames = 2 * PERIOD_DEN + 12345;
+	uint64_t now = start;
+
+	pacer.begin(now);
+	for(uint64_t frame = 1; frame <= frames; frame++)
+	{
+		const uint64_t next = pacer.frame_done(now + rand() % 16000);
+
+		if(next != scheduled(start, frame))
+		{
+			printf("Frame %llu starts at %llu, not %llu\n",
+					(unsigned long long)frame,
+					(unsigned long long)next,
+					(unsigned long long)scheduled(start, frame));
+			return -1;
+		}
+		now = next;
+	}
+
+	printf("%llu frames on schedule, %.4f Hz\n", (unsigned long long)frames,
+			frames * 1e6 / (now - start));
+	return 0;
+}
+
+static int check_catch_up(void)
+{
+	FramePacer pacer(PERIOD_NUM, PERIOD_DEN);
+	uint64_t now = 0, frame;
+
+	pacer.begin(now);
+
+	/* Frame 1 takes three and a half periods; the next frames take half a
+	 * period each and start at once until the schedule is met. */
+	now = pacer.frame_done(scheduled(0, 3) + PERIOD_NUM / PERIOD_DEN / 2);
+	for(frame = 2; frame < 12; frame++)
+		now = pacer.frame_done(now + PERIOD_NUM / PERIOD_DEN / 2);
+
+	if(now != scheduled(0, frame - 1) || pacer.resyncs() != 0)
+	{
+		printf("Overrun not caught up: frame %llu at %llu, not %llu\n",
+				(unsigned long long)frame - 1,
+				(unsigned long long)now,
+				(unsigned long long)scheduled(0, frame - 1));
+		return -1;
+	}
+
+	/* A stall longer than the catch-up limit starts the schedule over. */
+	now = scheduled(0, frame + FramePacer::MAX_CATCH_UP + 2);
+	if(pacer.frame_done(now) != now || pacer.resyncs() != 1 ||
+			pacer.frame_done(now) != scheduled(now, 1))
+	{
+		printf("Schedule not started over after a stall\n");
+		return -1;
+	}
+
+	printf("Overrun caught up, stall started over\n");
+	return 0;
+}
+
+static int check_timer(void)
+{
+	FramePacer pacer(PERIOD_NUM, PERIOD_DEN);
+	DeadlineTimer timer;
+	const int frames = 30;
+	uint64_t start, end;
+
+	timer.begin();
+	start = timer.now_us();
+	pacer.begin(start);
+	for(int frame = 0; frame < frames; frame++)
+		timer.sleep_until(pacer.frame_done(timer.now_us()));
+	end = timer.now_us();
+
+	/* Late wake-ups do not add up, as each deadline is absolute. */
+	if(end < scheduled(start, frames) || end > scheduled(start, frames) + 5000)
+	{
+		printf("%d frames took %llu us, expected %llu\n", frames,
+				(unsigned long long)(end - start),
+				(unsigned long long)(scheduled(start, frames) - start));
+		return -1;
+	}
+
+	printf("%d frames paced in %llu us\n", frames,
+			(unsigned long long)(end - start));
+	return 0;
+}
+
+int main(void)
+{
+	if(check_schedule() || check_catch_up() || check_timer())
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,118 @@
+/**
+ * Runs StripBuffer (src/strip_buffer.h) against the simulated SPI display
+ * (src/spi_sink_sim.h). Each frame draws random rows in order, as
+ * WALNUT_GB_DIRTY_LINES only draws the lines that changed, often all in one
+ * band as when a single sprite moves. It sometimes
+ * draws a row twice as a mid-line register write does. Such a write can also
+ * come on a row skipped as unchanged, which the core then draws whole as it
+ * was before drawing part of it again, as the row it is given holds an older
+ * strip. Frames follow each
+ * other without waiting for their transfers, and no strip may be drawn into
+ * while it is still being sent. Every few frames the transfers are let
+ * complete and the panel must show the frame.
+ *
+ * Build on the host with:
+ *	make test_strip_buffer
+ */
+#include "strip_buffer.h"
+#include "spi_sink_sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define W	160
+#define H	144
+
+typedef SpiSinkSim<W, H> Sink;
+typedef StripBuffer<Sink, W, H, 16, 2> Strips;
+
+static uint16_t image[W * H];
+static uint16_t mem[Strips::SIZE / 2];
+static Sink sink;
+
+static void draw_row(uint16_t *row, unsigned frame, int y, int x0 = 0)
+{
+	for(int x = x0; x < W; x++)
+		row[x] = (uint16_t)(frame * 31 + y * 7 + x);
+}
+
+int main(int argc, char *argv[])
+{
+	Strips strips(sink);
+	unsigned frames = 1000;
+
+	if(argc == 2)
+		frames = strtoul(argv[1], NULL, 10);
+
+	strips.begin(mem);
+
+	for(unsigned frame = 0; frame < frames; frame++)
+	{
+		const int odds = frame % 16 == 0 ? 1 : 1 + rand() % 12;
+		const bool band = frame % 16 != 0 && rand() % 2 == 0;
+		const int band_y = rand() % H;
+
+		for(int y = 0; y < H; y++)
+		{
+			if(band && (y < band_y || y >= band_y + 12))
+				continue;
+			if(frame != 0 && rand() % odds != 0)
+			{
+				/* Skipped as unchanged, then a mid-line write. */
+				if(rand() % 16 == 0)
+				{
+					const int x = rand() % W;
+
+					memcpy(strips.line(y), &image[y * W],
+							sizeof(uint16_t) * W);
+					draw_row(&image[y * W], frame, y, x);
+					draw_row(strips.line(y), frame, y, x);
+				}
+				continue;
+			}
+
+			draw_row(&image[y * W], frame, y);
+			draw_row(strips.line(y), frame, y);
+
+			if(rand() % 8 == 0)
+			{
+				/* Drawn again from a column on. */
+				const int x = rand() % W;
+
+				image[y * W + x] ^= 0x5555;
+				strips.line(y)[x] ^= 0x5555;
+			}
+		}
+
+		strips.end_frame();
+		if(frame % 8 != 7)
+			continue;
+
+		sink.wait();
+		if(sink.torn != 0)
+		{
+			printf("Frame %u drawn into a strip being sent\n", frame);
+			return EXIT_FAILURE;
+		}
+
+		if(memcmp(sink.panel, image, sizeof(image)) != 0)
+		{
+			for(int y = 0; y < H; y++)
+			{
+				if(memcmp(&sink.panel[y * W], &image[y * W],
+						sizeof(uint16_t) * W) != 0)
+				{
+					printf("Frame %u differs from line %d\n",
+							frame, y);
+					break;
+				}
+			}
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("%u frames, %lu transfers, %lu bytes, no differences\n", frames,
+			(unsigned long)sink.transfers, (unsigned long)sink.bytes);
+	return EXIT_SUCCESS;
+}
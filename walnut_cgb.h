@@ -59,17 +59,32 @@
 * for a little endian platform. If 0, then big endian.
 */
 // The safe flags below toggle opcode reloading for dual fetch execution for mbc, dma and specific opcodes - used for debugging invalidated opcodes or compatibility but slows execution
-#define WALNUT_GB_SAFE_DUALFETCH_OPCODES 0
-#define WALNUT_GB_SAFE_DUALFETCH_DMA  0
-#define WALNUT_GB_SAFE_DUALFETCH_MBC  0
+#ifndef WALNUT_GB_SAFE_DUALFETCH_OPCODES
+# define WALNUT_GB_SAFE_DUALFETCH_OPCODES 0
+#endif
+#ifndef WALNUT_GB_SAFE_DUALFETCH_DMA
+# define WALNUT_GB_SAFE_DUALFETCH_DMA 0
+#endif
+#ifndef WALNUT_GB_SAFE_DUALFETCH_MBC
+# define WALNUT_GB_SAFE_DUALFETCH_MBC 0
+#endif
 // WALNUT_GB_16_BIT_OPS_DUALFETCH when true enables 16-bit operation for opcodes with 16-bit reads for the first half of the dual fetch chain
 // currently breaks compatibility with some games, 16-bit opcode optimization needs revisions. The 3 tiers here are used to isolate misbehaving opcodes more quickly when debugging.
-#define WALNUT_GB_16_BIT_OPS_DUALFETCH 0
-#define WALNUT_GB_16_BIT_OPS_DUALFETCH_DISABLED2 0
-#define WALNUT_GB_16_BIT_OPS_DUALFETCH_DISABLED 0
+#ifndef WALNUT_GB_16_BIT_OPS_DUALFETCH
+# define WALNUT_GB_16_BIT_OPS_DUALFETCH 0
+#endif
+#ifndef WALNUT_GB_16_BIT_OPS_DUALFETCH_DISABLED2
+# define WALNUT_GB_16_BIT_OPS_DUALFETCH_DISABLED2 0
+#endif
+#ifndef WALNUT_GB_16_BIT_OPS_DUALFETCH_DISABLED
+# define WALNUT_GB_16_BIT_OPS_DUALFETCH_DISABLED 0
+#endif
 // WALNUT_GB_16_BIT_OPS when true enables 16-bit operation for opcodes with 16-bit reads(from stack, immedate 16-bit operands, etc) in the second half of the chained execution.
 // Like the above, this can break compatibility with some games and is disabled by default.
-#define WALNUT_GB_16_BIT_OPS 0
+// test/test_lockstep.c runs both cores side by side and reports the first opcode where they differ.
+#ifndef WALNUT_GB_16_BIT_OPS
+# define WALNUT_GB_16_BIT_OPS 0
+#endif
 // WALNUT_GB_16BIT_DMA uses 16-bit(and 32-bit) dma transfers rather than byte-by-byte, only one mode can be used at a time. The gb_read_32bit function is used for the 32-bit DMA, otherwise that function will not be called
 //  **Note:** The current implementation of 16-bit DMA is limited to systems that do not have aliasing or alignment restrictions when writing data (e.g., ESP32-S3). On some platforms, you may need to compile with `-fno-strict-aliasing` to avoid issues with pointer aliasing.
 #define WALNUT_GB_16BIT_DMA 0
@@ -77,7 +92,10 @@
 // Uses alignment aware read/writes with an 8-bit fallback (16-bit alignment implemented for read path only in this version)
 #define WALNUT_GB_16BIT_ALIGNED 1
 #define WALNUT_GB_32BIT_ALIGNED 1
-#define WALNUT_GB_RGB565_BIGENDIAN 0
+#ifndef WALNUT_GB_RGB565_BIGENDIAN
+# define WALNUT_GB_RGB565_BIGENDIAN 0
+#endif
+struct gb_s;
 uint8_t __gb_read(struct gb_s *gb, uint16_t addr);
 void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val);
 void __gb_write16(struct gb_s *gb, uint_fast16_t addr, uint16_t val);
@@ -149,6 +167,121 @@ void __gb_step_cpu_x(struct gb_s *gb);
 # define WALNUT_FULL_GBC_SUPPORT 1
 #endif
 
+/* Map ROM, VRAM and WRAM through a table of host pointers for each 256 byte
+ * page of the address space. Only IO, cart RAM and banking registers go through
+ * the slow handlers. */
+#ifndef WALNUT_GB_PAGE_TABLE
+# define WALNUT_GB_PAGE_TABLE 1
+#endif
+
+/* Detect short loops that only poll LY, STAT, IF, DIV or RAM and skip to the
+ * next event that could end them, as HALT does. Emulation is unchanged; see
+ * gb_get_idle_stats(). */
+#ifndef WALNUT_GB_IDLE_SKIP
+# define WALNUT_GB_IDLE_SKIP 1
+#endif
+
+/* Run common memcpy and memset loops in bulk, with the same registers, flags
+ * and cycles as the loop. Requires WALNUT_GB_PAGE_TABLE. */
+#ifndef WALNUT_GB_COPY_LOOPS
+# define WALNUT_GB_COPY_LOOPS WALNUT_GB_PAGE_TABLE
+#endif
+
+#if WALNUT_GB_COPY_LOOPS && !WALNUT_GB_PAGE_TABLE
+#error "WALNUT_GB_COPY_LOOPS requires WALNUT_GB_PAGE_TABLE"
+#endif
+
+/* Keep the tile data in VRAM decoded into rows of 2 bit colours, with a
+ * horizontally flipped copy of each row, and draw lines from them. Tiles are
+ * decoded again on first use after a write. Uses 24 KiB, or 12 KiB without
+ * WALNUT_FULL_GBC_SUPPORT. */
+#ifndef WALNUT_GB_TILE_CACHE
+# define WALNUT_GB_TILE_CACHE ENABLE_LCD
+#endif
+
+#if WALNUT_GB_TILE_CACHE && !ENABLE_LCD
+# undef WALNUT_GB_TILE_CACHE
+# define WALNUT_GB_TILE_CACHE 0
+#endif
+
+/* Draw whole background and window tiles eight pixels at a time, spreading
+ * tile cache rows into bytes with a 256 entry table and storing them as two
+ * 32 bit words. Requires WALNUT_GB_TILE_CACHE. */
+#ifndef WALNUT_GB_PIXEL_LUT
+# define WALNUT_GB_PIXEL_LUT WALNUT_GB_TILE_CACHE
+#endif
+
+#if WALNUT_GB_PIXEL_LUT && !WALNUT_GB_TILE_CACHE
+#error "WALNUT_GB_PIXEL_LUT requires WALNUT_GB_TILE_CACHE"
+#endif
+
+/* Keep the tile numbers and CGB attributes of the background and window map
+ * rows last drawn, so that the other lines of the same tile row do not read
+ * them from the map again. Writes to a map row drop it. Requires
+ * WALNUT_GB_TILE_CACHE. */
+#ifndef WALNUT_GB_MAP_CACHE
+# define WALNUT_GB_MAP_CACHE WALNUT_GB_TILE_CACHE
+#endif
+
+#if WALNUT_GB_MAP_CACHE && !WALNUT_GB_TILE_CACHE
+#error "WALNUT_GB_MAP_CACHE requires WALNUT_GB_TILE_CACHE"
+#endif
+
+/* Keep a list of the sprites to draw on each line, in drawing order, and only
+ * rebuild it after OAM or the sprite size is changed. Requires
+ * WALNUT_GB_HIGH_LCD_ACCURACY. */
+#ifndef WALNUT_GB_SPRITE_BUCKETS
+# define WALNUT_GB_SPRITE_BUCKETS WALNUT_GB_HIGH_LCD_ACCURACY
+#endif
+
+#if WALNUT_GB_SPRITE_BUCKETS && !ENABLE_LCD
+# undef WALNUT_GB_SPRITE_BUCKETS
+# define WALNUT_GB_SPRITE_BUCKETS 0
+#endif
+
+#if WALNUT_GB_SPRITE_BUCKETS && !WALNUT_GB_HIGH_LCD_ACCURACY
+#error "WALNUT_GB_SPRITE_BUCKETS requires WALNUT_GB_HIGH_LCD_ACCURACY"
+#endif
+
+/* Allow the lines to be recorded in a gb_line_log_s with the VRAM, OAM and
+ * palette changes made before each line, and drawn by another thread with
+ * gb_draw_logged_lines(), see gb_set_line_log(). Requires a GCC compatible
+ * compiler. */
+#ifndef WALNUT_GB_DEFERRED_LCD
+# define WALNUT_GB_DEFERRED_LCD 0
+#endif
+
+#if WALNUT_GB_DEFERRED_LCD && !ENABLE_LCD
+# undef WALNUT_GB_DEFERRED_LCD
+# define WALNUT_GB_DEFERRED_LCD 0
+#endif
+
+/* Only draw the lines that were drawn from VRAM, OAM, palettes or registers
+ * that have changed since, and leave the others as they are in the front-end's
+ * frame buffer. See gb_get_line_stats(). */
+#ifndef WALNUT_GB_DIRTY_LINES
+# define WALNUT_GB_DIRTY_LINES 0
+#endif
+
+#if WALNUT_GB_DIRTY_LINES && !ENABLE_LCD
+# undef WALNUT_GB_DIRTY_LINES
+# define WALNUT_GB_DIRTY_LINES 0
+#endif
+
+/* Let writes to LCDC, SCY, SCX and the palettes made while a line is being
+ * drawn (Mode 3) change the rest of that line, for raster effects that the
+ * line renderer otherwise misses. The line is drawn again from the pixel that
+ * the LCD has reached, see __gb_draw_span(). Lines without such writes are
+ * drawn once, as before. */
+#ifndef WALNUT_GB_LINE_SPANS
+# define WALNUT_GB_LINE_SPANS 0
+#endif
+
+#if WALNUT_GB_LINE_SPANS && !ENABLE_LCD
+# undef WALNUT_GB_LINE_SPANS
+# define WALNUT_GB_LINE_SPANS 0
+#endif
+
 #if (WALNUT_GB_12_COLOUR != WALNUT_FULL_GBC_SUPPORT)
 #error "WALNUT_GB_12_COLOUR and WALNUT_FULL_GBC_SUPPORT must both be enabled or both be disabled"
 #endif
@@ -328,6 +461,10 @@ void __gb_step_cpu_x(struct gb_s *gb);
 /* Stub __has_builtin if it isn't available. */
 # define __has_builtin(x) 0
 #endif
+#if !defined(__has_attribute)
+/* Stub __has_attribute if it isn't available. */
+# define __has_attribute(x) 0
+#endif
 
 /* The WGB_UNREACHABLE() macro tells the compiler that the code path will never
  * be reached, allowing for further optimisation. */
@@ -356,6 +493,15 @@ void __gb_step_cpu_x(struct gb_s *gb);
 #  define WGB_LIKELY(expr) (expr)
 # endif
 #endif /* !defined(WGB_LIKELY) */
+#if !defined(WGB_ALWAYS_INLINE)
+# if __has_attribute(always_inline)
+#  define WGB_ALWAYS_INLINE inline __attribute__((always_inline))
+# elif defined(_MSC_VER)
+#  define WGB_ALWAYS_INLINE __forceinline
+# else
+#  define WGB_ALWAYS_INLINE inline
+# endif
+#endif /* !defined(WGB_ALWAYS_INLINE) */
 
 #if WALNUT_GB_USE_INTRINSICS
 /* If using MSVC, only enable intrinsics for x86 platforms*/
@@ -583,7 +729,179 @@ struct count_s
 	uint_fast16_t serial_count;	/* Serial Counter */
 	uint_fast32_t rtc_count;	/* RTC Counter */
 	uint_fast32_t lcd_off_count;	/* Cycles LCD has been disabled */
+	uint_fast32_t pending_cycles;	/* Cycles not yet applied to counters */
+	uint_fast32_t next_event;	/* Pending cycles before a counter fires */
+#if WALNUT_GB_IDLE_SKIP
+	uint_fast32_t events_run;	/* Times __gb_run_events() was due */
+#endif
+};
+
+#if WALNUT_GB_IDLE_SKIP
+/* Loop watched by the idle loop detector. */
+struct gb_idle_s
+{
+	uint16_t pc;		/* Loop head */
+	uint16_t bank;		/* ROM bank of pc, 0 outside of ROM bank N */
+	uint16_t end;		/* Address after the backwards branch */
+	uint16_t cycles;	/* Cycles of one iteration, 0 if not idle */
+	bool reads_div;
+	bool armed;		/* Snapshot below was taken at the loop head */
+	uint8_t div;
+	uint16_t clock;
+	uint_fast32_t events_run;
+	struct cpu_registers_s regs;
+};
+
+/**
+ * Idle loop counters, see gb_get_idle_stats().
+ */
+struct gb_idle_stats_s
+{
+	uint_fast32_t skips;	/* Times an idle loop was fast-forwarded */
+	uint_fast32_t cycles;	/* Cycles skipped */
+};
+#endif
+
+#if WALNUT_GB_DIRTY_LINES
+/**
+ * Line counters, see gb_get_line_stats().
+ */
+struct gb_line_stats_s
+{
+	uint_fast32_t drawn;	/* Lines drawn */
+	uint_fast32_t skipped;	/* Lines left as they were last drawn */
 };
+#endif
+
+#if WALNUT_GB_TILE_CACHE
+/* Number of tiles in each VRAM bank, and in the tile cache. */
+#define WGB_BANK_TILES		384
+#if WALNUT_FULL_GBC_SUPPORT
+# define WGB_TILE_CACHE_SIZE	(2 * WGB_BANK_TILES)
+#else
+# define WGB_TILE_CACHE_SIZE	WGB_BANK_TILES
+#endif
+
+struct gb_tile_s
+{
+	/* Colour of each pixel of each row, with the leftmost pixel in bits
+	 * 1-0. */
+	uint16_t row[8];
+	/* The same rows flipped horizontally. */
+	uint16_t row_flip[8];
+};
+
+/* Map cache entries of the background and window, see __gb_draw_tiles(). */
+#define WGB_MAP_ROW_BG		0
+#define WGB_MAP_ROW_WIN		1
+#endif
+
+#if WALNUT_GB_MAP_CACHE
+/**
+ * A map row read by __gb_map_row().
+ */
+struct gb_map_row_s
+{
+	/* Offset of the row into VRAM bank 0, or 0 if the entry is empty. */
+	uint16_t map;
+	/* LCDC_TILE_SELECT when the row was read. */
+	uint8_t unsigned_tiles;
+	/* Tile cache index of each tile in VRAM bank 0. */
+	uint16_t tile[32];
+# if WALNUT_FULL_GBC_SUPPORT
+	/* CGB attributes of each tile. */
+	uint8_t att[32];
+# endif
+};
+#endif
+
+#if WALNUT_GB_TILE_CACHE || WALNUT_GB_DEFERRED_LCD || WALNUT_GB_DIRTY_LINES
+/* VRAM writes are noted with __gb_vram_written(). */
+# define WGB_VRAM_HOOK 1
+#else
+# define WGB_VRAM_HOOK 0
+#endif
+
+#if WALNUT_GB_MAP_CACHE || WALNUT_GB_DEFERRED_LCD || WALNUT_GB_DIRTY_LINES
+/* VRAM at offsets below this is not mapped for writes, see __gb_map_vram().
+ * The map cache, the line log and the dirty lines need the tile maps too. */
+# define WGB_VRAM_HOOK_END	VRAM_BANK_SIZE
+#else
+# define WGB_VRAM_HOOK_END	VRAM_BMAP_1
+#endif
+
+#if WALNUT_GB_SPRITE_BUCKETS || WALNUT_GB_DEFERRED_LCD || WALNUT_GB_DIRTY_LINES
+/* OAM writes are noted with __gb_oam_written(). */
+# define WGB_OAM_HOOK 1
+#else
+# define WGB_OAM_HOOK 0
+#endif
+
+#if WALNUT_GB_DIRTY_LINES
+/* Registers that a line was drawn with, see __gb_line_unchanged(). */
+struct gb_line_key_s
+{
+	uint8_t lcdc;
+	uint8_t scy;
+	uint8_t scx;
+	uint8_t wx;
+	/* Line of the window drawn, or 0xFF when the window is not drawn. */
+	uint8_t window;
+	uint8_t bgp;
+	/* Both sprite palettes, two bits per colour. */
+	uint16_t obp;
+};
+#endif
+
+#if WALNUT_GB_DEFERRED_LCD
+/* Size of the line log in 32 bit words. Must be a power of two. */
+#define WGB_LINE_LOG_WORDS	2048
+
+/* Records in the line log. Each starts with a word holding the type in the
+ * top byte and an argument in the low bytes. */
+#define WGB_LOG_VRAM	0	/* 16 bytes of VRAM, at the offset given */
+#define WGB_LOG_OAM	1	/* All of OAM */
+#define WGB_LOG_PALETTE	2	/* The CGB RGB565 palettes, cgb.fixPalette */
+#define WGB_LOG_LINE	3	/* A gb_logged_line_s to draw */
+#define WGB_LOG_FRAME	4	/* End of frame */
+#define WGB_LOG_SPAN	5	/* A gb_logged_line_s to draw from the pixel given */
+
+/* Registers used to draw a line. */
+struct gb_logged_line_s
+{
+	uint8_t ly;
+	uint8_t lcdc;
+	uint8_t scy;
+	uint8_t scx;
+	uint8_t wx;
+	/* WY latched at the start of the frame. */
+	uint8_t wy;
+	uint8_t bgp;
+	/* WGB_LOGGED_* */
+	uint8_t flags;
+	uint8_t bg_palette[4];
+	uint8_t sp_palette[8];
+};
+
+#define WGB_LOGGED_INTERLACE		0x01
+#define WGB_LOGGED_INTERLACE_COUNT	0x02
+#define WGB_LOGGED_FRAME_SKIP		0x04
+#define WGB_LOGGED_FRAME_SKIP_COUNT	0x08
+/* The window line was reset before this line. */
+#define WGB_LOGGED_WINDOW_RESET		0x10
+
+/**
+ * Lines recorded by the emulation thread and drawn by the drawing thread, see
+ * gb_set_line_log(). Each thread only writes its own position; they both
+ * count words from the start of the log and wrap around.
+ */
+struct gb_line_log_s
+{
+	uint32_t head;
+	uint32_t tail;
+	uint32_t words[WGB_LINE_LOG_WORDS];
+};
+#endif
 
 #if ENABLE_LCD
 	/* Bit mask for the shade of pixel to display */
@@ -746,6 +1064,11 @@ struct gb_s
 		bool cart_is_mbc3O : 1;
 	};
 
+	/* Set when gb_halt || (gb_ime && IF & IE), so that the CPU only has to
+	 * test one flag before each instruction. Updated by __gb_update_irq()
+	 * whenever IF, IE, IME or HALT change. */
+	bool irq_pending;
+
 	/* Cartridge information:
 	 * Memory Bank Controller (MBC) type. */
 	int8_t mbc;
@@ -763,6 +1086,11 @@ struct gb_s
 	/* Cartridge ROM/RAM mode select. */
 	uint8_t cart_mode_select;
 
+	/* Handles writes to the MBC registers at 0x0000-0x7FFF. Set by
+	 * gb_init() for the MBC of the cartridge. */
+	void (*mbc_write)(struct gb_s *gb, const uint_fast16_t addr,
+			const uint8_t val);
+
 	union cart_rtc rtc_latched, rtc_real;
 
 	struct cpu_registers_s cpu_reg;
@@ -775,6 +1103,79 @@ struct gb_s
 	uint8_t oam[OAM_SIZE];
 	uint8_t hram_io[HRAM_IO_SIZE];
 
+#if WALNUT_GB_PAGE_TABLE
+	/* Host pointer to the start of each 256 byte page, or NULL if the page
+	 * must be handled by __gb_read() or __gb_write(). */
+	const uint8_t *read_page[0x100];
+	uint8_t *write_page[0x100];
+
+	/* ROM image set with gb_set_rom_direct(). ROM pages are only mapped
+	 * when this is not NULL. */
+	const uint8_t *rom;
+	uint_fast32_t rom_size;
+
+	/* Cart RAM set with gb_set_cart_ram_direct(). The selected RAM bank
+	 * is only mapped when this is not NULL. */
+	uint8_t *cram;
+	uint_fast32_t cram_size;
+#endif
+
+#if WALNUT_GB_TILE_CACHE
+	/* Tile data of each VRAM bank, see __gb_tile(). A tile with its bit
+	 * set in tile_dirty is decoded again before it is drawn. */
+	struct gb_tile_s tiles[WGB_TILE_CACHE_SIZE];
+	uint32_t tile_dirty[WGB_TILE_CACHE_SIZE / 32];
+#endif
+
+#if WALNUT_GB_SPRITE_BUCKETS
+	/* Sprites to draw on each line, see __gb_fill_sprite_buckets(). They
+	 * are filled again before the next line is drawn when
+	 * sprite_buckets_dirty is set. */
+	uint8_t sprite_bucket[LCD_HEIGHT][MAX_SPRITES_LINE];
+	uint8_t sprite_bucket_count[LCD_HEIGHT];
+	bool sprite_buckets_dirty;
+#endif
+
+#if WALNUT_GB_DEFERRED_LCD
+	/* Log that lines are recorded to instead of being drawn, or NULL. */
+	struct gb_line_log_s *line_log;
+	/* VRAM, OAM and palettes changed since they were last recorded. VRAM
+	 * has one bit for every 16 bytes. */
+	uint32_t log_vram_dirty[VRAM_SIZE / 16 / 32];
+	bool log_oam_dirty;
+	bool log_palette_dirty;
+	/* Set when the window line is reset for the next logged line. */
+	bool log_window_reset;
+#endif
+
+#if WALNUT_GB_DIRTY_LINES
+	/* Generation of the next line drawn. Each 16 bytes of VRAM and the CGB
+	 * palettes hold the generation when they were last written, and each
+	 * line the generation that it was drawn in, so a line is unchanged if
+	 * nothing it is drawn from is newer. */
+	uint32_t line_gen;
+	uint32_t line_vram_gen[VRAM_SIZE / 16];
+	uint32_t line_palette_gen;
+	uint32_t line_drawn_gen[LCD_HEIGHT];
+	struct gb_line_key_s line_key[LCD_HEIGHT];
+	/* Lines to draw again whatever they were drawn from, such as the lines
+	 * a sprite was moved from. */
+	uint32_t line_dirty[(LCD_HEIGHT + 31) / 32];
+	/* OAM when it was last compared, see __gb_line_oam_check(). */
+	uint8_t line_oam[OAM_SIZE];
+	bool line_oam_written;
+	struct gb_line_stats_s line_stats;
+#endif
+
+#if WALNUT_GB_IDLE_SKIP
+	struct gb_idle_s idle;
+	struct gb_idle_stats_s idle_stats;
+#endif
+#if WALNUT_GB_IDLE_SKIP || WALNUT_GB_COPY_LOOPS
+	/* PC at the start of the previous step. */
+	uint16_t loop_prev_pc;
+#endif
+
 	struct
 	{
 		/**
@@ -800,6 +1201,22 @@ struct gb_s
 				const uint8_t *pixels,
 				const uint_fast8_t line);
 
+		/**
+		 * Used instead of lcd_draw_line when set with
+		 * gb_init_lcd_rgb565().
+		 *
+		 * \param gb_s		emulator context
+		 * \param line		Line to draw, between 0-143 inclusive.
+		 * \return		Pointer to 160 RGB565 pixels to draw the
+		 * 			line to, or NULL to skip drawing the
+		 * 			line.
+		 */
+		uint16_t *(*lcd_line_rgb565)(struct gb_s *gb,
+				const uint_fast8_t line);
+		/* RGB565 colour of each DMG pixel value, set by
+		 * gb_set_palette_rgb565(). */
+		uint16_t dmg_rgb565[0x40];
+
 		/* Palettes */
 		uint8_t bg_palette[4];
 		uint8_t sp_palette[8];
@@ -810,6 +1227,36 @@ struct gb_s
 		/* Only support 30fps frame skip. */
 		bool frame_skip_count : 1;
 		bool interlace_count : 1;
+
+#if ENABLE_LCD && WALNUT_FULL_GBC_SUPPORT
+		/* DMG or CGB renderer, set by gb_init(). */
+		void (*draw_line)(struct gb_s *gb);
+#endif
+#if WALNUT_GB_PIXEL_LUT
+		/* Background pixels for BGP bg_lanes_bgp, see __gb_bg_lanes(). */
+		uint32_t bg_lanes[256];
+		uint8_t bg_lanes_bgp;
+		bool bg_lanes_valid;
+#endif
+#if WALNUT_GB_MAP_CACHE
+		/* Background and window map rows, see __gb_map_row(). */
+		struct gb_map_row_s map_rows[2];
+#endif
+#if WALNUT_GB_LINE_SPANS
+		/* Set while a write made in Mode 3 is handled and the rest of the
+		 * line is drawn again from span_x, see __gb_draw_span(). */
+		bool in_span;
+		uint8_t span_x;
+		/* window_clear before the current line was drawn. */
+		uint8_t line_window_clear;
+		/* The last line given to lcd_draw_line. */
+		uint8_t line_pixels[LCD_WIDTH];
+# if WALNUT_GB_DIRTY_LINES
+		/* Set when the current line was skipped as unchanged, so
+		 * neither line_pixels nor the front-end's line were drawn. */
+		bool line_unchanged;
+# endif
+#endif
 	} display;
 
 #if WALNUT_FULL_GBC_SUPPORT
@@ -851,6 +1298,15 @@ struct gb_s
 		 */
 		bool interlace : 1;
 		bool frame_skip : 1;
+		/* Set before running a frame that will not be shown. Its lines
+		 * are not drawn, but the window line still advances as if they
+		 * were. */
+		bool no_render : 1;
+#if WALNUT_GB_IDLE_SKIP
+		/* Set by gb_init(). Clear to disable idle loop skipping, for
+		 * example for a title that misbehaves with it. */
+		bool idle_skip : 1;
+#endif
 
 		union
 		{
@@ -912,97 +1368,498 @@ struct gb_s
 #define IO_STAT_MODE_LCD_DRAW		3
 #define IO_STAT_MODE_VBLANK_OR_TRANSFER_MASK 0x1
 
-#if WALNUT_GB_16BIT_ALIGNED
-uint16_t __gb_read16(struct gb_s *gb, uint16_t addr)
+void __gb_run_events(struct gb_s *gb);
+
+/**
+ * Timers and the LCD are only updated when the next event deadline is reached.
+ * Call this before observing or changing a counter (DIV, TIMA, serial, LCD)
+ * from within an instruction so that the cycles of the previous instructions
+ * are accounted for first.
+ */
+static inline void __gb_catch_up(struct gb_s *gb)
 {
-    switch (WALNUT_GB_GET_MSN16(addr))
-    {
-        // --- Boot ROM / Fixed ROM 0
-        case 0x0:
-            if (gb->hram_io[IO_BOOT] == 0 && addr < 0x0100)
-                return (uint16_t)gb->gb_bootrom_read(gb, addr)
-                     | ((uint16_t)gb->gb_bootrom_read(gb, addr + 1) << 8);
-#if PEANUT_FULL_GBC_SUPPORT
-            else if (gb->cgb.cgbMode && gb->hram_io[IO_BOOT] == 0 && addr >= 0x0200 && addr < 0x0900)
-                return (uint16_t)gb->gb_bootrom_read(gb, addr)
-                     | ((uint16_t)gb->gb_bootrom_read(gb, addr + 1) << 8);
-#endif
-            /* fallthrough */
-        case 0x1:
-        case 0x2:
-        case 0x3:
-            return gb->gb_rom_read_16bit(gb, addr);
+	if(gb->counter.pending_cycles != 0)
+		__gb_run_events(gb);
+}
 
-        // --- Switchable ROM banks (0x4000–0x7FFF)
-        case 0x4:
-        case 0x5:
-        case 0x6:
-        case 0x7:
-        {
-            uint32_t bank_offset = (gb->selected_rom_bank - 1) * ROM_BANK_SIZE;
-            return gb->gb_rom_read_16bit(gb, addr + bank_offset);
-        }
+/**
+ * Internal function used to check whether the lines of VBlank are passed in
+ * one scheduled interval, so that LY and STAT are only brought up to date by
+ * __gb_catch_up(); see __gb_vblank_end().
+ */
+static inline bool __gb_vblank_lines(const struct gb_s *gb)
+{
+	return (gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_VBLANK &&
+		gb->hram_io[IO_LY] >= LCD_HEIGHT;
+}
 
-        // --- VRAM (0x8000–0x9FFF)
-        case 0x8:
-        case 0x9:
-        {
-            uint8_t *vram_base =
-#if PEANUT_FULL_GBC_SUPPORT
-                &gb->vram[addr - gb->cgb.vramBankOffset];
-#else
-                &gb->vram[addr - VRAM_ADDR];
-#endif
-            if (addr + 1 < 0xA000)
-            {
-                if (((uintptr_t)vram_base & 1) == 0)
-                    return *(uint16_t *)vram_base;
-                else
-                    return (uint16_t)vram_base[0] | ((uint16_t)vram_base[1] << 8);
-            }
-            return vram_base[0]; // last byte fallback
-        }
+/**
+ * Internal function used to refresh gb->irq_pending after IF, IE, IME or HALT
+ * were changed.
+ */
+static inline void __gb_update_irq(struct gb_s *gb)
+{
+	gb->irq_pending = gb->gb_halt || (gb->gb_ime &&
+		(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & ANY_INTR));
+}
 
-        // --- External RAM / RTC (0xA000–0xBFFF)
-        case 0xA:
-        case 0xB:
-            if (gb->mbc == 3 && gb->cart_ram_bank >= 0x08)
-                return gb->rtc_latched.bytes[gb->cart_ram_bank - 0x08]
-                     | ((uint16_t)gb->rtc_latched.bytes[gb->cart_ram_bank - 0x08 + 1] << 8);
-            else if (gb->cart_ram && gb->enable_cart_ram)
-            {
-                uint16_t offset;
-                if (gb->mbc == 2)
-                    offset = addr & 0x1FF;
-                else if ((gb->cart_mode_select || gb->mbc != 1) && gb->cart_ram_bank < gb->num_ram_banks)
-                    offset = addr - CART_RAM_ADDR + (gb->cart_ram_bank * CRAM_BANK_SIZE);
-                else
-                    offset = addr - CART_RAM_ADDR;
+/**
+ * Internal function used to handle gb->irq_pending. Leaves HALT and, if IME is
+ * set, calls the handler of the highest priority interrupt that is requested
+ * and enabled. Returns true if the PC was changed.
+ */
+static inline bool __gb_interrupt(struct gb_s *gb)
+{
+	/* Lowest set bit, which is the highest priority interrupt. */
+	static const uint8_t intr_bit[32] =
+	{
+		0, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+		4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0
+	};
+	uint8_t intr;
 
-                return gb->gb_cart_ram_read(gb, offset)
-                     | ((uint16_t)gb->gb_cart_ram_read(gb, offset + 1) << 8);
-            }
-            return 0xFFFF;
+	gb->gb_halt = false;
+	gb->irq_pending = false;
 
-        // --- Work RAM (0xC000–0xDFFF)
-        case 0xC:
-        case 0xD:
-        {
-            uint8_t *wram_ptr =
-#if PEANUT_FULL_GBC_SUPPORT
-                (gb->cgb.cgbMode && addr >= WRAM_1_ADDR)
-                    ? &gb->wram[addr - gb->cgb.wramBankOffset]
-                    : &gb->wram[addr - WRAM_0_ADDR];
+	if(!gb->gb_ime)
+		return false;
+
+	/* Disable interrupts */
+	gb->gb_ime = false;
+
+	/* Push Program Counter */
+	__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+	__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+
+	/* Call interrupt handler if required. */
+	intr = gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & ANY_INTR;
+	if(intr)
+	{
+		intr = intr_bit[intr];
+		gb->cpu_reg.pc.reg = VBLANK_INTR_ADDR + (intr << 3);
+		gb->hram_io[IO_IF] ^= 1 << intr;
+	}
+
+	return true;
+}
+
+/**
+ * Internal function used to get the ROM bank mapped at ROM_N_ADDR.
+ */
+static inline uint16_t __gb_rom_bank(const struct gb_s *gb)
+{
+	if(gb->mbc == 1 && gb->cart_mode_select)
+		return gb->selected_rom_bank & 0x1F;
+
+	return gb->selected_rom_bank;
+}
+
+#if WALNUT_GB_PAGE_TABLE
+/**
+ * Internal function used to map the fixed and switchable ROM banks.
+ * Called when the boot ROM is disabled or an MBC register is written.
+ */
+static void __gb_map_rom(struct gb_s *gb)
+{
+	uint_fast32_t bank;
+	uint_fast16_t page;
+
+	for(page = 0x00; page < 0x80; page++)
+		gb->read_page[page] = NULL;
+
+	if(gb->rom == NULL || gb->rom_size < 2 * ROM_BANK_SIZE)
+		return;
+
+	/* The boot ROM overlays the start of bank 0 until it is disabled. */
+	for(page = (gb->hram_io[IO_BOOT] == 0) ? 0x09 : 0x00; page < 0x40; page++)
+		gb->read_page[page] = gb->rom + (page << 8);
+
+	bank = __gb_rom_bank(gb);
+
+	/* Banks outside of the ROM image are left to gb_rom_read. */
+	if((bank + 1) * ROM_BANK_SIZE > gb->rom_size)
+		return;
+
+	for(page = 0x40; page < 0x80; page++)
+		gb->read_page[page] =
+			gb->rom + bank * ROM_BANK_SIZE + ((page - 0x40) << 8);
+}
+
+/**
+ * Internal function used to map the selected VRAM bank. With the tile cache,
+ * writes to tile data are left to __gb_write() so that the tiles are marked
+ * for decoding. With the line log, all writes to VRAM are.
+ */
+static void __gb_map_vram(struct gb_s *gb)
+{
+	uint_fast16_t page;
+
+	for(page = 0x80; page < 0xA0; page++)
+	{
+#if WALNUT_FULL_GBC_SUPPORT
+		gb->write_page[page] = &gb->vram[(page << 8) - gb->cgb.vramBankOffset];
 #else
-                &gb->wram[addr - WRAM_0_ADDR];
+		gb->write_page[page] = &gb->vram[(page << 8) - VRAM_ADDR];
 #endif
-            if (((uintptr_t)wram_ptr & 1) == 0)
-                return *(uint16_t *)wram_ptr;
-            else
-                return (uint16_t)wram_ptr[0] | ((uint16_t)wram_ptr[1] << 8);
-        }
+		gb->read_page[page] = gb->write_page[page];
+#if WGB_VRAM_HOOK
+		if(page < ((VRAM_ADDR + WGB_VRAM_HOOK_END) >> 8))
+			gb->write_page[page] = NULL;
+#endif
+	}
+}
 
-        // --- Echo RAM (0xE000–0xFDFF)
+/**
+ * Internal function used to map WRAM, the selected WRAM bank and echo RAM.
+ */
+static void __gb_map_wram(struct gb_s *gb)
+{
+	uint_fast16_t page;
+
+	for(page = 0xC0; page < 0xD0; page++)
+	{
+		gb->write_page[page] = &gb->wram[(page << 8) - WRAM_0_ADDR];
+		gb->read_page[page] = gb->write_page[page];
+	}
+
+	for(page = 0xD0; page < 0xE0; page++)
+	{
+#if WALNUT_FULL_GBC_SUPPORT
+		gb->write_page[page] = &gb->wram[(page << 8) - gb->cgb.wramBankOffset];
+		if(gb->cgb.cgbMode)
+			gb->read_page[page] = gb->write_page[page];
+		else
+			gb->read_page[page] = &gb->wram[(page << 8) - WRAM_0_ADDR];
+#else
+		gb->write_page[page] = &gb->wram[(page << 8) - WRAM_0_ADDR];
+		gb->read_page[page] = gb->write_page[page];
+#endif
+	}
+
+	for(page = 0xE0; page < 0xF0; page++)
+	{
+		gb->write_page[page] = &gb->wram[(page << 8) - ECHO_ADDR];
+		gb->read_page[page] = gb->write_page[page];
+	}
+
+	/* Up to OAM_ADDR. */
+	for(page = 0xF0; page < 0xFE; page++)
+	{
+#if WALNUT_FULL_GBC_SUPPORT
+		gb->write_page[page] =
+			&gb->wram[((page << 8) - 0x2000) - gb->cgb.wramBankOffset];
+#else
+		gb->write_page[page] = &gb->wram[(page << 8) - ECHO_ADDR];
+#endif
+		gb->read_page[page] = gb->write_page[page];
+	}
+}
+
+/**
+ * Internal function used to map the selected cart RAM bank. The bank is left
+ * to __gb_read() and __gb_write() when RAM is disabled, when the MBC3 RTC or
+ * MBC2 RAM is selected, or when the bank is outside of the cart RAM buffer.
+ */
+static void __gb_map_cart_ram(struct gb_s *gb)
+{
+	uint_fast32_t base = 0;
+	uint_fast16_t page;
+
+	for(page = 0xA0; page < 0xC0; page++)
+	{
+		gb->read_page[page] = NULL;
+		gb->write_page[page] = NULL;
+	}
+
+	if(gb->cram == NULL || !gb->cart_ram || !gb->enable_cart_ram ||
+			gb->num_ram_banks == 0 || gb->mbc == 2 ||
+			(gb->mbc == 3 && gb->cart_ram_bank >= 0x08))
+		return;
+
+	if((gb->cart_mode_select || gb->mbc != 1) &&
+			gb->cart_ram_bank < gb->num_ram_banks)
+		base = gb->cart_ram_bank * CRAM_BANK_SIZE;
+
+	if(base + CRAM_BANK_SIZE > gb->cram_size)
+		return;
+
+	for(page = 0xA0; page < 0xC0; page++)
+	{
+		gb->write_page[page] = gb->cram + base + ((page - 0xA0) << 8);
+		gb->read_page[page] = gb->write_page[page];
+	}
+}
+#endif
+
+/**
+ * Internal function used to apply a change of the selected ROM or RAM bank,
+ * the RAM enable or the banking mode.
+ */
+static inline void __gb_mbc_changed(struct gb_s *gb)
+{
+	(void)gb;
+#if WALNUT_GB_PAGE_TABLE
+	__gb_map_rom(gb);
+	__gb_map_cart_ram(gb);
+#endif
+#if WALNUT_GB_SAFE_DUALFETCH_MBC
+	gb->prefetch_invalid=true;
+#endif
+}
+
+/**
+ * Internal functions used to write to the MBC registers, one for each MBC
+ * type. gb_init() selects one for gb->mbc_write.
+ */
+static void __gb_mbc0_write(struct gb_s *gb, const uint_fast16_t addr,
+		const uint8_t val)
+{
+	/* Only the banking mode is stored, it has no effect without an MBC. */
+	if(addr >= 0x6000)
+		gb->cart_mode_select = val & 1;
+}
+
+static void __gb_mbc1_write(struct gb_s *gb, const uint_fast16_t addr,
+		const uint8_t val)
+{
+	switch(addr >> 13)
+	{
+	case 0: /* RAM enable. */
+		if(gb->cart_ram)
+			gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
+		break;
+
+	case 1: /* ROM bank, lower 5 bits. */
+		gb->selected_rom_bank = (val & 0x1F) | (gb->selected_rom_bank & 0x60);
+
+		if((gb->selected_rom_bank & 0x1F) == 0x00)
+			gb->selected_rom_bank++;
+
+		gb->selected_rom_bank &= gb->num_rom_banks_mask;
+		break;
+
+	case 2: /* RAM bank, or upper 2 bits of the ROM bank. */
+		gb->cart_ram_bank = (val & 3);
+		gb->selected_rom_bank = ((val & 3) << 5) | (gb->selected_rom_bank & 0x1F);
+		gb->selected_rom_bank &= gb->num_rom_banks_mask;
+		break;
+
+	default: /* Banking mode. */
+		gb->cart_mode_select = val & 1;
+		break;
+	}
+
+	__gb_mbc_changed(gb);
+}
+
+static void __gb_mbc2_write(struct gb_s *gb, const uint_fast16_t addr,
+		const uint8_t val)
+{
+	if(addr >= 0x4000)
+	{
+		if(addr >= 0x6000)
+			gb->cart_mode_select = val & 1;
+
+		return;
+	}
+
+	/* If bit 8 is 1, then set ROM bank number. */
+	if(addr & 0x100)
+	{
+		gb->selected_rom_bank = val & 0x0F;
+		/* Setting ROM bank to 0, sets it to 1. */
+		if(!gb->selected_rom_bank)
+			gb->selected_rom_bank++;
+
+		gb->selected_rom_bank &= gb->num_rom_banks_mask;
+	}
+	/* Otherwise set whether RAM is enabled or not. */
+	else
+		gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
+
+	__gb_mbc_changed(gb);
+}
+
+static void __gb_mbc3_write(struct gb_s *gb, const uint_fast16_t addr,
+		const uint8_t val)
+{
+	switch(addr >> 13)
+	{
+	case 0: /* RAM and RTC enable. */
+		if(gb->cart_ram)
+			gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
+		break;
+
+	case 1: /* ROM bank. */
+		gb->selected_rom_bank = val;
+		if(!gb->cart_is_mbc3O)
+			gb->selected_rom_bank = val & 0x7F;
+
+		if(!gb->selected_rom_bank)
+			gb->selected_rom_bank++;
+
+		gb->selected_rom_bank &= gb->num_rom_banks_mask;
+		break;
+
+	case 2: /* RAM bank or RTC register. */
+		gb->cart_ram_bank = val;
+		/* If not using MBC3, only the first 4 cart RAM banks are useable.
+		 * If cart RAM bank 0x8-0xC are selected, then the corresponding
+		 * RTC register is selected instead of cart RAM. */
+		if(!gb->cart_is_mbc3O && gb->cart_ram_bank < 0x8)
+			gb->cart_ram_bank &= 0x3;
+		break;
+
+	default: /* Latch the RTC when 1 is written after 0. */
+		if((val & 1) && gb->cart_mode_select == 0)
+			memcpy(&gb->rtc_latched.bytes, &gb->rtc_real.bytes, sizeof(gb->rtc_latched.bytes));
+
+		gb->cart_mode_select = val & 1;
+		break;
+	}
+
+	__gb_mbc_changed(gb);
+}
+
+static void __gb_mbc5_write(struct gb_s *gb, const uint_fast16_t addr,
+		const uint8_t val)
+{
+	switch(addr >> 12)
+	{
+	case 0x0:
+	case 0x1: /* RAM enable. */
+		if(gb->cart_ram)
+			gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
+		break;
+
+	case 0x2: /* ROM bank, lower 8 bits. */
+		gb->selected_rom_bank = (gb->selected_rom_bank & 0x100) | val;
+		gb->selected_rom_bank &= gb->num_rom_banks_mask;
+		break;
+
+	case 0x3: /* ROM bank, bit 8. */
+		gb->selected_rom_bank = (val & 0x01) << 8 | (gb->selected_rom_bank & 0xFF);
+		gb->selected_rom_bank &= gb->num_rom_banks_mask;
+		break;
+
+	case 0x4:
+	case 0x5: /* RAM bank. */
+		gb->cart_ram_bank = (val & 0x0F);
+		break;
+
+	default: /* Banking mode, unused. */
+		gb->cart_mode_select = val & 1;
+		break;
+	}
+
+	__gb_mbc_changed(gb);
+}
+
+#if WALNUT_GB_16BIT_ALIGNED
+uint16_t __gb_read16(struct gb_s *gb, uint16_t addr)
+{
+#if WALNUT_GB_PAGE_TABLE
+    // --- Mapped page, both bytes within the page
+    {
+        const uint8_t *page = gb->read_page[addr >> 8];
+        if (WGB_LIKELY(page != NULL && (addr & 0xFF) != 0xFF))
+        {
+            const uint8_t *p = page + (addr & 0xFF);
+            if (((uintptr_t)p & 1) == 0)
+                return *(const uint16_t *)p;
+            else
+                return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+        }
+    }
+#endif
+    switch (WALNUT_GB_GET_MSN16(addr))
+    {
+        // --- Boot ROM / Fixed ROM 0
+        case 0x0:
+            if (gb->hram_io[IO_BOOT] == 0 && addr < 0x0100)
+                return (uint16_t)gb->gb_bootrom_read(gb, addr)
+                     | ((uint16_t)gb->gb_bootrom_read(gb, addr + 1) << 8);
+#if PEANUT_FULL_GBC_SUPPORT
+            else if (gb->cgb.cgbMode && gb->hram_io[IO_BOOT] == 0 && addr >= 0x0200 && addr < 0x0900)
+                return (uint16_t)gb->gb_bootrom_read(gb, addr)
+                     | ((uint16_t)gb->gb_bootrom_read(gb, addr + 1) << 8);
+#endif
+            /* fallthrough */
+        case 0x1:
+        case 0x2:
+        case 0x3:
+            return gb->gb_rom_read_16bit(gb, addr);
+
+        // --- Switchable ROM banks (0x4000–0x7FFF)
+        case 0x4:
+        case 0x5:
+        case 0x6:
+        case 0x7:
+        {
+            uint32_t bank_offset = (gb->selected_rom_bank - 1) * ROM_BANK_SIZE;
+            return gb->gb_rom_read_16bit(gb, addr + bank_offset);
+        }
+
+        // --- VRAM (0x8000–0x9FFF)
+        case 0x8:
+        case 0x9:
+        {
+            uint8_t *vram_base =
+#if PEANUT_FULL_GBC_SUPPORT
+                &gb->vram[addr - gb->cgb.vramBankOffset];
+#else
+                &gb->vram[addr - VRAM_ADDR];
+#endif
+            if (addr + 1 < 0xA000)
+            {
+                if (((uintptr_t)vram_base & 1) == 0)
+                    return *(uint16_t *)vram_base;
+                else
+                    return (uint16_t)vram_base[0] | ((uint16_t)vram_base[1] << 8);
+            }
+            return vram_base[0]; // last byte fallback
+        }
+
+        // --- External RAM / RTC (0xA000–0xBFFF)
+        case 0xA:
+        case 0xB:
+            if (gb->mbc == 3 && gb->cart_ram_bank >= 0x08)
+                return gb->rtc_latched.bytes[gb->cart_ram_bank - 0x08]
+                     | ((uint16_t)gb->rtc_latched.bytes[gb->cart_ram_bank - 0x08 + 1] << 8);
+            else if (gb->cart_ram && gb->enable_cart_ram)
+            {
+                uint16_t offset;
+                if (gb->mbc == 2)
+                    offset = addr & 0x1FF;
+                else if ((gb->cart_mode_select || gb->mbc != 1) && gb->cart_ram_bank < gb->num_ram_banks)
+                    offset = addr - CART_RAM_ADDR + (gb->cart_ram_bank * CRAM_BANK_SIZE);
+                else
+                    offset = addr - CART_RAM_ADDR;
+
+                return gb->gb_cart_ram_read(gb, offset)
+                     | ((uint16_t)gb->gb_cart_ram_read(gb, offset + 1) << 8);
+            }
+            return 0xFFFF;
+
+        // --- Work RAM (0xC000–0xDFFF)
+        case 0xC:
+        case 0xD:
+        {
+            uint8_t *wram_ptr =
+#if PEANUT_FULL_GBC_SUPPORT
+                (gb->cgb.cgbMode && addr >= WRAM_1_ADDR)
+                    ? &gb->wram[addr - gb->cgb.wramBankOffset]
+                    : &gb->wram[addr - WRAM_0_ADDR];
+#else
+                &gb->wram[addr - WRAM_0_ADDR];
+#endif
+            if (((uintptr_t)wram_ptr & 1) == 0)
+                return *(uint16_t *)wram_ptr;
+            else
+                return (uint16_t)wram_ptr[0] | ((uint16_t)wram_ptr[1] << 8);
+        }
+
+        // --- Echo RAM (0xE000–0xFDFF)
         case 0xE:
         {
             uint8_t *echo_ptr = &gb->wram[addr - ECHO_ADDR];
@@ -1024,6 +1881,8 @@ uint16_t __gb_read16(struct gb_s *gb, uint16_t addr)
             }
             else if (addr >= IO_ADDR)
             {
+                if (addr < HRAM_ADDR)
+                    __gb_catch_up(gb);
                 // Some special registers require manual byte combine
 #if ENABLE_SOUND
                 if (addr >= 0xFF10 && addr <= 0xFF3F)
@@ -1046,6 +1905,14 @@ uint16_t __gb_read16(struct gb_s *gb, uint16_t addr)
 #else
 uint16_t __gb_read16(struct gb_s *gb, uint16_t addr)
 {
+#if WALNUT_GB_PAGE_TABLE
+    // --- Mapped page, both bytes within the page
+    {
+        const uint8_t *page = gb->read_page[addr >> 8];
+        if (WGB_LIKELY(page != NULL && (addr & 0xFF) != 0xFF))
+            return *(const uint16_t *)&page[addr & 0xFF];
+    }
+#endif
     switch(WALNUT_GB_GET_MSN16(addr))
     {
         // --- Boot ROM / Fixed ROM 0
@@ -1138,6 +2005,8 @@ uint16_t __gb_read16(struct gb_s *gb, uint16_t addr)
             // --- HRAM / IO (0xFF00–0xFFFF)
             else if (addr >= IO_ADDR)
             {
+                if (addr < HRAM_ADDR)
+                    __gb_catch_up(gb);
                 // Some registers are not contiguous, must combine manually
 #if ENABLE_SOUND
                 if (addr >= 0xFF10 && addr <= 0xFF3F)
@@ -1193,6 +2062,22 @@ uint16_t __gb_read16(struct gb_s *gb, uint16_t addr)
 #if WALNUT_GB_32BIT_ALIGNED
 uint32_t __gb_read32(struct gb_s *gb, uint16_t addr)
 {
+#if WALNUT_GB_PAGE_TABLE
+    // --- Mapped page, all four bytes within the page
+    {
+        const uint8_t *page = gb->read_page[addr >> 8];
+        if (WGB_LIKELY(page != NULL && (addr & 0xFF) <= 0xFC))
+        {
+            const uint8_t *p = page + (addr & 0xFF);
+            if (((uintptr_t)p & 3) == 0)
+                return *(const uint32_t *)p;
+            return (uint32_t)p[0]
+                 | ((uint32_t)p[1] << 8)
+                 | ((uint32_t)p[2] << 16)
+                 | ((uint32_t)p[3] << 24);
+        }
+    }
+#endif
     switch (WALNUT_GB_GET_MSN16(addr))
     {
         // --- Boot ROM / Fixed ROM 0
@@ -1333,6 +2218,8 @@ uint32_t __gb_read32(struct gb_s *gb, uint16_t addr)
             }
             else if (addr >= IO_ADDR)
             {
+                if (addr < HRAM_ADDR)
+                    __gb_catch_up(gb);
 #if ENABLE_SOUND
                 if (addr >= 0xFF10 && addr <= 0xFF3F)
                 {
@@ -1359,6 +2246,14 @@ uint32_t __gb_read32(struct gb_s *gb, uint16_t addr)
 #else
 uint32_t __gb_read32(struct gb_s *gb, uint16_t addr)
 {
+#if WALNUT_GB_PAGE_TABLE
+    // --- Mapped page, all four bytes within the page
+    {
+        const uint8_t *page = gb->read_page[addr >> 8];
+        if (WGB_LIKELY(page != NULL && (addr & 0xFF) <= 0xFC))
+            return *(const uint32_t *)&page[addr & 0xFF];
+    }
+#endif
     switch (WALNUT_GB_GET_MSN16(addr))
     {
         // --- Boot ROM / Fixed ROM 0
@@ -1462,6 +2357,8 @@ uint32_t __gb_read32(struct gb_s *gb, uint16_t addr)
                 return *(uint32_t *)&gb->oam[addr - OAM_ADDR];
             else if (addr >= IO_ADDR)
             {
+                if (addr < HRAM_ADDR)
+                    __gb_catch_up(gb);
 #if ENABLE_SOUND
                 if (addr >= 0xFF10 && addr <= 0xFF3F)
                 {
@@ -1505,6 +2402,15 @@ uint32_t __gb_read32(struct gb_s *gb, uint16_t addr)
  */
 uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
 {
+#if WALNUT_GB_PAGE_TABLE
+	{
+		const uint8_t *page = gb->read_page[addr >> 8];
+
+		if(WGB_LIKELY(page != NULL))
+			return page[addr & 0xFF];
+	}
+#endif
+
 	switch(WALNUT_GB_GET_MSN16(addr))
 	{
 	case 0x0:
@@ -1595,6 +2501,14 @@ uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
 		if(addr < IO_ADDR)
 			return 0xFF;
 
+		/* DIV and TIMA are advanced lazily, and so are LY and STAT
+		 * within VBlank, see __gb_vblank_end(). */
+		if(addr == IO_ADDR + IO_DIV || addr == IO_ADDR + IO_TIMA)
+			__gb_catch_up(gb);
+		else if((addr == IO_ADDR + IO_LY || addr == IO_ADDR + IO_STAT) &&
+				__gb_vblank_lines(gb))
+			__gb_catch_up(gb);
+
 		/* APU registers. */
 		if((addr >= 0xFF10) && (addr <= 0xFF3F))
 		{
@@ -1671,130 +2585,159 @@ uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
 }
 
 
-
+#if WGB_VRAM_HOOK
 /**
- * Internal function used to write bytes.
+ * Internal function used to note a write to the given offset into gb->vram.
+ * The tile or map row there is marked for reading again, and the 16 bytes
+ * around it for the line log and as newer than the lines drawn so far. Offsets
+ * past the end of VRAM are ignored.
  */
-void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
+static inline void __gb_vram_written(struct gb_s *gb, const uint_fast16_t offset)
 {
-	switch(WALNUT_GB_GET_MSN16(addr))
-	{
-	case 0x0:
-	case 0x1:
-		/* Set RAM enable bit. MBC2 is handled in fall-through. */
-		if (gb->mbc > 0 && gb->mbc != 2)
-		{
-			if (gb->cart_ram)
-				gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
-			return;
-		}
+# if WALNUT_GB_TILE_CACHE
+	const uint_fast16_t bank_offset = offset & (VRAM_BANK_SIZE - 1);
+	uint_fast16_t t;
+# endif
 
-		/* Intentional fall through. */
-	case 0x2:
-		if (gb->mbc == 5)
-		{
-			gb->selected_rom_bank =
-				(gb->selected_rom_bank & 0x100) | val;
-			gb->selected_rom_bank =
-				gb->selected_rom_bank & gb->num_rom_banks_mask;
-#if WALNUT_GB_SAFE_DUALFETCH_MBC
-			gb->prefetch_invalid=true;
-#endif
-			return;
-		}
+	if(offset >= VRAM_SIZE)
+		return;
 
-	/* Intentional fall through. */
-	case 0x3:
-		if(gb->mbc == 1)
-		{
-			//selected_rom_bank = val & 0x7;
-			gb->selected_rom_bank = (val & 0x1F) | (gb->selected_rom_bank & 0x60);
+# if WALNUT_GB_DEFERRED_LCD
+	gb->log_vram_dirty[offset / 512] |= (uint32_t)1 << ((offset / 16) % 32);
+# endif
+# if WALNUT_GB_DIRTY_LINES
+	gb->line_vram_gen[offset / 16] = gb->line_gen;
+# endif
+# if WALNUT_GB_TILE_CACHE
+	if(bank_offset >= VRAM_BMAP_1)
+	{
+#  if WALNUT_GB_MAP_CACHE
+		/* Either bank, as bank 1 holds the CGB attributes. */
+		const uint_fast16_t map = bank_offset & ~(uint_fast16_t)0x1F;
+
+		if(gb->display.map_rows[WGB_MAP_ROW_BG].map == map)
+			gb->display.map_rows[WGB_MAP_ROW_BG].map = 0;
+		if(gb->display.map_rows[WGB_MAP_ROW_WIN].map == map)
+			gb->display.map_rows[WGB_MAP_ROW_WIN].map = 0;
+#  endif
+		return;
+	}
 
-			if((gb->selected_rom_bank & 0x1F) == 0x00)
-				gb->selected_rom_bank++;
-#if WALNUT_GB_SAFE_DUALFETCH_MBC
-			gb->prefetch_invalid=true;
+	t = (bank_offset >> 4) + (offset / VRAM_BANK_SIZE) * WGB_BANK_TILES;
+	gb->tile_dirty[t / 32] |= (uint32_t)1 << (t % 32);
+# endif
+}
 #endif
-		}
-		else if(gb->mbc == 2)
-		{
-			/* If bit 8 is 1, then set ROM bank number. */
-			if(addr & 0x100)
-			{
-				gb->selected_rom_bank = val & 0x0F;
-				/* Setting ROM bank to 0, sets it to 1. */
-				if(!gb->selected_rom_bank)
-					gb->selected_rom_bank++;
-			}
-			/* Otherwise set whether RAM is enabled or not. */
-			else
-			{
-				gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
-				return;
-			}
-		}
-		else if(gb->mbc == 3)
-		{
-			gb->selected_rom_bank = val;
-			if(!gb->cart_is_mbc3O)
-				gb->selected_rom_bank = val & 0x7F;
 
-			if(!gb->selected_rom_bank)
-				gb->selected_rom_bank++;
-		}
-		else if(gb->mbc == 5)
-			gb->selected_rom_bank = (val & 0x01) << 8 | (gb->selected_rom_bank & 0xFF);
+#if WGB_OAM_HOOK
+/**
+ * Internal function used to note a write to OAM.
+ */
+static inline void __gb_oam_written(struct gb_s *gb)
+{
+# if WALNUT_GB_SPRITE_BUCKETS
+	gb->sprite_buckets_dirty = true;
+# endif
+# if WALNUT_GB_DEFERRED_LCD
+	gb->log_oam_dirty = true;
+# endif
+# if WALNUT_GB_DIRTY_LINES
+	gb->line_oam_written = true;
+# endif
+}
+#endif
 
-		gb->selected_rom_bank = gb->selected_rom_bank & gb->num_rom_banks_mask;
-#if WALNUT_GB_SAFE_DUALFETCH_MBC
-		gb->prefetch_invalid=true;
+#if WALNUT_GB_LINE_SPANS
+static void __gb_draw_unchanged_line(struct gb_s *gb);
+static void __gb_draw_span(struct gb_s *gb, const uint_fast8_t x);
+
+/**
+ * Internal function used to check whether a write to addr changes how the
+ * line is drawn.
+ */
+static inline bool __gb_span_register(const uint_fast16_t addr)
+{
+	switch(addr)
+	{
+	case IO_ADDR + IO_LCDC:
+	case IO_ADDR + IO_SCY:
+	case IO_ADDR + IO_SCX:
+	case IO_ADDR + IO_BGP:
+	case IO_ADDR + IO_OBP0:
+	case IO_ADDR + IO_OBP1:
+# if WALNUT_FULL_GBC_SUPPORT
+	case 0xFF69:
+	case 0xFF6B:
+# endif
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/**
+ * Internal function used before a write to a register that changes how the
+ * line is drawn. Returns the pixel that the LCD has reached if the line is
+ * being drawn, else LCD_WIDTH.
+ */
+static uint_fast8_t __gb_span_start(struct gb_s *gb)
+{
+	__gb_catch_up(gb);
+
+	if(gb->lcd_blank || !(gb->hram_io[IO_LCDC] & LCDC_ENABLE) ||
+			(gb->hram_io[IO_STAT] & STAT_MODE) != IO_STAT_MODE_LCD_DRAW)
+		return LCD_WIDTH;
+
+	/* About one pixel is sent to the LCD each cycle of Mode 3. */
+	if(gb->counter.lcd_count - LCD_MODE2_OAM_SCAN_END >= LCD_WIDTH)
+		return LCD_WIDTH;
+
+	return gb->counter.lcd_count - LCD_MODE2_OAM_SCAN_END;
+}
 #endif
-		return;
 
-	case 0x4:
-	case 0x5:
-		if(gb->mbc == 1)
-		{
-			gb->cart_ram_bank = (val & 3);
-			gb->selected_rom_bank = ((val & 3) << 5) | (gb->selected_rom_bank & 0x1F);
-			gb->selected_rom_bank = gb->selected_rom_bank & gb->num_rom_banks_mask;
-		}
-		else if(gb->mbc == 3)
+/**
+ * Internal function used to write bytes.
+ */
+void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
+{
+#if WALNUT_GB_PAGE_TABLE
+	{
+		uint8_t *page = gb->write_page[addr >> 8];
+
+		if(WGB_LIKELY(page != NULL))
 		{
-			gb->cart_ram_bank = val;
-			/* If not using MBC3, only the first 4 cart RAM banks are useable.
-			 * If cart RAM bank 0x8-0xC are selected, then the corresponding
-			 * RTC register is selected instead of cart RAM. */
-			if(!gb->cart_is_mbc3O && gb->cart_ram_bank < 0x8)
-				gb->cart_ram_bank &= 0x3;
+			page[addr & 0xFF] = val;
+			return;
 		}
-
-		else if(gb->mbc == 5)
-			gb->cart_ram_bank = (val & 0x0F);
-#if WALNUT_GB_SAFE_DUALFETCH_MBC
-		gb->prefetch_invalid=true;
+	}
 #endif
-		return;
-
+	switch(WALNUT_GB_GET_MSN16(addr))
+	{
+	case 0x0:
+	case 0x1:
+	case 0x2:
+	case 0x3:
+	case 0x4:
+	case 0x5:
 	case 0x6:
 	case 0x7:
-		val &= 1;
-		if(gb->mbc == 3 && val && gb->cart_mode_select == 0)
-			memcpy(&gb->rtc_latched.bytes, &gb->rtc_real.bytes, sizeof(gb->rtc_latched.bytes));
-
-		/* Set banking mode select. */
-		gb->cart_mode_select = val;
-#if WALNUT_GB_SAFE_DUALFETCH_MBC
-		gb->prefetch_invalid=true;
-#endif
+		gb->mbc_write(gb, addr, val);
 		return;
 
 	case 0x8:
 	case 0x9:
 #if WALNUT_FULL_GBC_SUPPORT
 		gb->vram[addr - gb->cgb.vramBankOffset] = val;
+# if WGB_VRAM_HOOK
+		__gb_vram_written(gb, addr - gb->cgb.vramBankOffset);
+# endif
 #else
 		gb->vram[addr - VRAM_ADDR] = val;
+# if WGB_VRAM_HOOK
+		__gb_vram_written(gb, addr - VRAM_ADDR);
+# endif
 #endif
 		return;
 
@@ -1868,6 +2811,9 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		if(addr < UNUSED_ADDR)
 		{
 			gb->oam[addr - OAM_ADDR] = val;
+#if WGB_OAM_HOOK
+			__gb_oam_written(gb);
+#endif
 			return;
 		}
 
@@ -1891,6 +2837,25 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			return;
 		}
 
+#if WALNUT_GB_LINE_SPANS
+		/* A write made while the line is being drawn changes the rest
+		 * of the line. */
+		if(WGB_UNLIKELY(__gb_span_register(addr)) &&
+				!gb->display.in_span)
+		{
+			const uint_fast8_t x = __gb_span_start(gb);
+
+			if(x < LCD_WIDTH)
+			{
+				__gb_draw_unchanged_line(gb);
+				gb->display.in_span = true;
+				__gb_write(gb, addr, val);
+				__gb_draw_span(gb, x);
+				return;
+			}
+		}
+#endif
+
 		/* IO and Interrupts. */
 		switch(WALNUT_GB_GET_LSB16(addr))
 		{
@@ -1916,16 +2881,21 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			return;
 
 		case 0x02:
+			__gb_catch_up(gb);
 			gb->hram_io[IO_SC] = val;
+			gb->counter.next_event = 0;
 			return;
 
 		/* Timer Registers */
 		case 0x04:
+			__gb_catch_up(gb);
 			gb->hram_io[IO_DIV] = 0x00;
 			return;
 
 		case 0x05:
+			__gb_catch_up(gb);
 			gb->hram_io[IO_TIMA] = val;
+			gb->counter.next_event = 0;
 			return;
 
 		case 0x06:
@@ -1933,12 +2903,15 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			return;
 
 		case 0x07:
+			__gb_catch_up(gb);
 			gb->hram_io[IO_TAC] = val;
+			gb->counter.next_event = 0;
 			return;
 
 		/* Interrupt Flag Register */
 		case 0x0F:
 			gb->hram_io[IO_IF] = (val | 0xE0);
+			__gb_update_irq(gb);
 			return;
 
 		/* LCD Registers */
@@ -1946,9 +2919,16 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		{
 			uint8_t lcd_enabled;
 
+			__gb_catch_up(gb);
+			gb->counter.next_event = 0;
+
 			/* Check if LCD is already enabled. */
 			lcd_enabled = (gb->hram_io[IO_LCDC] & LCDC_ENABLE);
 
+#if WALNUT_GB_SPRITE_BUCKETS
+			if((gb->hram_io[IO_LCDC] ^ val) & LCDC_OBJ_SIZE)
+				gb->sprite_buckets_dirty = true;
+#endif
 			gb->hram_io[IO_LCDC] = val;
 
 			/* Check if LCD is going to be switched on. */
@@ -1980,6 +2960,12 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		}
 
 		case 0x41:
+			/* The LYC interrupt may now have to stop VBlank. */
+			if(__gb_vblank_lines(gb))
+			{
+				__gb_catch_up(gb);
+				gb->counter.next_event = 0;
+			}
 			gb->hram_io[IO_STAT] = (val & STAT_USER_BITS) | (gb->hram_io[IO_STAT] & STAT_MODE) | 0x80;
 			return;
 
@@ -1993,6 +2979,11 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 
 		/* LY (0xFF44) is read only. */
 		case 0x45:
+			if(__gb_vblank_lines(gb))
+			{
+				__gb_catch_up(gb);
+				gb->counter.next_event = 0;
+			}
 			gb->hram_io[IO_LYC] = val;
 			return;
 
@@ -2049,6 +3040,9 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
     for (i = 0; i < OAM_SIZE; i++)
         gb->oam[i] = __gb_read(gb, dma_addr + i);
 #endif
+#if WGB_OAM_HOOK
+			__gb_oam_written(gb);
+#endif
 #if WALNUT_GB_SAFE_DUALFETCH_DMA
 		gb->prefetch_invalid=true;
 #endif
@@ -2099,11 +3093,17 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		case 0x4F:
 			gb->cgb.vramBank = val & 0x01;
 			if(gb->cgb.cgbMode) gb->cgb.vramBankOffset = VRAM_ADDR - (gb->cgb.vramBank << 13);
+#if WALNUT_GB_PAGE_TABLE
+			__gb_map_vram(gb);
+#endif
 			return;
 #endif
 		/* Turn off boot ROM */
 		case 0x50:
 			gb->hram_io[IO_BOOT] = 0x01;
+#if WALNUT_GB_PAGE_TABLE
+			__gb_map_rom(gb);
+#endif
 			return;
 #if WALNUT_FULL_GBC_SUPPORT
 		/* DMA Register */
@@ -2216,6 +3216,12 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			gb->cgb.fixPalette[(gb->cgb.BGPaletteID & 0x3E) >> 1] = bgr555_to_rgb565BE_accurate((gb->cgb.BGPalette[(gb->cgb.BGPaletteID & 0x3E) + 1] << 8) | (gb->cgb.BGPalette[(gb->cgb.BGPaletteID & 0x3E)])); // convert native bgr 555 to rgb565 for native LCD panel rendering
 #else
   	  gb->cgb.fixPalette[(gb->cgb.BGPaletteID & 0x3E) >> 1] = bgr555_to_rgb565_accurate((gb->cgb.BGPalette[(gb->cgb.BGPaletteID & 0x3E) + 1] << 8) | (gb->cgb.BGPalette[(gb->cgb.BGPaletteID & 0x3E)])); // convert native bgr 555 to rgb565 for native LCD panel rendering
+#endif
+#if WALNUT_GB_DEFERRED_LCD
+			gb->log_palette_dirty = true;
+#endif
+#if WALNUT_GB_DIRTY_LINES
+			gb->line_palette_gen = gb->line_gen;
 #endif
 			if(gb->cgb.BGPaletteInc) {
 				gb->cgb.BGPaletteID++;
@@ -2236,6 +3242,12 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			gb->cgb.fixPalette[0x20 + ((gb->cgb.OAMPaletteID & 0x3E) >> 1)] = bgr555_to_rgb565BE_accurate((gb->cgb.OAMPalette[(gb->cgb.OAMPaletteID & 0x3E) + 1] << 8) + (gb->cgb.OAMPalette[(gb->cgb.OAMPaletteID & 0x3E)]));
 #else
 			gb->cgb.fixPalette[0x20 + ((gb->cgb.OAMPaletteID & 0x3E) >> 1)] = bgr555_to_rgb565_accurate((gb->cgb.OAMPalette[(gb->cgb.OAMPaletteID & 0x3E) + 1] << 8) + (gb->cgb.OAMPalette[(gb->cgb.OAMPaletteID & 0x3E)]));
+#endif
+#if WALNUT_GB_DEFERRED_LCD
+			gb->log_palette_dirty = true;
+#endif
+#if WALNUT_GB_DIRTY_LINES
+			gb->line_palette_gen = gb->line_gen;
 #endif
 			if(gb->cgb.OAMPaletteInc) {
 				gb->cgb.OAMPaletteID++;
@@ -2248,12 +3260,16 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			gb->cgb.wramBank = val;
 			gb->cgb.wramBankOffset = WRAM_1_ADDR - (1 << 12);
 			if(gb->cgb.cgbMode && (gb->cgb.wramBank & 7) > 0) gb->cgb.wramBankOffset = WRAM_1_ADDR - ((gb->cgb.wramBank & 7) << 12);
+#if WALNUT_GB_PAGE_TABLE
+			__gb_map_wram(gb);
+#endif
 			return;
 #endif
 
 		/* Interrupt Enable Register */
 		case 0xFF:
 			gb->hram_io[IO_IE] = val;
+			__gb_update_irq(gb);
 			return;
 		}
 	}
@@ -2273,6 +3289,10 @@ void __gb_write32(struct gb_s *gb, uint16_t addr, uint32_t val) {
             dst = &gb->vram[addr - gb->cgb.vramBankOffset];
 #else
             dst = &gb->vram[addr - VRAM_ADDR];
+#endif
+#if WGB_VRAM_HOOK
+            __gb_vram_written(gb, dst - gb->vram);
+            __gb_vram_written(gb, dst - gb->vram + 3);
 #endif
             break;
 
@@ -2298,6 +3318,9 @@ void __gb_write32(struct gb_s *gb, uint16_t addr, uint32_t val) {
 #endif
             } else if (addr < UNUSED_ADDR) {
                 dst = &gb->oam[addr - OAM_ADDR];
+#if WGB_OAM_HOOK
+                __gb_oam_written(gb);
+#endif
             }
             break;
 
@@ -2332,8 +3355,16 @@ void __gb_write32(struct gb_s *gb, uint16_t addr, uint32_t val) {
         case 0x9:
 #if WALNUT_FULL_GBC_SUPPORT
             *(uint32_t*)&gb->vram[addr - gb->cgb.vramBankOffset] = val;
+# if WGB_VRAM_HOOK
+            __gb_vram_written(gb, addr - gb->cgb.vramBankOffset);
+            __gb_vram_written(gb, addr - gb->cgb.vramBankOffset + 3);
+# endif
 #else
             *(uint32_t*)&gb->vram[addr - VRAM_ADDR] = val;
+# if WGB_VRAM_HOOK
+            __gb_vram_written(gb, addr - VRAM_ADDR);
+            __gb_vram_written(gb, addr - VRAM_ADDR + 3);
+# endif
 #endif
             return;
 
@@ -2361,6 +3392,9 @@ void __gb_write32(struct gb_s *gb, uint16_t addr, uint32_t val) {
             }
             if(addr < UNUSED_ADDR) {
                 *(uint32_t*)&gb->oam[addr - OAM_ADDR] = val;
+#if WGB_OAM_HOOK
+                __gb_oam_written(gb);
+#endif
                 return;
             }
             break;
@@ -2386,8 +3420,16 @@ void __gb_write16(struct gb_s *gb, uint_fast16_t addr, uint16_t val)
         case 0x9:
 #if WALNUT_FULL_GBC_SUPPORT
             *((uint16_t *)(gb->vram + (addr - gb->cgb.vramBankOffset))) = val;
+# if WGB_VRAM_HOOK
+            __gb_vram_written(gb, addr - gb->cgb.vramBankOffset);
+            __gb_vram_written(gb, addr - gb->cgb.vramBankOffset + 1);
+# endif
 #else
             *((uint16_t *)(gb->vram + (addr - VRAM_ADDR))) = val;
+# if WGB_VRAM_HOOK
+            __gb_vram_written(gb, addr - VRAM_ADDR);
+            __gb_vram_written(gb, addr - VRAM_ADDR + 1);
+# endif
 #endif
             return;
 
@@ -2644,7 +3686,7 @@ struct sprite_data {
 	uint8_t x;
 };
 
-#if WALNUT_GB_HIGH_LCD_ACCURACY
+#if WALNUT_GB_HIGH_LCD_ACCURACY && !WALNUT_GB_SPRITE_BUCKETS
 static int compare_sprites(const struct sprite_data *const sd1, const struct sprite_data *const sd2)
 {
 	int x_res;
@@ -2657,988 +3699,2891 @@ static int compare_sprites(const struct sprite_data *const sd1, const struct spr
 }
 #endif
 
+#if WALNUT_GB_TILE_CACHE
+/**
+ * Internal function used to decode tile t of VRAM into gb->tiles.
+ */
+static void __gb_decode_tile(struct gb_s *gb, const uint_fast16_t t)
+{
+	struct gb_tile_s *tile = &gb->tiles[t];
+	const uint8_t *data = &gb->vram[(t / WGB_BANK_TILES) * VRAM_BANK_SIZE
+		+ (t % WGB_BANK_TILES) * 0x10];
+	uint_fast8_t py, px;
+
+	for(py = 0; py < 8; py++)
+	{
+		uint_fast16_t row = 0, row_flip = 0;
+
+		/* Bit 7 of each bitplane is the leftmost pixel. */
+		for(px = 0; px < 8; px++)
+		{
+			uint_fast16_t c = ((data[2 * py] >> px) & 0x1)
+				| (((data[2 * py + 1] >> px) & 0x1) << 1);
+
+			row |= c << (2 * (7 - px));
+			row_flip |= c << (2 * px);
+		}
+
+		tile->row[py] = row;
+		tile->row_flip[py] = row_flip;
+	}
+
+	gb->tile_dirty[t / 32] &= ~((uint32_t)1 << (t % 32));
+}
 
-void __gb_draw_line(struct gb_s *gb)
+/**
+ * Internal function used to get decoded tile t, decoding it first if it was
+ * written. Tiles 0-383 are in VRAM bank 0, and 384-767 are in bank 1.
+ */
+static WGB_ALWAYS_INLINE const struct gb_tile_s *__gb_tile(struct gb_s *gb,
+		const uint_fast16_t t)
 {
-	uint8_t pixels[160] = {0};
-	const uint8_t hram_io_ly = gb->hram_io[IO_LY];
-#if WALNUT_FULL_GBC_SUPPORT
-	const uint8_t cgbMode = gb->cgb.cgbMode;
-#endif
-	/* If LCD not initialised by front-end, don't render anything. */
-	if(gb->display.lcd_draw_line == NULL)
-		return;
+	if(WGB_UNLIKELY(gb->tile_dirty[t / 32] & ((uint32_t)1 << (t % 32))))
+		__gb_decode_tile(gb, t);
 
-	if(gb->direct.frame_skip && !gb->display.frame_skip_count)
-		return;
+	return &gb->tiles[t];
+}
 
-#if WALNUT_FULL_GBC_SUPPORT
-	uint8_t pixelsPrio[160] = {0};  //do these pixels have priority over OAM?
-#endif
-	/* If interlaced mode is activated, check if we need to draw the current
-	 * line. */
-	if(gb->direct.interlace)
+#if WALNUT_GB_PIXEL_LUT
+/* Spreads the four 2 bit colours of a byte of a tile cache row into the four
+ * bytes of a little endian word, leftmost pixel first. */
+#define WGB_LANES(b) ((uint32_t)((b) & 0x3) \
+		| ((uint32_t)(((b) >> 2) & 0x3) << 8) \
+		| ((uint32_t)(((b) >> 4) & 0x3) << 16) \
+		| ((uint32_t)(((b) >> 6) & 0x3) << 24))
+#define WGB_LANES4(b)	WGB_LANES(b), WGB_LANES((b) + 1), \
+			WGB_LANES((b) + 2), WGB_LANES((b) + 3)
+#define WGB_LANES16(b)	WGB_LANES4(b), WGB_LANES4((b) + 4), \
+			WGB_LANES4((b) + 8), WGB_LANES4((b) + 12)
+#define WGB_LANES64(b)	WGB_LANES16(b), WGB_LANES16((b) + 16), \
+			WGB_LANES16((b) + 32), WGB_LANES16((b) + 48)
+
+static const uint32_t __gb_pixel_lanes[256] = {
+	WGB_LANES64(0), WGB_LANES64(64), WGB_LANES64(128), WGB_LANES64(192)
+};
+
+/**
+ * Internal function used to get the DMG background pixels for each byte of a
+ * tile cache row, as __gb_pixel_lanes with the BGP colours. The table is built
+ * again when BGP has changed since it was last used.
+ */
+static const uint32_t *__gb_bg_lanes(struct gb_s *gb)
+{
+	uint_fast16_t b;
+
+	if(WGB_LIKELY(gb->display.bg_lanes_valid &&
+			gb->display.bg_lanes_bgp == gb->hram_io[IO_BGP]))
+		return gb->display.bg_lanes;
+
+	for(b = 0; b < 256; b++)
 	{
-		if((!gb->display.interlace_count
-				&& (hram_io_ly & 1) == 0)
-				|| (gb->display.interlace_count
-				    && (hram_io_ly & 1) == 1))
-		{
-			/* Compensate for missing window draw if required. */
-			if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
-					&& hram_io_ly >= gb->display.WY
-					&& gb->hram_io[IO_WX] <= 166)
-				gb->display.window_clear++;
+		uint32_t lanes = 0;
+		uint_fast8_t px;
 
-			return;
+		for(px = 0; px < 4; px++)
+		{
+			uint32_t c = gb->display.bg_palette[(b >> (2 * px)) & 0x3];
+#if WALNUT_GB_12_COLOUR
+			c |= LCD_PALETTE_BG;
+#endif
+			lanes |= c << (8 * px);
 		}
+
+		gb->display.bg_lanes[b] = lanes;
 	}
 
-	/* If background is enabled, draw it. */
-#if WALNUT_FULL_GBC_SUPPORT
-	if(cgbMode || gb->hram_io[IO_LCDC] & LCDC_BG_ENABLE)
-#else
-	if(gb->hram_io[IO_LCDC] & LCDC_BG_ENABLE)
+	gb->display.bg_lanes_bgp = gb->hram_io[IO_BGP];
+	gb->display.bg_lanes_valid = true;
+	return gb->display.bg_lanes;
+}
 #endif
-	{
-		uint8_t bg_y, disp_x, bg_x, idx, py, px, t1, t2;
-		uint16_t bg_map, tile;
 
-		/* Calculate current background line to draw. Constant because
-		 * this function draws only this one line each time it is
-		 * called. */
-		bg_y = hram_io_ly + gb->hram_io[IO_SCY];
+#if WALNUT_GB_MAP_CACHE
+/**
+ * Internal function used to get the map row at gb->vram[map] from entry e of
+ * gb->display.map_rows, reading the row into the entry first if the entry
+ * holds another row or the row was written.
+ */
+static WGB_ALWAYS_INLINE const struct gb_map_row_s *__gb_map_row(
+		struct gb_s *gb, const uint_fast8_t e, const uint_fast16_t map)
+{
+	struct gb_map_row_s *row = &gb->display.map_rows[e];
+	const uint8_t unsigned_tiles =
+		gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT;
+	uint_fast8_t x;
 
-		/* Get selected background map address for first tile
-		 * corresponding to current line.
-		 * 0x20 (32) is the width of a background tile, and the bit
-		 * shift is to calculate the address. */
-		bg_map =
-			((gb->hram_io[IO_LCDC] & LCDC_BG_MAP) ?
-			 VRAM_BMAP_2 : VRAM_BMAP_1)
-			+ (bg_y >> 3) * 0x20;
+	if(WGB_LIKELY(row->map == map && row->unsigned_tiles == unsigned_tiles))
+		return row;
 
-		/* The displays (what the player sees) X coordinate, drawn right
-		 * to left. */
-		disp_x = LCD_WIDTH - 1;
+	for(x = 0; x < 32; x++)
+	{
+		const uint8_t idx = gb->vram[map + x];
 
-		/* The X coordinate to begin drawing the background at. */
-		bg_x = disp_x + gb->hram_io[IO_SCX];
+		/* Tiles 0-127 are at 0x9000 with signed addressing. */
+		row->tile[x] = (unsigned_tiles || idx >= 0x80) ?
+			idx : idx + 0x100;
+# if WALNUT_FULL_GBC_SUPPORT
+		row->att[x] = gb->vram[map + x + VRAM_BANK_SIZE];
+# endif
+	}
 
-		/* Get tile index for current background tile. */
-		idx = gb->vram[bg_map + (bg_x >> 3)];
-#if WALNUT_FULL_GBC_SUPPORT
-		uint8_t idxAtt = gb->vram[bg_map + (bg_x >> 3) + 0x2000];
+	row->map = map;
+	row->unsigned_tiles = unsigned_tiles;
+	return row;
+}
 #endif
-		/* Y coordinate of tile pixel to draw. */
-		py = (bg_y & 0x07);
-		/* X coordinate of tile pixel to draw. */
-		px = 7 - (bg_x & 0x07);
 
-		/* Select addressing mode. */
-		if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
-			tile = VRAM_TILES_1 + idx * 0x10;
-		else
-			tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
+/**
+ * Internal function used to draw the background or window tiles of the map
+ * row at gb->vram[map] to pixels disp_x to 159 of the line. x is the first
+ * pixel of the map row to draw and py is the row of each tile to draw. With
+ * the map cache, the row is kept in entry e of gb->display.map_rows.
+ */
+static WGB_ALWAYS_INLINE void __gb_draw_tiles(struct gb_s *gb,
+		uint8_t *pixels, uint8_t *pixelsPrio, const uint_fast8_t e,
+		const uint_fast16_t map, uint8_t x, uint_fast8_t disp_x,
+		const uint_fast8_t py, const uint8_t cgbMode)
+{
+#if WALNUT_GB_MAP_CACHE
+	const struct gb_map_row_s *map_row = __gb_map_row(gb, e, map);
+#else
+	const uint8_t unsigned_tiles =
+		gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT;
+	(void)e;
+#endif
+	uint_fast8_t skip = x & 0x07;
+#if WALNUT_GB_PIXEL_LUT
+	const uint32_t *bg_lanes = __gb_bg_lanes(gb);
+#endif
+#if !WALNUT_FULL_GBC_SUPPORT
+	(void)pixelsPrio;
+	(void)cgbMode;
+#endif
+
+	while(disp_x < LCD_WIDTH)
+	{
+#if WALNUT_GB_MAP_CACHE
+		uint_fast16_t t = map_row->tile[x >> 3];
+#else
+		const uint8_t idx = gb->vram[map + (x >> 3)];
+		/* Tiles 0-127 are at 0x9000 with signed addressing. */
+		uint_fast16_t t = (unsigned_tiles || idx >= 0x80) ?
+			idx : idx + 0x100;
+#endif
+		uint_fast16_t row;
+		uint_fast8_t n = 8 - skip;
+
+		if(n > LCD_WIDTH - disp_x)
+			n = LCD_WIDTH - disp_x;
 
 #if WALNUT_FULL_GBC_SUPPORT
 		if(cgbMode)
 		{
-			if(idxAtt & 0x08) tile += 0x2000; //VRAM bank 2
-			if(idxAtt & 0x40) tile += 2 * (7 - py);
-		}
-		if(!(idxAtt & 0x40))
-		{
-			tile += 2 * py;
-		}
+# if WALNUT_GB_MAP_CACHE
+			const uint8_t idxAtt = map_row->att[x >> 3];
+# else
+			const uint8_t idxAtt = gb->vram[map + (x >> 3) + VRAM_BANK_SIZE];
+# endif
+			const uint8_t pal = (idxAtt & 0x07) << 2;
+			const uint8_t prio = idxAtt >> 7;
+			const struct gb_tile_s *tile;
 
-		/* fetch first tile */
-		if(cgbMode && (idxAtt & 0x20))
-		{  //Horizantal Flip
-			t1 = gb->vram[tile] << px;
-			t2 = gb->vram[tile + 1] << px;
+			if(idxAtt & 0x08)
+				t += WGB_BANK_TILES; //VRAM bank 2
+
+			tile = __gb_tile(gb, t);
+			row = (idxAtt & 0x40) ? 7 - py : py;
+			row = (idxAtt & 0x20) ? tile->row_flip[row] : tile->row[row];
+			row >>= 2 * skip;
+
+#if WALNUT_GB_PIXEL_LUT
+			if(n == 8)
+			{
+				const uint32_t lanes = pal * UINT32_C(0x01010101);
+				const uint32_t lo = __gb_pixel_lanes[row & 0xFF] | lanes;
+				const uint32_t hi = __gb_pixel_lanes[row >> 8] | lanes;
+
+				memcpy(&pixels[disp_x], &lo, sizeof(lo));
+				memcpy(&pixels[disp_x + 4], &hi, sizeof(hi));
+				memset(&pixelsPrio[disp_x], prio, 8);
+				disp_x += 8;
+				n = 0;
+			}
+#endif
+			for(; n != 0; n--, disp_x++)
+			{
+				pixels[disp_x] = pal | (row & 0x3);
+				pixelsPrio[disp_x] = prio;
+				row >>= 2;
+			}
 		}
 		else
-		{
-			t1 = gb->vram[tile] >> px;
-			t2 = gb->vram[tile + 1] >> px;
-		}
-#else
-		tile += 2 * py;
-
-		/* fetch first tile */
-		t1 = gb->vram[tile] >> px;
-		t2 = gb->vram[tile + 1] >> px;
 #endif
-		
-		for(; disp_x != 0xFF; disp_x--)
 		{
-			uint8_t c;
+			row = __gb_tile(gb, t)->row[py] >> (2 * skip);
 
-			if(px == 8)
+#if WALNUT_GB_PIXEL_LUT
+			if(n == 8)
 			{
-				/* fetch next tile */
-				px = 0;
-				bg_x = disp_x + gb->hram_io[IO_SCX];
-				idx = gb->vram[bg_map + (bg_x >> 3)];
-#if WALNUT_FULL_GBC_SUPPORT
-				idxAtt = gb->vram[bg_map + (bg_x >> 3) + 0x2000];
+				memcpy(&pixels[disp_x], &bg_lanes[row & 0xFF], 4);
+				memcpy(&pixels[disp_x + 4], &bg_lanes[row >> 8], 4);
+				disp_x += 8;
+				n = 0;
+			}
 #endif
-				if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
-					tile = VRAM_TILES_1 + idx * 0x10;
-				else
-					tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
-
-#if WALNUT_FULL_GBC_SUPPORT
-				if(cgbMode)
-				{
-					if(idxAtt & 0x08) tile += 0x2000; //VRAM bank 2
-					if(idxAtt & 0x40) tile += 2 * (7 - py);
-				}
-				if(!(idxAtt & 0x40))
-				{
-					tile += 2 * py;
-				}
-#else
-				tile += 2 * py;
+			for(; n != 0; n--, disp_x++)
+			{
+				pixels[disp_x] = gb->display.bg_palette[row & 0x3];
+#if WALNUT_GB_12_COLOUR
+				pixels[disp_x] |= LCD_PALETTE_BG;
 #endif
-				t1 = gb->vram[tile];
-				t2 = gb->vram[tile + 1];
+				row >>= 2;
 			}
+		}
+
+		x += 8 - skip;
+		skip = 0;
+	}
+}
+#endif
+
+#if WALNUT_GB_SPRITE_BUCKETS
+/**
+ * Internal function used to fill the list of sprites to draw on each line.
+ * Like the per-line search that it replaces, the DMG keeps the ten sprites
+ * with the lowest X coordinate, then the lowest number, and the CGB keeps the
+ * first ten sprites in OAM.
+ */
+static void __gb_fill_sprite_buckets(struct gb_s *gb, const uint8_t cgbMode)
+{
+	const uint_fast8_t height =
+		(gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE) ? 16 : 8;
+	uint_fast8_t sprite_number;
+#if !WALNUT_FULL_GBC_SUPPORT
+	(void)cgbMode;
+#endif
+
+	memset(gb->sprite_bucket_count, 0, sizeof(gb->sprite_bucket_count));
+
+	for(sprite_number = 0; sprite_number < NUM_SPRITES; sprite_number++)
+	{
+		/* Sprite Y position. */
+		const int_fast16_t OY = gb->oam[4 * sprite_number + 0];
+		/* Sprite X position. */
+		const uint8_t OX = gb->oam[4 * sprite_number + 1];
+		int_fast16_t ly = OY - 16;
+		int_fast16_t end = ly + height;
+
+		if(ly < 0)
+			ly = 0;
+		if(end > LCD_HEIGHT)
+			end = LCD_HEIGHT;
+
+		for(; ly < end; ly++)
+		{
+			uint8_t *bucket = gb->sprite_bucket[ly];
+			uint_fast8_t count = gb->sprite_bucket_count[ly];
+			uint_fast8_t place;
 
-			/* copy background */
 #if WALNUT_FULL_GBC_SUPPORT
-			if(cgbMode && (idxAtt & 0x20))
-			{  //Horizantal Flip
-				c = (((t1 & 0x80) >> 1) | (t2 & 0x80)) >> 6;
-				pixels[disp_x] = ((idxAtt & 0x07) << 2) + c;
-				pixelsPrio[disp_x] = (idxAtt >> 7);
-				t1 = t1 << 1;
-				t2 = t2 << 1;
-			}
-			else
+			if(cgbMode)
 			{
-				c = (t1 & 0x1) | ((t2 & 0x1) << 1);
-				if(cgbMode)
+				if(count < MAX_SPRITES_LINE)
 				{
-					pixels[disp_x] = ((idxAtt & 0x07) << 2) + c;
-					pixelsPrio[disp_x] = (idxAtt >> 7);
-				}
-				else
-				{
-					pixels[disp_x] = gb->display.bg_palette[c];
-#if WALNUT_GB_12_COLOUR
-					pixels[disp_x] |= LCD_PALETTE_BG;
-#endif
+					bucket[count] = sprite_number;
+					gb->sprite_bucket_count[ly]++;
 				}
-				t1 = t1 >> 1;
-				t2 = t2 >> 1;
+
+				continue;
 			}
-#else
-			c = (t1 & 0x1) | ((t2 & 0x1) << 1);
-			pixels[disp_x] = gb->display.bg_palette[c];
-#if WALNUT_GB_12_COLOUR
-			pixels[disp_x] |= LCD_PALETTE_BG;
-#endif
-			t1 = t1 >> 1;
-			t2 = t2 >> 1;
 #endif
-			px++;
+			/* Sprites are added in OAM order, so a sprite goes after
+			 * the sprites with the same X coordinate. */
+			for(place = count; place != 0; place--)
+			{
+				if(gb->oam[4 * bucket[place - 1] + 1] <= OX)
+					break;
+			}
+
+			if(place >= MAX_SPRITES_LINE)
+				continue;
+
+			if(count == MAX_SPRITES_LINE)
+				count--;
+			else
+				gb->sprite_bucket_count[ly]++;
+
+			for(; count > place; count--)
+				bucket[count] = bucket[count - 1];
+
+			bucket[place] = sprite_number;
 		}
 	}
 
-	/* draw window */
-	if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
-			&& hram_io_ly >= gb->display.WY
-			&& gb->hram_io[IO_WX] <= 166)
+	gb->sprite_buckets_dirty = false;
+}
+#endif
+
+#if WALNUT_GB_DIRTY_LINES
+/**
+ * Internal function used to mark every line to be drawn again, and to start
+ * the generations again when they wrap around.
+ */
+static void __gb_lines_reset(struct gb_s *gb)
+{
+	gb->line_gen = 1;
+	memset(gb->line_vram_gen, 0, sizeof(gb->line_vram_gen));
+	gb->line_palette_gen = 0;
+	memset(gb->line_drawn_gen, 0, sizeof(gb->line_drawn_gen));
+	memset(gb->line_dirty, 0xFF, sizeof(gb->line_dirty));
+}
+
+/**
+ * Internal function used to mark the lines a sprite at Y position OY may be
+ * drawn on to be drawn again.
+ */
+static void __gb_line_sprite_dirty(struct gb_s *gb, const int_fast16_t OY)
+{
+	int_fast16_t ly = OY - 16;
+	int_fast16_t end = OY;
+
+	if(ly < 0)
+		ly = 0;
+	if(end > LCD_HEIGHT)
+		end = LCD_HEIGHT;
+
+	for(; ly < end; ly++)
+		gb->line_dirty[ly / 32] |= (uint32_t)1 << (ly % 32);
+}
+
+/**
+ * Internal function used to compare OAM with its copy from the last time the
+ * lines were checked. The lines each changed sprite was on before, and is on
+ * now, are drawn again.
+ */
+static void __gb_line_oam_check(struct gb_s *gb)
+{
+	uint_fast8_t i;
+
+	for(i = 0; i < OAM_SIZE; i += 4)
 	{
-		uint16_t win_line, tile;
-		uint8_t disp_x, win_x, py, px, idx, t1, t2, end;
+		if(memcmp(&gb->oam[i], &gb->line_oam[i], 4) == 0)
+			continue;
 
-		/* Calculate Window Map Address. */
-		win_line = (gb->hram_io[IO_LCDC] & LCDC_WINDOW_MAP) ?
-				    VRAM_BMAP_2 : VRAM_BMAP_1;
-		win_line += (gb->display.window_clear >> 3) * 0x20;
+		__gb_line_sprite_dirty(gb, gb->line_oam[i]);
+		__gb_line_sprite_dirty(gb, gb->oam[i]);
+	}
 
-		disp_x = LCD_WIDTH - 1;
-		win_x = disp_x - gb->hram_io[IO_WX] + 7;
+	memcpy(gb->line_oam, gb->oam, OAM_SIZE);
+	gb->line_oam_written = false;
+}
 
-		// look up tile
-		py = gb->display.window_clear & 0x07;
-		px = 7 - (win_x & 0x07);
-		idx = gb->vram[win_line + (win_x >> 3)];
+/**
+ * Internal function used to check that the 21 tiles from column first of the
+ * tile map row at offset map, and the row itself, are no newer than gen.
+ */
+static bool __gb_line_map_unchanged(struct gb_s *gb, const uint_fast16_t map,
+		const uint_fast8_t first, const uint32_t gen,
+		const uint8_t cgbMode)
+{
+	const uint32_t *vram_gen = gb->line_vram_gen;
+	uint_fast8_t i;
+#if !WALNUT_FULL_GBC_SUPPORT
+	(void)cgbMode;
+#endif
+
+	if(vram_gen[map / 16] > gen || vram_gen[map / 16 + 1] > gen)
+		return false;
 #if WALNUT_FULL_GBC_SUPPORT
-		uint8_t idxAtt = gb->vram[win_line + (win_x >> 3) + 0x2000];
+	/* Tile attributes. */
+	if(cgbMode && (vram_gen[(map + VRAM_BANK_SIZE) / 16] > gen
+			|| vram_gen[(map + VRAM_BANK_SIZE) / 16 + 1] > gen))
+		return false;
 #endif
 
+	for(i = 0; i < 21; i++)
+	{
+		const uint_fast16_t entry = map + ((first + i) & 0x1F);
+		const uint8_t idx = gb->vram[entry];
+		uint_fast16_t tile;
+
 		if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
 			tile = VRAM_TILES_1 + idx * 0x10;
 		else
 			tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
-
 #if WALNUT_FULL_GBC_SUPPORT
-		if(cgbMode)
-		{
-			if(idxAtt & 0x08) tile += 0x2000; //VRAM bank 2
-			if(idxAtt & 0x40) tile += 2 * (7 - py);
-		}
-		if(!(idxAtt & 0x40))
-		{
-			tile += 2 * py;
-		}
+		if(cgbMode && (gb->vram[entry + VRAM_BANK_SIZE] & 0x08))
+			tile += VRAM_BANK_SIZE;
+#endif
+		if(vram_gen[tile / 16] > gen)
+			return false;
+	}
 
-		// fetch first tile
-		if(cgbMode && (idxAtt & 0x20))
-		{  //Horizantal Flip
-			t1 = gb->vram[tile] << px;
-			t2 = gb->vram[tile + 1] << px;
-		}
-		else
-		{
-			t1 = gb->vram[tile] >> px;
-			t2 = gb->vram[tile + 1] >> px;
-		}
-#else
-		tile += 2 * py;
+	return true;
+}
 
-		// fetch first tile
-		t1 = gb->vram[tile] >> px;
-		t2 = gb->vram[tile + 1] >> px;
-#endif
-		// loop & copy window
-		end = (gb->hram_io[IO_WX] < 7 ? 0 : gb->hram_io[IO_WX] - 7) - 1;
+/**
+ * Internal function used to check if the current line would be drawn the same
+ * as when it was last drawn. The registers it is drawn with are returned in
+ * key, to be kept with __gb_line_drawn() if it is drawn.
+ */
+static bool __gb_line_unchanged(struct gb_s *gb, struct gb_line_key_s *key,
+		const uint8_t cgbMode)
+{
+	const uint_fast8_t ly = gb->hram_io[IO_LY];
+	const uint8_t lcdc = gb->hram_io[IO_LCDC];
+	const uint32_t gen = gb->line_drawn_gen[ly];
+	const uint8_t *sp = gb->display.sp_palette;
+	uint_fast8_t i;
+#if !WALNUT_FULL_GBC_SUPPORT
+	(void)cgbMode;
+#endif
+
+	key->lcdc = lcdc;
+	key->scy = gb->hram_io[IO_SCY];
+	key->scx = gb->hram_io[IO_SCX];
+	key->wx = gb->hram_io[IO_WX];
+	key->window = 0xFF;
+	if(lcdc & LCDC_WINDOW_ENABLE && ly >= gb->display.WY
+			&& gb->hram_io[IO_WX] <= 166)
+		key->window = gb->display.window_clear;
+	key->bgp = gb->hram_io[IO_BGP];
+	key->obp = sp[0] | (sp[1] << 2) | (sp[2] << 4) | (sp[3] << 6)
+		| (sp[4] << 8) | (sp[5] << 10) | (sp[6] << 12)
+		| ((uint16_t)sp[7] << 14);
 
-		for(; disp_x != end; disp_x--)
-		{
-			uint8_t c;
+	if(gb->line_oam_written)
+		__gb_line_oam_check(gb);
 
-			if(px == 8)
-			{
-				// fetch next tile
-				px = 0;
-				win_x = disp_x - gb->hram_io[IO_WX] + 7;
-				idx = gb->vram[win_line + (win_x >> 3)];
-#if WALNUT_FULL_GBC_SUPPORT
-				idxAtt = gb->vram[win_line + (win_x >> 3) + 0x2000];
-#endif
+	if(gb->line_dirty[ly / 32] & ((uint32_t)1 << (ly % 32)))
+		return false;
 
-				if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
-					tile = VRAM_TILES_1 + idx * 0x10;
-				else
-					tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
+	if(memcmp(key, &gb->line_key[ly], sizeof(*key)) != 0)
+		return false;
 
 #if WALNUT_FULL_GBC_SUPPORT
-				if(cgbMode)
-				{
-					if(idxAtt & 0x08) tile += 0x2000; //VRAM bank 2
-					if(idxAtt & 0x40) tile += 2 * (7 - py);
-				}
-				if(!(idxAtt & 0x40))
-				{
-					tile += 2 * py;
-				}
-#else
-				tile += 2 * py;
-#endif
-				t1 = gb->vram[tile];
-				t2 = gb->vram[tile + 1];
-			}
+	if(cgbMode && gb->line_palette_gen > gen)
+		return false;
 
-			// copy window
-#if WALNUT_FULL_GBC_SUPPORT
-			if(idxAtt & 0x20)
-			{  //Horizantal Flip
-				c = (((t1 & 0x80) >> 1) | (t2 & 0x80)) >> 6;
-				pixels[disp_x] = ((idxAtt & 0x07) << 2) + c;
-				pixelsPrio[disp_x] = (idxAtt >> 7);
-				t1 = t1 << 1;
-				t2 = t2 << 1;
-			}
-			else
-			{
-				c = (t1 & 0x1) | ((t2 & 0x1) << 1);
-				if(cgbMode)
-				{
-					pixels[disp_x] = ((idxAtt & 0x07) << 2) + c;
-					pixelsPrio[disp_x] = (idxAtt >> 7);
-				}
-				else
-				{
-					pixels[disp_x] = gb->display.bg_palette[c];
-#if WALNUT_GB_12_COLOUR
-					pixels[disp_x] |= LCD_PALETTE_BG;
-#endif
-				}
-				t1 = t1 >> 1;
-				t2 = t2 >> 1;
-			}
+	if(cgbMode || lcdc & LCDC_BG_ENABLE)
 #else
-			c = (t1 & 0x1) | ((t2 & 0x1) << 1);
-			pixels[disp_x] = gb->display.bg_palette[c];
-#if WALNUT_GB_12_COLOUR
-			pixels[disp_x] |= LCD_PALETTE_BG;
-#endif
-			t1 = t1 >> 1;
-			t2 = t2 >> 1;
+	if(lcdc & LCDC_BG_ENABLE)
 #endif
-			px++;
-		}
+	{
+		const uint8_t bg_y = ly + key->scy;
 
-		gb->display.window_clear++; // advance window line
+		if(!__gb_line_map_unchanged(gb,
+				((lcdc & LCDC_BG_MAP) ? VRAM_BMAP_2 : VRAM_BMAP_1)
+				+ (bg_y >> 3) * 0x20, key->scx >> 3, gen, cgbMode))
+			return false;
 	}
 
-	// draw sprites
-	if(gb->hram_io[IO_LCDC] & LCDC_OBJ_ENABLE)
-	{
-		uint8_t sprite_number;
-#if WALNUT_GB_HIGH_LCD_ACCURACY
-		uint8_t number_of_sprites = 0;
+	if(key->window != 0xFF && !__gb_line_map_unchanged(gb,
+			((lcdc & LCDC_WINDOW_MAP) ? VRAM_BMAP_2 : VRAM_BMAP_1)
+			+ (key->window >> 3) * 0x20, 0, gen, cgbMode))
+		return false;
 
-		struct sprite_data sprites_to_render[MAX_SPRITES_LINE + 1]; // Requires one extra slot for sorting 
+	if(!(lcdc & LCDC_OBJ_ENABLE))
+		return true;
 
-		/* Record number of sprites on the line being rendered, limited
-		 * to the maximum number sprites that the Game Boy is able to
-		 * render on each line (10 sprites). */
-		for(sprite_number = 0;
-				sprite_number < NUM_SPRITES;
-				sprite_number++)
-		{
-			/* Sprite Y position. */
-			uint8_t OY = gb->oam[4 * sprite_number + 0];
-			/* Sprite X position. */
-			uint8_t OX = gb->oam[4 * sprite_number + 1];
+	/* Every sprite on the line, including any past the ten drawn. */
+	for(i = 0; i < OAM_SIZE; i += 4)
+	{
+		const uint8_t OY = gb->oam[i];
+		uint_fast16_t tile = gb->oam[i + 2];
 
-			/* If sprite isn't on this line, continue. */
-			if(hram_io_ly +
-				(gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 0 : 8) >= OY
-					|| hram_io_ly + 16 < OY)
-				continue;
+		if(ly + (lcdc & LCDC_OBJ_SIZE ? 0 : 8) >= OY || ly + 16 < OY)
+			continue;
 
+		if(lcdc & LCDC_OBJ_SIZE)
+			tile &= 0xFE;
 #if WALNUT_FULL_GBC_SUPPORT
-			if (!cgbMode)
-			{
+		if(cgbMode && (gb->oam[i + 3] & 0x08))
+			tile += VRAM_BANK_SIZE / 16;
 #endif
-			struct sprite_data current;
+		if(gb->line_vram_gen[tile] > gen
+				|| ((lcdc & LCDC_OBJ_SIZE)
+				    && gb->line_vram_gen[tile + 1] > gen))
+			return false;
+	}
 
-			current.sprite_number = sprite_number;
-			current.x = OX;
+	return true;
+}
 
-			uint8_t place;
-			for (place = number_of_sprites; place != 0; place--)
-			{
-				if(compare_sprites(&sprites_to_render[place - 1], &current) < 0)
-					break;
-			}
-			if(place >= MAX_SPRITES_LINE)
-				continue;
-			for (uint8_t i = number_of_sprites; i > place; --i) {
-				sprites_to_render[i] = sprites_to_render[i - 1];
-			}
-			if(number_of_sprites < MAX_SPRITES_LINE)
-				number_of_sprites++;
-			sprites_to_render[place] = current;
-#if WALNUT_FULL_GBC_SUPPORT
-			}
-			else
-			{
-				// CGB does not care about the X coordinate of the sprite when it comes to render priority, only the OAM order.
-				// Skip the reordering and just fill sprites_to_render until it is full.
-				if (number_of_sprites >= MAX_SPRITES_LINE) continue;
-				sprites_to_render[number_of_sprites].sprite_number = sprite_number;
-				sprites_to_render[number_of_sprites].x = OX;
-				number_of_sprites++;
-			}
-#endif
-		}
-#endif
+/**
+ * Internal function used to keep the registers that the current line is being
+ * drawn with, and the generation it is drawn in.
+ */
+static void __gb_line_drawn(struct gb_s *gb, const struct gb_line_key_s *key)
+{
+	const uint_fast8_t ly = gb->hram_io[IO_LY];
 
-		/* Render each sprite, from low priority to high priority. */
-#if WALNUT_GB_HIGH_LCD_ACCURACY
-		/* Render the top ten prioritised sprites on this scanline. */
-		for(sprite_number = number_of_sprites - 1;
-				sprite_number != 0xFF;
-				sprite_number--)
-		{
-			uint8_t s = sprites_to_render[sprite_number].sprite_number;
-#else
-		for (sprite_number = NUM_SPRITES - 1;
-			sprite_number != 0xFF;
-			sprite_number--)
-		{
-			uint8_t s = sprite_number;
-#endif
-			uint8_t py, t1, t2, dir, start, end, shift, disp_x;
-			/* Sprite Y position. */
-			uint8_t OY = gb->oam[4 * s + 0];
-			/* Sprite X position. */
-			uint8_t OX = gb->oam[4 * s + 1];
-			/* Sprite Tile/Pattern Number. */
-			uint8_t OT = gb->oam[4 * s + 2]
-				     & (gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 0xFE : 0xFF);
-			/* Additional attributes. */
-			uint8_t OF = gb->oam[4 * s + 3];
+	gb->line_key[ly] = *key;
+	gb->line_drawn_gen[ly] = gb->line_gen;
+	gb->line_dirty[ly / 32] &= ~((uint32_t)1 << (ly % 32));
+	gb->line_stats.drawn++;
 
-#if !WALNUT_GB_HIGH_LCD_ACCURACY
-			/* If sprite isn't on this line, continue. */
-			if(hram_io_ly +
-					(gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 0 : 8) >= OY ||
-					hram_io_ly + 16 < OY)
-				continue;
+	/* Later writes are newer than this line. */
+	if(++gb->line_gen == 0)
+		__gb_lines_reset(gb);
+}
 #endif
 
-			/* Continue if sprite not visible. */
-			if(OX == 0 || OX >= 168)
-				continue;
-
-			// y flip
-			py = hram_io_ly - OY + 16;
-
-			if(OF & OBJ_FLIP_Y)
-				py = (gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 15 : 7) - py;
-
-			// fetch the tile
-#if WALNUT_FULL_GBC_SUPPORT
-			if(cgbMode)
-			{
-				t1 = gb->vram[((OF & OBJ_BANK) << 10) + VRAM_TILES_1 + OT * 0x10 + 2 * py];
-				t2 = gb->vram[((OF & OBJ_BANK) << 10) + VRAM_TILES_1 + OT * 0x10 + 2 * py + 1];
-			}
-			else
+/**
+ * Internal function used to draw the current line. cgbMode is a constant at
+ * each call, so the DMG and CGB renderers below are each compiled without the
+ * tests for the other mode.
+ */
+static WGB_ALWAYS_INLINE void __gb_draw_line_mode(struct gb_s *gb,
+		const uint8_t cgbMode)
+{
+	uint8_t pixels[160];
+	const uint8_t hram_io_ly = gb->hram_io[IO_LY];
+	uint16_t *line_rgb565 = NULL;
+	bool skip_line = gb->direct.no_render;
+#if WALNUT_GB_DIRTY_LINES
+	struct gb_line_key_s key;
 #endif
-			{
-				t1 = gb->vram[VRAM_TILES_1 + OT * 0x10 + 2 * py];
-				t2 = gb->vram[VRAM_TILES_1 + OT * 0x10 + 2 * py + 1];
-			}
-
-			// handle x flip
-			if(OF & OBJ_FLIP_X)
-			{
-				dir = 1;
-				start = (OX < 8 ? 0 : OX - 8);
-				end = MIN(OX, LCD_WIDTH);
-				shift = 8 - OX + start;
-			}
-			else
-			{
-				dir = (uint8_t)-1;
-				start = MIN(OX, LCD_WIDTH) - 1;
-				end = (OX < 8 ? 0 : OX - 8) - 1;
-				shift = OX - (start + 1);
-			}
-
-			// copy tile
-			t1 >>= shift;
-			t2 >>= shift;
+#if !WALNUT_FULL_GBC_SUPPORT
+	(void)cgbMode;
+#endif
+	/* If LCD not initialised by front-end, don't render anything. */
+	if(gb->display.lcd_draw_line == NULL &&
+			gb->display.lcd_line_rgb565 == NULL)
+		return;
 
-			/* TODO: Put for loop within the to if statements
-			 * because the BG priority bit will be the same for
-			 * all the pixels in the tile. */
-			for(disp_x = start; disp_x != end; disp_x += dir)
-			{
-				uint8_t c = (t1 & 0x1) | ((t2 & 0x1) << 1);
-				// check transparency / sprite overlap / background overlap
-#if WALNUT_FULL_GBC_SUPPORT
-				if(cgbMode)
-				{
-					uint8_t isBackgroundDisabled = c && !(gb->hram_io[IO_LCDC] & LCDC_BG_ENABLE);
-					uint8_t isPixelPriorityNonConflicting = c &&
-															!(pixelsPrio[disp_x] && (pixels[disp_x] & 0x3)) &&
-															!((OF & OBJ_PRIORITY) && (pixels[disp_x] & 0x3));
+	if(gb->direct.frame_skip && !gb->display.frame_skip_count)
+		return;
 
-					if(isBackgroundDisabled || isPixelPriorityNonConflicting)
-					{
-						/* Set pixel colour. */
-						pixels[disp_x] = ((OF & OBJ_CGB_PALETTE) << 2) + c + 0x20;  // add 0x20 to differentiate from BG
-					}
-				}
-				else
-#endif
-				if(c && !(OF & OBJ_PRIORITY && !((pixels[disp_x] & 0x3) == gb->display.bg_palette[0])))
-				{
-					/* Set pixel colour. */
-					pixels[disp_x] = (OF & OBJ_PALETTE)
-						? gb->display.sp_palette[c + 4]
-						: gb->display.sp_palette[c];
-#if WALNUT_GB_12_COLOUR
-					/* Set pixel palette (OBJ0 or OBJ1). */
-					pixels[disp_x] |= (OF & OBJ_PALETTE);
+#if WALNUT_GB_LINE_SPANS
+	if(!gb->display.in_span)
+		gb->display.line_window_clear = gb->display.window_clear;
 #endif
 #if WALNUT_FULL_GBC_SUPPORT
-					/* Deselect BG palette. */
-					pixels[disp_x] &= ~LCD_PALETTE_BG;
+	uint8_t pixelsPrio[160];  //do these pixels have priority over OAM?
 #endif
-				}
-				t1 = t1 >> 1;
-				t2 = t2 >> 1;
-			}
-		}
+	/* If interlaced mode is activated, check if we need to draw the current
+	 * line. */
+	if(!skip_line && gb->direct.interlace)
+	{
+		skip_line = (!gb->display.interlace_count
+				&& (hram_io_ly & 1) == 0)
+				|| (gb->display.interlace_count
+				    && (hram_io_ly & 1) == 1);
 	}
-	
-	gb->display.lcd_draw_line(gb, pixels, gb->hram_io[IO_LY]);
-}
-#endif
 
-/**
- * Internal function used to step the CPU twice (dual fetch/16-bit).
- */
-static inline void __gb_step_cpu(struct gb_s *gb)
-{
-	uint16_t oppair;
-	uint8_t opcode;
-	uint_fast16_t inst_cycles;
-	static const uint8_t op_cycles[0x100] =
+#if WALNUT_GB_DIRTY_LINES
+# if WALNUT_GB_LINE_SPANS
+	if(!gb->display.in_span)
+		gb->display.line_unchanged = false;
+# endif
+	/* Lines that would be drawn the same are left as they are. */
+	if(!skip_line &&
+# if WALNUT_GB_LINE_SPANS
+			!gb->display.in_span &&
+# endif
+			__gb_line_unchanged(gb, &key, cgbMode))
 	{
-		/* *INDENT-OFF* */
-		/*0 1 2  3  4  5  6  7  8  9  A  B  C  D  E  F	*/
-		4,12, 8, 8, 4, 4, 8, 4,20, 8, 8, 8, 4, 4, 8, 4,	/* 0x00 */
-		4,12, 8, 8, 4, 4, 8, 4,12, 8, 8, 8, 4, 4, 8, 4,	/* 0x10 */
-		8,12, 8, 8, 4, 4, 8, 4, 8, 8, 8, 8, 4, 4, 8, 4,	/* 0x20 */
-		8,12, 8, 8,12,12,12, 4, 8, 8, 8, 8, 4, 4, 8, 4,	/* 0x30 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x40 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x50 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x60 */
-		8, 8, 8, 8, 8, 8, 4, 8, 4, 4, 4, 4, 4, 4, 8, 4, /* 0x70 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x80 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x90 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0xA0 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0xB0 */
-		8,12,12,16,12,16, 8,16, 8,16,12, 8,12,24, 8,16,	/* 0xC0 */
-		8,12,12, 0,12,16, 8,16, 8,16,12, 0,12, 0, 8,16,	/* 0xD0 */
-		12,12,8, 0, 0,16, 8,16,16, 4,16, 0, 0, 0, 8,16,	/* 0xE0 */
-		12,12,8, 4, 0,16, 8,16,12, 8,16, 4, 0, 0, 8,16	/* 0xF0 */
-		/* *INDENT-ON* */
-	};
-	static const uint_fast16_t TAC_CYCLES[4] = {1024, 16, 64, 256};
+		gb->line_stats.skipped++;
+		skip_line = true;
+# if WALNUT_GB_LINE_SPANS
+		gb->display.line_unchanged = true;
+# endif
+	}
+#endif
 
-	/* Handle interrupts */
-	/* If gb_halt is positive, then an interrupt must have occurred by the
-	 * time we reach here, because on HALT, we jump to the next interrupt
-	 * immediately. */
-	while(gb->gb_halt || (gb->gb_ime &&
-			gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & ANY_INTR))
+	/* The front-end may also skip the line by not giving a line to draw
+	 * to. */
+	if(!skip_line && gb->display.lcd_line_rgb565 != NULL)
 	{
-		gb->gb_halt = false;
-
-		if(!gb->gb_ime)
-			break;
-
-		/* Disable interrupts */
-		gb->gb_ime = false;
-
-		/* Push Program Counter */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		line_rgb565 = gb->display.lcd_line_rgb565(gb, hram_io_ly);
+		skip_line = (line_rgb565 == NULL);
+	}
 
-		/* Call interrupt handler if required. */
-		if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & VBLANK_INTR)
-		{
-			gb->cpu_reg.pc.reg = VBLANK_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= VBLANK_INTR;
-		}
-		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & LCDC_INTR)
-		{
-			gb->cpu_reg.pc.reg = LCDC_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= LCDC_INTR;
-		}
-		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & TIMER_INTR)
-		{
-			gb->cpu_reg.pc.reg = TIMER_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= TIMER_INTR;
-		}
-		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & SERIAL_INTR)
-		{
-			gb->cpu_reg.pc.reg = SERIAL_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= SERIAL_INTR;
-		}
-		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & CONTROL_INTR)
-		{
-			gb->cpu_reg.pc.reg = CONTROL_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= CONTROL_INTR;
-		}
+	if(skip_line)
+	{
+		/* Compensate for missing window draw if required. */
+		if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
+				&& hram_io_ly >= gb->display.WY
+				&& gb->hram_io[IO_WX] <= 166)
+			gb->display.window_clear++;
 
-		break;
+		return;
 	}
 
-	/* Obtain opcode */
-	
-	oppair = __gb_read16(gb, gb->cpu_reg.pc.reg++);
-	opcode = (uint8_t)oppair; // auto-truncate
-#if (WALNUT_GB_SAFE_DUALFETCH_DMA || WALNUT_GB_SAFE_DUALFETCH_MBC)
-  gb->prefetch_invalid=false;
+	memset(pixels, 0, sizeof(pixels));
+#if WALNUT_FULL_GBC_SUPPORT
+	memset(pixelsPrio, 0, sizeof(pixelsPrio));
+#endif
+#if WALNUT_GB_DIRTY_LINES
+# if WALNUT_GB_LINE_SPANS
+	/* The line no longer matches its key, so it is drawn in full next
+	 * time. */
+	if(gb->display.in_span)
+		gb->line_dirty[hram_io_ly / 32] |= (uint32_t)1 << (hram_io_ly % 32);
+	else
+# endif
+	__gb_line_drawn(gb, &key);
 #endif
-	inst_cycles = op_cycles[opcode];
 
-	/* Execute opcode */
-	switch(opcode)
+	/* If background is enabled, draw it. */
+#if WALNUT_FULL_GBC_SUPPORT
+	if(cgbMode || gb->hram_io[IO_LCDC] & LCDC_BG_ENABLE)
+#else
+	if(gb->hram_io[IO_LCDC] & LCDC_BG_ENABLE)
+#endif
 	{
-	case 0x00: /* NOP */
-		opcode = (uint8_t)(oppair >> 8);
-		break;
+#if WALNUT_GB_TILE_CACHE
+		const uint8_t bg_y = hram_io_ly + gb->hram_io[IO_SCY];
+		const uint_fast16_t bg_map =
+			((gb->hram_io[IO_LCDC] & LCDC_BG_MAP) ?
+			 VRAM_BMAP_2 : VRAM_BMAP_1)
+			+ (bg_y >> 3) * 0x20;
 
-	case 0x01: /* LD BC, imm */
-#if WALNUT_GB_16_BIT_OPS_DUALFETCH
-    gb->cpu_reg.bc.bytes.c = (uint8_t)(oppair >> 8); // C was already partially loaded in oppair
-    oppair = __gb_read16(gb, gb->cpu_reg.pc.reg + 1); // Read 16-bit immediate starting from PC+1    
-    gb->cpu_reg.bc.bytes.b = (uint8_t)(oppair);// Store lower byte of immediate into B
-    gb->cpu_reg.pc.reg += 2;// Increment PC by 2 to skip over the 16-bit immediate
-    // Prefetch next opcode from upper byte of read16
-    opcode = (uint8_t)(oppair >> 8);
-#else
-    // Original 8-bit fetch path
-    gb->cpu_reg.bc.bytes.c = (uint8_t)(oppair >> 8);
-    gb->cpu_reg.pc.reg++;
-    gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.pc.reg++);
-    opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-#endif
-		break;
-	case 0x02: /* LD (BC), A */
-		__gb_write(gb, gb->cpu_reg.bc.reg, gb->cpu_reg.a);	  
-#if WALNUT_GB_SAFE_DUALFETCH_OPCODES
-		opcode = __gb_read(gb, gb->cpu_reg.pc.reg); // GTA SAFE TEST
+# if WALNUT_FULL_GBC_SUPPORT
+		__gb_draw_tiles(gb, pixels, pixelsPrio, WGB_MAP_ROW_BG,
+				bg_map, gb->hram_io[IO_SCX], 0, bg_y & 0x07, cgbMode);
+# else
+		__gb_draw_tiles(gb, pixels, NULL, WGB_MAP_ROW_BG,
+				bg_map, gb->hram_io[IO_SCX], 0, bg_y & 0x07, cgbMode);
+# endif
 #else
-		opcode = (uint8_t)(oppair >> 8);
-#endif
-		break;
-
-	case 0x03: /* INC BC */
-		gb->cpu_reg.bc.reg++;
-		opcode = (uint8_t)(oppair >> 8);
-		break;
+		uint8_t bg_y, disp_x, bg_x, idx, py, px, t1, t2;
+		uint16_t bg_map, tile;
 
-	case 0x04: /* INC B */
-		WGB_INSTR_INC_R8(gb->cpu_reg.bc.bytes.b);
-		opcode = (uint8_t)(oppair >> 8);
-		break;
+		/* Calculate current background line to draw. Constant because
+		 * this function draws only this one line each time it is
+		 * called. */
+		bg_y = hram_io_ly + gb->hram_io[IO_SCY];
 
-	case 0x05: /* DEC B */
-		WGB_INSTR_DEC_R8(gb->cpu_reg.bc.bytes.b);
-		opcode = (uint8_t)(oppair >> 8);
-		break;
+		/* Get selected background map address for first tile
+		 * corresponding to current line.
+		 * 0x20 (32) is the width of a background tile, and the bit
+		 * shift is to calculate the address. */
+		bg_map =
+			((gb->hram_io[IO_LCDC] & LCDC_BG_MAP) ?
+			 VRAM_BMAP_2 : VRAM_BMAP_1)
+			+ (bg_y >> 3) * 0x20;
 
-	case 0x06: /* LD B, imm */
-		gb->cpu_reg.bc.bytes.b = (uint8_t)(oppair >> 8);
-	  gb->cpu_reg.pc.reg++;
-		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-		break;
-	case 0x07: /* RLCA */
-		gb->cpu_reg.a = (gb->cpu_reg.a << 1) | (gb->cpu_reg.a >> 7);
-		gb->cpu_reg.f.reg = 0;
-		gb->cpu_reg.f.f_bits.c = (gb->cpu_reg.a & 0x01);
-		opcode = (uint8_t)(oppair >> 8);
-		break;
-	case 0x08: /* LD (imm), SP */
-	{		
-#if WALNUT_GB_16_BIT_OPS_DUALFETCH
-		uint8_t l = (uint8_t)(oppair >> 8);
-		gb->cpu_reg.pc.reg++;
-    oppair = __gb_read16(gb, gb->cpu_reg.pc.reg++);
-		uint8_t h = oppair;
-		uint16_t temp = WALNUT_GB_U8_TO_U16(h, l);
-		__gb_write16(gb,temp,gb->cpu_reg.sp.reg);
-    // gb->cpu_reg.pc.reg+=2;
-		opcode = oppair >> 8;
-#else
-    uint8_t l = (uint8_t)(oppair >> 8);
-	  gb->cpu_reg.pc.reg++;
-    uint8_t h = __gb_read(gb, gb->cpu_reg.pc.reg++);
-    uint16_t temp = WALNUT_GB_U8_TO_U16(h, l);
-    __gb_write(gb, temp++, gb->cpu_reg.sp.bytes.p);
-    __gb_write(gb, temp, gb->cpu_reg.sp.bytes.s);
-		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-#endif
-    break;
-	}
+		/* The displays (what the player sees) X coordinate, drawn right
+		 * to left. */
+		disp_x = LCD_WIDTH - 1;
 
-	case 0x09: /* ADD HL, BC */
-	{
-		uint_fast32_t temp = gb->cpu_reg.hl.reg + gb->cpu_reg.bc.reg;
-		gb->cpu_reg.f.f_bits.n = 0;
-		gb->cpu_reg.f.f_bits.h =
-			(temp ^ gb->cpu_reg.hl.reg ^ gb->cpu_reg.bc.reg) & 0x1000 ? 1 : 0;
-		gb->cpu_reg.f.f_bits.c = (temp & 0xFFFF0000) ? 1 : 0;
-		gb->cpu_reg.hl.reg = (temp & 0x0000FFFF);
-		opcode = (uint8_t)(oppair >> 8);
-		break;
-	}
+		/* The X coordinate to begin drawing the background at. */
+		bg_x = disp_x + gb->hram_io[IO_SCX];
 
-	case 0x0A: /* LD A, (BC) */
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.bc.reg);
-		opcode = (uint8_t)(oppair >> 8);
-		break;
+		/* Get tile index for current background tile. */
+		idx = gb->vram[bg_map + (bg_x >> 3)];
+#if WALNUT_FULL_GBC_SUPPORT
+		uint8_t idxAtt = gb->vram[bg_map + (bg_x >> 3) + 0x2000];
+#endif
+		/* Y coordinate of tile pixel to draw. */
+		py = (bg_y & 0x07);
+		/* X coordinate of tile pixel to draw. */
+		px = 7 - (bg_x & 0x07);
 
-	case 0x0B: /* DEC BC */
-		gb->cpu_reg.bc.reg--;
-		opcode = (uint8_t)(oppair >> 8);
-		break;
+		/* Select addressing mode. */
+		if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
+			tile = VRAM_TILES_1 + idx * 0x10;
+		else
+			tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
 
-	case 0x0C: /* INC C */
-		WGB_INSTR_INC_R8(gb->cpu_reg.bc.bytes.c);
-		opcode = (uint8_t)(oppair >> 8);
-		break;
+#if WALNUT_FULL_GBC_SUPPORT
+		if(cgbMode)
+		{
+			if(idxAtt & 0x08) tile += 0x2000; //VRAM bank 2
+			if(idxAtt & 0x40) tile += 2 * (7 - py);
+		}
+		if(!(idxAtt & 0x40))
+		{
+			tile += 2 * py;
+		}
 
-	case 0x0D: /* DEC C */
-		WGB_INSTR_DEC_R8(gb->cpu_reg.bc.bytes.c);
-		opcode = (uint8_t)(oppair >> 8);
-		break;
+		/* fetch first tile */
+		if(cgbMode && (idxAtt & 0x20))
+		{  //Horizantal Flip
+			t1 = gb->vram[tile] << px;
+			t2 = gb->vram[tile + 1] << px;
+		}
+		else
+		{
+			t1 = gb->vram[tile] >> px;
+			t2 = gb->vram[tile + 1] >> px;
+		}
+#else
+		tile += 2 * py;
 
-	case 0x0E: /* LD C, imm */
-		gb->cpu_reg.bc.bytes.c = (uint8_t)(oppair >> 8);
-		gb->cpu_reg.pc.reg++;
-	  opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-		break;
+		/* fetch first tile */
+		t1 = gb->vram[tile] >> px;
+		t2 = gb->vram[tile + 1] >> px;
+#endif
+		
+		for(; disp_x != 0xFF; disp_x--)
+		{
+			uint8_t c;
 
-	case 0x0F: /* RRCA */
-		gb->cpu_reg.f.reg = 0;
-		gb->cpu_reg.f.f_bits.c = gb->cpu_reg.a & 0x01;
-		gb->cpu_reg.a = (gb->cpu_reg.a >> 1) | (gb->cpu_reg.a << 7);
-		opcode = (uint8_t)(oppair >> 8);
-		break;
-	case 0x10: /* STOP */
-		//gb->gb_halt = true;
+			if(px == 8)
+			{
+				/* fetch next tile */
+				px = 0;
+				bg_x = disp_x + gb->hram_io[IO_SCX];
+				idx = gb->vram[bg_map + (bg_x >> 3)];
 #if WALNUT_FULL_GBC_SUPPORT
-		if(gb->cgb.cgbMode & gb->cgb.doubleSpeedPrep)
-		{
-			gb->cgb.doubleSpeedPrep = 0;
-			gb->cgb.doubleSpeed ^= 1;
-		}
+				idxAtt = gb->vram[bg_map + (bg_x >> 3) + 0x2000];
 #endif
-		opcode = (uint8_t)(oppair >> 8);
-		break;
+				if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
+					tile = VRAM_TILES_1 + idx * 0x10;
+				else
+					tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
 
-	case 0x11: /* LD DE, imm */
-#if WALNUT_GB_16_BIT_OPS_DUALFETCH
-    gb->cpu_reg.de.bytes.e = (uint8_t)(oppair >> 8);
-	  gb->cpu_reg.pc.reg++;
-		oppair = __gb_read16(gb, gb->cpu_reg.pc.reg++);
-    gb->cpu_reg.de.bytes.d = oppair;
-		opcode = oppair >> 8;
+#if WALNUT_FULL_GBC_SUPPORT
+				if(cgbMode)
+				{
+					if(idxAtt & 0x08) tile += 0x2000; //VRAM bank 2
+					if(idxAtt & 0x40) tile += 2 * (7 - py);
+				}
+				if(!(idxAtt & 0x40))
+				{
+					tile += 2 * py;
+				}
 #else
-    gb->cpu_reg.de.bytes.e = (uint8_t)(oppair >> 8);
-	  gb->cpu_reg.pc.reg++;
-    gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+				tile += 2 * py;
 #endif
-		break;
-	case 0x12: /* LD (DE), A */
-		__gb_write(gb, gb->cpu_reg.de.reg, gb->cpu_reg.a);
-#if WALNUT_GB_SAFE_DUALFETCH_OPCODES
-		opcode = __gb_read(gb, gb->cpu_reg.pc.reg); // GTA SAFE TEST
+				t1 = gb->vram[tile];
+				t2 = gb->vram[tile + 1];
+			}
+
+			/* copy background */
+#if WALNUT_FULL_GBC_SUPPORT
+			if(cgbMode && (idxAtt & 0x20))
+			{  //Horizantal Flip
+				c = (((t1 & 0x80) >> 1) | (t2 & 0x80)) >> 6;
+				pixels[disp_x] = ((idxAtt & 0x07) << 2) + c;
+				pixelsPrio[disp_x] = (idxAtt >> 7);
+				t1 = t1 << 1;
+				t2 = t2 << 1;
+			}
+			else
+			{
+				c = (t1 & 0x1) | ((t2 & 0x1) << 1);
+				if(cgbMode)
+				{
+					pixels[disp_x] = ((idxAtt & 0x07) << 2) + c;
+					pixelsPrio[disp_x] = (idxAtt >> 7);
+				}
+				else
+				{
+					pixels[disp_x] = gb->display.bg_palette[c];
+#if WALNUT_GB_12_COLOUR
+					pixels[disp_x] |= LCD_PALETTE_BG;
+#endif
+				}
+				t1 = t1 >> 1;
+				t2 = t2 >> 1;
+			}
 #else
-		opcode = (uint8_t)(oppair >> 8);
+			c = (t1 & 0x1) | ((t2 & 0x1) << 1);
+			pixels[disp_x] = gb->display.bg_palette[c];
+#if WALNUT_GB_12_COLOUR
+			pixels[disp_x] |= LCD_PALETTE_BG;
+#endif
+			t1 = t1 >> 1;
+			t2 = t2 >> 1;
+#endif
+			px++;
+		}
 #endif
-		break;
-
-	case 0x13: /* INC DE */
-		gb->cpu_reg.de.reg++;
-		opcode = (uint8_t)(oppair >> 8);
-		break;
-
-	case 0x14: /* INC D */
-		WGB_INSTR_INC_R8(gb->cpu_reg.de.bytes.d);
-		opcode = (uint8_t)(oppair >> 8);
-		break;
-
-	case 0x15: /* DEC D */
-		WGB_INSTR_DEC_R8(gb->cpu_reg.de.bytes.d);
-		opcode = (uint8_t)(oppair >> 8);
-		break;
-
-	case 0x16: /* LD D, imm */
-		gb->cpu_reg.de.bytes.d = (uint8_t)(oppair >> 8);
-	  gb->cpu_reg.pc.reg++;
-	  opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-		break;
-
-	case 0x17: /* RLA */
-	{
-		uint8_t temp = gb->cpu_reg.a;
-		gb->cpu_reg.a = (gb->cpu_reg.a << 1) | gb->cpu_reg.f.f_bits.c;
-		gb->cpu_reg.f.reg = 0;
-		gb->cpu_reg.f.f_bits.c = (temp >> 7) & 0x01;
-		opcode = (uint8_t)(oppair >> 8);
-		break;
 	}
 
-	case 0x18: /* JR imm */
-	{
-		int8_t temp = (int8_t) (uint8_t)(oppair >> 8);
-	  gb->cpu_reg.pc.reg++;
-		gb->cpu_reg.pc.reg += temp;
-		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-		break;
-	}
-	case 0x19: /* ADD HL, DE */
+	/* draw window */
+	if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
+			&& hram_io_ly >= gb->display.WY
+			&& gb->hram_io[IO_WX] <= 166)
 	{
-		uint_fast32_t temp = gb->cpu_reg.hl.reg + gb->cpu_reg.de.reg;
-		gb->cpu_reg.f.f_bits.n = 0;
-		gb->cpu_reg.f.f_bits.h =
-			(temp ^ gb->cpu_reg.hl.reg ^ gb->cpu_reg.de.reg) & 0x1000 ? 1 : 0;
-		gb->cpu_reg.f.f_bits.c = (temp & 0xFFFF0000) ? 1 : 0;
-		gb->cpu_reg.hl.reg = (temp & 0x0000FFFF);
-		opcode = (uint8_t)(oppair >> 8);
-		break;
-	}
-	case 0x1A: /* LD A, (DE) */
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.de.reg);
-		opcode = (uint8_t)(oppair >> 8);
-		break;
+#if WALNUT_GB_TILE_CACHE
+		const uint8_t WX = gb->hram_io[IO_WX];
+		const uint_fast16_t win_line =
+			((gb->hram_io[IO_LCDC] & LCDC_WINDOW_MAP) ?
+			 VRAM_BMAP_2 : VRAM_BMAP_1)
+			+ (gb->display.window_clear >> 3) * 0x20;
 
-	case 0x1B: /* DEC DE */
-		gb->cpu_reg.de.reg--;
-		opcode = (uint8_t)(oppair >> 8);
-		break;
+# if WALNUT_FULL_GBC_SUPPORT
+		__gb_draw_tiles(gb, pixels, pixelsPrio, WGB_MAP_ROW_WIN,
+				win_line, WX < 7 ? 7 - WX : 0, WX < 7 ? 0 : WX - 7,
+				gb->display.window_clear & 0x07, cgbMode);
+# else
+		__gb_draw_tiles(gb, pixels, NULL, WGB_MAP_ROW_WIN,
+				win_line, WX < 7 ? 7 - WX : 0, WX < 7 ? 0 : WX - 7,
+				gb->display.window_clear & 0x07, cgbMode);
+# endif
+#else
+		uint16_t win_line, tile;
+		uint8_t disp_x, win_x, py, px, idx, t1, t2, end;
 
-	case 0x1C: /* INC E */
-		WGB_INSTR_INC_R8(gb->cpu_reg.de.bytes.e);
-		opcode = (uint8_t)(oppair >> 8);
-		break;
+		/* Calculate Window Map Address. */
+		win_line = (gb->hram_io[IO_LCDC] & LCDC_WINDOW_MAP) ?
+				    VRAM_BMAP_2 : VRAM_BMAP_1;
+		win_line += (gb->display.window_clear >> 3) * 0x20;
 
-	case 0x1D: /* DEC E */
-		WGB_INSTR_DEC_R8(gb->cpu_reg.de.bytes.e);
-		opcode = (uint8_t)(oppair >> 8);
-		break;
+		disp_x = LCD_WIDTH - 1;
+		win_x = disp_x - gb->hram_io[IO_WX] + 7;
 
-	case 0x1E: /* LD E, imm */
-		gb->cpu_reg.de.bytes.e =  (uint8_t)(oppair >> 8);
-	  gb->cpu_reg.pc.reg++;
-	  opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-		break;
+		// look up tile
+		py = gb->display.window_clear & 0x07;
+		px = 7 - (win_x & 0x07);
+		idx = gb->vram[win_line + (win_x >> 3)];
+#if WALNUT_FULL_GBC_SUPPORT
+		uint8_t idxAtt = gb->vram[win_line + (win_x >> 3) + 0x2000];
+#endif
 
-	case 0x1F: /* RRA */
-	{
-		uint8_t temp = gb->cpu_reg.a;
-		gb->cpu_reg.a = gb->cpu_reg.a >> 1 | (gb->cpu_reg.f.f_bits.c << 7);
-		gb->cpu_reg.f.reg = 0;
-		gb->cpu_reg.f.f_bits.c = temp & 0x1;
-		opcode = (uint8_t)(oppair >> 8);
-		break;		
-	}
+		if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
+			tile = VRAM_TILES_1 + idx * 0x10;
+		else
+			tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
 
-	case 0x20: /* JR NZ, imm */
-		if(!gb->cpu_reg.f.f_bits.z)
+#if WALNUT_FULL_GBC_SUPPORT
+		if(cgbMode)
 		{
-			int8_t temp = (int8_t) (oppair >> 8);
-	    gb->cpu_reg.pc.reg++;
-			gb->cpu_reg.pc.reg += temp;
-			inst_cycles += 4;
+			if(idxAtt & 0x08) tile += 0x2000; //VRAM bank 2
+			if(idxAtt & 0x40) tile += 2 * (7 - py);
 		}
-		else
-			gb->cpu_reg.pc.reg++;
-		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-		break;
-
-	case 0x21: /* LD HL, imm */
-#if WALNUT_GB_16_BIT_OPS_DUALFETCH
-		gb->cpu_reg.hl.bytes.l =(uint8_t)(oppair >> 8);
-		gb->cpu_reg.pc.reg++;
-		oppair = __gb_read16(gb, gb->cpu_reg.pc.reg++);
-    gb->cpu_reg.hl.bytes.h = oppair;
-		opcode = oppair >> 8;
-#else
-    gb->cpu_reg.hl.bytes.l =(uint8_t)(oppair >> 8);
-	  gb->cpu_reg.pc.reg++;
-    gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-#endif
-		break;
-
-	case 0x22: /* LDI (HL), A */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.a);
-		gb->cpu_reg.hl.reg++;
-#if WALNUT_GB_SAFE_DUALFETCH_OPCODES
-		opcode = __gb_read(gb, gb->cpu_reg.pc.reg); // GTA SAFE TEST
-#else
-		opcode = (uint8_t)(oppair >> 8);
-#endif
-		break;
-
-	case 0x23: /* INC HL */
-		gb->cpu_reg.hl.reg++;
-		opcode = (uint8_t)(oppair >> 8);
-		break;
-
-	case 0x24: /* INC H */
-		WGB_INSTR_INC_R8(gb->cpu_reg.hl.bytes.h);
-		opcode = (uint8_t)(oppair >> 8);
-		break;
-
-	case 0x25: /* DEC H */
-		WGB_INSTR_DEC_R8(gb->cpu_reg.hl.bytes.h);
-		opcode = (uint8_t)(oppair >> 8);
-		break;
-
-	case 0x26: /* LD H, imm */
-		gb->cpu_reg.hl.bytes.h =(uint8_t)(oppair >> 8);
-	  gb->cpu_reg.pc.reg++;
-	  opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-		break;
-
-	case 0x27: /* DAA */
-	{
-		/* The following is from SameBoy. MIT License. */
-		int16_t a = gb->cpu_reg.a;
-
-		if(gb->cpu_reg.f.f_bits.n)
+		if(!(idxAtt & 0x40))
 		{
-			if(gb->cpu_reg.f.f_bits.h)
-				a = (a - 0x06) & 0xFF;
+			tile += 2 * py;
+		}
 
-			if(gb->cpu_reg.f.f_bits.c)
-				a -= 0x60;
+		// fetch first tile
+		if(cgbMode && (idxAtt & 0x20))
+		{  //Horizantal Flip
+			t1 = gb->vram[tile] << px;
+			t2 = gb->vram[tile + 1] << px;
 		}
 		else
 		{
-			if(gb->cpu_reg.f.f_bits.h || (a & 0x0F) > 9)
-				a += 0x06;
-
-			if(gb->cpu_reg.f.f_bits.c || a > 0x9F)
-				a += 0x60;
+			t1 = gb->vram[tile] >> px;
+			t2 = gb->vram[tile + 1] >> px;
 		}
+#else
+		tile += 2 * py;
 
-		if((a & 0x100) == 0x100)
-			gb->cpu_reg.f.f_bits.c = 1;
-
-		gb->cpu_reg.a = (uint8_t)a;
-		gb->cpu_reg.f.f_bits.z = (gb->cpu_reg.a == 0);
-		gb->cpu_reg.f.f_bits.h = 0;
-		opcode = (uint8_t)(oppair >> 8);
-		break;
-	}
+		// fetch first tile
+		t1 = gb->vram[tile] >> px;
+		t2 = gb->vram[tile + 1] >> px;
+#endif
+		// loop & copy window
+		end = (gb->hram_io[IO_WX] < 7 ? 0 : gb->hram_io[IO_WX] - 7) - 1;
 
-	case 0x28: /* JR Z, imm */
-		if(gb->cpu_reg.f.f_bits.z)
+		for(; disp_x != end; disp_x--)
 		{
-			int8_t temp = (int8_t) (oppair >> 8);
-	    gb->cpu_reg.pc.reg++;
-			gb->cpu_reg.pc.reg += temp;
-			inst_cycles += 4;
-		}
-		else
-			gb->cpu_reg.pc.reg++;
-		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-		break;
-
-	case 0x29: /* ADD HL, HL */
-	{
-		gb->cpu_reg.f.f_bits.c = (gb->cpu_reg.hl.reg & 0x8000) > 0;
-		gb->cpu_reg.hl.reg <<= 1;
-		gb->cpu_reg.f.f_bits.n = 0;
-		gb->cpu_reg.f.f_bits.h = (gb->cpu_reg.hl.reg & 0x1000) > 0;
-		opcode = (uint8_t)(oppair >> 8);
-		break;
-	}
+			uint8_t c;
 
-	case 0x2A: /* LD A, (HL+) */
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.hl.reg++);
-		opcode = (uint8_t)(oppair >> 8);
-		break;
+			if(px == 8)
+			{
+				// fetch next tile
+				px = 0;
+				win_x = disp_x - gb->hram_io[IO_WX] + 7;
+				idx = gb->vram[win_line + (win_x >> 3)];
+#if WALNUT_FULL_GBC_SUPPORT
+				idxAtt = gb->vram[win_line + (win_x >> 3) + 0x2000];
+#endif
 
-	case 0x2B: /* DEC HL */
-		gb->cpu_reg.hl.reg--;
-		opcode = (uint8_t)(oppair >> 8);
-		break;
+				if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
+					tile = VRAM_TILES_1 + idx * 0x10;
+				else
+					tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
 
-	case 0x2C: /* INC L */
+#if WALNUT_FULL_GBC_SUPPORT
+				if(cgbMode)
+				{
+					if(idxAtt & 0x08) tile += 0x2000; //VRAM bank 2
+					if(idxAtt & 0x40) tile += 2 * (7 - py);
+				}
+				if(!(idxAtt & 0x40))
+				{
+					tile += 2 * py;
+				}
+#else
+				tile += 2 * py;
+#endif
+				t1 = gb->vram[tile];
+				t2 = gb->vram[tile + 1];
+			}
+
+			// copy window
+#if WALNUT_FULL_GBC_SUPPORT
+			if(idxAtt & 0x20)
+			{  //Horizantal Flip
+				c = (((t1 & 0x80) >> 1) | (t2 & 0x80)) >> 6;
+				pixels[disp_x] = ((idxAtt & 0x07) << 2) + c;
+				pixelsPrio[disp_x] = (idxAtt >> 7);
+				t1 = t1 << 1;
+				t2 = t2 << 1;
+			}
+			else
+			{
+				c = (t1 & 0x1) | ((t2 & 0x1) << 1);
+				if(cgbMode)
+				{
+					pixels[disp_x] = ((idxAtt & 0x07) << 2) + c;
+					pixelsPrio[disp_x] = (idxAtt >> 7);
+				}
+				else
+				{
+					pixels[disp_x] = gb->display.bg_palette[c];
+#if WALNUT_GB_12_COLOUR
+					pixels[disp_x] |= LCD_PALETTE_BG;
+#endif
+				}
+				t1 = t1 >> 1;
+				t2 = t2 >> 1;
+			}
+#else
+			c = (t1 & 0x1) | ((t2 & 0x1) << 1);
+			pixels[disp_x] = gb->display.bg_palette[c];
+#if WALNUT_GB_12_COLOUR
+			pixels[disp_x] |= LCD_PALETTE_BG;
+#endif
+			t1 = t1 >> 1;
+			t2 = t2 >> 1;
+#endif
+			px++;
+		}
+#endif
+
+		gb->display.window_clear++; // advance window line
+	}
+
+	// draw sprites
+	if(gb->hram_io[IO_LCDC] & LCDC_OBJ_ENABLE)
+	{
+		uint8_t sprite_number;
+#if WALNUT_GB_SPRITE_BUCKETS
+		const uint8_t *sprites_to_render;
+		uint8_t number_of_sprites;
+
+		if(gb->sprite_buckets_dirty)
+			__gb_fill_sprite_buckets(gb, cgbMode);
+
+		sprites_to_render = gb->sprite_bucket[hram_io_ly];
+		number_of_sprites = gb->sprite_bucket_count[hram_io_ly];
+#elif WALNUT_GB_HIGH_LCD_ACCURACY
+		uint8_t number_of_sprites = 0;
+
+		struct sprite_data sprites_to_render[MAX_SPRITES_LINE + 1]; // Requires one extra slot for sorting 
+
+		/* Record number of sprites on the line being rendered, limited
+		 * to the maximum number sprites that the Game Boy is able to
+		 * render on each line (10 sprites). */
+		for(sprite_number = 0;
+				sprite_number < NUM_SPRITES;
+				sprite_number++)
+		{
+			/* Sprite Y position. */
+			uint8_t OY = gb->oam[4 * sprite_number + 0];
+			/* Sprite X position. */
+			uint8_t OX = gb->oam[4 * sprite_number + 1];
+
+			/* If sprite isn't on this line, continue. */
+			if(hram_io_ly +
+				(gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 0 : 8) >= OY
+					|| hram_io_ly + 16 < OY)
+				continue;
+
+#if WALNUT_FULL_GBC_SUPPORT
+			if (!cgbMode)
+			{
+#endif
+			struct sprite_data current;
+
+			current.sprite_number = sprite_number;
+			current.x = OX;
+
+			uint8_t place;
+			for (place = number_of_sprites; place != 0; place--)
+			{
+				if(compare_sprites(&sprites_to_render[place - 1], &current) < 0)
+					break;
+			}
+			if(place >= MAX_SPRITES_LINE)
+				continue;
+			for (uint8_t i = number_of_sprites; i > place; --i) {
+				sprites_to_render[i] = sprites_to_render[i - 1];
+			}
+			if(number_of_sprites < MAX_SPRITES_LINE)
+				number_of_sprites++;
+			sprites_to_render[place] = current;
+#if WALNUT_FULL_GBC_SUPPORT
+			}
+			else
+			{
+				// CGB does not care about the X coordinate of the sprite when it comes to render priority, only the OAM order.
+				// Skip the reordering and just fill sprites_to_render until it is full.
+				if (number_of_sprites >= MAX_SPRITES_LINE) continue;
+				sprites_to_render[number_of_sprites].sprite_number = sprite_number;
+				sprites_to_render[number_of_sprites].x = OX;
+				number_of_sprites++;
+			}
+#endif
+		}
+#endif
+
+		/* Render each sprite, from low priority to high priority. */
+#if WALNUT_GB_SPRITE_BUCKETS
+		for(sprite_number = number_of_sprites - 1;
+				sprite_number != 0xFF;
+				sprite_number--)
+		{
+			uint8_t s = sprites_to_render[sprite_number];
+#elif WALNUT_GB_HIGH_LCD_ACCURACY
+		/* Render the top ten prioritised sprites on this scanline. */
+		for(sprite_number = number_of_sprites - 1;
+				sprite_number != 0xFF;
+				sprite_number--)
+		{
+			uint8_t s = sprites_to_render[sprite_number].sprite_number;
+#else
+		for (sprite_number = NUM_SPRITES - 1;
+			sprite_number != 0xFF;
+			sprite_number--)
+		{
+			uint8_t s = sprite_number;
+#endif
+#if WALNUT_GB_TILE_CACHE
+			uint_fast16_t row;
+			uint8_t py, start, end, disp_x;
+			const uint8_t dir = 1;
+#else
+			uint8_t py, t1, t2, dir, start, end, shift, disp_x;
+#endif
+			/* Sprite Y position. */
+			uint8_t OY = gb->oam[4 * s + 0];
+			/* Sprite X position. */
+			uint8_t OX = gb->oam[4 * s + 1];
+			/* Sprite Tile/Pattern Number. */
+			uint8_t OT = gb->oam[4 * s + 2]
+				     & (gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 0xFE : 0xFF);
+			/* Additional attributes. */
+			uint8_t OF = gb->oam[4 * s + 3];
+
+#if !WALNUT_GB_HIGH_LCD_ACCURACY
+			/* If sprite isn't on this line, continue. */
+			if(hram_io_ly +
+					(gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 0 : 8) >= OY ||
+					hram_io_ly + 16 < OY)
+				continue;
+#endif
+
+			/* Continue if sprite not visible. */
+			if(OX == 0 || OX >= 168)
+				continue;
+
+			// y flip
+			py = hram_io_ly - OY + 16;
+
+			if(OF & OBJ_FLIP_Y)
+				py = (gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 15 : 7) - py;
+
+			// fetch the tile
+#if WALNUT_GB_TILE_CACHE
+			{
+				/* The second tile of 8x16 sprites follows the first. */
+				uint_fast16_t t = OT + (py >> 3);
+				const struct gb_tile_s *tile;
+
+# if WALNUT_FULL_GBC_SUPPORT
+				if(cgbMode && (OF & OBJ_BANK))
+					t += WGB_BANK_TILES;
+# endif
+				tile = __gb_tile(gb, t);
+				row = (OF & OBJ_FLIP_X) ?
+					tile->row_flip[py & 0x07] : tile->row[py & 0x07];
+			}
+
+			/* Drawn from left to right, flipped or not. */
+			start = (OX < 8 ? 0 : OX - 8);
+			end = MIN(OX, LCD_WIDTH);
+			row >>= 2 * (start + 8 - OX);
+#else
+#if WALNUT_FULL_GBC_SUPPORT
+			if(cgbMode)
+			{
+				t1 = gb->vram[((OF & OBJ_BANK) << 10) + VRAM_TILES_1 + OT * 0x10 + 2 * py];
+				t2 = gb->vram[((OF & OBJ_BANK) << 10) + VRAM_TILES_1 + OT * 0x10 + 2 * py + 1];
+			}
+			else
+#endif
+			{
+				t1 = gb->vram[VRAM_TILES_1 + OT * 0x10 + 2 * py];
+				t2 = gb->vram[VRAM_TILES_1 + OT * 0x10 + 2 * py + 1];
+			}
+
+			// handle x flip
+			if(OF & OBJ_FLIP_X)
+			{
+				dir = 1;
+				start = (OX < 8 ? 0 : OX - 8);
+				end = MIN(OX, LCD_WIDTH);
+				shift = 8 - OX + start;
+			}
+			else
+			{
+				dir = (uint8_t)-1;
+				start = MIN(OX, LCD_WIDTH) - 1;
+				end = (OX < 8 ? 0 : OX - 8) - 1;
+				shift = OX - (start + 1);
+			}
+
+			// copy tile
+			t1 >>= shift;
+			t2 >>= shift;
+#endif
+
+			/* TODO: Put for loop within the to if statements
+			 * because the BG priority bit will be the same for
+			 * all the pixels in the tile. */
+			for(disp_x = start; disp_x != end; disp_x += dir)
+			{
+#if WALNUT_GB_TILE_CACHE
+				uint8_t c = row & 0x3;
+#else
+				uint8_t c = (t1 & 0x1) | ((t2 & 0x1) << 1);
+#endif
+				// check transparency / sprite overlap / background overlap
+#if WALNUT_FULL_GBC_SUPPORT
+				if(cgbMode)
+				{
+					uint8_t isBackgroundDisabled = c && !(gb->hram_io[IO_LCDC] & LCDC_BG_ENABLE);
+					uint8_t isPixelPriorityNonConflicting = c &&
+															!(pixelsPrio[disp_x] && (pixels[disp_x] & 0x3)) &&
+															!((OF & OBJ_PRIORITY) && (pixels[disp_x] & 0x3));
+
+					if(isBackgroundDisabled || isPixelPriorityNonConflicting)
+					{
+						/* Set pixel colour. */
+						pixels[disp_x] = ((OF & OBJ_CGB_PALETTE) << 2) + c + 0x20;  // add 0x20 to differentiate from BG
+					}
+				}
+				else
+#endif
+				if(c && !(OF & OBJ_PRIORITY && !((pixels[disp_x] & 0x3) == gb->display.bg_palette[0])))
+				{
+					/* Set pixel colour. */
+					pixels[disp_x] = (OF & OBJ_PALETTE)
+						? gb->display.sp_palette[c + 4]
+						: gb->display.sp_palette[c];
+#if WALNUT_GB_12_COLOUR
+					/* Set pixel palette (OBJ0 or OBJ1). */
+					pixels[disp_x] |= (OF & OBJ_PALETTE);
+#endif
+#if WALNUT_FULL_GBC_SUPPORT
+					/* Deselect BG palette. */
+					pixels[disp_x] &= ~LCD_PALETTE_BG;
+#endif
+				}
+#if WALNUT_GB_TILE_CACHE
+				row >>= 2;
+#else
+				t1 = t1 >> 1;
+				t2 = t2 >> 1;
+#endif
+			}
+		}
+	}
+	
+	if(line_rgb565 != NULL)
+	{
+		/* Resolve the colours while the line is still in cache. */
+#if WALNUT_FULL_GBC_SUPPORT
+		const uint16_t *palette = cgbMode ?
+			gb->cgb.fixPalette : gb->display.dmg_rgb565;
+#else
+		const uint16_t *palette = gb->display.dmg_rgb565;
+#endif
+		uint_fast8_t x = 0;
+
+#if WALNUT_GB_LINE_SPANS
+		x = gb->display.span_x;
+#endif
+		for(; x < LCD_WIDTH; x++)
+			line_rgb565[x] = palette[pixels[x]];
+
+		return;
+	}
+
+#if WALNUT_GB_LINE_SPANS
+	/* The start of the line is left as it was drawn. */
+	memcpy(pixels, gb->display.line_pixels, gb->display.span_x);
+	memcpy(gb->display.line_pixels, pixels, sizeof(pixels));
+#endif
+	gb->display.lcd_draw_line(gb, pixels, gb->hram_io[IO_LY]);
+}
+
+#if WALNUT_FULL_GBC_SUPPORT
+static void __gb_draw_line_dmg(struct gb_s *gb)
+{
+	__gb_draw_line_mode(gb, 0);
+}
+
+static void __gb_draw_line_cgb(struct gb_s *gb)
+{
+	__gb_draw_line_mode(gb, 1);
+}
+
+/* Bound by gb_init() to the renderer for the cartridge's mode. */
+# define __gb_draw_line(gb)	(gb)->display.draw_line(gb)
+#else
+# define __gb_draw_line(gb)	__gb_draw_line_mode(gb, 0)
+#endif
+#endif
+
+#if WALNUT_GB_DEFERRED_LCD
+/**
+ * Internal function used to add a record to the line log: the header word,
+ * then the given number of words of data. Waits for the drawing thread while
+ * the log is full.
+ */
+static void __gb_log_record(struct gb_line_log_s *log, const uint32_t header,
+		const void *data, const uint_fast8_t words)
+{
+	const uint8_t *src = (const uint8_t *)data;
+	const uint32_t head = log->head;
+	const uint32_t end = head + 1 + words;
+	uint_fast8_t i;
+
+	/* The drawing thread is expected to run on another core. */
+	while(end - __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE) >
+			WGB_LINE_LOG_WORDS)
+		continue;
+
+	log->words[head % WGB_LINE_LOG_WORDS] = header;
+
+	for(i = 0; i < words; i++)
+		memcpy(&log->words[(head + 1 + i) % WGB_LINE_LOG_WORDS],
+				src + 4 * i, 4);
+
+	__atomic_store_n(&log->head, end, __ATOMIC_RELEASE);
+}
+
+/**
+ * Internal function used to record the current line in the line log instead
+ * of drawing it, after the VRAM, OAM and palettes changed since the previous
+ * logged line. header is WGB_LOG_LINE << 24, or WGB_LOG_SPAN << 24 with the
+ * first pixel to draw.
+ */
+static void __gb_log_line(struct gb_s *gb, const uint32_t header)
+{
+	struct gb_line_log_s *log = gb->line_log;
+	struct gb_logged_line_s line;
+	uint_fast16_t i;
+
+	for(i = 0; i < VRAM_SIZE / 512; i++)
+	{
+		uint32_t dirty = gb->log_vram_dirty[i];
+
+		if(dirty == 0)
+			continue;
+
+		gb->log_vram_dirty[i] = 0;
+
+		do
+		{
+			const uint_fast16_t offset =
+				(i * 32 + __builtin_ctz(dirty)) * 16;
+
+			__gb_log_record(log, (WGB_LOG_VRAM << 24) | offset,
+					&gb->vram[offset], 16 / 4);
+			dirty &= dirty - 1;
+		}
+		while(dirty != 0);
+	}
+
+	if(gb->log_oam_dirty)
+	{
+		gb->log_oam_dirty = false;
+		__gb_log_record(log, WGB_LOG_OAM << 24, gb->oam, OAM_SIZE / 4);
+	}
+
+#if WALNUT_FULL_GBC_SUPPORT
+	if(gb->log_palette_dirty)
+	{
+		gb->log_palette_dirty = false;
+		__gb_log_record(log, WGB_LOG_PALETTE << 24, gb->cgb.fixPalette,
+				sizeof(gb->cgb.fixPalette) / 4);
+	}
+#endif
+
+	line.ly = gb->hram_io[IO_LY];
+	line.lcdc = gb->hram_io[IO_LCDC];
+	line.scy = gb->hram_io[IO_SCY];
+	line.scx = gb->hram_io[IO_SCX];
+	line.wx = gb->hram_io[IO_WX];
+	line.wy = gb->display.WY;
+	line.bgp = gb->hram_io[IO_BGP];
+	line.flags = 0;
+	if(gb->direct.interlace)
+		line.flags |= WGB_LOGGED_INTERLACE;
+	if(gb->display.interlace_count)
+		line.flags |= WGB_LOGGED_INTERLACE_COUNT;
+	if(gb->direct.frame_skip)
+		line.flags |= WGB_LOGGED_FRAME_SKIP;
+	if(gb->display.frame_skip_count)
+		line.flags |= WGB_LOGGED_FRAME_SKIP_COUNT;
+	if(gb->log_window_reset)
+		line.flags |= WGB_LOGGED_WINDOW_RESET;
+	gb->log_window_reset = false;
+	memcpy(line.bg_palette, gb->display.bg_palette, sizeof(line.bg_palette));
+	memcpy(line.sp_palette, gb->display.sp_palette, sizeof(line.sp_palette));
+
+	__gb_log_record(log, header, &line, sizeof(line) / 4);
+}
+#endif
+
+#if WALNUT_GB_LINE_SPANS
+/**
+ * Internal function used before a write made in Mode 3 changes the registers
+ * of the current line. __gb_draw_span() only draws the line from the write
+ * on, over the start of the line as it was drawn. If that draw was skipped as
+ * unchanged, the start of the line was never drawn there, so the whole line
+ * is drawn first with the registers it would have been drawn with.
+ */
+static void __gb_draw_unchanged_line(struct gb_s *gb)
+{
+# if WALNUT_GB_DIRTY_LINES
+	const uint8_t window_clear = gb->display.window_clear;
+
+	if(!gb->display.line_unchanged)
+		return;
+
+	gb->display.line_unchanged = false;
+	gb->display.in_span = true;
+	gb->display.window_clear = gb->display.line_window_clear;
+	__gb_draw_line(gb);
+	gb->display.window_clear = window_clear;
+	gb->display.in_span = false;
+# else
+	(void)gb;
+# endif
+}
+
+/**
+ * Internal function used after a write made in Mode 3 to draw the current line
+ * again from pixel x, over what was drawn at the start of Mode 3, so that the
+ * line is made of spans drawn with the registers of their time. With the line
+ * log, the span is logged instead. Clears gb->display.in_span, which the
+ * caller sets.
+ */
+static void __gb_draw_span(struct gb_s *gb, const uint_fast8_t x)
+{
+	const uint8_t window_clear = gb->display.window_clear;
+
+	/* The LCD was switched off by the write. */
+	if(!(gb->hram_io[IO_LCDC] & LCDC_ENABLE))
+	{
+		gb->display.in_span = false;
+		return;
+	}
+
+# if WALNUT_GB_DEFERRED_LCD
+	if(gb->line_log != NULL)
+	{
+		__gb_log_line(gb, (WGB_LOG_SPAN << 24) | x);
+		gb->display.in_span = false;
+		return;
+	}
+# endif
+
+	/* The window line is the one the line was drawn with. */
+	gb->display.window_clear = gb->display.line_window_clear;
+	gb->display.span_x = x;
+	__gb_draw_line(gb);
+	gb->display.span_x = 0;
+	gb->display.window_clear = window_clear;
+	gb->display.in_span = false;
+}
+#endif
+
+/**
+ * Internal function used to move LY to the next line and compare it with LYC.
+ */
+static inline void __gb_next_ly(struct gb_s *gb)
+{
+	gb->hram_io[IO_LY] = gb->hram_io[IO_LY] + 1;
+	if (gb->hram_io[IO_LY] == LCD_VERT_LINES)
+		gb->hram_io[IO_LY] = 0;
+
+	/* LYC Update */
+	if(gb->hram_io[IO_LY] == gb->hram_io[IO_LYC])
+	{
+		gb->hram_io[IO_STAT] |= STAT_LYC_COINC;
+
+		if(gb->hram_io[IO_STAT] & STAT_LYC_INTR)
+			gb->hram_io[IO_IF] |= LCDC_INTR;
+	}
+	else
+		gb->hram_io[IO_STAT] &= 0xFB;
+}
+
+/**
+ * Internal function used to get the LCD cycles from the start of the current
+ * line of VBlank to the next line that is scheduled as an event: the LYC line
+ * if its interrupt is enabled, otherwise line 0. The lines in between only
+ * change LY and the LYC flag, so they are all passed by the next call to
+ * __gb_run_events(), such as when LY or STAT is read. Only for lines where
+ * __gb_vblank_lines() is true.
+ */
+static inline uint_fast32_t __gb_vblank_end(const struct gb_s *gb)
+{
+	const uint_fast8_t ly = gb->hram_io[IO_LY];
+	uint_fast8_t end = LCD_VERT_LINES;
+
+	if((gb->hram_io[IO_STAT] & STAT_LYC_INTR) &&
+			gb->hram_io[IO_LYC] > ly &&
+			gb->hram_io[IO_LYC] < LCD_VERT_LINES)
+		end = gb->hram_io[IO_LYC];
+
+	return (uint_fast32_t)(end - ly) * LCD_LINE_CYCLES;
+}
+
+/**
+ * Internal function used to apply pending cycles to the DIV, TIMA, serial, RTC
+ * and LCD counters. Called when the next event deadline is reached, or earlier
+ * through __gb_catch_up(). Afterwards, the number of cycles until the next
+ * counter can fire is stored in gb->counter.next_event.
+ */
+void __gb_run_events(struct gb_s *gb)
+{
+	static const uint_fast16_t TAC_CYCLES[4] = {1024, 16, 64, 256};
+	uint_fast32_t inst_cycles = gb->counter.pending_cycles;
+	uint_fast32_t next;
+
+#if WALNUT_GB_IDLE_SKIP
+	/* Calls from __gb_catch_up() before the deadline change no state
+	 * that an idle loop can observe, other than DIV. */
+	if(inst_cycles >= gb->counter.next_event)
+		gb->counter.events_run++;
+#endif
+	gb->counter.pending_cycles = 0;
+
+	/* If halted, loop until an interrupt occurs. */
+	do
+	{
+		/* DIV register timing */
+		gb->counter.div_count += inst_cycles;
+		while(gb->counter.div_count >= DIV_CYCLES)
+		{
+			gb->hram_io[IO_DIV]++;
+			gb->counter.div_count -= DIV_CYCLES;
+		}
+
+		/* Check for RTC tick. */
+		if(gb->mbc == 3 && (gb->rtc_real.reg.high & 0x40) == 0)
+		{
+			gb->counter.rtc_count += inst_cycles;
+			while(WGB_UNLIKELY(gb->counter.rtc_count >= RTC_CYCLES))
+			{
+				gb->counter.rtc_count -= RTC_CYCLES;
+
+				/* Detect invalid rollover. */
+				if(WGB_UNLIKELY(gb->rtc_real.reg.sec == 63))
+				{
+					gb->rtc_real.reg.sec = 0;
+					continue;
+				}
+
+				if(++gb->rtc_real.reg.sec != 60)
+					continue;
+
+				gb->rtc_real.reg.sec = 0;
+				if(gb->rtc_real.reg.min == 63)
+				{
+					gb->rtc_real.reg.min = 0;
+					continue;
+				}
+				if(++gb->rtc_real.reg.min != 60)
+					continue;
+
+				gb->rtc_real.reg.min = 0;
+				if(gb->rtc_real.reg.hour == 31)
+				{
+					gb->rtc_real.reg.hour = 0;
+					continue;
+				}
+				if(++gb->rtc_real.reg.hour != 24)
+					continue;
+
+				gb->rtc_real.reg.hour = 0;
+				if(++gb->rtc_real.reg.yday != 0)
+					continue;
+
+				if(gb->rtc_real.reg.high & 1)  /* Bit 8 of days*/
+					gb->rtc_real.reg.high |= 0x80; /* Overflow bit */
+
+				gb->rtc_real.reg.high ^= 1;
+			}
+		}
+
+		/* Check serial transmission. */
+		if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
+		{
+			unsigned int serial_cycles = SERIAL_CYCLES_1KB;
+
+			/* If new transfer, call TX function. */
+			if(gb->counter.serial_count == 0 &&
+				gb->gb_serial_tx != NULL)
+				(gb->gb_serial_tx)(gb, gb->hram_io[IO_SB]);
+
+#if WALNUT_FULL_GBC_SUPPORT
+			if(gb->hram_io[IO_SC] & 0x3)
+				serial_cycles = SERIAL_CYCLES_32KB;
+#endif
+
+			gb->counter.serial_count += inst_cycles;
+
+			/* If it's time to receive byte, call RX function. */
+			if(gb->counter.serial_count >= serial_cycles)
+			{
+				/* If RX can be done, do it. */
+				/* If RX failed, do not change SB if using external
+				 * clock, or set to 0xFF if using internal clock. */
+				uint8_t rx;
+
+				if(gb->gb_serial_rx != NULL &&
+					(gb->gb_serial_rx(gb, &rx) ==
+						GB_SERIAL_RX_SUCCESS))
+				{
+					gb->hram_io[IO_SB] = rx;
+
+					/* Inform game of serial TX/RX completion. */
+					gb->hram_io[IO_SC] &= 0x01;
+					gb->hram_io[IO_IF] |= SERIAL_INTR;
+				}
+				else if(gb->hram_io[IO_SC] & SERIAL_SC_CLOCK_SRC)
+				{
+					/* If using internal clock, and console is not
+					 * attached to any external peripheral, shifted
+					 * bits are replaced with logic 1. */
+					gb->hram_io[IO_SB] = 0xFF;
+
+					/* Inform game of serial TX/RX completion. */
+					gb->hram_io[IO_SC] &= 0x01;
+					gb->hram_io[IO_IF] |= SERIAL_INTR;
+				}
+				else
+				{
+					/* If using external clock, and console is not
+					 * attached to any external peripheral, bits are
+					 * not shifted, so SB is not modified. */
+				}
+
+				gb->counter.serial_count = 0;
+			}
+		}
+
+		/* TIMA register timing */
+		/* TODO: Change tac_enable to struct of TAC timer control bits. */
+		if(gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK)
+		{
+			gb->counter.tima_count += inst_cycles;
+
+			while(gb->counter.tima_count >=
+				TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK])
+			{
+				gb->counter.tima_count -=
+					TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK];
+
+				if(++gb->hram_io[IO_TIMA] == 0)
+				{
+					gb->hram_io[IO_IF] |= TIMER_INTR;
+					/* On overflow, set TMA to TIMA. */
+					gb->hram_io[IO_TIMA] = gb->hram_io[IO_TMA];
+				}
+			}
+		}
+
+		/* If LCD is off, don't update LCD state or increase the LCD
+		 * ticks. Instead, keep track of the amount of time that is
+		 * being passed. */
+		if(!(gb->hram_io[IO_LCDC] & LCDC_ENABLE))
+		{
+			gb->counter.lcd_off_count += inst_cycles;
+			if(gb->counter.lcd_off_count >= LCD_FRAME_CYCLES)
+			{
+				gb->counter.lcd_off_count -= LCD_FRAME_CYCLES;
+				gb->gb_frame = true;
+#if WALNUT_GB_DEFERRED_LCD
+				if(gb->line_log != NULL)
+					__gb_log_record(gb->line_log,
+						WGB_LOG_FRAME << 24, NULL, 0);
+#endif
+			}
+			continue;
+		}
+
+		/* LCD Timing */
+#if WALNUT_FULL_GBC_SUPPORT
+        if (inst_cycles > 1) {
+            gb->counter.lcd_count += (inst_cycles >> gb->cgb.doubleSpeed);
+        } else {
+#endif
+		gb->counter.lcd_count += inst_cycles;
+#if WALNUT_FULL_GBC_SUPPORT
+	}
+#endif
+
+		/* Lines of VBlank before the last, which may be several at once,
+		 * see __gb_vblank_end(). */
+		while(gb->counter.lcd_count >= LCD_LINE_CYCLES &&
+				gb->hram_io[IO_LY] >= LCD_HEIGHT &&
+				gb->hram_io[IO_LY] < LCD_VERT_LINES - 1)
+		{
+			gb->counter.lcd_count -= LCD_LINE_CYCLES;
+			__gb_next_ly(gb);
+		}
+
+		/* New Scanline. HBlank -> VBlank or OAM Scan */
+		if(gb->counter.lcd_count >= LCD_LINE_CYCLES)
+		{
+			gb->counter.lcd_count -= LCD_LINE_CYCLES;
+
+			/* Next line */
+			__gb_next_ly(gb);
+
+			/* Check if LCD should be in Mode 1 (VBLANK) state */
+			if(gb->hram_io[IO_LY] == LCD_HEIGHT)
+			{
+				gb->hram_io[IO_STAT] =
+					(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_VBLANK;
+				gb->gb_frame = true;
+				gb->hram_io[IO_IF] |= VBLANK_INTR;
+				gb->lcd_blank = false;
+#if WALNUT_GB_DEFERRED_LCD
+				if(gb->line_log != NULL)
+					__gb_log_record(gb->line_log,
+						WGB_LOG_FRAME << 24, NULL, 0);
+#endif
+
+				if(gb->hram_io[IO_STAT] & STAT_MODE_1_INTR)
+					gb->hram_io[IO_IF] |= LCDC_INTR;
+
+#if ENABLE_LCD
+				/* If frame skip is activated, check if we need to draw
+				 * the frame or skip it. */
+				if(gb->direct.frame_skip)
+				{
+					gb->display.frame_skip_count =
+						!gb->display.frame_skip_count;
+				}
+
+				/* If interlaced is activated, change which lines get
+				 * updated. Also, only update lines on frames that are
+				 * actually drawn when frame skip is enabled. */
+				if(gb->direct.interlace &&
+						(!gb->direct.frame_skip ||
+						 gb->display.frame_skip_count))
+				{
+					gb->display.interlace_count =
+						!gb->display.interlace_count;
+				}
+#endif
+                                /* If halted forever, then return on VBLANK. */
+                                if(gb->gb_halt && !gb->hram_io[IO_IE])
+					break;
+			}
+			/* Start of normal Line (not in VBLANK) */
+			else if(gb->hram_io[IO_LY] < LCD_HEIGHT)
+			{
+				if(gb->hram_io[IO_LY] == 0)
+				{
+					/* Clear Screen */
+					gb->display.WY = gb->hram_io[IO_WY];
+					gb->display.window_clear = 0;
+#if WALNUT_GB_DEFERRED_LCD
+					gb->log_window_reset = true;
+#endif
+				}
+
+				/* OAM Search occurs at the start of the line. */
+				gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_OAM_SCAN;
+				gb->counter.lcd_count = 0;
+
+#if WALNUT_FULL_GBC_SUPPORT
+				//DMA GBC
+				if(gb->cgb.cgbMode && !gb->cgb.dmaActive && gb->cgb.dmaMode)
+				{
+#if WALNUT_GB_32BIT_DMA
+					// Optimized 16-bit path
+					for (uint8_t i = 0; i < 0x10; i += 4)
+					{
+							uint32_t val = __gb_read32(gb, (gb->cgb.dmaSource & 0xFFF0) + i);
+							__gb_write32(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i, val);
+							// 8-bit logic if there is some cause to fall back
+							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i, val);
+							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i + 1, val >> 8);
+							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i + 2, val >> 16);
+							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i + 3, val >> 24);
+					}
+#elif WALNUT_GB_16BIT_DMA
+					// Optimized 16-bit path
+					for (uint8_t i = 0; i < 0x10; i += 2)
+					{
+							uint16_t val = __gb_read16(gb, (gb->cgb.dmaSource & 0xFFF0) + i);
+							__gb_write16(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i, val);
+							// 8-bit logic if there is some cause to fall back
+							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i, val & 0xFF);
+							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i + 1, val >> 8);
+					}
+#else
+			    // Original 8-bit path
+					for (uint8_t i = 0; i < 0x10; i++)
+					{
+						__gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i,
+										__gb_read(gb, (gb->cgb.dmaSource & 0xFFF0) + i));
+					}
+#endif
+
+					gb->cgb.dmaSource += 0x10;
+					gb->cgb.dmaDest += 0x10;
+					if(!(--gb->cgb.dmaSize)) {gb->cgb.dmaActive = 1;
+					}
+#if WALNUT_GB_SAFE_DUALFETCH_DMA
+					gb->prefetch_invalid=true;
+#endif
+				}
+#endif
+				if(gb->hram_io[IO_STAT] & STAT_MODE_2_INTR)
+					gb->hram_io[IO_IF] |= LCDC_INTR;
+
+				/* If halted immediately jump to next LCD mode.
+				 * From OAM Search to LCD Draw. */
+				//if(gb->counter.lcd_count < LCD_MODE2_OAM_SCAN_END)
+				//	inst_cycles = LCD_MODE2_OAM_SCAN_END - gb->counter.lcd_count;
+				inst_cycles = LCD_MODE2_OAM_SCAN_DURATION;
+			}
+		}
+		/* Go from Mode 3 (LCD Draw) to Mode 0 (HBLANK). */
+		else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_LCD_DRAW &&
+				gb->counter.lcd_count >= LCD_MODE3_LCD_DRAW_END)
+		{
+			gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_HBLANK;
+
+			if(gb->hram_io[IO_STAT] & STAT_MODE_0_INTR)
+				gb->hram_io[IO_IF] |= LCDC_INTR;
+
+			/* If halted immediately, jump from OAM Scan to LCD Draw. */
+			if (gb->counter.lcd_count < LCD_MODE0_HBLANK_MAX_DRUATION)
+				inst_cycles = LCD_MODE0_HBLANK_MAX_DRUATION - gb->counter.lcd_count;
+		}
+		/* Go from Mode 2 (OAM Scan) to Mode 3 (LCD Draw). */
+		else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_OAM_SCAN &&
+				gb->counter.lcd_count >= LCD_MODE2_OAM_SCAN_END)
+		{
+			gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_LCD_DRAW;
+#if WALNUT_GB_DEFERRED_LCD
+			if(!gb->lcd_blank && gb->line_log != NULL)
+				__gb_log_line(gb, WGB_LOG_LINE << 24);
+			else if(!gb->lcd_blank)
+				__gb_draw_line(gb);
+#elif ENABLE_LCD
+			if(!gb->lcd_blank)
+				__gb_draw_line(gb);
+#endif
+			/* If halted immediately jump to next LCD mode. */
+			if (gb->counter.lcd_count < LCD_MODE3_LCD_DRAW_MIN_DURATION)
+				inst_cycles = LCD_MODE3_LCD_DRAW_MIN_DURATION - gb->counter.lcd_count;
+		}
+	} while(gb->gb_halt && (gb->hram_io[IO_IF] & gb->hram_io[IO_IE]) == 0);
+
+	/* DIV has no side effects, so it is not scheduled and is only brought
+	 * up to date when read. */
+	next = LCD_FRAME_CYCLES;
+
+	if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
+	{
+		uint_fast32_t serial_cycles = SERIAL_CYCLES_1KB;
+
+#if WALNUT_FULL_GBC_SUPPORT
+		if(gb->hram_io[IO_SC] & 0x3)
+			serial_cycles = SERIAL_CYCLES_32KB;
+#endif
+		/* A new transfer calls gb_serial_tx after the next instruction. */
+		if(gb->counter.serial_count == 0 ||
+				gb->counter.serial_count >= serial_cycles)
+			next = 0;
+		else if(serial_cycles - gb->counter.serial_count < next)
+			next = serial_cycles - gb->counter.serial_count;
+	}
+
+	if(gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK)
+	{
+		const uint_fast32_t tac_cycles =
+			TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK];
+		/* Cycles until TIMA overflows. */
+		const uint_fast32_t tima_cycles =
+			(0x100 - gb->hram_io[IO_TIMA]) * tac_cycles;
+
+		if(gb->counter.tima_count >= tima_cycles)
+			next = 0;
+		else if(tima_cycles - gb->counter.tima_count < next)
+			next = tima_cycles - gb->counter.tima_count;
+	}
+
+	if(gb->mbc == 3)
+	{
+		if(gb->counter.rtc_count >= RTC_CYCLES)
+			next = 0;
+		else if(RTC_CYCLES - gb->counter.rtc_count < next)
+			next = RTC_CYCLES - gb->counter.rtc_count;
+	}
+
+	if(!(gb->hram_io[IO_LCDC] & LCDC_ENABLE))
+	{
+		if(gb->counter.lcd_off_count >= LCD_FRAME_CYCLES)
+			next = 0;
+		else if(LCD_FRAME_CYCLES - gb->counter.lcd_off_count < next)
+			next = LCD_FRAME_CYCLES - gb->counter.lcd_off_count;
+	}
+	else
+	{
+		uint_fast32_t lcd_end = LCD_LINE_CYCLES;
+		uint_fast32_t lcd_cycles = 0;
+
+		if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_OAM_SCAN)
+			lcd_end = LCD_MODE2_OAM_SCAN_END;
+		else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_LCD_DRAW)
+			lcd_end = LCD_MODE3_LCD_DRAW_END;
+		/* After gb_reset() STAT is in mode 1 with LY at 0; those
+		 * lines are passed one at a time. */
+		else if(__gb_vblank_lines(gb))
+			lcd_end = __gb_vblank_end(gb);
+
+		if(gb->counter.lcd_count < lcd_end)
+			lcd_cycles = lcd_end - gb->counter.lcd_count;
+#if WALNUT_FULL_GBC_SUPPORT
+		/* The LCD runs at half the CPU rate in double speed mode. */
+		lcd_cycles <<= gb->cgb.doubleSpeed;
+#endif
+		if(lcd_cycles < next)
+			next = lcd_cycles;
+	}
+
+	gb->counter.next_event = next;
+	__gb_update_irq(gb);
+}
+
+#if WALNUT_GB_IDLE_SKIP
+/**
+ * Internal function used to check whether the code at pc is a short loop that
+ * only reads LY, STAT, IF, DIV, WRAM or HRAM, only changes A and F, and ends
+ * with a branch back to pc. Forward branches out of the loop are allowed.
+ * Returns the cycles of one iteration, or 0 if this is not an idle loop.
+ */
+static uint_fast16_t __gb_idle_scan(struct gb_s *gb, const uint_fast16_t pc,
+	uint16_t *end, bool *reads_div)
+{
+	uint_fast16_t addr = pc;
+	uint_fast16_t cycles = 0;
+	uint_fast8_t i;
+
+	*reads_div = false;
+
+	for(i = 0; i < 8; i++)
+	{
+		const uint8_t opcode = __gb_read(gb, addr);
+		uint_fast16_t src;
+		uint_fast16_t target;
+
+		switch(opcode)
+		{
+		case 0x00: /* NOP */
+		case 0x07: /* RLCA */
+		case 0x0F: /* RRCA */
+		case 0x17: /* RLA */
+		case 0x1F: /* RRA */
+		case 0x2F: /* CPL */
+		case 0x37: /* SCF */
+		case 0x3C: /* INC A */
+		case 0x3D: /* DEC A */
+		case 0x3F: /* CCF */
+			cycles += 4;
+			addr++;
+			continue;
+
+		case 0xC6: /* ADD A, imm */
+		case 0xCE: /* ADC A, imm */
+		case 0xD6: /* SUB imm */
+		case 0xDE: /* SBC A, imm */
+		case 0xE6: /* AND imm */
+		case 0xEE: /* XOR imm */
+		case 0xF6: /* OR imm */
+		case 0xFE: /* CP imm */
+			cycles += 8;
+			addr += 2;
+			continue;
+
+		case 0x0A: /* LD A, (BC) */
+			src = gb->cpu_reg.bc.reg;
+			cycles += 8;
+			addr++;
+			break;
+
+		case 0x1A: /* LD A, (DE) */
+			src = gb->cpu_reg.de.reg;
+			cycles += 8;
+			addr++;
+			break;
+
+		case 0xF0: /* LDH A, (imm) */
+			src = IO_ADDR | __gb_read(gb, addr + 1);
+			cycles += 12;
+			addr += 2;
+			break;
+
+		case 0xFA: /* LD A, (imm) */
+			src = __gb_read(gb, addr + 1) | (__gb_read(gb, addr + 2) << 8);
+			cycles += 16;
+			addr += 3;
+			break;
+
+		case 0xCB:
+		{
+			const uint8_t cbop = __gb_read(gb, addr + 1);
+
+			/* BIT only. */
+			if((cbop & 0xC0) != 0x40)
+				return 0;
+
+			addr += 2;
+
+			if((cbop & 0x07) != 0x06)
+			{
+				cycles += 8;
+				continue;
+			}
+
+			src = gb->cpu_reg.hl.reg;
+			cycles += 12;
+			break;
+		}
+
+		case 0x18: /* JR imm */
+		case 0x20: /* JR NZ, imm */
+		case 0x28: /* JR Z, imm */
+		case 0x30: /* JR NC, imm */
+		case 0x38: /* JR C, imm */
+			target = (addr + 2 + (int8_t)__gb_read(gb, addr + 1)) & 0xFFFF;
+			addr += 2;
+
+			if(target == pc)
+			{
+				*end = addr;
+				return cycles + 12;
+			}
+
+			/* Only a conditional branch out of the loop. */
+			if(opcode == 0x18 || target < addr)
+				return 0;
+
+			cycles += 8;
+			continue;
+
+		case 0xC3: /* JP imm */
+		case 0xC2: /* JP NZ, imm */
+		case 0xCA: /* JP Z, imm */
+		case 0xD2: /* JP NC, imm */
+		case 0xDA: /* JP C, imm */
+			target = __gb_read(gb, addr + 1) | (__gb_read(gb, addr + 2) << 8);
+			addr += 3;
+
+			if(target == pc)
+			{
+				*end = addr;
+				return cycles + 16;
+			}
+
+			if(opcode == 0xC3 || target < addr)
+				return 0;
+
+			cycles += 12;
+			continue;
+
+		default:
+			/* LD A, r and ALU A, r. */
+			if(opcode < 0x78 || opcode > 0xBF)
+				return 0;
+
+			addr++;
+
+			if((opcode & 0x07) != 0x06)
+			{
+				cycles += 4;
+				continue;
+			}
+
+			src = gb->cpu_reg.hl.reg;
+			cycles += 8;
+			break;
+		}
+
+		/* Memory operands. These only change when an event is run, as
+		 * interrupts and DMA happen then. */
+		if(src == (IO_ADDR | IO_DIV))
+			*reads_div = true;
+		else if(src != (IO_ADDR | IO_LY) && src != (IO_ADDR | IO_STAT) &&
+			src != (IO_ADDR | IO_IF) &&
+			!(src >= WRAM_0_ADDR && src < ECHO_ADDR) &&
+			!(src >= HRAM_ADDR && src < INTR_EN_ADDR))
+			return 0;
+	}
+
+	return 0;
+}
+
+/**
+ * Internal function used to fast-forward idle loops.
+ * The first time the loop head is reached the CPU registers are stored. If an
+ * iteration later returns to the head with the same registers and no event
+ * was run in between, every following iteration is identical until the next
+ * event. Whole iterations up to that event are then skipped by adding their
+ * cycles to the pending cycles.
+ */
+static void __gb_idle_check(struct gb_s *gb)
+{
+	struct gb_idle_s *idle = &gb->idle;
+	const uint_fast16_t pc = gb->cpu_reg.pc.reg;
+	uint16_t bank;
+	uint16_t clock;
+
+	if(!gb->direct.idle_skip || pc >= VRAM_ADDR ||
+		(gb->hram_io[IO_BOOT] == 0 && pc < 0x0900))
+		return;
+
+	bank = (pc < ROM_N_ADDR) ? 0 : __gb_rom_bank(gb);
+
+	if(pc != idle->pc || bank != idle->bank)
+	{
+		/* Dual fetch steps may start within the loop. */
+		if(idle->cycles != 0 && bank == idle->bank &&
+			pc > idle->pc && pc < idle->end)
+			return;
+
+		idle->pc = pc;
+		idle->bank = bank;
+		idle->armed = false;
+		idle->cycles = __gb_idle_scan(gb, pc, &idle->end,
+			&idle->reads_div);
+	}
+
+	if(idle->cycles == 0)
+		return;
+
+	/* Cycle count since DIV was last reset, modulo 0x10000. */
+	clock = (uint16_t)(gb->hram_io[IO_DIV] * DIV_CYCLES +
+		gb->counter.div_count + gb->counter.pending_cycles);
+
+	if(idle->armed && idle->events_run == gb->counter.events_run &&
+		idle->div == gb->hram_io[IO_DIV] &&
+		memcmp(&idle->regs, &gb->cpu_reg, sizeof(idle->regs)) == 0)
+	{
+		/* May be more than one iteration with dual fetch. */
+		const uint_fast32_t loop = (uint16_t)(clock - idle->clock);
+		const uint_fast32_t pending = gb->counter.pending_cycles;
+		uint_fast32_t next_event = gb->counter.next_event;
+
+		/* LY and STAT change at each line of VBlank without an
+		 * event. */
+		if((gb->hram_io[IO_LCDC] & LCDC_ENABLE) &&
+			(gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_VBLANK)
+		{
+			uint_fast32_t line_end =
+				LCD_LINE_CYCLES - gb->counter.lcd_count;
+#if WALNUT_FULL_GBC_SUPPORT
+			line_end <<= gb->cgb.doubleSpeed;
+#endif
+			if(line_end < next_event)
+				next_event = line_end;
+		}
+
+		if(loop != 0 && loop % idle->cycles == 0 &&
+			loop <= 4 * idle->cycles &&
+			pending + loop < next_event)
+		{
+			uint_fast32_t n = (next_event - pending - 1) / loop;
+
+			/* DIV must not change within the skipped iterations. */
+			if(idle->reads_div)
+			{
+				const uint_fast32_t div = gb->counter.div_count + pending;
+				const uint_fast32_t div_n = (div < DIV_CYCLES) ?
+					(DIV_CYCLES - 1 - div) / loop : 0;
+
+				if(div_n < n)
+					n = div_n;
+			}
+
+			if(n != 0)
+			{
+				gb->counter.pending_cycles += n * loop;
+				gb->idle_stats.skips++;
+				gb->idle_stats.cycles += n * loop;
+				clock += n * loop;
+			}
+		}
+	}
+
+	idle->armed = true;
+	idle->div = gb->hram_io[IO_DIV];
+	idle->clock = clock;
+	idle->events_run = gb->counter.events_run;
+	memcpy(&idle->regs, &gb->cpu_reg, sizeof(idle->regs));
+}
+#endif
+
+#if WALNUT_GB_COPY_LOOPS
+/**
+ * Internal function used to run the remaining iterations of a copy or fill
+ * loop at the PC in bulk. The recognised loops are, where N is B, C or BC:
+ *
+ *	LD A, (HL+) / LD (DE), A / INC DE / DEC N / JR NZ
+ *	LD A, (DE) / LD (HL+), A / INC DE / DEC N / JR NZ
+ *	[XOR A | LD A, imm | LD A, D | LD A, E] / LD (HL+ or HL-), A / DEC N / JR NZ
+ *
+ * where DEC BC is followed by LD A, B / OR C or LD A, C / OR B, and JP NZ may
+ * be used instead of JR NZ. A fill with BC must reload A.
+ * Only whole iterations that end before the next event are run, and both the
+ * source and destination must stay within one mapped page outside cartridge
+ * RAM. Otherwise the loop is left to the interpreter, which returns here on the
+ * next iteration.
+ * Returns true if any iterations were run.
+ */
+static bool __gb_copy_loop(struct gb_s *gb)
+{
+	const uint_fast16_t pc = gb->cpu_reg.pc.reg;
+	uint_fast16_t addr = pc;
+	uint_fast16_t cycles = 0;
+	uint8_t fill_op = 0;
+	uint8_t fill = 0;
+	uint8_t src_op = 0;
+	uint8_t dst_op;
+	uint8_t count_op;
+	uint8_t or_op = 0;
+	uint8_t opcode;
+	uint_fast32_t n;
+	uint_fast16_t src = 0;
+	uint_fast16_t dst;
+	uint_fast32_t i;
+	const uint8_t *src_page = NULL;
+	uint8_t *dst_page;
+	bool done;
+
+	/* Fill value. */
+	opcode = __gb_read(gb, addr);
+	switch(opcode)
+	{
+	case 0xAF: /* XOR A */
+	case 0x7A: /* LD A, D */
+	case 0x7B: /* LD A, E */
+		fill_op = opcode;
+		cycles += 4;
+		addr++;
+		opcode = __gb_read(gb, addr);
+		break;
+
+	case 0x3E: /* LD A, imm */
+		fill_op = opcode;
+		fill = __gb_read(gb, addr + 1);
+		cycles += 8;
+		addr += 2;
+		opcode = __gb_read(gb, addr);
+		break;
+	}
+
+	/* Transfer. */
+	switch(opcode)
+	{
+	case 0x2A: /* LD A, (HL+) / LD (DE), A / INC DE */
+		if(__gb_read(gb, addr + 1) != 0x12 ||
+			__gb_read(gb, addr + 2) != 0x13)
+			return false;
+
+		src_op = opcode;
+		dst_op = 0x12;
+		cycles += 24;
+		addr += 3;
+		break;
+
+	case 0x1A: /* LD A, (DE) / LD (HL+), A / INC DE */
+		if(__gb_read(gb, addr + 1) != 0x22 ||
+			__gb_read(gb, addr + 2) != 0x13)
+			return false;
+
+		src_op = opcode;
+		dst_op = 0x22;
+		cycles += 24;
+		addr += 3;
+		break;
+
+	case 0x22: /* LD (HL+), A */
+	case 0x32: /* LD (HL-), A */
+		dst_op = opcode;
+		cycles += 8;
+		addr++;
+		break;
+
+	default:
+		return false;
+	}
+
+	if(fill_op != 0 && src_op != 0)
+		return false;
+
+	/* Counter. */
+	count_op = __gb_read(gb, addr);
+	switch(count_op)
+	{
+	case 0x05: /* DEC B */
+		n = gb->cpu_reg.bc.bytes.b;
+		cycles += 4;
+		addr++;
+		break;
+
+	case 0x0D: /* DEC C */
+		n = gb->cpu_reg.bc.bytes.c;
+		cycles += 4;
+		addr++;
+		break;
+
+	case 0x0B: /* DEC BC / LD A, B / OR C */
+		if(__gb_read(gb, addr + 1) == 0x78 &&
+			__gb_read(gb, addr + 2) == 0xB1)
+			or_op = 0xB1;
+		else if(__gb_read(gb, addr + 1) == 0x79 &&
+			__gb_read(gb, addr + 2) == 0xB0)
+			or_op = 0xB0;
+		else
+			return false;
+
+		if(src_op == 0 && fill_op == 0)
+			return false;
+
+		n = gb->cpu_reg.bc.reg;
+		cycles += 16;
+		addr += 3;
+		break;
+
+	default:
+		return false;
+	}
+
+	if(n == 0)
+		n = (count_op == 0x0B) ? 0x10000 : 0x100;
+
+	/* Branch back, taken cycles. */
+	opcode = __gb_read(gb, addr);
+	if(opcode == 0x20 &&
+		((addr + 2 + (int8_t)__gb_read(gb, addr + 1)) & 0xFFFF) == pc)
+	{
+		cycles += 12;
+		addr += 2;
+	}
+	else if(opcode == 0xC2 && (uint_fast16_t)(__gb_read(gb, addr + 1) |
+		(__gb_read(gb, addr + 2) << 8)) == pc)
+	{
+		cycles += 16;
+		addr += 3;
+	}
+	else
+		return false;
+
+	/* Whole iterations that end before the next event. */
+	if(gb->counter.pending_cycles + cycles >= gb->counter.next_event)
+		return false;
+
+	i = (gb->counter.next_event - gb->counter.pending_cycles - 1) / cycles;
+	if(i < n)
+		n = i;
+
+	/* Source and destination must stay within their current page. */
+	if(src_op != 0)
+	{
+		src = (src_op == 0x2A) ? gb->cpu_reg.hl.reg : gb->cpu_reg.de.reg;
+		src_page = gb->read_page[src >> 8];
+
+		/* Cartridge RAM is left to the interpreter, like unmapped pages. */
+		if(src_page == NULL ||
+			(src >= CART_RAM_ADDR && src < WRAM_0_ADDR))
+			return false;
+
+		if(n > 0x100 - (src & 0xFF))
+			n = 0x100 - (src & 0xFF);
+	}
+
+	dst = (dst_op == 0x12) ? gb->cpu_reg.de.reg : gb->cpu_reg.hl.reg;
+	dst_page = gb->write_page[dst >> 8];
+#if WGB_VRAM_HOOK
+	/* Tile data is only mapped for reads, see __gb_map_vram(). */
+	if(dst >= VRAM_ADDR && dst < VRAM_ADDR + WGB_VRAM_HOOK_END)
+		dst_page = (uint8_t *)gb->read_page[dst >> 8];
+#endif
+
+	/* The loop must not overwrite itself. */
+	if(dst_page == NULL || (dst >> 8) == (pc >> 8) ||
+		(dst >> 8) == ((addr - 1) >> 8) ||
+		(dst >= CART_RAM_ADDR && dst < WRAM_0_ADDR))
+		return false;
+
+	if(dst_op == 0x32)
+	{
+		if(n > (dst & 0xFF) + 1u)
+			n = (dst & 0xFF) + 1;
+	}
+	else if(n > 0x100 - (dst & 0xFF))
+		n = 0x100 - (dst & 0xFF);
+
+	/* Fill value is read once, it can't change within the loop. */
+	if(fill_op == 0xAF)
+		fill = 0;
+	else if(fill_op == 0x7A)
+		fill = gb->cpu_reg.de.bytes.d;
+	else if(fill_op == 0x7B)
+		fill = gb->cpu_reg.de.bytes.e;
+	else if(fill_op == 0)
+		fill = gb->cpu_reg.a;
+
+	dst_page += dst & 0xFF;
+
+	if(src_op != 0)
+	{
+		src_page += src & 0xFF;
+		for(i = 0; i < n; i++)
+			dst_page[i] = src_page[i];
+
+		fill = dst_page[n - 1];
+	}
+	else if(dst_op == 0x32)
+	{
+		for(i = 0; i < n; i++)
+			*(dst_page - i) = fill;
+	}
+	else
+		memset(dst_page, fill, n);
+
+#if WGB_VRAM_HOOK
+	if(dst >= VRAM_ADDR && dst < VRAM_ADDR + WGB_VRAM_HOOK_END)
+	{
+		uint_fast16_t first = dst_page - gb->vram;
+		uint_fast16_t last = first + n - 1;
+
+		if(dst_op == 0x32)
+		{
+			last = first;
+			first = first - (n - 1);
+		}
+
+		for(first &= ~(uint_fast16_t)0xF; first <= last; first += 0x10)
+			__gb_vram_written(gb, first);
+	}
+#endif
+
+	/* Registers and flags as left by the last iteration. */
+	if(dst_op == 0x32)
+		gb->cpu_reg.hl.reg -= n;
+	else if(dst_op == 0x22 || src_op == 0x2A)
+		gb->cpu_reg.hl.reg += n;
+
+	if(dst_op == 0x12 || src_op == 0x1A)
+		gb->cpu_reg.de.reg += n;
+
+	if(fill_op == 0xAF)
+	{
+		WGB_INSTR_XOR_R8(gb->cpu_reg.a);
+	}
+
+	gb->cpu_reg.a = fill;
+
+	switch(count_op)
+	{
+	case 0x05:
+		gb->cpu_reg.bc.bytes.b -= n - 1;
+		WGB_INSTR_DEC_R8(gb->cpu_reg.bc.bytes.b);
+		done = (gb->cpu_reg.bc.bytes.b == 0);
+		break;
+
+	case 0x0D:
+		gb->cpu_reg.bc.bytes.c -= n - 1;
+		WGB_INSTR_DEC_R8(gb->cpu_reg.bc.bytes.c);
+		done = (gb->cpu_reg.bc.bytes.c == 0);
+		break;
+
+	default:
+		gb->cpu_reg.bc.reg -= n;
+		if(or_op == 0xB1)
+		{
+			gb->cpu_reg.a = gb->cpu_reg.bc.bytes.b;
+			WGB_INSTR_OR_R8(gb->cpu_reg.bc.bytes.c);
+		}
+		else
+		{
+			gb->cpu_reg.a = gb->cpu_reg.bc.bytes.c;
+			WGB_INSTR_OR_R8(gb->cpu_reg.bc.bytes.b);
+		}
+		done = (gb->cpu_reg.bc.reg == 0);
+		break;
+	}
+
+	/* The final branch is not taken when the count reaches zero. */
+	gb->cpu_reg.pc.reg = done ? addr : pc;
+	gb->counter.pending_cycles += n * cycles - (done ? 4 : 0);
+	return true;
+}
+#endif
+
+#if WALNUT_GB_IDLE_SKIP || WALNUT_GB_COPY_LOOPS
+/**
+ * Internal function used to look for loops that can be run faster than
+ * stepping them. Called at the start of a step when the PC moved backwards.
+ */
+static void __gb_loop_check(struct gb_s *gb)
+{
+#if WALNUT_GB_COPY_LOOPS
+	if(__gb_copy_loop(gb))
+		return;
+#endif
+#if WALNUT_GB_IDLE_SKIP
+	__gb_idle_check(gb);
+#endif
+}
+#endif
+
+/**
+ * Internal function used to step the CPU twice (dual fetch/16-bit).
+ */
+static inline void __gb_step_cpu(struct gb_s *gb)
+{
+	uint16_t oppair;
+	uint8_t opcode;
+	uint_fast16_t inst_cycles;
+	static const uint8_t op_cycles[0x100] =
+	{
+		/* *INDENT-OFF* */
+		/*0 1 2  3  4  5  6  7  8  9  A  B  C  D  E  F	*/
+		4,12, 8, 8, 4, 4, 8, 4,20, 8, 8, 8, 4, 4, 8, 4,	/* 0x00 */
+		4,12, 8, 8, 4, 4, 8, 4,12, 8, 8, 8, 4, 4, 8, 4,	/* 0x10 */
+		8,12, 8, 8, 4, 4, 8, 4, 8, 8, 8, 8, 4, 4, 8, 4,	/* 0x20 */
+		8,12, 8, 8,12,12,12, 4, 8, 8, 8, 8, 4, 4, 8, 4,	/* 0x30 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x40 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x50 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x60 */
+		8, 8, 8, 8, 8, 8, 4, 8, 4, 4, 4, 4, 4, 4, 8, 4, /* 0x70 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x80 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x90 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0xA0 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0xB0 */
+		8,12,12,16,12,16, 8,16, 8,16,12, 8,12,24, 8,16,	/* 0xC0 */
+		8,12,12, 0,12,16, 8,16, 8,16,12, 0,12, 0, 8,16,	/* 0xD0 */
+		12,12,8, 0, 0,16, 8,16,16, 4,16, 0, 0, 0, 8,16,	/* 0xE0 */
+		12,12,8, 4, 0,16, 8,16,12, 8,16, 4, 0, 0, 8,16	/* 0xF0 */
+		/* *INDENT-ON* */
+	};
+	static const uint_fast16_t TAC_CYCLES[4] = {1024, 16, 64, 256};
+
+	/* Handle interrupts */
+	/* If gb_halt is positive, then an interrupt must have occurred by the
+	 * time we reach here, because on HALT, we jump to the next interrupt
+	 * immediately. */
+	if(WGB_UNLIKELY(gb->irq_pending))
+		__gb_interrupt(gb);
+
+#if WALNUT_GB_IDLE_SKIP || WALNUT_GB_COPY_LOOPS
+	/* Loops are only looked for when the PC moves backwards. */
+	if(WGB_UNLIKELY(gb->cpu_reg.pc.reg <= gb->loop_prev_pc))
+		__gb_loop_check(gb);
+
+	gb->loop_prev_pc = gb->cpu_reg.pc.reg;
+#endif
+
+	/* Obtain opcode */
+	
+	oppair = __gb_read16(gb, gb->cpu_reg.pc.reg++);
+	opcode = (uint8_t)oppair; // auto-truncate
+#if (WALNUT_GB_SAFE_DUALFETCH_DMA || WALNUT_GB_SAFE_DUALFETCH_MBC)
+  gb->prefetch_invalid=false;
+#endif
+	inst_cycles = op_cycles[opcode];
+
+	/* Execute opcode */
+	switch(opcode)
+	{
+	case 0x00: /* NOP */
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+
+	case 0x01: /* LD BC, imm */
+#if WALNUT_GB_16_BIT_OPS_DUALFETCH
+    gb->cpu_reg.bc.bytes.c = (uint8_t)(oppair >> 8); // C was already partially loaded in oppair
+    oppair = __gb_read16(gb, gb->cpu_reg.pc.reg + 1); // Read 16-bit immediate starting from PC+1    
+    gb->cpu_reg.bc.bytes.b = (uint8_t)(oppair);// Store lower byte of immediate into B
+    gb->cpu_reg.pc.reg += 2;// Increment PC by 2 to skip over the 16-bit immediate
+    // Prefetch next opcode from upper byte of read16
+    opcode = (uint8_t)(oppair >> 8);
+#else
+    // Original 8-bit fetch path
+    gb->cpu_reg.bc.bytes.c = (uint8_t)(oppair >> 8);
+    gb->cpu_reg.pc.reg++;
+    gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.pc.reg++);
+    opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+#endif
+		break;
+	case 0x02: /* LD (BC), A */
+		__gb_write(gb, gb->cpu_reg.bc.reg, gb->cpu_reg.a);	  
+#if WALNUT_GB_SAFE_DUALFETCH_OPCODES
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg); // GTA SAFE TEST
+#else
+		opcode = (uint8_t)(oppair >> 8);
+#endif
+		break;
+
+	case 0x03: /* INC BC */
+		gb->cpu_reg.bc.reg++;
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+
+	case 0x04: /* INC B */
+		WGB_INSTR_INC_R8(gb->cpu_reg.bc.bytes.b);
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+
+	case 0x05: /* DEC B */
+		WGB_INSTR_DEC_R8(gb->cpu_reg.bc.bytes.b);
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+
+	case 0x06: /* LD B, imm */
+		gb->cpu_reg.bc.bytes.b = (uint8_t)(oppair >> 8);
+	  gb->cpu_reg.pc.reg++;
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+		break;
+	case 0x07: /* RLCA */
+		gb->cpu_reg.a = (gb->cpu_reg.a << 1) | (gb->cpu_reg.a >> 7);
+		gb->cpu_reg.f.reg = 0;
+		gb->cpu_reg.f.f_bits.c = (gb->cpu_reg.a & 0x01);
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+	case 0x08: /* LD (imm), SP */
+	{		
+#if WALNUT_GB_16_BIT_OPS_DUALFETCH
+		uint8_t l = (uint8_t)(oppair >> 8);
+		gb->cpu_reg.pc.reg++;
+    oppair = __gb_read16(gb, gb->cpu_reg.pc.reg++);
+		uint8_t h = oppair;
+		uint16_t temp = WALNUT_GB_U8_TO_U16(h, l);
+		__gb_write16(gb,temp,gb->cpu_reg.sp.reg);
+    // gb->cpu_reg.pc.reg+=2;
+		opcode = oppair >> 8;
+#else
+    uint8_t l = (uint8_t)(oppair >> 8);
+	  gb->cpu_reg.pc.reg++;
+    uint8_t h = __gb_read(gb, gb->cpu_reg.pc.reg++);
+    uint16_t temp = WALNUT_GB_U8_TO_U16(h, l);
+    __gb_write(gb, temp++, gb->cpu_reg.sp.bytes.p);
+    __gb_write(gb, temp, gb->cpu_reg.sp.bytes.s);
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+#endif
+    break;
+	}
+
+	case 0x09: /* ADD HL, BC */
+	{
+		uint_fast32_t temp = gb->cpu_reg.hl.reg + gb->cpu_reg.bc.reg;
+		gb->cpu_reg.f.f_bits.n = 0;
+		gb->cpu_reg.f.f_bits.h =
+			(temp ^ gb->cpu_reg.hl.reg ^ gb->cpu_reg.bc.reg) & 0x1000 ? 1 : 0;
+		gb->cpu_reg.f.f_bits.c = (temp & 0xFFFF0000) ? 1 : 0;
+		gb->cpu_reg.hl.reg = (temp & 0x0000FFFF);
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+	}
+
+	case 0x0A: /* LD A, (BC) */
+		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.bc.reg);
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+
+	case 0x0B: /* DEC BC */
+		gb->cpu_reg.bc.reg--;
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+
+	case 0x0C: /* INC C */
+		WGB_INSTR_INC_R8(gb->cpu_reg.bc.bytes.c);
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+
+	case 0x0D: /* DEC C */
+		WGB_INSTR_DEC_R8(gb->cpu_reg.bc.bytes.c);
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+
+	case 0x0E: /* LD C, imm */
+		gb->cpu_reg.bc.bytes.c = (uint8_t)(oppair >> 8);
+		gb->cpu_reg.pc.reg++;
+	  opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+		break;
+
+	case 0x0F: /* RRCA */
+		gb->cpu_reg.f.reg = 0;
+		gb->cpu_reg.f.f_bits.c = gb->cpu_reg.a & 0x01;
+		gb->cpu_reg.a = (gb->cpu_reg.a >> 1) | (gb->cpu_reg.a << 7);
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+	case 0x10: /* STOP */
+		//gb->gb_halt = true;
+#if WALNUT_FULL_GBC_SUPPORT
+		if(gb->cgb.cgbMode & gb->cgb.doubleSpeedPrep)
+		{
+			/* LCD timing rate changes with the CPU speed. */
+			__gb_catch_up(gb);
+			gb->cgb.doubleSpeedPrep = 0;
+			gb->cgb.doubleSpeed ^= 1;
+			gb->counter.next_event = 0;
+		}
+#endif
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+
+	case 0x11: /* LD DE, imm */
+#if WALNUT_GB_16_BIT_OPS_DUALFETCH
+    gb->cpu_reg.de.bytes.e = (uint8_t)(oppair >> 8);
+	  gb->cpu_reg.pc.reg++;
+		oppair = __gb_read16(gb, gb->cpu_reg.pc.reg++);
+    gb->cpu_reg.de.bytes.d = oppair;
+		opcode = oppair >> 8;
+#else
+    gb->cpu_reg.de.bytes.e = (uint8_t)(oppair >> 8);
+	  gb->cpu_reg.pc.reg++;
+    gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+#endif
+		break;
+	case 0x12: /* LD (DE), A */
+		__gb_write(gb, gb->cpu_reg.de.reg, gb->cpu_reg.a);
+#if WALNUT_GB_SAFE_DUALFETCH_OPCODES
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg); // GTA SAFE TEST
+#else
+		opcode = (uint8_t)(oppair >> 8);
+#endif
+		break;
+
+	case 0x13: /* INC DE */
+		gb->cpu_reg.de.reg++;
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+
+	case 0x14: /* INC D */
+		WGB_INSTR_INC_R8(gb->cpu_reg.de.bytes.d);
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+
+	case 0x15: /* DEC D */
+		WGB_INSTR_DEC_R8(gb->cpu_reg.de.bytes.d);
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+
+	case 0x16: /* LD D, imm */
+		gb->cpu_reg.de.bytes.d = (uint8_t)(oppair >> 8);
+	  gb->cpu_reg.pc.reg++;
+	  opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+		break;
+
+	case 0x17: /* RLA */
+	{
+		uint8_t temp = gb->cpu_reg.a;
+		gb->cpu_reg.a = (gb->cpu_reg.a << 1) | gb->cpu_reg.f.f_bits.c;
+		gb->cpu_reg.f.reg = 0;
+		gb->cpu_reg.f.f_bits.c = (temp >> 7) & 0x01;
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+	}
+
+	case 0x18: /* JR imm */
+	{
+		int8_t temp = (int8_t) (uint8_t)(oppair >> 8);
+	  gb->cpu_reg.pc.reg++;
+		gb->cpu_reg.pc.reg += temp;
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+		break;
+	}
+	case 0x19: /* ADD HL, DE */
+	{
+		uint_fast32_t temp = gb->cpu_reg.hl.reg + gb->cpu_reg.de.reg;
+		gb->cpu_reg.f.f_bits.n = 0;
+		gb->cpu_reg.f.f_bits.h =
+			(temp ^ gb->cpu_reg.hl.reg ^ gb->cpu_reg.de.reg) & 0x1000 ? 1 : 0;
+		gb->cpu_reg.f.f_bits.c = (temp & 0xFFFF0000) ? 1 : 0;
+		gb->cpu_reg.hl.reg = (temp & 0x0000FFFF);
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+	}
+	case 0x1A: /* LD A, (DE) */
+		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.de.reg);
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+
+	case 0x1B: /* DEC DE */
+		gb->cpu_reg.de.reg--;
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+
+	case 0x1C: /* INC E */
+		WGB_INSTR_INC_R8(gb->cpu_reg.de.bytes.e);
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+
+	case 0x1D: /* DEC E */
+		WGB_INSTR_DEC_R8(gb->cpu_reg.de.bytes.e);
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+
+	case 0x1E: /* LD E, imm */
+		gb->cpu_reg.de.bytes.e =  (uint8_t)(oppair >> 8);
+	  gb->cpu_reg.pc.reg++;
+	  opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+		break;
+
+	case 0x1F: /* RRA */
+	{
+		uint8_t temp = gb->cpu_reg.a;
+		gb->cpu_reg.a = gb->cpu_reg.a >> 1 | (gb->cpu_reg.f.f_bits.c << 7);
+		gb->cpu_reg.f.reg = 0;
+		gb->cpu_reg.f.f_bits.c = temp & 0x1;
+		opcode = (uint8_t)(oppair >> 8);
+		break;		
+	}
+
+	case 0x20: /* JR NZ, imm */
+		if(!gb->cpu_reg.f.f_bits.z)
+		{
+			int8_t temp = (int8_t) (oppair >> 8);
+	    gb->cpu_reg.pc.reg++;
+			gb->cpu_reg.pc.reg += temp;
+			inst_cycles += 4;
+		}
+		else
+			gb->cpu_reg.pc.reg++;
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+		break;
+
+	case 0x21: /* LD HL, imm */
+#if WALNUT_GB_16_BIT_OPS_DUALFETCH
+		gb->cpu_reg.hl.bytes.l =(uint8_t)(oppair >> 8);
+		gb->cpu_reg.pc.reg++;
+		oppair = __gb_read16(gb, gb->cpu_reg.pc.reg++);
+    gb->cpu_reg.hl.bytes.h = oppair;
+		opcode = oppair >> 8;
+#else
+    gb->cpu_reg.hl.bytes.l =(uint8_t)(oppair >> 8);
+	  gb->cpu_reg.pc.reg++;
+    gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+#endif
+		break;
+
+	case 0x22: /* LDI (HL), A */
+		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.a);
+		gb->cpu_reg.hl.reg++;
+#if WALNUT_GB_SAFE_DUALFETCH_OPCODES
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg); // GTA SAFE TEST
+#else
+		opcode = (uint8_t)(oppair >> 8);
+#endif
+		break;
+
+	case 0x23: /* INC HL */
+		gb->cpu_reg.hl.reg++;
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+
+	case 0x24: /* INC H */
+		WGB_INSTR_INC_R8(gb->cpu_reg.hl.bytes.h);
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+
+	case 0x25: /* DEC H */
+		WGB_INSTR_DEC_R8(gb->cpu_reg.hl.bytes.h);
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+
+	case 0x26: /* LD H, imm */
+		gb->cpu_reg.hl.bytes.h =(uint8_t)(oppair >> 8);
+	  gb->cpu_reg.pc.reg++;
+	  opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+		break;
+
+	case 0x27: /* DAA */
+	{
+		/* The following is from SameBoy. MIT License. */
+		int16_t a = gb->cpu_reg.a;
+
+		if(gb->cpu_reg.f.f_bits.n)
+		{
+			if(gb->cpu_reg.f.f_bits.h)
+				a = (a - 0x06) & 0xFF;
+
+			if(gb->cpu_reg.f.f_bits.c)
+				a -= 0x60;
+		}
+		else
+		{
+			if(gb->cpu_reg.f.f_bits.h || (a & 0x0F) > 9)
+				a += 0x06;
+
+			if(gb->cpu_reg.f.f_bits.c || a > 0x9F)
+				a += 0x60;
+		}
+
+		if((a & 0x100) == 0x100)
+			gb->cpu_reg.f.f_bits.c = 1;
+
+		gb->cpu_reg.a = (uint8_t)a;
+		gb->cpu_reg.f.f_bits.z = (gb->cpu_reg.a == 0);
+		gb->cpu_reg.f.f_bits.h = 0;
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+	}
+
+	case 0x28: /* JR Z, imm */
+		if(gb->cpu_reg.f.f_bits.z)
+		{
+			int8_t temp = (int8_t) (oppair >> 8);
+	    gb->cpu_reg.pc.reg++;
+			gb->cpu_reg.pc.reg += temp;
+			inst_cycles += 4;
+		}
+		else
+			gb->cpu_reg.pc.reg++;
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+		break;
+
+	case 0x29: /* ADD HL, HL */
+	{
+		gb->cpu_reg.f.f_bits.c = (gb->cpu_reg.hl.reg & 0x8000) > 0;
+		gb->cpu_reg.hl.reg <<= 1;
+		gb->cpu_reg.f.f_bits.n = 0;
+		gb->cpu_reg.f.f_bits.h = (gb->cpu_reg.hl.reg & 0x1000) > 0;
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+	}
+
+	case 0x2A: /* LD A, (HL+) */
+		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.hl.reg++);
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+
+	case 0x2B: /* DEC HL */
+		gb->cpu_reg.hl.reg--;
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+
+	case 0x2C: /* INC L */
 		WGB_INSTR_INC_R8(gb->cpu_reg.hl.bytes.l);
 		opcode = (uint8_t)(oppair >> 8);
 		break;
@@ -4082,7 +7027,10 @@ static inline void __gb_step_cpu(struct gb_s *gb)
 		int_fast16_t halt_cycles = INT_FAST16_MAX;
 
 		/* TODO: Emulate HALT bug? */
+		__gb_catch_up(gb);
 		gb->gb_halt = true;
+		gb->irq_pending = true;
+		gb->counter.next_event = 0;
 
 		if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
 		{
@@ -4858,6 +7806,7 @@ static inline void __gb_step_cpu(struct gb_s *gb)
     gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
 #endif
 		gb->gb_ime = true;
+		__gb_update_irq(gb);
 		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
 	}
 	break;
@@ -4879,580 +7828,273 @@ static inline void __gb_step_cpu(struct gb_s *gb)
 
 	case 0xDC: /* CALL C, imm */
 		if(gb->cpu_reg.f.f_bits.c)
-		{
-        uint8_t c = (uint8_t)(oppair >> 8);
-				gb->cpu_reg.pc.reg++;
-        uint8_t p = __gb_read(gb, gb->cpu_reg.pc.reg++);
-#if WALNUT_GB_16_BIT_OPS_DUALFETCH_DISABLED
-				gb->cpu_reg.sp.reg-=2;
-				__gb_write16(gb, gb->cpu_reg.sp.reg, gb->cpu_reg.pc.reg);
-#else
-        __gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-        __gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-#endif
-        gb->cpu_reg.pc.bytes.c = c;
-        gb->cpu_reg.pc.bytes.p = p;
-				inst_cycles += 12;
-		}
-		else
-			gb->cpu_reg.pc.reg += 2;
-		opcode = __gb_read(gb, gb->cpu_reg.pc.reg); 
-		break;
-
-	case 0xDE: /* SBC A, imm */
-	{
-		uint8_t val = (uint8_t)(oppair >> 8);
-		gb->cpu_reg.pc.reg++;
-		WGB_INSTR_SBC_R8(val, gb->cpu_reg.f.f_bits.c);
-		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-		break;
-	}
-	case 0xDF: /* RST 0x0018 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0018;
-		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-		break;
-
-	case 0xE0: /* LD (0xFF00+imm), A */
-		__gb_write(gb, 0xFF00 | (uint8_t)(oppair >> 8),
-			   gb->cpu_reg.a);
-		gb->cpu_reg.pc.reg++;
-	  opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-		break;
-
-	case 0xE1: /* POP HL */
-#if WALNUT_GB_16_BIT_OPS_DUALFETCH_DISABLED_DISABLED 
-    gb->cpu_reg.hl.reg = __gb_read16(gb, gb->cpu_reg.sp.reg);
-    gb->cpu_reg.sp.reg += 2; // advance SP past the popped value
-#else
-    gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.sp.reg++);
-    gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.sp.reg++);
-#endif
-		opcode = (uint8_t)(oppair >> 8);
-		break;
-
-	case 0xE2: /* LD (C), A */
-		__gb_write(gb, 0xFF00 | gb->cpu_reg.bc.bytes.c, gb->cpu_reg.a);
-#if WALNUT_GB_SAFE_DUALFETCH_OPCODES_DISABLED
-		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-#else
-		opcode = (uint8_t)(oppair >> 8);
-#endif
-		break;
-
-	case 0xE5: /* PUSH HL */
-#if WALNUT_GB_16_BIT_OPS_DUALFETCH_DISABLED
-		gb->cpu_reg.sp.reg-=2;
-		__gb_write16(gb, gb->cpu_reg.sp.reg, gb->cpu_reg.hl.reg);
-#else
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.hl.bytes.h);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.hl.bytes.l);
-#endif
-		opcode = (uint8_t)(oppair >> 8);
-		break;
-
-	case 0xE6: /* AND imm */
-	{
-		uint8_t temp = (uint8_t)(oppair >> 8);
-		gb->cpu_reg.pc.reg++;
-		WGB_INSTR_AND_R8(temp);
-		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-		break;
-	}
-
-	case 0xE7: /* RST 0x0020 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0020;
-		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-		break;
-
-	case 0xE8: /* ADD SP, imm */
-	{
-		int8_t offset = (int8_t)(oppair >> 8);
-		gb->cpu_reg.pc.reg++;
-		gb->cpu_reg.f.reg = 0;
-		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
-		gb->cpu_reg.f.f_bits.c = ((gb->cpu_reg.sp.reg & 0xFF) + (offset & 0xFF) > 0xFF);
-		gb->cpu_reg.sp.reg += offset;
-		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-		break;
-	}
-
-	case 0xE9: /* JP (HL) */
-		gb->cpu_reg.pc.reg = gb->cpu_reg.hl.reg;
-		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-		break;
-
-	case 0xEA: /* LD (imm), A */
-	{
-#if WALNUT_GB_16_BIT_OPS_DUALFETCH_DISABLED
-    uint8_t l = (uint8_t)(oppair >> 8);
-		gb->cpu_reg.pc.reg++;
-		oppair = __gb_read16(gb, gb->cpu_reg.pc.reg++);
-    uint8_t h = oppair; // autotruncate
-    uint16_t addr = WALNUT_GB_U8_TO_U16(h, l);
-		__gb_write(gb, addr, gb->cpu_reg.a);
-		opcode = oppair >> 8;	
-#else
-    uint8_t l = (uint8_t)(oppair >> 8);
-		gb->cpu_reg.pc.reg++;
-    uint8_t h = __gb_read(gb, gb->cpu_reg.pc.reg++);
-    uint16_t addr = WALNUT_GB_U8_TO_U16(h, l);
-		__gb_write(gb, addr, gb->cpu_reg.a);
-		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);		
-#endif
-		break;
-	}
-
-	case 0xEE: /* XOR imm */
-		WGB_INSTR_XOR_R8((uint8_t)(oppair >> 8));
-		gb->cpu_reg.pc.reg++;
-		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-		break;
-
-	case 0xEF: /* RST 0x0028 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0028;
-		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-		break;
-
-	case 0xF0: /* LD A, (0xFF00+imm) */
-		gb->cpu_reg.a =
-			__gb_read(gb, 0xFF00 | (uint8_t)(oppair >> 8));
-			gb->cpu_reg.pc.reg++;
-			opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-		break;
-
-	case 0xF1: /* POP AF */
-	{
-		uint8_t temp_8 = __gb_read(gb, gb->cpu_reg.sp.reg++);
-		gb->cpu_reg.f.f_bits.z = (temp_8 >> 7) & 1;
-		gb->cpu_reg.f.f_bits.n = (temp_8 >> 6) & 1;
-		gb->cpu_reg.f.f_bits.h = (temp_8 >> 5) & 1;
-		gb->cpu_reg.f.f_bits.c = (temp_8 >> 4) & 1;
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.sp.reg++);
-		opcode = (uint8_t)(oppair >> 8);
-		break;
-	}
-
-	case 0xF2: /* LD A, (C) */
-		gb->cpu_reg.a = __gb_read(gb, 0xFF00 | gb->cpu_reg.bc.bytes.c);
-#if WALNUT_GB_SAFE_DUALFETCH_OPCODES
-		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-#else
-	opcode = (uint8_t)(oppair >> 8);
-#endif
-		break;
-
-	case 0xF3: /* DI */
-		gb->gb_ime = false;
-		opcode = (uint8_t)(oppair >> 8);
-		break;
-
-	case 0xF5: /* PUSH AF */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.a);
-		__gb_write(gb, --gb->cpu_reg.sp.reg,
-			   gb->cpu_reg.f.f_bits.z << 7 | gb->cpu_reg.f.f_bits.n << 6 |
-			   gb->cpu_reg.f.f_bits.h << 5 | gb->cpu_reg.f.f_bits.c << 4);
-		opcode = (uint8_t)(oppair >> 8);
+		{
+        uint8_t c = (uint8_t)(oppair >> 8);
+				gb->cpu_reg.pc.reg++;
+        uint8_t p = __gb_read(gb, gb->cpu_reg.pc.reg++);
+#if WALNUT_GB_16_BIT_OPS_DUALFETCH_DISABLED
+				gb->cpu_reg.sp.reg-=2;
+				__gb_write16(gb, gb->cpu_reg.sp.reg, gb->cpu_reg.pc.reg);
+#else
+        __gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+        __gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+#endif
+        gb->cpu_reg.pc.bytes.c = c;
+        gb->cpu_reg.pc.bytes.p = p;
+				inst_cycles += 12;
+		}
+		else
+			gb->cpu_reg.pc.reg += 2;
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg); 
 		break;
 
-	case 0xF6: /* OR imm */
-		WGB_INSTR_OR_R8((uint8_t)(oppair >> 8));
+	case 0xDE: /* SBC A, imm */
+	{
+		uint8_t val = (uint8_t)(oppair >> 8);
 		gb->cpu_reg.pc.reg++;
+		WGB_INSTR_SBC_R8(val, gb->cpu_reg.f.f_bits.c);
 		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
 		break;
-
-	case 0xF7: /* PUSH AF */
+	}
+	case 0xDF: /* RST 0x0018 */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0030;
+		gb->cpu_reg.pc.reg = 0x0018;
 		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
 		break;
 
-	case 0xF8: /* LD HL, SP+/-imm */
-	{
-		/* Taken from SameBoy, which is released under MIT Licence. */
-		int8_t offset = (int8_t) (oppair >> 8);
+	case 0xE0: /* LD (0xFF00+imm), A */
+		__gb_write(gb, 0xFF00 | (uint8_t)(oppair >> 8),
+			   gb->cpu_reg.a);
 		gb->cpu_reg.pc.reg++;
-		gb->cpu_reg.hl.reg = gb->cpu_reg.sp.reg + offset;
-		gb->cpu_reg.f.reg = 0;
-		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
-		gb->cpu_reg.f.f_bits.c = ((gb->cpu_reg.sp.reg & 0xFF) + (offset & 0xFF) > 0xFF) ? 1 : 0;
-		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+	  opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
 		break;
-	}
 
-	case 0xF9: /* LD SP, HL */
-		gb->cpu_reg.sp.reg = gb->cpu_reg.hl.reg;
+	case 0xE1: /* POP HL */
+#if WALNUT_GB_16_BIT_OPS_DUALFETCH_DISABLED_DISABLED 
+    gb->cpu_reg.hl.reg = __gb_read16(gb, gb->cpu_reg.sp.reg);
+    gb->cpu_reg.sp.reg += 2; // advance SP past the popped value
+#else
+    gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.sp.reg++);
+    gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.sp.reg++);
+#endif
 		opcode = (uint8_t)(oppair >> 8);
 		break;
 
-	case 0xFA: /* LD A, (imm) */
-	{
-#if WALNUT_GB_16_BIT_OPS_DUALFETCH_DISABLED
-    uint8_t l = (uint8_t)(oppair >> 8); // we dont increment pc because a interrupt might change it an invalidate this byte, we increment if no interrupt between 1st and 2nd opcode handlers
-		gb->cpu_reg.pc.reg++;
-		oppair = __gb_read16(gb, gb->cpu_reg.pc.reg++);
-    uint8_t h = oppair; // auto-truncate
-    uint16_t addr = WALNUT_GB_U8_TO_U16(h, l);
-		gb->cpu_reg.a = __gb_read(gb, addr);
-		opcode = oppair >> 8;
-#else
-    uint8_t l = (uint8_t)(oppair >> 8); // we dont increment pc because a interrupt might change it an invalidate this byte, we increment if no interrupt between 1st and 2nd opcode handlers
-		gb->cpu_reg.pc.reg++;
-    uint8_t h = __gb_read(gb, gb->cpu_reg.pc.reg++);
-    uint16_t addr = WALNUT_GB_U8_TO_U16(h, l);
-		gb->cpu_reg.a = __gb_read(gb, addr);
+	case 0xE2: /* LD (C), A */
+		__gb_write(gb, 0xFF00 | gb->cpu_reg.bc.bytes.c, gb->cpu_reg.a);
+#if WALNUT_GB_SAFE_DUALFETCH_OPCODES_DISABLED
 		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+#else
+		opcode = (uint8_t)(oppair >> 8);
 #endif
 		break;
-	}
 
-	case 0xFB: /* EI */
-		gb->gb_ime = true;
+	case 0xE5: /* PUSH HL */
+#if WALNUT_GB_16_BIT_OPS_DUALFETCH_DISABLED
+		gb->cpu_reg.sp.reg-=2;
+		__gb_write16(gb, gb->cpu_reg.sp.reg, gb->cpu_reg.hl.reg);
+#else
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.hl.bytes.h);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.hl.bytes.l);
+#endif
 		opcode = (uint8_t)(oppair >> 8);
 		break;
 
-	case 0xFE: /* CP imm */
+	case 0xE6: /* AND imm */
 	{
-		uint8_t val = (uint8_t)(oppair >> 8);
+		uint8_t temp = (uint8_t)(oppair >> 8);
 		gb->cpu_reg.pc.reg++;
-		WGB_INSTR_CP_R8(val);
+		WGB_INSTR_AND_R8(temp);
 		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
 		break;
 	}
 
-	case 0xFF: /* RST 0x0038 */
+	case 0xE7: /* RST 0x0020 */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0038;
+		gb->cpu_reg.pc.reg = 0x0020;
 		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
 		break;
 
-	default:
-		/* Return address where invalid opcode that was read. */
-		(gb->gb_error)(gb, GB_INVALID_OPCODE, gb->cpu_reg.pc.reg - 1);
-		WGB_UNREACHABLE();
-		return;
-	}
-
-	do
+	case 0xE8: /* ADD SP, imm */
 	{
-		/* DIV register timing */
-		gb->counter.div_count += inst_cycles;
-		while(gb->counter.div_count >= DIV_CYCLES)
-		{
-			gb->hram_io[IO_DIV]++;
-			gb->counter.div_count -= DIV_CYCLES;
-		}
-
-		/* Check for RTC tick. */
-		if(gb->mbc == 3 && (gb->rtc_real.reg.high & 0x40) == 0)
-		{
-			gb->counter.rtc_count += inst_cycles;
-			while(WGB_UNLIKELY(gb->counter.rtc_count >= RTC_CYCLES))
-			{
-				gb->counter.rtc_count -= RTC_CYCLES;
-
-				/* Detect invalid rollover. */
-				if(WGB_UNLIKELY(gb->rtc_real.reg.sec == 63))
-				{
-					gb->rtc_real.reg.sec = 0;
-					continue;
-				}
-
-				if(++gb->rtc_real.reg.sec != 60)
-					continue;
-
-				gb->rtc_real.reg.sec = 0;
-				if(gb->rtc_real.reg.min == 63)
-				{
-					gb->rtc_real.reg.min = 0;
-					continue;
-				}
-				if(++gb->rtc_real.reg.min != 60)
-					continue;
-
-				gb->rtc_real.reg.min = 0;
-				if(gb->rtc_real.reg.hour == 31)
-				{
-					gb->rtc_real.reg.hour = 0;
-					continue;
-				}
-				if(++gb->rtc_real.reg.hour != 24)
-					continue;
-
-				gb->rtc_real.reg.hour = 0;
-				if(++gb->rtc_real.reg.yday != 0)
-					continue;
-
-				if(gb->rtc_real.reg.high & 1)  /* Bit 8 of days*/
-					gb->rtc_real.reg.high |= 0x80; /* Overflow bit */
-
-				gb->rtc_real.reg.high ^= 1;
-			}
-		}
-
-		/* Check serial transmission. */
-		if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
-		{
-			unsigned int serial_cycles = SERIAL_CYCLES_1KB;
-
-			/* If new transfer, call TX function. */
-			if(gb->counter.serial_count == 0 &&
-				gb->gb_serial_tx != NULL)
-				(gb->gb_serial_tx)(gb, gb->hram_io[IO_SB]);
-
-#if WALNUT_FULL_GBC_SUPPORT
-			if(gb->hram_io[IO_SC] & 0x3)
-				serial_cycles = SERIAL_CYCLES_32KB;
-#endif
-
-			gb->counter.serial_count += inst_cycles;
-
-			/* If it's time to receive byte, call RX function. */
-			if(gb->counter.serial_count >= serial_cycles)
-			{
-				/* If RX can be done, do it. */
-				/* If RX failed, do not change SB if using external
-				 * clock, or set to 0xFF if using internal clock. */
-				uint8_t rx;
-
-				if(gb->gb_serial_rx != NULL &&
-					(gb->gb_serial_rx(gb, &rx) ==
-						GB_SERIAL_RX_SUCCESS))
-				{
-					gb->hram_io[IO_SB] = rx;
-
-					/* Inform game of serial TX/RX completion. */
-					gb->hram_io[IO_SC] &= 0x01;
-					gb->hram_io[IO_IF] |= SERIAL_INTR;
-				}
-				else if(gb->hram_io[IO_SC] & SERIAL_SC_CLOCK_SRC)
-				{
-					/* If using internal clock, and console is not
-					 * attached to any external peripheral, shifted
-					 * bits are replaced with logic 1. */
-					gb->hram_io[IO_SB] = 0xFF;
-
-					/* Inform game of serial TX/RX completion. */
-					gb->hram_io[IO_SC] &= 0x01;
-					gb->hram_io[IO_IF] |= SERIAL_INTR;
-				}
-				else
-				{
-					/* If using external clock, and console is not
-					 * attached to any external peripheral, bits are
-					 * not shifted, so SB is not modified. */
-				}
-
-				gb->counter.serial_count = 0;
-			}
-		}
-
-		/* TIMA register timing */
-		/* TODO: Change tac_enable to struct of TAC timer control bits. */
-		if(gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK)
-		{
-			gb->counter.tima_count += inst_cycles;
-
-			while(gb->counter.tima_count >=
-				TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK])
-			{
-				gb->counter.tima_count -=
-					TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK];
-
-				if(++gb->hram_io[IO_TIMA] == 0)
-				{
-					gb->hram_io[IO_IF] |= TIMER_INTR;
-					/* On overflow, set TMA to TIMA. */
-					gb->hram_io[IO_TIMA] = gb->hram_io[IO_TMA];
-				}
-			}
-		}
-
-		/* If LCD is off, don't update LCD state or increase the LCD
-		 * ticks. Instead, keep track of the amount of time that is
-		 * being passed. */
-		if(!(gb->hram_io[IO_LCDC] & LCDC_ENABLE))
-		{
-			gb->counter.lcd_off_count += inst_cycles;
-			if(gb->counter.lcd_off_count >= LCD_FRAME_CYCLES)
-			{
-				gb->counter.lcd_off_count -= LCD_FRAME_CYCLES;
-				gb->gb_frame = true;
-			}
-			continue;
-		}
+		int8_t offset = (int8_t)(oppair >> 8);
+		gb->cpu_reg.pc.reg++;
+		gb->cpu_reg.f.reg = 0;
+		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
+		gb->cpu_reg.f.f_bits.c = ((gb->cpu_reg.sp.reg & 0xFF) + (offset & 0xFF) > 0xFF);
+		gb->cpu_reg.sp.reg += offset;
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+		break;
+	}
 
-		/* LCD Timing */
-#if WALNUT_FULL_GBC_SUPPORT
-        if (inst_cycles > 1) {
-            gb->counter.lcd_count += (inst_cycles >> gb->cgb.doubleSpeed);
-        } else {
+	case 0xE9: /* JP (HL) */
+		gb->cpu_reg.pc.reg = gb->cpu_reg.hl.reg;
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+		break;
+
+	case 0xEA: /* LD (imm), A */
+	{
+#if WALNUT_GB_16_BIT_OPS_DUALFETCH_DISABLED
+    uint8_t l = (uint8_t)(oppair >> 8);
+		gb->cpu_reg.pc.reg++;
+		oppair = __gb_read16(gb, gb->cpu_reg.pc.reg++);
+    uint8_t h = oppair; // autotruncate
+    uint16_t addr = WALNUT_GB_U8_TO_U16(h, l);
+		__gb_write(gb, addr, gb->cpu_reg.a);
+		opcode = oppair >> 8;	
+#else
+    uint8_t l = (uint8_t)(oppair >> 8);
+		gb->cpu_reg.pc.reg++;
+    uint8_t h = __gb_read(gb, gb->cpu_reg.pc.reg++);
+    uint16_t addr = WALNUT_GB_U8_TO_U16(h, l);
+		__gb_write(gb, addr, gb->cpu_reg.a);
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);		
 #endif
-		gb->counter.lcd_count += inst_cycles;
-#if WALNUT_FULL_GBC_SUPPORT
+		break;
 	}
-#endif
 
-		/* New Scanline. HBlank -> VBlank or OAM Scan */
-		if(gb->counter.lcd_count >= LCD_LINE_CYCLES)
-		{
-			gb->counter.lcd_count -= LCD_LINE_CYCLES;
+	case 0xEE: /* XOR imm */
+		WGB_INSTR_XOR_R8((uint8_t)(oppair >> 8));
+		gb->cpu_reg.pc.reg++;
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+		break;
 
-			/* Next line */
-			gb->hram_io[IO_LY] = gb->hram_io[IO_LY] + 1;
-			if (gb->hram_io[IO_LY] == LCD_VERT_LINES)
-				gb->hram_io[IO_LY] = 0;
+	case 0xEF: /* RST 0x0028 */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		gb->cpu_reg.pc.reg = 0x0028;
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+		break;
 
-			/* LYC Update */
-			if(gb->hram_io[IO_LY] == gb->hram_io[IO_LYC])
-			{
-				gb->hram_io[IO_STAT] |= STAT_LYC_COINC;
+	case 0xF0: /* LD A, (0xFF00+imm) */
+		gb->cpu_reg.a =
+			__gb_read(gb, 0xFF00 | (uint8_t)(oppair >> 8));
+			gb->cpu_reg.pc.reg++;
+			opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+		break;
 
-				if(gb->hram_io[IO_STAT] & STAT_LYC_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
-			}
-			else
-				gb->hram_io[IO_STAT] &= 0xFB;
+	case 0xF1: /* POP AF */
+	{
+		uint8_t temp_8 = __gb_read(gb, gb->cpu_reg.sp.reg++);
+		gb->cpu_reg.f.f_bits.z = (temp_8 >> 7) & 1;
+		gb->cpu_reg.f.f_bits.n = (temp_8 >> 6) & 1;
+		gb->cpu_reg.f.f_bits.h = (temp_8 >> 5) & 1;
+		gb->cpu_reg.f.f_bits.c = (temp_8 >> 4) & 1;
+		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.sp.reg++);
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+	}
 
-			/* Check if LCD should be in Mode 1 (VBLANK) state */
-			if(gb->hram_io[IO_LY] == LCD_HEIGHT)
-			{
-				gb->hram_io[IO_STAT] =
-					(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_VBLANK;
-				gb->gb_frame = true;
-				gb->hram_io[IO_IF] |= VBLANK_INTR;
-				gb->lcd_blank = false;
+	case 0xF2: /* LD A, (C) */
+		gb->cpu_reg.a = __gb_read(gb, 0xFF00 | gb->cpu_reg.bc.bytes.c);
+#if WALNUT_GB_SAFE_DUALFETCH_OPCODES
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+#else
+	opcode = (uint8_t)(oppair >> 8);
+#endif
+		break;
 
-				if(gb->hram_io[IO_STAT] & STAT_MODE_1_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
+	case 0xF3: /* DI */
+		gb->gb_ime = false;
+		__gb_update_irq(gb);
+		opcode = (uint8_t)(oppair >> 8);
+		break;
 
-#if ENABLE_LCD
-				/* If frame skip is activated, check if we need to draw
-				 * the frame or skip it. */
-				if(gb->direct.frame_skip)
-				{
-					gb->display.frame_skip_count =
-						!gb->display.frame_skip_count;
-				}
+	case 0xF5: /* PUSH AF */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.a);
+		__gb_write(gb, --gb->cpu_reg.sp.reg,
+			   gb->cpu_reg.f.f_bits.z << 7 | gb->cpu_reg.f.f_bits.n << 6 |
+			   gb->cpu_reg.f.f_bits.h << 5 | gb->cpu_reg.f.f_bits.c << 4);
+		opcode = (uint8_t)(oppair >> 8);
+		break;
 
-				/* If interlaced is activated, change which lines get
-				 * updated. Also, only update lines on frames that are
-				 * actually drawn when frame skip is enabled. */
-				if(gb->direct.interlace &&
-						(!gb->direct.frame_skip ||
-						 gb->display.frame_skip_count))
-				{
-					gb->display.interlace_count =
-						!gb->display.interlace_count;
-				}
-#endif
-                                /* If halted forever, then return on VBLANK. */
-                                if(gb->gb_halt && !gb->hram_io[IO_IE])
-					break;
-			}
-			/* Start of normal Line (not in VBLANK) */
-			else if(gb->hram_io[IO_LY] < LCD_HEIGHT)
-			{
-				if(gb->hram_io[IO_LY] == 0)
-				{
-					/* Clear Screen */
-					gb->display.WY = gb->hram_io[IO_WY];
-					gb->display.window_clear = 0;
-				}
+	case 0xF6: /* OR imm */
+		WGB_INSTR_OR_R8((uint8_t)(oppair >> 8));
+		gb->cpu_reg.pc.reg++;
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+		break;
 
-				/* OAM Search occurs at the start of the line. */
-				gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_OAM_SCAN;
-				gb->counter.lcd_count = 0;
+	case 0xF7: /* PUSH AF */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		gb->cpu_reg.pc.reg = 0x0030;
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+		break;
 
-#if WALNUT_FULL_GBC_SUPPORT
-				//DMA GBC
-				if(gb->cgb.cgbMode && !gb->cgb.dmaActive && gb->cgb.dmaMode)
-				{
-#if WALNUT_GB_32BIT_DMA
-					// Optimized 16-bit path
-					for (uint8_t i = 0; i < 0x10; i += 4)
-					{
-							uint32_t val = __gb_read32(gb, (gb->cgb.dmaSource & 0xFFF0) + i);
-							__gb_write32(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i, val);
-							// 8-bit logic if there is some cause to fall back
-							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i, val);
-							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i + 1, val >> 8);
-							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i + 2, val >> 16);
-							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i + 3, val >> 24);
-					}
-#elif WALNUT_GB_16BIT_DMA
-					// Optimized 16-bit path
-					for (uint8_t i = 0; i < 0x10; i += 2)
-					{
-							uint16_t val = __gb_read16(gb, (gb->cgb.dmaSource & 0xFFF0) + i);
-							__gb_write16(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i, val);
-							// 8-bit logic if there is some cause to fall back
-							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i, val & 0xFF);
-							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i + 1, val >> 8);
-					}
+	case 0xF8: /* LD HL, SP+/-imm */
+	{
+		/* Taken from SameBoy, which is released under MIT Licence. */
+		int8_t offset = (int8_t) (oppair >> 8);
+		gb->cpu_reg.pc.reg++;
+		gb->cpu_reg.hl.reg = gb->cpu_reg.sp.reg + offset;
+		gb->cpu_reg.f.reg = 0;
+		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
+		gb->cpu_reg.f.f_bits.c = ((gb->cpu_reg.sp.reg & 0xFF) + (offset & 0xFF) > 0xFF) ? 1 : 0;
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+		break;
+	}
+
+	case 0xF9: /* LD SP, HL */
+		gb->cpu_reg.sp.reg = gb->cpu_reg.hl.reg;
+		opcode = (uint8_t)(oppair >> 8);
+		break;
+
+	case 0xFA: /* LD A, (imm) */
+	{
+#if WALNUT_GB_16_BIT_OPS_DUALFETCH_DISABLED
+    uint8_t l = (uint8_t)(oppair >> 8); // we dont increment pc because a interrupt might change it an invalidate this byte, we increment if no interrupt between 1st and 2nd opcode handlers
+		gb->cpu_reg.pc.reg++;
+		oppair = __gb_read16(gb, gb->cpu_reg.pc.reg++);
+    uint8_t h = oppair; // auto-truncate
+    uint16_t addr = WALNUT_GB_U8_TO_U16(h, l);
+		gb->cpu_reg.a = __gb_read(gb, addr);
+		opcode = oppair >> 8;
 #else
-			    // Original 8-bit path
-					for (uint8_t i = 0; i < 0x10; i++)
-					{
-						__gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i,
-										__gb_read(gb, (gb->cgb.dmaSource & 0xFFF0) + i));
-					}
+    uint8_t l = (uint8_t)(oppair >> 8); // we dont increment pc because a interrupt might change it an invalidate this byte, we increment if no interrupt between 1st and 2nd opcode handlers
+		gb->cpu_reg.pc.reg++;
+    uint8_t h = __gb_read(gb, gb->cpu_reg.pc.reg++);
+    uint16_t addr = WALNUT_GB_U8_TO_U16(h, l);
+		gb->cpu_reg.a = __gb_read(gb, addr);
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
 #endif
+		break;
+	}
 
-					gb->cgb.dmaSource += 0x10;
-					gb->cgb.dmaDest += 0x10;
-					if(!(--gb->cgb.dmaSize)) {gb->cgb.dmaActive = 1;
-					}
-#if WALNUT_GB_SAFE_DUALFETCH_DMA
-					gb->prefetch_invalid=true;
-#endif
-				}
-#endif
-				if(gb->hram_io[IO_STAT] & STAT_MODE_2_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
+	case 0xFB: /* EI */
+		gb->gb_ime = true;
+		__gb_update_irq(gb);
+		opcode = (uint8_t)(oppair >> 8);
+		break;
 
-				/* If halted immediately jump to next LCD mode.
-				 * From OAM Search to LCD Draw. */
-				//if(gb->counter.lcd_count < LCD_MODE2_OAM_SCAN_END)
-				//	inst_cycles = LCD_MODE2_OAM_SCAN_END - gb->counter.lcd_count;
-				inst_cycles = LCD_MODE2_OAM_SCAN_DURATION;
-			}
-		}
-		/* Go from Mode 3 (LCD Draw) to Mode 0 (HBLANK). */
-		else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_LCD_DRAW &&
-				gb->counter.lcd_count >= LCD_MODE3_LCD_DRAW_END)
-		{
-			gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_HBLANK;
+	case 0xFE: /* CP imm */
+	{
+		uint8_t val = (uint8_t)(oppair >> 8);
+		gb->cpu_reg.pc.reg++;
+		WGB_INSTR_CP_R8(val);
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+		break;
+	}
+
+	case 0xFF: /* RST 0x0038 */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		gb->cpu_reg.pc.reg = 0x0038;
+		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
+		break;
 
-			if(gb->hram_io[IO_STAT] & STAT_MODE_0_INTR)
-				gb->hram_io[IO_IF] |= LCDC_INTR;
+	default:
+		/* Return address where invalid opcode that was read. */
+		(gb->gb_error)(gb, GB_INVALID_OPCODE, gb->cpu_reg.pc.reg - 1);
+		WGB_UNREACHABLE();
+		return;
+	}
 
-			/* If halted immediately, jump from OAM Scan to LCD Draw. */
-			if (gb->counter.lcd_count < LCD_MODE0_HBLANK_MAX_DRUATION)
-				inst_cycles = LCD_MODE0_HBLANK_MAX_DRUATION - gb->counter.lcd_count;
-		}
-		/* Go from Mode 2 (OAM Scan) to Mode 3 (LCD Draw). */
-		else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_OAM_SCAN &&
-				gb->counter.lcd_count >= LCD_MODE2_OAM_SCAN_END)
-		{
-			gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_LCD_DRAW;
-#if ENABLE_LCD
-			if(!gb->lcd_blank)
-				__gb_draw_line(gb);
-#endif
-			/* If halted immediately jump to next LCD mode. */
-			if (gb->counter.lcd_count < LCD_MODE3_LCD_DRAW_MIN_DURATION)
-				inst_cycles = LCD_MODE3_LCD_DRAW_MIN_DURATION - gb->counter.lcd_count;
-		}
-	} while(gb->gb_halt && (gb->hram_io[IO_IF] & gb->hram_io[IO_IE]) == 0);
-	/* If halted, loop until an interrupt occurs. */
+	/* Counters are only updated once the next event is due. */
+	gb->counter.pending_cycles += inst_cycles;
+	if(gb->counter.pending_cycles >= gb->counter.next_event)
+		__gb_run_events(gb);
 
 	// **** 2nd instruction processing ****
 #if (WALNUT_GB_SAFE_DUALFETCH_DMA || WALNUT_GB_SAFE_DUALFETCH_MBC)
@@ -5462,56 +8104,10 @@ static inline void __gb_step_cpu(struct gb_s *gb)
 		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);// opcode was invalidated so we reload
 	}
 #endif
-	/* Handle interrupts */
-	/* If gb_halt is positive, then an interrupt must have occurred by the
-	 * time we reach here, because on HALT, we jump to the next interrupt
-	 * immediately. We also load opcode here because it may be replacing the previously loaded one from the dual fetch logic's first pass */
-	while(gb->gb_halt || (gb->gb_ime &&
-			gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & ANY_INTR))
-	{
-		gb->gb_halt = false;
-
-		if(!gb->gb_ime)
-			break;
-
-		/* Disable interrupts */
-		gb->gb_ime = false;
-
-		/* Push Program Counter */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-
-		/* Call interrupt handler if required. */
-		if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & VBLANK_INTR)
-		{
-			gb->cpu_reg.pc.reg = VBLANK_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= VBLANK_INTR;
-		}
-		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & LCDC_INTR)
-		{
-			gb->cpu_reg.pc.reg = LCDC_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= LCDC_INTR;
-		}
-		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & TIMER_INTR)
-		{
-			gb->cpu_reg.pc.reg = TIMER_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= TIMER_INTR;
-		}
-		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & SERIAL_INTR)
-		{
-			gb->cpu_reg.pc.reg = SERIAL_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= SERIAL_INTR;
-		}
-		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & CONTROL_INTR)
-		{
-			gb->cpu_reg.pc.reg = CONTROL_INTR_ADDR;			
-			gb->hram_io[IO_IF] ^= CONTROL_INTR;
-		}
-		
+	/* Handle interrupts. The opcode read by the dual fetch is replaced
+	 * when a handler is called. */
+	if(WGB_UNLIKELY(gb->irq_pending) && __gb_interrupt(gb))
 		opcode = __gb_read(gb, gb->cpu_reg.pc.reg);
-
-		break;
-	}
 	// at this point opcode always has the next instruction but pc hasn't yet been incremented so we increment here collectively for all cases
 	// that can lead us to this point.
 	gb->cpu_reg.pc.reg++;
@@ -5615,8 +8211,11 @@ static inline void __gb_step_cpu(struct gb_s *gb)
 #if WALNUT_FULL_GBC_SUPPORT
 		if(gb->cgb.cgbMode & gb->cgb.doubleSpeedPrep)
 		{
+			/* LCD timing rate changes with the CPU speed. */
+			__gb_catch_up(gb);
 			gb->cgb.doubleSpeedPrep = 0;
 			gb->cgb.doubleSpeed ^= 1;
+			gb->counter.next_event = 0;
 		}
 #endif
 		break;
@@ -6150,7 +8749,10 @@ static inline void __gb_step_cpu(struct gb_s *gb)
 		int_fast16_t halt_cycles = INT_FAST16_MAX;
 
 		/* TODO: Emulate HALT bug? */
+		__gb_catch_up(gb);
 		gb->gb_halt = true;
+		gb->irq_pending = true;
+		gb->counter.next_event = 0;
 
 		if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
 		{
@@ -6557,226 +9159,30 @@ static inline void __gb_step_cpu(struct gb_s *gb)
 {
     uint8_t c = __gb_read(gb, gb->cpu_reg.pc.reg++);
     uint8_t p = __gb_read(gb, gb->cpu_reg.pc.reg++);
-    gb->cpu_reg.pc.bytes.c = c;
-    gb->cpu_reg.pc.bytes.p = p;
-}
-#endif
-		break;
-
-	case 0xC4: /* CALL NZ imm */
-		if(!gb->cpu_reg.f.f_bits.z)
-		{
-#if WALNUT_GB_16_BIT_OPS
-			uint16_t addr = __gb_read16(gb, gb->cpu_reg.pc.reg);
-			gb->cpu_reg.pc.reg += 2;
-      gb->cpu_reg.sp.reg -= 2;
-      __gb_write16(gb, gb->cpu_reg.sp.reg, gb->cpu_reg.pc.reg);
-			gb->cpu_reg.pc.reg = addr;
-#else
-			uint8_t c, p;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-			gb->cpu_reg.pc.bytes.c = c;
-			gb->cpu_reg.pc.bytes.p = p;
-#endif        
-			inst_cycles += 12;
-		}
-		else
-			gb->cpu_reg.pc.reg += 2;
-
-		break;
-
-	case 0xC5: /* PUSH BC */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.bc.bytes.b);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.bc.bytes.c);
-		break;
-
-	case 0xC6: /* ADD A, imm */
-	{
-		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		WGB_INSTR_ADC_R8(val, 0);
-		break;
-	}
-
-	case 0xC7: /* RST 0x0000 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0000;
-		break;
-
-	case 0xC8: /* RET Z */
-		if(gb->cpu_reg.f.f_bits.z)
-		{
-#if WALNUT_GB_16_BIT_OPS
-        // Optional 16-bit path if stack is aligned
-        gb->cpu_reg.pc.reg = __gb_read16(gb, gb->cpu_reg.sp.reg);
-        gb->cpu_reg.sp.reg += 2;
-#else
-        gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
-        gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
-#endif
-			inst_cycles += 12;
-		}
-		break;
-
-	case 0xC9: /* RET */
-	{
-#if WALNUT_GB_16_BIT_OPS
-    gb->cpu_reg.pc.reg = __gb_read16(gb, gb->cpu_reg.sp.reg);
-    gb->cpu_reg.sp.reg += 2;
-#else
-    gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
-    gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
-#endif
-		break;
-	}
-
-	case 0xCA: /* JP Z, imm */
-		if(gb->cpu_reg.f.f_bits.z)
-		{
-#if WALNUT_GB_16_BIT_OPS
-        gb->cpu_reg.pc.reg = __gb_read16(gb, gb->cpu_reg.pc.reg); // no need to advance pc because of jump
-#else
-        uint8_t c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-        uint8_t p = __gb_read(gb, gb->cpu_reg.pc.reg++);
-        gb->cpu_reg.pc.bytes.c = c;
-        gb->cpu_reg.pc.bytes.p = p;
-#endif
-			inst_cycles += 4;
-		}
-		else
-			gb->cpu_reg.pc.reg += 2;
-
-		break;
-
-	case 0xCB: /* CB INST */
-		inst_cycles = __gb_execute_cb(gb);
-		break;
-
-	case 0xCC: /* CALL Z, imm */
-		if(gb->cpu_reg.f.f_bits.z)
-		{
-#if WALNUT_GB_16_BIT_OPS
-        uint16_t addr = __gb_read16(gb, gb->cpu_reg.pc.reg);
-        gb->cpu_reg.pc.reg += 2; // advance past immediate
-
-        // push old PC
-				gb->cpu_reg.sp.reg-=2;
-        __gb_write16(gb, gb->cpu_reg.sp.reg, gb->cpu_reg.pc.reg);
-
-        gb->cpu_reg.pc.reg = addr;
-#else
-        uint8_t c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-        uint8_t p = __gb_read(gb, gb->cpu_reg.pc.reg++);
-        __gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-        __gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-        gb->cpu_reg.pc.bytes.c = c;
-        gb->cpu_reg.pc.bytes.p = p;
-#endif
-			inst_cycles += 12;
-		}
-		else
-			gb->cpu_reg.pc.reg += 2;
-
-		break;
-
-	case 0xCD: /* CALL imm */
-#if WALNUT_GB_16_BIT_OPS
-{
-    uint16_t addr = __gb_read16(gb, gb->cpu_reg.pc.reg);
-    gb->cpu_reg.pc.reg += 2; // advance past immediate
-		gb->cpu_reg.sp.reg-=2;
-		__gb_write16(gb, gb->cpu_reg.sp.reg, gb->cpu_reg.pc.reg);
-    gb->cpu_reg.pc.reg = addr;
-}
-#else
-{
-    uint8_t c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-    uint8_t p = __gb_read(gb, gb->cpu_reg.pc.reg++);
-    __gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-    __gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-    gb->cpu_reg.pc.bytes.c = c;
-    gb->cpu_reg.pc.bytes.p = p;
-}
-#endif
-	break;
-
-	case 0xCE: /* ADC A, imm */
-	{
-		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		WGB_INSTR_ADC_R8(val, gb->cpu_reg.f.f_bits.c);
-		break;
-	}
-
-	case 0xCF: /* RST 0x0008 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0008;
-		break;
-
-	case 0xD0: /* RET NC */
-
-    if (!gb->cpu_reg.f.f_bits.c)
-    {
-#if WALNUT_GB_16_BIT_OPS
-        gb->cpu_reg.pc.reg = __gb_read16(gb, gb->cpu_reg.sp.reg);
-        gb->cpu_reg.sp.reg += 2; // advance SP past the popped PC
-#else
-        gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
-        gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
-#endif
-        inst_cycles += 12;
-    }
-
-		break;
-
-	case 0xD1: /* POP DE */
-#if WALNUT_GB_16_BIT_OPS
-    gb->cpu_reg.de.reg = __gb_read16(gb, gb->cpu_reg.sp.reg);
-    gb->cpu_reg.sp.reg += 2;
-#else
-    gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.sp.reg++);
-    gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.sp.reg++);
-#endif
-		break;
-
-	case 0xD2: /* JP NC, imm */
-		if(!gb->cpu_reg.f.f_bits.c)
-		{
-#if WALNUT_GB_16_BIT_OPS
-        gb->cpu_reg.pc.reg = __gb_read16(gb, gb->cpu_reg.pc.reg); // jump so no need to advance pc
-#else
-        uint8_t c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-        uint8_t p = __gb_read(gb, gb->cpu_reg.pc.reg++);
-        gb->cpu_reg.pc.bytes.c = c;
-        gb->cpu_reg.pc.bytes.p = p;
-#endif
-			inst_cycles += 4;
-		}
-		else
-			gb->cpu_reg.pc.reg += 2;
-
+    gb->cpu_reg.pc.bytes.c = c;
+    gb->cpu_reg.pc.bytes.p = p;
+}
+#endif
 		break;
 
-	case 0xD4: /* CALL NC, imm */
-		if(!gb->cpu_reg.f.f_bits.c)
+	case 0xC4: /* CALL NZ imm */
+		if(!gb->cpu_reg.f.f_bits.z)
 		{
 #if WALNUT_GB_16_BIT_OPS
-        uint16_t addr = __gb_read16(gb, gb->cpu_reg.pc.reg);
-        gb->cpu_reg.pc.reg += 2; // advance PC past immediate
-				gb->cpu_reg.sp.reg-=2;
-        __gb_write16(gb, gb->cpu_reg.sp.reg, gb->cpu_reg.pc.reg);
-        gb->cpu_reg.pc.reg = addr;
+			uint16_t addr = __gb_read16(gb, gb->cpu_reg.pc.reg);
+			gb->cpu_reg.pc.reg += 2;
+      gb->cpu_reg.sp.reg -= 2;
+      __gb_write16(gb, gb->cpu_reg.sp.reg, gb->cpu_reg.pc.reg);
+			gb->cpu_reg.pc.reg = addr;
 #else
-        uint8_t c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-        uint8_t p = __gb_read(gb, gb->cpu_reg.pc.reg++);
-        __gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-        __gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-        gb->cpu_reg.pc.bytes.c = c;
-        gb->cpu_reg.pc.bytes.p = p;
-#endif
+			uint8_t c, p;
+			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
+			p = __gb_read(gb, gb->cpu_reg.pc.reg++);
+			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+			gb->cpu_reg.pc.bytes.c = c;
+			gb->cpu_reg.pc.bytes.p = p;
+#endif        
 			inst_cycles += 12;
 		}
 		else
@@ -6784,70 +9190,56 @@ static inline void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0xD5: /* PUSH DE */
-	// this was revised but working backwards from this 16-bit op to find the one thats broken
-#if WALNUT_GB_16_BIT_OPS
-		gb->cpu_reg.sp.reg-=2;
-		__gb_write16(gb,gb->cpu_reg.sp.reg,gb->cpu_reg.de.reg);
-#else
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.de.bytes.d);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.de.bytes.e);
-#endif
+	case 0xC5: /* PUSH BC */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.bc.bytes.b);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.bc.bytes.c);
 		break;
 
-	case 0xD6: /* SUB imm */
+	case 0xC6: /* ADD A, imm */
 	{
 		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		uint16_t temp = gb->cpu_reg.a - val;
-		gb->cpu_reg.f.f_bits.z = ((temp & 0xFF) == 0x00);
-		gb->cpu_reg.f.f_bits.n = 1;
-		gb->cpu_reg.f.f_bits.h =
-			(gb->cpu_reg.a ^ val ^ temp) & 0x10 ? 1 : 0;
-		gb->cpu_reg.f.f_bits.c = (temp & 0xFF00) ? 1 : 0;
-		gb->cpu_reg.a = (temp & 0xFF);
+		WGB_INSTR_ADC_R8(val, 0);
 		break;
 	}
 
-	case 0xD7: /* RST 0x0010 */
+	case 0xC7: /* RST 0x0000 */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0010;
+		gb->cpu_reg.pc.reg = 0x0000;
 		break;
 
-	case 0xD8: /* RET C */
-		if(gb->cpu_reg.f.f_bits.c)
+	case 0xC8: /* RET Z */
+		if(gb->cpu_reg.f.f_bits.z)
 		{
-#if WALNUT_GB_16_BIT
+#if WALNUT_GB_16_BIT_OPS
+        // Optional 16-bit path if stack is aligned
         gb->cpu_reg.pc.reg = __gb_read16(gb, gb->cpu_reg.sp.reg);
-        gb->cpu_reg.sp.reg += 2; // advance SP past the popped PC
+        gb->cpu_reg.sp.reg += 2;
 #else
         gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
         gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
 #endif
 			inst_cycles += 12;
 		}
-
 		break;
 
-	case 0xD9: /* RETI */
+	case 0xC9: /* RET */
 	{
-#if WALNUT_GB_16_BIT
+#if WALNUT_GB_16_BIT_OPS
     gb->cpu_reg.pc.reg = __gb_read16(gb, gb->cpu_reg.sp.reg);
-    gb->cpu_reg.sp.reg += 2; // advance SP past the popped PC
+    gb->cpu_reg.sp.reg += 2;
 #else
     gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
     gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
 #endif
-		gb->gb_ime = true;
+		break;
 	}
-	break;
 
-	case 0xDA: /* JP C, imm */
-		if(gb->cpu_reg.f.f_bits.c)
+	case 0xCA: /* JP Z, imm */
+		if(gb->cpu_reg.f.f_bits.z)
 		{
-#if WALNUT_GB_16_BIT
-        gb->cpu_reg.pc.reg = __gb_read16(gb, gb->cpu_reg.pc.reg);
-        gb->cpu_reg.pc.reg += 2; // advance PC past the immediate word
+#if WALNUT_GB_16_BIT_OPS
+        gb->cpu_reg.pc.reg = __gb_read16(gb, gb->cpu_reg.pc.reg); // no need to advance pc because of jump
 #else
         uint8_t c = __gb_read(gb, gb->cpu_reg.pc.reg++);
         uint8_t p = __gb_read(gb, gb->cpu_reg.pc.reg++);
@@ -6861,16 +9253,22 @@ static inline void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0xDC: /* CALL C, imm */
-		if(gb->cpu_reg.f.f_bits.c)
+	case 0xCB: /* CB INST */
+		inst_cycles = __gb_execute_cb(gb);
+		break;
+
+	case 0xCC: /* CALL Z, imm */
+		if(gb->cpu_reg.f.f_bits.z)
 		{
-#if WALNUT_GB_16_BIT
-        uint16_t target = __gb_read16(gb, gb->cpu_reg.pc.reg);
-        gb->cpu_reg.pc.reg += 2; // advance PC past the immediate word
-        // push current PC onto stack
-        gb->cpu_reg.sp.reg -= 2;
-				__gb_write16(gb, gb->cpu_reg.sp.reg, gb->cpu_reg.pc.reg)
-        gb->cpu_reg.pc.reg = target;
+#if WALNUT_GB_16_BIT_OPS
+        uint16_t addr = __gb_read16(gb, gb->cpu_reg.pc.reg);
+        gb->cpu_reg.pc.reg += 2; // advance past immediate
+
+        // push old PC
+				gb->cpu_reg.sp.reg-=2;
+        __gb_write16(gb, gb->cpu_reg.sp.reg, gb->cpu_reg.pc.reg);
+
+        gb->cpu_reg.pc.reg = addr;
 #else
         uint8_t c = __gb_read(gb, gb->cpu_reg.pc.reg++);
         uint8_t p = __gb_read(gb, gb->cpu_reg.pc.reg++);
@@ -6886,499 +9284,400 @@ static inline void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0xDE: /* SBC A, imm */
-	{
-		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		WGB_INSTR_SBC_R8(val, gb->cpu_reg.f.f_bits.c);
-		break;
-	}
-
-	case 0xDF: /* RST 0x0018 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0018;
-		break;
-
-	case 0xE0: /* LD (0xFF00+imm), A */
-		__gb_write(gb, 0xFF00 | __gb_read(gb, gb->cpu_reg.pc.reg++),
-			   gb->cpu_reg.a);
-		break;
-
-	case 0xE1: /* POP HL */
-#if WALNUT_GB_16_BIT
-    gb->cpu_reg.hl.reg = __gb_read16(gb, gb->cpu_reg.sp.reg);
-    gb->cpu_reg.sp.reg += 2; // advance SP past the popped value
+	case 0xCD: /* CALL imm */
+#if WALNUT_GB_16_BIT_OPS
+{
+    uint16_t addr = __gb_read16(gb, gb->cpu_reg.pc.reg);
+    gb->cpu_reg.pc.reg += 2; // advance past immediate
+		gb->cpu_reg.sp.reg-=2;
+		__gb_write16(gb, gb->cpu_reg.sp.reg, gb->cpu_reg.pc.reg);
+    gb->cpu_reg.pc.reg = addr;
+}
 #else
-    gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.sp.reg++);
-    gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.sp.reg++);
+{
+    uint8_t c = __gb_read(gb, gb->cpu_reg.pc.reg++);
+    uint8_t p = __gb_read(gb, gb->cpu_reg.pc.reg++);
+    __gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+    __gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+    gb->cpu_reg.pc.bytes.c = c;
+    gb->cpu_reg.pc.bytes.p = p;
+}
 #endif
-		break;
-
-	case 0xE2: /* LD (C), A */
-		__gb_write(gb, 0xFF00 | gb->cpu_reg.bc.bytes.c, gb->cpu_reg.a);
-		break;
-
-	case 0xE5: /* PUSH HL */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.hl.bytes.h);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.hl.bytes.l);
-		break;
+	break;
 
-	case 0xE6: /* AND imm */
+	case 0xCE: /* ADC A, imm */
 	{
-		uint8_t temp = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		WGB_INSTR_AND_R8(temp);
+		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		WGB_INSTR_ADC_R8(val, gb->cpu_reg.f.f_bits.c);
 		break;
 	}
 
-	case 0xE7: /* RST 0x0020 */
+	case 0xCF: /* RST 0x0008 */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0020;
-		break;
-
-	case 0xE8: /* ADD SP, imm */
-	{
-		int8_t offset = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.f.reg = 0;
-		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
-		gb->cpu_reg.f.f_bits.c = ((gb->cpu_reg.sp.reg & 0xFF) + (offset & 0xFF) > 0xFF);
-		gb->cpu_reg.sp.reg += offset;
+		gb->cpu_reg.pc.reg = 0x0008;
 		break;
-	}
 
-	case 0xE9: /* JP (HL) */
-		gb->cpu_reg.pc.reg = gb->cpu_reg.hl.reg;
-		break;
+	case 0xD0: /* RET NC */
 
-	case 0xEA: /* LD (imm), A */
-	{
-#if WALNUT_GB_16_BIT
-    uint16_t addr = __gb_read16(gb, gb->cpu_reg.pc.reg);
-    gb->cpu_reg.pc.reg += 2; // advance past the immediate
+    if (!gb->cpu_reg.f.f_bits.c)
+    {
+#if WALNUT_GB_16_BIT_OPS
+        gb->cpu_reg.pc.reg = __gb_read16(gb, gb->cpu_reg.sp.reg);
+        gb->cpu_reg.sp.reg += 2; // advance SP past the popped PC
 #else
-    uint8_t l = __gb_read(gb, gb->cpu_reg.pc.reg++);
-    uint8_t h = __gb_read(gb, gb->cpu_reg.pc.reg++);
-    uint16_t addr = WALNUT_GB_U8_TO_U16(h, l);
+        gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
+        gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
 #endif
-		__gb_write(gb, addr, gb->cpu_reg.a);
-		break;
-	}
-
-	case 0xEE: /* XOR imm */
-		WGB_INSTR_XOR_R8(__gb_read(gb, gb->cpu_reg.pc.reg++));
-		break;
-
-	case 0xEF: /* RST 0x0028 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0028;
-		break;
-
-	case 0xF0: /* LD A, (0xFF00+imm) */
-		gb->cpu_reg.a =
-			__gb_read(gb, 0xFF00 | __gb_read(gb, gb->cpu_reg.pc.reg++));
-		break;
-
-	case 0xF1: /* POP AF */
-	{
-		uint8_t temp_8 = __gb_read(gb, gb->cpu_reg.sp.reg++);
-		gb->cpu_reg.f.f_bits.z = (temp_8 >> 7) & 1;
-		gb->cpu_reg.f.f_bits.n = (temp_8 >> 6) & 1;
-		gb->cpu_reg.f.f_bits.h = (temp_8 >> 5) & 1;
-		gb->cpu_reg.f.f_bits.c = (temp_8 >> 4) & 1;
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.sp.reg++);
-		break;
-	}
-
-	case 0xF2: /* LD A, (C) */
-		gb->cpu_reg.a = __gb_read(gb, 0xFF00 | gb->cpu_reg.bc.bytes.c);
-		break;
-
-	case 0xF3: /* DI */
-		gb->gb_ime = false;
-		break;
-
-	case 0xF5: /* PUSH AF */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.a);
-		__gb_write(gb, --gb->cpu_reg.sp.reg,
-			   gb->cpu_reg.f.f_bits.z << 7 | gb->cpu_reg.f.f_bits.n << 6 |
-			   gb->cpu_reg.f.f_bits.h << 5 | gb->cpu_reg.f.f_bits.c << 4);
-		break;
-
-	case 0xF6: /* OR imm */
-		WGB_INSTR_OR_R8(__gb_read(gb, gb->cpu_reg.pc.reg++));
-		break;
+        inst_cycles += 12;
+    }
 
-	case 0xF7: /* PUSH AF */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0030;
 		break;
 
-	case 0xF8: /* LD HL, SP+/-imm */
-	{
-		/* Taken from SameBoy, which is released under MIT Licence. */
-		int8_t offset = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.hl.reg = gb->cpu_reg.sp.reg + offset;
-		gb->cpu_reg.f.reg = 0;
-		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
-		gb->cpu_reg.f.f_bits.c = ((gb->cpu_reg.sp.reg & 0xFF) + (offset & 0xFF) > 0xFF) ? 1 : 0;
+	case 0xD1: /* POP DE */
+#if WALNUT_GB_16_BIT_OPS
+    gb->cpu_reg.de.reg = __gb_read16(gb, gb->cpu_reg.sp.reg);
+    gb->cpu_reg.sp.reg += 2;
+#else
+    gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.sp.reg++);
+    gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.sp.reg++);
+#endif
 		break;
-	}
 
-	case 0xF9: /* LD SP, HL */
-		gb->cpu_reg.sp.reg = gb->cpu_reg.hl.reg;
+	case 0xD2: /* JP NC, imm */
+		if(!gb->cpu_reg.f.f_bits.c)
+		{
+#if WALNUT_GB_16_BIT_OPS
+        gb->cpu_reg.pc.reg = __gb_read16(gb, gb->cpu_reg.pc.reg); // jump so no need to advance pc
+#else
+        uint8_t c = __gb_read(gb, gb->cpu_reg.pc.reg++);
+        uint8_t p = __gb_read(gb, gb->cpu_reg.pc.reg++);
+        gb->cpu_reg.pc.bytes.c = c;
+        gb->cpu_reg.pc.bytes.p = p;
+#endif
+			inst_cycles += 4;
+		}
+		else
+			gb->cpu_reg.pc.reg += 2;
+
 		break;
 
-	case 0xFA: /* LD A, (imm) */
-	{
-#if WALNUT_GB_16_BIT
-    uint16_t addr = __gb_read16(gb, gb->cpu_reg.pc.reg);
-    gb->cpu_reg.pc.reg += 2; // advance past the immediate
+	case 0xD4: /* CALL NC, imm */
+		if(!gb->cpu_reg.f.f_bits.c)
+		{
+#if WALNUT_GB_16_BIT_OPS
+        uint16_t addr = __gb_read16(gb, gb->cpu_reg.pc.reg);
+        gb->cpu_reg.pc.reg += 2; // advance PC past immediate
+				gb->cpu_reg.sp.reg-=2;
+        __gb_write16(gb, gb->cpu_reg.sp.reg, gb->cpu_reg.pc.reg);
+        gb->cpu_reg.pc.reg = addr;
 #else
-    uint8_t l = __gb_read(gb, gb->cpu_reg.pc.reg++);
-    uint8_t h = __gb_read(gb, gb->cpu_reg.pc.reg++);
-    uint16_t addr = WALNUT_GB_U8_TO_U16(h, l);
+        uint8_t c = __gb_read(gb, gb->cpu_reg.pc.reg++);
+        uint8_t p = __gb_read(gb, gb->cpu_reg.pc.reg++);
+        __gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+        __gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+        gb->cpu_reg.pc.bytes.c = c;
+        gb->cpu_reg.pc.bytes.p = p;
 #endif
-		gb->cpu_reg.a = __gb_read(gb, addr);
+			inst_cycles += 12;
+		}
+		else
+			gb->cpu_reg.pc.reg += 2;
+
 		break;
-	}
 
-	case 0xFB: /* EI */
-		gb->gb_ime = true;
+	case 0xD5: /* PUSH DE */
+	// this was revised but working backwards from this 16-bit op to find the one thats broken
+#if WALNUT_GB_16_BIT_OPS
+		gb->cpu_reg.sp.reg-=2;
+		__gb_write16(gb,gb->cpu_reg.sp.reg,gb->cpu_reg.de.reg);
+#else
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.de.bytes.d);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.de.bytes.e);
+#endif
 		break;
 
-	case 0xFE: /* CP imm */
+	case 0xD6: /* SUB imm */
 	{
 		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		WGB_INSTR_CP_R8(val);
+		uint16_t temp = gb->cpu_reg.a - val;
+		gb->cpu_reg.f.f_bits.z = ((temp & 0xFF) == 0x00);
+		gb->cpu_reg.f.f_bits.n = 1;
+		gb->cpu_reg.f.f_bits.h =
+			(gb->cpu_reg.a ^ val ^ temp) & 0x10 ? 1 : 0;
+		gb->cpu_reg.f.f_bits.c = (temp & 0xFF00) ? 1 : 0;
+		gb->cpu_reg.a = (temp & 0xFF);
 		break;
 	}
 
-	case 0xFF: /* RST 0x0038 */
+	case 0xD7: /* RST 0x0010 */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0038;
+		gb->cpu_reg.pc.reg = 0x0010;
 		break;
 
-	default:
-		/* Return address where invalid opcode that was read. */
-		(gb->gb_error)(gb, GB_INVALID_OPCODE, gb->cpu_reg.pc.reg - 1);
-		WGB_UNREACHABLE();
-	}
-
-	// *** post opcode handling ***
-
-	do
-	{
-		/* DIV register timing */
-		gb->counter.div_count += inst_cycles;
-		while(gb->counter.div_count >= DIV_CYCLES)
+	case 0xD8: /* RET C */
+		if(gb->cpu_reg.f.f_bits.c)
 		{
-			gb->hram_io[IO_DIV]++;
-			gb->counter.div_count -= DIV_CYCLES;
+#if WALNUT_GB_16_BIT
+        gb->cpu_reg.pc.reg = __gb_read16(gb, gb->cpu_reg.sp.reg);
+        gb->cpu_reg.sp.reg += 2; // advance SP past the popped PC
+#else
+        gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
+        gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
+#endif
+			inst_cycles += 12;
 		}
 
-		/* Check for RTC tick. */
-		if(gb->mbc == 3 && (gb->rtc_real.reg.high & 0x40) == 0)
-		{
-			gb->counter.rtc_count += inst_cycles;
-			while(WGB_UNLIKELY(gb->counter.rtc_count >= RTC_CYCLES))
-			{
-				gb->counter.rtc_count -= RTC_CYCLES;
-
-				/* Detect invalid rollover. */
-				if(WGB_UNLIKELY(gb->rtc_real.reg.sec == 63))
-				{
-					gb->rtc_real.reg.sec = 0;
-					continue;
-				}
-
-				if(++gb->rtc_real.reg.sec != 60)
-					continue;
-
-				gb->rtc_real.reg.sec = 0;
-				if(gb->rtc_real.reg.min == 63)
-				{
-					gb->rtc_real.reg.min = 0;
-					continue;
-				}
-				if(++gb->rtc_real.reg.min != 60)
-					continue;
-
-				gb->rtc_real.reg.min = 0;
-				if(gb->rtc_real.reg.hour == 31)
-				{
-					gb->rtc_real.reg.hour = 0;
-					continue;
-				}
-				if(++gb->rtc_real.reg.hour != 24)
-					continue;
-
-				gb->rtc_real.reg.hour = 0;
-				if(++gb->rtc_real.reg.yday != 0)
-					continue;
-
-				if(gb->rtc_real.reg.high & 1)  /* Bit 8 of days*/
-					gb->rtc_real.reg.high |= 0x80; /* Overflow bit */
+		break;
 
-				gb->rtc_real.reg.high ^= 1;
-			}
-		}
+	case 0xD9: /* RETI */
+	{
+#if WALNUT_GB_16_BIT
+    gb->cpu_reg.pc.reg = __gb_read16(gb, gb->cpu_reg.sp.reg);
+    gb->cpu_reg.sp.reg += 2; // advance SP past the popped PC
+#else
+    gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
+    gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
+#endif
+		gb->gb_ime = true;
+		__gb_update_irq(gb);
+	}
+	break;
 
-		/* Check serial transmission. */
-		if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
+	case 0xDA: /* JP C, imm */
+		if(gb->cpu_reg.f.f_bits.c)
 		{
-			unsigned int serial_cycles = SERIAL_CYCLES_1KB;
+#if WALNUT_GB_16_BIT
+        gb->cpu_reg.pc.reg = __gb_read16(gb, gb->cpu_reg.pc.reg);
+        gb->cpu_reg.pc.reg += 2; // advance PC past the immediate word
+#else
+        uint8_t c = __gb_read(gb, gb->cpu_reg.pc.reg++);
+        uint8_t p = __gb_read(gb, gb->cpu_reg.pc.reg++);
+        gb->cpu_reg.pc.bytes.c = c;
+        gb->cpu_reg.pc.bytes.p = p;
+#endif
+			inst_cycles += 4;
+		}
+		else
+			gb->cpu_reg.pc.reg += 2;
 
-			/* If new transfer, call TX function. */
-			if(gb->counter.serial_count == 0 &&
-				gb->gb_serial_tx != NULL)
-				(gb->gb_serial_tx)(gb, gb->hram_io[IO_SB]);
+		break;
 
-#if WALNUT_FULL_GBC_SUPPORT
-			if(gb->hram_io[IO_SC] & 0x3)
-				serial_cycles = SERIAL_CYCLES_32KB;
+	case 0xDC: /* CALL C, imm */
+		if(gb->cpu_reg.f.f_bits.c)
+		{
+#if WALNUT_GB_16_BIT
+        uint16_t target = __gb_read16(gb, gb->cpu_reg.pc.reg);
+        gb->cpu_reg.pc.reg += 2; // advance PC past the immediate word
+        // push current PC onto stack
+        gb->cpu_reg.sp.reg -= 2;
+				__gb_write16(gb, gb->cpu_reg.sp.reg, gb->cpu_reg.pc.reg)
+        gb->cpu_reg.pc.reg = target;
+#else
+        uint8_t c = __gb_read(gb, gb->cpu_reg.pc.reg++);
+        uint8_t p = __gb_read(gb, gb->cpu_reg.pc.reg++);
+        __gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+        __gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+        gb->cpu_reg.pc.bytes.c = c;
+        gb->cpu_reg.pc.bytes.p = p;
 #endif
+			inst_cycles += 12;
+		}
+		else
+			gb->cpu_reg.pc.reg += 2;
 
-			gb->counter.serial_count += inst_cycles;
-
-			/* If it's time to receive byte, call RX function. */
-			if(gb->counter.serial_count >= serial_cycles)
-			{
-				/* If RX can be done, do it. */
-				/* If RX failed, do not change SB if using external
-				 * clock, or set to 0xFF if using internal clock. */
-				uint8_t rx;
+		break;
 
-				if(gb->gb_serial_rx != NULL &&
-					(gb->gb_serial_rx(gb, &rx) ==
-						GB_SERIAL_RX_SUCCESS))
-				{
-					gb->hram_io[IO_SB] = rx;
+	case 0xDE: /* SBC A, imm */
+	{
+		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		WGB_INSTR_SBC_R8(val, gb->cpu_reg.f.f_bits.c);
+		break;
+	}
 
-					/* Inform game of serial TX/RX completion. */
-					gb->hram_io[IO_SC] &= 0x01;
-					gb->hram_io[IO_IF] |= SERIAL_INTR;
-				}
-				else if(gb->hram_io[IO_SC] & SERIAL_SC_CLOCK_SRC)
-				{
-					/* If using internal clock, and console is not
-					 * attached to any external peripheral, shifted
-					 * bits are replaced with logic 1. */
-					gb->hram_io[IO_SB] = 0xFF;
+	case 0xDF: /* RST 0x0018 */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		gb->cpu_reg.pc.reg = 0x0018;
+		break;
 
-					/* Inform game of serial TX/RX completion. */
-					gb->hram_io[IO_SC] &= 0x01;
-					gb->hram_io[IO_IF] |= SERIAL_INTR;
-				}
-				else
-				{
-					/* If using external clock, and console is not
-					 * attached to any external peripheral, bits are
-					 * not shifted, so SB is not modified. */
-				}
+	case 0xE0: /* LD (0xFF00+imm), A */
+		__gb_write(gb, 0xFF00 | __gb_read(gb, gb->cpu_reg.pc.reg++),
+			   gb->cpu_reg.a);
+		break;
 
-				gb->counter.serial_count = 0;
-			}
-		}
+	case 0xE1: /* POP HL */
+#if WALNUT_GB_16_BIT
+    gb->cpu_reg.hl.reg = __gb_read16(gb, gb->cpu_reg.sp.reg);
+    gb->cpu_reg.sp.reg += 2; // advance SP past the popped value
+#else
+    gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.sp.reg++);
+    gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.sp.reg++);
+#endif
+		break;
 
-		/* TIMA register timing */
-		/* TODO: Change tac_enable to struct of TAC timer control bits. */
-		if(gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK)
-		{
-			gb->counter.tima_count += inst_cycles;
+	case 0xE2: /* LD (C), A */
+		__gb_write(gb, 0xFF00 | gb->cpu_reg.bc.bytes.c, gb->cpu_reg.a);
+		break;
 
-			while(gb->counter.tima_count >=
-				TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK])
-			{
-				gb->counter.tima_count -=
-					TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK];
+	case 0xE5: /* PUSH HL */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.hl.bytes.h);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.hl.bytes.l);
+		break;
 
-				if(++gb->hram_io[IO_TIMA] == 0)
-				{
-					gb->hram_io[IO_IF] |= TIMER_INTR;
-					/* On overflow, set TMA to TIMA. */
-					gb->hram_io[IO_TIMA] = gb->hram_io[IO_TMA];
-				}
-			}
-		}
+	case 0xE6: /* AND imm */
+	{
+		uint8_t temp = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		WGB_INSTR_AND_R8(temp);
+		break;
+	}
 
-		/* If LCD is off, don't update LCD state or increase the LCD
-		 * ticks. Instead, keep track of the amount of time that is
-		 * being passed. */
-		if(!(gb->hram_io[IO_LCDC] & LCDC_ENABLE))
-		{
-			gb->counter.lcd_off_count += inst_cycles;
-			if(gb->counter.lcd_off_count >= LCD_FRAME_CYCLES)
-			{
-				gb->counter.lcd_off_count -= LCD_FRAME_CYCLES;
-				gb->gb_frame = true;
-			}
-			continue;
-		}
+	case 0xE7: /* RST 0x0020 */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		gb->cpu_reg.pc.reg = 0x0020;
+		break;
 
-		/* LCD Timing */
-#if WALNUT_FULL_GBC_SUPPORT
-        if (inst_cycles > 1) {
-            gb->counter.lcd_count += (inst_cycles >> gb->cgb.doubleSpeed);
-        } else {
-#endif
-		gb->counter.lcd_count += inst_cycles;
-#if WALNUT_FULL_GBC_SUPPORT
+	case 0xE8: /* ADD SP, imm */
+	{
+		int8_t offset = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
+		gb->cpu_reg.f.reg = 0;
+		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
+		gb->cpu_reg.f.f_bits.c = ((gb->cpu_reg.sp.reg & 0xFF) + (offset & 0xFF) > 0xFF);
+		gb->cpu_reg.sp.reg += offset;
+		break;
 	}
+
+	case 0xE9: /* JP (HL) */
+		gb->cpu_reg.pc.reg = gb->cpu_reg.hl.reg;
+		break;
+
+	case 0xEA: /* LD (imm), A */
+	{
+#if WALNUT_GB_16_BIT
+    uint16_t addr = __gb_read16(gb, gb->cpu_reg.pc.reg);
+    gb->cpu_reg.pc.reg += 2; // advance past the immediate
+#else
+    uint8_t l = __gb_read(gb, gb->cpu_reg.pc.reg++);
+    uint8_t h = __gb_read(gb, gb->cpu_reg.pc.reg++);
+    uint16_t addr = WALNUT_GB_U8_TO_U16(h, l);
 #endif
+		__gb_write(gb, addr, gb->cpu_reg.a);
+		break;
+	}
 
-		/* New Scanline. HBlank -> VBlank or OAM Scan */
-		if(gb->counter.lcd_count >= LCD_LINE_CYCLES)
-		{
-			gb->counter.lcd_count -= LCD_LINE_CYCLES;
+	case 0xEE: /* XOR imm */
+		WGB_INSTR_XOR_R8(__gb_read(gb, gb->cpu_reg.pc.reg++));
+		break;
 
-			/* Next line */
-			gb->hram_io[IO_LY] = gb->hram_io[IO_LY] + 1;
-			if (gb->hram_io[IO_LY] == LCD_VERT_LINES)
-				gb->hram_io[IO_LY] = 0;
+	case 0xEF: /* RST 0x0028 */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		gb->cpu_reg.pc.reg = 0x0028;
+		break;
 
-			/* LYC Update */
-			if(gb->hram_io[IO_LY] == gb->hram_io[IO_LYC])
-			{
-				gb->hram_io[IO_STAT] |= STAT_LYC_COINC;
+	case 0xF0: /* LD A, (0xFF00+imm) */
+		gb->cpu_reg.a =
+			__gb_read(gb, 0xFF00 | __gb_read(gb, gb->cpu_reg.pc.reg++));
+		break;
 
-				if(gb->hram_io[IO_STAT] & STAT_LYC_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
-			}
-			else
-				gb->hram_io[IO_STAT] &= 0xFB;
+	case 0xF1: /* POP AF */
+	{
+		uint8_t temp_8 = __gb_read(gb, gb->cpu_reg.sp.reg++);
+		gb->cpu_reg.f.f_bits.z = (temp_8 >> 7) & 1;
+		gb->cpu_reg.f.f_bits.n = (temp_8 >> 6) & 1;
+		gb->cpu_reg.f.f_bits.h = (temp_8 >> 5) & 1;
+		gb->cpu_reg.f.f_bits.c = (temp_8 >> 4) & 1;
+		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.sp.reg++);
+		break;
+	}
 
-			/* Check if LCD should be in Mode 1 (VBLANK) state */
-			if(gb->hram_io[IO_LY] == LCD_HEIGHT)
-			{
-				gb->hram_io[IO_STAT] =
-					(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_VBLANK;
-				gb->gb_frame = true;
-				gb->hram_io[IO_IF] |= VBLANK_INTR;
-				gb->lcd_blank = false;
+	case 0xF2: /* LD A, (C) */
+		gb->cpu_reg.a = __gb_read(gb, 0xFF00 | gb->cpu_reg.bc.bytes.c);
+		break;
 
-				if(gb->hram_io[IO_STAT] & STAT_MODE_1_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
+	case 0xF3: /* DI */
+		gb->gb_ime = false;
+		__gb_update_irq(gb);
+		break;
 
-#if ENABLE_LCD
-				/* If frame skip is activated, check if we need to draw
-				 * the frame or skip it. */
-				if(gb->direct.frame_skip)
-				{
-					gb->display.frame_skip_count =
-						!gb->display.frame_skip_count;
-				}
+	case 0xF5: /* PUSH AF */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.a);
+		__gb_write(gb, --gb->cpu_reg.sp.reg,
+			   gb->cpu_reg.f.f_bits.z << 7 | gb->cpu_reg.f.f_bits.n << 6 |
+			   gb->cpu_reg.f.f_bits.h << 5 | gb->cpu_reg.f.f_bits.c << 4);
+		break;
 
-				/* If interlaced is activated, change which lines get
-				 * updated. Also, only update lines on frames that are
-				 * actually drawn when frame skip is enabled. */
-				if(gb->direct.interlace &&
-						(!gb->direct.frame_skip ||
-						 gb->display.frame_skip_count))
-				{
-					gb->display.interlace_count =
-						!gb->display.interlace_count;
-				}
-#endif
-                                /* If halted forever, then return on VBLANK. */
-                                if(gb->gb_halt && !gb->hram_io[IO_IE])
-					break;
-			}
-			/* Start of normal Line (not in VBLANK) */
-			else if(gb->hram_io[IO_LY] < LCD_HEIGHT)
-			{
-				if(gb->hram_io[IO_LY] == 0)
-				{
-					/* Clear Screen */
-					gb->display.WY = gb->hram_io[IO_WY];
-					gb->display.window_clear = 0;
-				}
+	case 0xF6: /* OR imm */
+		WGB_INSTR_OR_R8(__gb_read(gb, gb->cpu_reg.pc.reg++));
+		break;
 
-				/* OAM Search occurs at the start of the line. */
-				gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_OAM_SCAN;
-				gb->counter.lcd_count = 0;
+	case 0xF7: /* PUSH AF */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		gb->cpu_reg.pc.reg = 0x0030;
+		break;
 
+	case 0xF8: /* LD HL, SP+/-imm */
+	{
+		/* Taken from SameBoy, which is released under MIT Licence. */
+		int8_t offset = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
+		gb->cpu_reg.hl.reg = gb->cpu_reg.sp.reg + offset;
+		gb->cpu_reg.f.reg = 0;
+		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
+		gb->cpu_reg.f.f_bits.c = ((gb->cpu_reg.sp.reg & 0xFF) + (offset & 0xFF) > 0xFF) ? 1 : 0;
+		break;
+	}
 
-#if WALNUT_FULL_GBC_SUPPORT
-				//DMA GBC
-				if(gb->cgb.cgbMode && !gb->cgb.dmaActive && gb->cgb.dmaMode)
-				{
-#if WALNUT_GB_32BIT_DMA
-					// Optimized 16-bit path
-					for (uint8_t i = 0; i < 0x10; i += 4)
-					{
-							uint32_t val = __gb_read32(gb, (gb->cgb.dmaSource & 0xFFF0) + i);
-							__gb_write32(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i, val);
-							// 8-bit logic if there is some cause to fall back
-							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i, val);
-							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i + 1, val >> 8);
-							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i + 2, val >> 16);
-							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i + 3, val >> 24);
-					}
-#elif WALNUT_GB_16BIT_DMA
-					// Optimized 16-bit path
-					for (uint8_t i = 0; i < 0x10; i += 2)
-					{
-							uint16_t val = __gb_read16(gb, (gb->cgb.dmaSource & 0xFFF0) + i);
-							__gb_write16(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i, val);
-							// 8-bit logic if there is some cause to fall back
-							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i, val & 0xFF);
-							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i + 1, val >> 8);
-					}
+	case 0xF9: /* LD SP, HL */
+		gb->cpu_reg.sp.reg = gb->cpu_reg.hl.reg;
+		break;
+
+	case 0xFA: /* LD A, (imm) */
+	{
+#if WALNUT_GB_16_BIT
+    uint16_t addr = __gb_read16(gb, gb->cpu_reg.pc.reg);
+    gb->cpu_reg.pc.reg += 2; // advance past the immediate
 #else
-			    // Original 8-bit path
-					for (uint8_t i = 0; i < 0x10; i++)
-					{
-						__gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i,
-										__gb_read(gb, (gb->cgb.dmaSource & 0xFFF0) + i));
-					}
+    uint8_t l = __gb_read(gb, gb->cpu_reg.pc.reg++);
+    uint8_t h = __gb_read(gb, gb->cpu_reg.pc.reg++);
+    uint16_t addr = WALNUT_GB_U8_TO_U16(h, l);
 #endif
+		gb->cpu_reg.a = __gb_read(gb, addr);
+		break;
+	}
 
-					gb->cgb.dmaSource += 0x10;
-					gb->cgb.dmaDest += 0x10;
-					if(!(--gb->cgb.dmaSize)) {gb->cgb.dmaActive = 1;
-					}
-				}
-#endif
-				if(gb->hram_io[IO_STAT] & STAT_MODE_2_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
+	case 0xFB: /* EI */
+		gb->gb_ime = true;
+		__gb_update_irq(gb);
+		break;
 
-				/* If halted immediately jump to next LCD mode.
-				 * From OAM Search to LCD Draw. */
-				//if(gb->counter.lcd_count < LCD_MODE2_OAM_SCAN_END)
-				//	inst_cycles = LCD_MODE2_OAM_SCAN_END - gb->counter.lcd_count;
-				inst_cycles = LCD_MODE2_OAM_SCAN_DURATION;
-			}
-		}
-		/* Go from Mode 3 (LCD Draw) to Mode 0 (HBLANK). */
-		else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_LCD_DRAW &&
-				gb->counter.lcd_count >= LCD_MODE3_LCD_DRAW_END)
-		{
-			gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_HBLANK;
+	case 0xFE: /* CP imm */
+	{
+		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		WGB_INSTR_CP_R8(val);
+		break;
+	}
 
-			if(gb->hram_io[IO_STAT] & STAT_MODE_0_INTR)
-				gb->hram_io[IO_IF] |= LCDC_INTR;
+	case 0xFF: /* RST 0x0038 */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		gb->cpu_reg.pc.reg = 0x0038;
+		break;
 
-			/* If halted immediately, jump from OAM Scan to LCD Draw. */
-			if (gb->counter.lcd_count < LCD_MODE0_HBLANK_MAX_DRUATION)
-				inst_cycles = LCD_MODE0_HBLANK_MAX_DRUATION - gb->counter.lcd_count;
-		}
-		/* Go from Mode 2 (OAM Scan) to Mode 3 (LCD Draw). */
-		else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_OAM_SCAN &&
-				gb->counter.lcd_count >= LCD_MODE2_OAM_SCAN_END)
-		{
-			gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_LCD_DRAW;
-#if ENABLE_LCD
-			if(!gb->lcd_blank)
-				__gb_draw_line(gb);
-#endif
-			/* If halted immediately jump to next LCD mode. */
-			if (gb->counter.lcd_count < LCD_MODE3_LCD_DRAW_MIN_DURATION)
-				inst_cycles = LCD_MODE3_LCD_DRAW_MIN_DURATION - gb->counter.lcd_count;
-		}
-	} while(gb->gb_halt && (gb->hram_io[IO_IF] & gb->hram_io[IO_IE]) == 0);
+	default:
+		/* Return address where invalid opcode that was read. */
+		(gb->gb_error)(gb, GB_INVALID_OPCODE, gb->cpu_reg.pc.reg - 1);
+		WGB_UNREACHABLE();
+	}
+
+	// *** post opcode handling ***
+
+	/* Counters are only updated once the next event is due. */
+	gb->counter.pending_cycles += inst_cycles;
+	if(gb->counter.pending_cycles >= gb->counter.next_event)
+		__gb_run_events(gb);
 }
 
 void gb_run_frame(struct gb_s *gb)
@@ -7550,6 +9849,16 @@ void gb_reset(struct gb_s *gb)
 	gb->counter.serial_count = 0;
 	gb->counter.rtc_count = 0;
 	gb->counter.lcd_off_count = 0;
+	gb->counter.pending_cycles = 0;
+	gb->counter.next_event = 0;
+#if WALNUT_GB_IDLE_SKIP
+	gb->counter.events_run = 0;
+	memset(&gb->idle, 0, sizeof(gb->idle));
+	memset(&gb->idle_stats, 0, sizeof(gb->idle_stats));
+#endif
+#if WALNUT_GB_IDLE_SKIP || WALNUT_GB_COPY_LOOPS
+	gb->loop_prev_pc = 0;
+#endif
 
 	gb->direct.joypad = 0xFF;
 	gb->hram_io[IO_JOYP] = 0xCF;
@@ -7577,6 +9886,7 @@ void gb_reset(struct gb_s *gb)
 	gb->hram_io[IO_WX] = 0x00;
 	gb->hram_io[IO_IE] = 0x00;
 	gb->hram_io[IO_IF] = 0xE1;
+	__gb_update_irq(gb);
 #if WALNUT_FULL_GBC_SUPPORT
 	/* Initialize some CGB registers */
 	gb->cgb.doubleSpeed = 0;
@@ -7600,6 +9910,40 @@ void gb_reset(struct gb_s *gb)
 	gb->cgb.dmaSource = 0;
 	gb->cgb.dmaDest = 0;
 #endif
+
+#if WALNUT_GB_PAGE_TABLE
+	/* Pages that are not mapped below are always handled by
+	 * __gb_read() and __gb_write(). */
+	memset(gb->read_page, 0, sizeof(gb->read_page));
+	memset(gb->write_page, 0, sizeof(gb->write_page));
+	__gb_map_rom(gb);
+	__gb_map_vram(gb);
+	__gb_map_wram(gb);
+	__gb_map_cart_ram(gb);
+#endif
+#if WALNUT_GB_TILE_CACHE
+	memset(gb->tile_dirty, 0xFF, sizeof(gb->tile_dirty));
+#endif
+#if WALNUT_GB_PIXEL_LUT
+	gb->display.bg_lanes_valid = false;
+#endif
+#if WALNUT_GB_MAP_CACHE
+	gb->display.map_rows[WGB_MAP_ROW_BG].map = 0;
+	gb->display.map_rows[WGB_MAP_ROW_WIN].map = 0;
+#endif
+#if WALNUT_GB_SPRITE_BUCKETS
+	gb->sprite_buckets_dirty = true;
+#endif
+#if WALNUT_GB_DEFERRED_LCD
+	/* Everything is recorded again before the next logged line. */
+	memset(gb->log_vram_dirty, 0xFF, sizeof(gb->log_vram_dirty));
+	gb->log_oam_dirty = true;
+	gb->log_palette_dirty = true;
+#endif
+#if WALNUT_GB_DIRTY_LINES
+	__gb_lines_reset(gb);
+	gb->line_oam_written = true;
+#endif
 }
 
 enum gb_init_error_e gb_init(struct gb_s *gb,
@@ -7663,6 +10007,16 @@ enum gb_init_error_e gb_init(struct gb_s *gb,
 
 	gb->gb_bootrom_read = NULL;
 
+#if WALNUT_GB_PAGE_TABLE
+	gb->rom = NULL;
+	gb->rom_size = 0;
+	gb->cram = NULL;
+	gb->cram_size = 0;
+#endif
+#if WALNUT_GB_IDLE_SKIP
+	gb->direct.idle_skip = true;
+#endif
+
 	/* Check valid ROM using checksum value. */
 	{
 		uint8_t x = 0;
@@ -7679,6 +10033,10 @@ enum gb_init_error_e gb_init(struct gb_s *gb,
 	{
 #if WALNUT_FULL_GBC_SUPPORT
 		gb->cgb.cgbMode = (gb_rom_read(gb, cgb_flag) & 0x80) >> 7;
+# if ENABLE_LCD
+		gb->display.draw_line = gb->cgb.cgbMode ?
+			__gb_draw_line_cgb : __gb_draw_line_dmg;
+# endif
 #endif
 		const uint8_t mbc_value = gb->gb_rom_read(gb, mbc_location);
 
@@ -7687,6 +10045,29 @@ enum gb_init_error_e gb_init(struct gb_s *gb,
 			return GB_INIT_CARTRIDGE_UNSUPPORTED;
 	}
 
+	switch(gb->mbc)
+	{
+	case 1:
+		gb->mbc_write = __gb_mbc1_write;
+		break;
+
+	case 2:
+		gb->mbc_write = __gb_mbc2_write;
+		break;
+
+	case 3:
+		gb->mbc_write = __gb_mbc3_write;
+		break;
+
+	case 5:
+		gb->mbc_write = __gb_mbc5_write;
+		break;
+
+	default:
+		gb->mbc_write = __gb_mbc0_write;
+		break;
+	}
+
 	gb->num_rom_banks_mask = num_rom_banks_mask[gb_rom_read(gb, bank_count_location)] - 1;
 	gb->cart_ram = cart_ram[gb_rom_read(gb, mbc_location)];
 	gb->num_ram_banks = num_ram_banks[gb_rom_read(gb, ram_size_location)];
@@ -7710,6 +10091,13 @@ enum gb_init_error_e gb_init(struct gb_s *gb,
 
 	gb->lcd_blank = false;
 	gb->display.lcd_draw_line = NULL;
+	gb->display.lcd_line_rgb565 = NULL;
+#if WALNUT_GB_DEFERRED_LCD
+	gb->line_log = NULL;
+#endif
+#if WALNUT_GB_DIRTY_LINES
+	memset(&gb->line_stats, 0, sizeof(gb->line_stats));
+#endif
 
 	gb_reset(gb);
 
@@ -7747,17 +10135,215 @@ void gb_init_lcd(struct gb_s *gb,
 			const uint_fast8_t line))
 {
 	gb->display.lcd_draw_line = lcd_draw_line;
+	gb->display.lcd_line_rgb565 = NULL;
 
 	gb->direct.interlace = false;
 	gb->display.interlace_count = false;
 	gb->direct.frame_skip = false;
 	gb->display.frame_skip_count = false;
+	gb->direct.no_render = false;
+#if WALNUT_GB_LINE_SPANS
+	gb->display.in_span = false;
+	gb->display.span_x = 0;
+	memset(gb->display.line_pixels, 0, sizeof(gb->display.line_pixels));
+# if WALNUT_GB_DIRTY_LINES
+	gb->display.line_unchanged = false;
+# endif
+#endif
 
 	gb->display.window_clear = 0;
 	gb->display.WY = 0;
+#if WALNUT_GB_DIRTY_LINES
+	/* The front-end draws the lines differently now. */
+	memset(gb->line_dirty, 0xFF, sizeof(gb->line_dirty));
+#endif
 
 	return;
 }
+
+void gb_set_palette_rgb565(struct gb_s *gb, const uint16_t palette[12])
+{
+	uint_fast8_t i;
+
+	/* Pixel values are the shade in bits 1-0 and the layer in bits 5-4,
+	 * see lcd_draw_line. Layer 3 is never drawn and has no colours. */
+	for(i = 0; i < 0x40; i++)
+	{
+		uint16_t c;
+
+		if((i & 0x30) == 0x30)
+			continue;
+
+		c = palette[((i & 0x30) >> 2) + (i & 0x03)];
+#if WALNUT_GB_RGB565_BIGENDIAN
+		c = (uint16_t)((c << 8) | (c >> 8));
+#endif
+		gb->display.dmg_rgb565[i] = c;
+	}
+#if WALNUT_GB_DIRTY_LINES
+	/* The front-end draws the lines differently now. */
+	memset(gb->line_dirty, 0xFF, sizeof(gb->line_dirty));
+#endif
+}
+
+void gb_init_lcd_rgb565(struct gb_s *gb,
+		uint16_t *(*lcd_line_rgb565)(struct gb_s *gb,
+			const uint_fast8_t line))
+{
+	/* White to black for each layer until the front-end sets a palette. */
+	const uint16_t grey[12] = {
+		0xFFFF, 0xAD55, 0x52AA, 0x0000,
+		0xFFFF, 0xAD55, 0x52AA, 0x0000,
+		0xFFFF, 0xAD55, 0x52AA, 0x0000
+	};
+
+	gb_init_lcd(gb, NULL);
+	gb->display.lcd_line_rgb565 = lcd_line_rgb565;
+	gb_set_palette_rgb565(gb, grey);
+}
+#endif
+
+#if WALNUT_GB_DEFERRED_LCD
+void gb_set_line_log(struct gb_s *gb, struct gb_s *render,
+		struct gb_line_log_s *log)
+{
+	gb->line_log = log;
+
+	if(log == NULL)
+		return;
+
+	/* The drawing context starts with everything drawn so far, so only
+	 * later changes need to be recorded. */
+	*render = *gb;
+	render->line_log = NULL;
+
+	memset(gb->log_vram_dirty, 0, sizeof(gb->log_vram_dirty));
+	gb->log_oam_dirty = false;
+	gb->log_palette_dirty = false;
+	gb->log_window_reset = false;
+	log->head = 0;
+	log->tail = 0;
+}
+
+bool gb_draw_logged_lines(struct gb_s *render, struct gb_line_log_s *log)
+{
+	uint32_t tail = log->tail;
+	const uint32_t head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+
+	while(tail != head)
+	{
+		const uint32_t header = log->words[tail % WGB_LINE_LOG_WORDS];
+		const uint_fast32_t arg = header & 0xFFFFFF;
+		/* Large enough for the biggest record, OAM. */
+		uint32_t data[OAM_SIZE / 4];
+		struct gb_logged_line_s line;
+		uint_fast8_t words = 0;
+		uint_fast8_t i;
+
+		switch(header >> 24)
+		{
+		case WGB_LOG_VRAM:
+			words = 16 / 4;
+			break;
+		case WGB_LOG_OAM:
+			words = OAM_SIZE / 4;
+			break;
+#if WALNUT_FULL_GBC_SUPPORT
+		case WGB_LOG_PALETTE:
+			words = sizeof(render->cgb.fixPalette) / 4;
+			break;
+#endif
+		case WGB_LOG_LINE:
+		case WGB_LOG_SPAN:
+			words = sizeof(line) / 4;
+			break;
+		}
+
+		for(i = 0; i < words; i++)
+			data[i] = log->words[(tail + 1 + i) % WGB_LINE_LOG_WORDS];
+
+		/* The record has been copied, so its space can be reused. */
+		tail += 1 + words;
+		__atomic_store_n(&log->tail, tail, __ATOMIC_RELEASE);
+
+		switch(header >> 24)
+		{
+		case WGB_LOG_VRAM:
+			memcpy(&render->vram[arg], data, 16);
+#if WALNUT_GB_TILE_CACHE || WALNUT_GB_DIRTY_LINES
+			__gb_vram_written(render, arg);
+#endif
+			break;
+
+		case WGB_LOG_OAM:
+			memcpy(render->oam, data, OAM_SIZE);
+#if WALNUT_GB_SPRITE_BUCKETS || WALNUT_GB_DIRTY_LINES
+			__gb_oam_written(render);
+#endif
+			break;
+
+#if WALNUT_FULL_GBC_SUPPORT
+		case WGB_LOG_PALETTE:
+			memcpy(render->cgb.fixPalette, data,
+					sizeof(render->cgb.fixPalette));
+# if WALNUT_GB_DIRTY_LINES
+			render->line_palette_gen = render->line_gen;
+# endif
+			break;
+#endif
+
+		case WGB_LOG_LINE:
+		case WGB_LOG_SPAN:
+#if WALNUT_GB_LINE_SPANS
+			/* Before the registers of the span are set. */
+			if((header >> 24) == WGB_LOG_SPAN)
+				__gb_draw_unchanged_line(render);
+#endif
+			memcpy(&line, data, sizeof(line));
+#if WALNUT_GB_SPRITE_BUCKETS
+			if((render->hram_io[IO_LCDC] ^ line.lcdc) & LCDC_OBJ_SIZE)
+				render->sprite_buckets_dirty = true;
+#endif
+			render->hram_io[IO_LY] = line.ly;
+			render->hram_io[IO_LCDC] = line.lcdc;
+			render->hram_io[IO_SCY] = line.scy;
+			render->hram_io[IO_SCX] = line.scx;
+			render->hram_io[IO_WX] = line.wx;
+			render->hram_io[IO_BGP] = line.bgp;
+			render->display.WY = line.wy;
+			memcpy(render->display.bg_palette, line.bg_palette,
+					sizeof(line.bg_palette));
+			memcpy(render->display.sp_palette, line.sp_palette,
+					sizeof(line.sp_palette));
+			render->direct.interlace =
+				(line.flags & WGB_LOGGED_INTERLACE) != 0;
+			render->display.interlace_count =
+				(line.flags & WGB_LOGGED_INTERLACE_COUNT) != 0;
+			render->direct.frame_skip =
+				(line.flags & WGB_LOGGED_FRAME_SKIP) != 0;
+			render->display.frame_skip_count =
+				(line.flags & WGB_LOGGED_FRAME_SKIP_COUNT) != 0;
+			if(line.flags & WGB_LOGGED_WINDOW_RESET)
+				render->display.window_clear = 0;
+
+#if WALNUT_GB_LINE_SPANS
+			if((header >> 24) == WGB_LOG_SPAN)
+			{
+				render->display.in_span = true;
+				__gb_draw_span(render, arg);
+				break;
+			}
+#endif
+			__gb_draw_line(render);
+			break;
+
+		case WGB_LOG_FRAME:
+			return true;
+		}
+	}
+
+	return false;
+}
 #endif
 
 void gb_set_bootrom(struct gb_s *gb,
@@ -7766,6 +10352,62 @@ void gb_set_bootrom(struct gb_s *gb,
 	gb->gb_bootrom_read = gb_bootrom_read;
 }
 
+#if WALNUT_GB_PAGE_TABLE
+void gb_set_rom_direct(struct gb_s *gb, const uint8_t *rom,
+		const uint_fast32_t rom_size)
+{
+	gb->rom = rom;
+	gb->rom_size = rom_size;
+	__gb_map_rom(gb);
+}
+
+void gb_set_cart_ram_direct(struct gb_s *gb, uint8_t *ram,
+		const uint_fast32_t ram_size)
+{
+	gb->cram = ram;
+	gb->cram_size = ram_size;
+	__gb_map_cart_ram(gb);
+}
+#endif
+
+#if WALNUT_GB_DIRTY_LINES
+void gb_redraw_lines(struct gb_s *gb)
+{
+	memset(gb->line_dirty, 0xFF, sizeof(gb->line_dirty));
+}
+
+uint_fast8_t gb_get_line_stats(struct gb_s *gb,
+		struct gb_line_stats_s *stats, const bool reset)
+{
+	const uint_fast32_t lines =
+		gb->line_stats.drawn + gb->line_stats.skipped;
+	const uint_fast32_t skipped = gb->line_stats.skipped;
+
+	if(stats != NULL)
+		*stats = gb->line_stats;
+
+	if(reset)
+		memset(&gb->line_stats, 0, sizeof(gb->line_stats));
+
+	if(lines == 0)
+		return 0;
+
+	return (uint_fast8_t)(((uint_fast64_t)skipped * 100) / lines);
+}
+#endif
+
+#if WALNUT_GB_IDLE_SKIP
+void gb_get_idle_stats(struct gb_s *gb, struct gb_idle_stats_s *stats,
+		const bool reset)
+{
+	if(stats != NULL)
+		*stats = gb->idle_stats;
+
+	if(reset)
+		memset(&gb->idle_stats, 0, sizeof(gb->idle_stats));
+}
+#endif
+
 /**
  * Deprecated. Will be removed in the next major version.
  */
@@ -7861,6 +10503,67 @@ void gb_init_lcd(struct gb_s *gb,
 		void (*lcd_draw_line)(struct gb_s *gb,
 			const uint8_t *pixels,
 			const uint_fast8_t line));
+
+/**
+ * Initialises the display context of the emulator to draw lines directly as
+ * RGB565 pixels, instead of calling lcd_draw_line. Before drawing each line,
+ * the core asks lcd_line_rgb565 for the 160 pixels to draw it to. Returning
+ * NULL skips all drawing for that line. CGB colours come from the CGB
+ * palettes, and DMG colours from gb_set_palette_rgb565(). All colours are
+ * byte swapped when WALNUT_GB_RGB565_BIGENDIAN is 1, as most SPI panels
+ * expect.
+ * This function can be called at any time.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param lcd_line_rgb565 Pointer to function that returns the line to draw
+ *		"line" to. Must not be NULL.
+ */
+void gb_init_lcd_rgb565(struct gb_s *gb,
+		uint16_t *(*lcd_line_rgb565)(struct gb_s *gb,
+			const uint_fast8_t line));
+
+/**
+ * Sets the colours of DMG games drawn with gb_init_lcd_rgb565().
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param palette RGB565 colours of shades 0-3 of OBJ0, then OBJ1, then BG.
+ *		Without WALNUT_GB_12_COLOUR, only the OBJ0 colours are used.
+ *		The colours are copied.
+ */
+void gb_set_palette_rgb565(struct gb_s *gb, const uint16_t palette[12]);
+#endif
+
+#if WALNUT_GB_DEFERRED_LCD
+/**
+ * Records the lines of gb to log instead of drawing them, so that they can be
+ * drawn to render by another thread with gb_draw_logged_lines() while gb runs
+ * the next lines. Each line is recorded with the registers it is drawn with
+ * and the VRAM, OAM and CGB palettes changed since the previous line, so the
+ * lines are the same as when drawn by gb. render is made a copy of gb,
+ * including its LCD callbacks and private data, so call this after
+ * gb_init_lcd() and between frames. Only available when
+ * WALNUT_GB_DEFERRED_LCD is 1.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param render Context that the lines are drawn in. Must not be NULL unless
+ *		log is NULL.
+ * \param log	Log to record to, or NULL to draw lines in gb again.
+ */
+void gb_set_line_log(struct gb_s *gb, struct gb_s *render,
+		struct gb_line_log_s *log);
+
+/**
+ * Draws the lines recorded in log to render, through the LCD callbacks of
+ * render, until the end of a frame or of the log. Must only be called by one
+ * thread. gb waits for this function while log is full, so it must not be
+ * called on the thread running gb.
+ *
+ * \param render Context given to gb_set_line_log().
+ * \param log	Log given to gb_set_line_log().
+ * \returns	true when the end of a frame was reached, or false when all
+ *		recorded lines were drawn before it.
+ */
+bool gb_draw_logged_lines(struct gb_s *render, struct gb_line_log_s *log);
 #endif
 
 /**
@@ -7936,101 +10639,102 @@ void gb_tick_rtc(struct gb_s *gb);
  * Should be called after gb_init().
  *
  * \param gb	An initialised emulator context. Must not be NULL.
- * \param time	Time structure with date and time.
- */
-void gb_set_rtc(struct gb_s *gb, const struct tm * const time);
-
-/**
- * Use boot ROM on reset. gb_reset() must be called for this to take affect.
- * \param gb 	An initialised emulator context. Must not be NULL.
- * \param gb_bootrom_read Function pointer to read boot ROM binary.
- */
-void gb_set_bootrom(struct gb_s *gb,
-	uint8_t (*gb_bootrom_read)(struct gb_s*, const uint_fast16_t));
-
-/* Steps the cpu by one instruction, this is the original Peanut-GB dispatch method here for compatibility, or for burning cycles inefficiently if doing preemptive execution */
-void __gb_step_cpu_x(struct gb_s *gb)
-{
-	uint8_t opcode;
-	uint_fast16_t inst_cycles;
-	static const uint8_t op_cycles[0x100] =
-	{
-		/* *INDENT-OFF* */
-		/*0 1 2  3  4  5  6  7  8  9  A  B  C  D  E  F	*/
-		4,12, 8, 8, 4, 4, 8, 4,20, 8, 8, 8, 4, 4, 8, 4,	/* 0x00 */
-		4,12, 8, 8, 4, 4, 8, 4,12, 8, 8, 8, 4, 4, 8, 4,	/* 0x10 */
-		8,12, 8, 8, 4, 4, 8, 4, 8, 8, 8, 8, 4, 4, 8, 4,	/* 0x20 */
-		8,12, 8, 8,12,12,12, 4, 8, 8, 8, 8, 4, 4, 8, 4,	/* 0x30 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x40 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x50 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x60 */
-		8, 8, 8, 8, 8, 8, 4, 8, 4, 4, 4, 4, 4, 4, 8, 4, /* 0x70 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x80 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x90 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0xA0 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0xB0 */
-		8,12,12,16,12,16, 8,16, 8,16,12, 8,12,24, 8,16,	/* 0xC0 */
-		8,12,12, 0,12,16, 8,16, 8,16,12, 0,12, 0, 8,16,	/* 0xD0 */
-		12,12,8, 0, 0,16, 8,16,16, 4,16, 0, 0, 0, 8,16,	/* 0xE0 */
-		12,12,8, 4, 0,16, 8,16,12, 8,16, 4, 0, 0, 8,16	/* 0xF0 */
-		/* *INDENT-ON* */
-	};
-	static const uint_fast16_t TAC_CYCLES[4] = {1024, 16, 64, 256};
-
-	/* Handle interrupts */
-	/* If gb_halt is positive, then an interrupt must have occurred by the
-	 * time we reach here, because on HALT, we jump to the next interrupt
-	 * immediately. */
-	while(gb->gb_halt || (gb->gb_ime &&
-			gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & ANY_INTR))
-	{
-		gb->gb_halt = false;
+ * \param time	Time structure with date and time.
+ */
+void gb_set_rtc(struct gb_s *gb, const struct tm * const time);
 
-		if(!gb->gb_ime)
-			break;
+/**
+ * Use boot ROM on reset. gb_reset() must be called for this to take affect.
+ * \param gb 	An initialised emulator context. Must not be NULL.
+ * \param gb_bootrom_read Function pointer to read boot ROM binary.
+ */
+void gb_set_bootrom(struct gb_s *gb,
+	uint8_t (*gb_bootrom_read)(struct gb_s*, const uint_fast16_t));
 
-		/* Disable interrupts */
-		gb->gb_ime = false;
+/**
+ * Let the emulator read the ROM image directly from memory instead of calling
+ * gb_rom_read for every access. The ROM must stay in memory, unmodified, for as
+ * long as the emulator context is used. Only available when
+ * WALNUT_GB_PAGE_TABLE is defined to a non-zero value.
+ * Should be called after gb_init().
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param rom	Pointer to the ROM image. Set to NULL to use gb_rom_read again.
+ * \param rom_size Size of the ROM image in bytes.
+ */
+#if WALNUT_GB_PAGE_TABLE
+void gb_set_rom_direct(struct gb_s *gb, const uint8_t *rom,
+	const uint_fast32_t rom_size);
+#endif
 
-		/* Push Program Counter */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+/**
+ * Lets the core access cart RAM directly instead of through the
+ * gb_cart_ram_read and gb_cart_ram_write callbacks. The enabled RAM bank is
+ * then read and written through the page table. ram must be the buffer used
+ * by those callbacks, since MBC2 RAM and the MBC3 RTC still use them. Only
+ * available when WALNUT_GB_PAGE_TABLE is enabled.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param ram	Pointer to the cart RAM. Set to NULL to use the callbacks again.
+ * \param ram_size Size of the cart RAM in bytes, see gb_get_save_size_s().
+ */
+#if WALNUT_GB_PAGE_TABLE
+void gb_set_cart_ram_direct(struct gb_s *gb, uint8_t *ram,
+	const uint_fast32_t ram_size);
+#endif
 
-		/* Call interrupt handler if required. */
-		if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & VBLANK_INTR)
-		{
-			gb->cpu_reg.pc.reg = VBLANK_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= VBLANK_INTR;
-		}
-		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & LCDC_INTR)
-		{
-			gb->cpu_reg.pc.reg = LCDC_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= LCDC_INTR;
-		}
-		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & TIMER_INTR)
-		{
-			gb->cpu_reg.pc.reg = TIMER_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= TIMER_INTR;
-		}
-		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & SERIAL_INTR)
-		{
-			gb->cpu_reg.pc.reg = SERIAL_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= SERIAL_INTR;
-		}
-		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & CONTROL_INTR)
-		{
-			gb->cpu_reg.pc.reg = CONTROL_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= CONTROL_INTR;
-		}
+/**
+ * Copies the idle loop counters: how many times an idle loop was
+ * fast-forwarded and how many cycles were skipped. Only available when
+ * WALNUT_GB_IDLE_SKIP is defined to a non-zero value. Skipping can be turned
+ * off for a title by clearing gb->direct.idle_skip after gb_init().
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param stats	Receives the counters. May be NULL.
+ * \param reset	Clear the counters after reading them.
+ */
+#if WALNUT_GB_IDLE_SKIP
+void gb_get_idle_stats(struct gb_s *gb, struct gb_idle_stats_s *stats,
+	const bool reset);
+#endif
 
-		break;
-	}
+/**
+ * Draws every line on the next frame, even the lines that would be drawn the
+ * same as before. Call this when the front-end's copy of the lines was lost,
+ * for example after clearing the screen. Only available when
+ * WALNUT_GB_DIRTY_LINES is defined to a non-zero value.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ */
+#if WALNUT_GB_DIRTY_LINES
+void gb_redraw_lines(struct gb_s *gb);
+#endif
 
-	/* Obtain opcode */
-	opcode = __gb_read(gb, gb->cpu_reg.pc.reg++);
-	inst_cycles = op_cycles[opcode];
+/**
+ * Returns the percentage of lines that were not drawn because they would be
+ * drawn the same as before, and optionally copies the line counters. Lines
+ * skipped for interlacing or frame skip, or by the front-end, are not
+ * counted. Only available when WALNUT_GB_DIRTY_LINES is defined to a non-zero
+ * value.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param stats	Receives the counters. May be NULL.
+ * \param reset	Clear the counters after reading them.
+ * \returns	Percentage of lines left as they were.
+ */
+#if WALNUT_GB_DIRTY_LINES
+uint_fast8_t gb_get_line_stats(struct gb_s *gb,
+	struct gb_line_stats_s *stats, const bool reset);
+#endif
+
+/* Executes an opcode that has already been fetched, with the program counter
+ * pointing past it. Returns inst_cycles, plus any extra cycles taken by
+ * conditional branches. */
+static inline uint_fast16_t __gb_execute_opcode(struct gb_s *gb,
+	uint8_t opcode, uint_fast16_t inst_cycles)
+{
+	static const uint_fast16_t TAC_CYCLES[4] = {1024, 16, 64, 256};
 
-	/* Execute opcode */
 	switch(opcode)
 	{
 	case 0x00: /* NOP */
@@ -8128,8 +10832,11 @@ void __gb_step_cpu_x(struct gb_s *gb)
 #if WALNUT_FULL_GBC_SUPPORT
 		if(gb->cgb.cgbMode & gb->cgb.doubleSpeedPrep)
 		{
+			/* LCD timing rate changes with the CPU speed. */
+			__gb_catch_up(gb);
 			gb->cgb.doubleSpeedPrep = 0;
 			gb->cgb.doubleSpeed ^= 1;
+			gb->counter.next_event = 0;
 		}
 #endif
 		break;
@@ -8663,7 +11370,10 @@ void __gb_step_cpu_x(struct gb_s *gb)
 		int_fast16_t halt_cycles = INT_FAST16_MAX;
 
 		/* TODO: Emulate HALT bug? */
+		__gb_catch_up(gb);
 		gb->gb_halt = true;
+		gb->irq_pending = true;
+		gb->counter.next_event = 0;
 
 		if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
 		{
@@ -9352,6 +12062,7 @@ void __gb_step_cpu_x(struct gb_s *gb)
     gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
 #endif
 		gb->gb_ime = true;
+		__gb_update_irq(gb);
 	}
 	break;
 
@@ -9508,388 +12219,136 @@ void __gb_step_cpu_x(struct gb_s *gb)
 		break;
 
 	case 0xF3: /* DI */
-		gb->gb_ime = false;
-		break;
-
-	case 0xF5: /* PUSH AF */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.a);
-		__gb_write(gb, --gb->cpu_reg.sp.reg,
-			   gb->cpu_reg.f.f_bits.z << 7 | gb->cpu_reg.f.f_bits.n << 6 |
-			   gb->cpu_reg.f.f_bits.h << 5 | gb->cpu_reg.f.f_bits.c << 4);
-		break;
-
-	case 0xF6: /* OR imm */
-		WGB_INSTR_OR_R8(__gb_read(gb, gb->cpu_reg.pc.reg++));
-		break;
-
-	case 0xF7: /* PUSH AF */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0030;
-		break;
-
-	case 0xF8: /* LD HL, SP+/-imm */
-	{
-		/* Taken from SameBoy, which is released under MIT Licence. */
-		int8_t offset = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.hl.reg = gb->cpu_reg.sp.reg + offset;
-		gb->cpu_reg.f.reg = 0;
-		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
-		gb->cpu_reg.f.f_bits.c = ((gb->cpu_reg.sp.reg & 0xFF) + (offset & 0xFF) > 0xFF) ? 1 : 0;
-		break;
-	}
-
-	case 0xF9: /* LD SP, HL */
-		gb->cpu_reg.sp.reg = gb->cpu_reg.hl.reg;
-		break;
-
-	case 0xFA: /* LD A, (imm) */
-	{
-#if WALNUT_GB_16_BIT_DISABLED
-    uint16_t addr = __gb_read16(gb, gb->cpu_reg.pc.reg);
-    gb->cpu_reg.pc.reg += 2; // advance past the immediate
-#else
-    uint8_t l = __gb_read(gb, gb->cpu_reg.pc.reg++);
-    uint8_t h = __gb_read(gb, gb->cpu_reg.pc.reg++);
-    uint16_t addr = WALNUT_GB_U8_TO_U16(h, l);
-#endif
-		gb->cpu_reg.a = __gb_read(gb, addr);
-		break;
-	}
-
-	case 0xFB: /* EI */
-		gb->gb_ime = true;
-		break;
-
-	case 0xFE: /* CP imm */
-	{
-		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		WGB_INSTR_CP_R8(val);
-		break;
-	}
-
-	case 0xFF: /* RST 0x0038 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0038;
-		break;
-
-	default:
-		/* Return address where invalid opcode that was read. */
-		(gb->gb_error)(gb, GB_INVALID_OPCODE, gb->cpu_reg.pc.reg - 1);
-		WGB_UNREACHABLE();
-	}
-
-	do
-	{
-		/* DIV register timing */
-		gb->counter.div_count += inst_cycles;
-		while(gb->counter.div_count >= DIV_CYCLES)
-		{
-			gb->hram_io[IO_DIV]++;
-			gb->counter.div_count -= DIV_CYCLES;
-		}
-
-		/* Check for RTC tick. */
-		if(gb->mbc == 3 && (gb->rtc_real.reg.high & 0x40) == 0)
-		{
-			gb->counter.rtc_count += inst_cycles;
-			while(WGB_UNLIKELY(gb->counter.rtc_count >= RTC_CYCLES))
-			{
-				gb->counter.rtc_count -= RTC_CYCLES;
-
-				/* Detect invalid rollover. */
-				if(WGB_UNLIKELY(gb->rtc_real.reg.sec == 63))
-				{
-					gb->rtc_real.reg.sec = 0;
-					continue;
-				}
-
-				if(++gb->rtc_real.reg.sec != 60)
-					continue;
-
-				gb->rtc_real.reg.sec = 0;
-				if(gb->rtc_real.reg.min == 63)
-				{
-					gb->rtc_real.reg.min = 0;
-					continue;
-				}
-				if(++gb->rtc_real.reg.min != 60)
-					continue;
-
-				gb->rtc_real.reg.min = 0;
-				if(gb->rtc_real.reg.hour == 31)
-				{
-					gb->rtc_real.reg.hour = 0;
-					continue;
-				}
-				if(++gb->rtc_real.reg.hour != 24)
-					continue;
-
-				gb->rtc_real.reg.hour = 0;
-				if(++gb->rtc_real.reg.yday != 0)
-					continue;
-
-				if(gb->rtc_real.reg.high & 1)  /* Bit 8 of days*/
-					gb->rtc_real.reg.high |= 0x80; /* Overflow bit */
-
-				gb->rtc_real.reg.high ^= 1;
-			}
-		}
-
-		/* Check serial transmission. */
-		if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
-		{
-			unsigned int serial_cycles = SERIAL_CYCLES_1KB;
-
-			/* If new transfer, call TX function. */
-			if(gb->counter.serial_count == 0 &&
-				gb->gb_serial_tx != NULL)
-				(gb->gb_serial_tx)(gb, gb->hram_io[IO_SB]);
-
-#if WALNUT_FULL_GBC_SUPPORT
-			if(gb->hram_io[IO_SC] & 0x3)
-				serial_cycles = SERIAL_CYCLES_32KB;
-#endif
-
-			gb->counter.serial_count += inst_cycles;
-
-			/* If it's time to receive byte, call RX function. */
-			if(gb->counter.serial_count >= serial_cycles)
-			{
-				/* If RX can be done, do it. */
-				/* If RX failed, do not change SB if using external
-				 * clock, or set to 0xFF if using internal clock. */
-				uint8_t rx;
-
-				if(gb->gb_serial_rx != NULL &&
-					(gb->gb_serial_rx(gb, &rx) ==
-						GB_SERIAL_RX_SUCCESS))
-				{
-					gb->hram_io[IO_SB] = rx;
-
-					/* Inform game of serial TX/RX completion. */
-					gb->hram_io[IO_SC] &= 0x01;
-					gb->hram_io[IO_IF] |= SERIAL_INTR;
-				}
-				else if(gb->hram_io[IO_SC] & SERIAL_SC_CLOCK_SRC)
-				{
-					/* If using internal clock, and console is not
-					 * attached to any external peripheral, shifted
-					 * bits are replaced with logic 1. */
-					gb->hram_io[IO_SB] = 0xFF;
-
-					/* Inform game of serial TX/RX completion. */
-					gb->hram_io[IO_SC] &= 0x01;
-					gb->hram_io[IO_IF] |= SERIAL_INTR;
-				}
-				else
-				{
-					/* If using external clock, and console is not
-					 * attached to any external peripheral, bits are
-					 * not shifted, so SB is not modified. */
-				}
-
-				gb->counter.serial_count = 0;
-			}
-		}
-
-		/* TIMA register timing */
-		/* TODO: Change tac_enable to struct of TAC timer control bits. */
-		if(gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK)
-		{
-			gb->counter.tima_count += inst_cycles;
-
-			while(gb->counter.tima_count >=
-				TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK])
-			{
-				gb->counter.tima_count -=
-					TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK];
+		gb->gb_ime = false;
+		__gb_update_irq(gb);
+		break;
 
-				if(++gb->hram_io[IO_TIMA] == 0)
-				{
-					gb->hram_io[IO_IF] |= TIMER_INTR;
-					/* On overflow, set TMA to TIMA. */
-					gb->hram_io[IO_TIMA] = gb->hram_io[IO_TMA];
-				}
-			}
-		}
+	case 0xF5: /* PUSH AF */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.a);
+		__gb_write(gb, --gb->cpu_reg.sp.reg,
+			   gb->cpu_reg.f.f_bits.z << 7 | gb->cpu_reg.f.f_bits.n << 6 |
+			   gb->cpu_reg.f.f_bits.h << 5 | gb->cpu_reg.f.f_bits.c << 4);
+		break;
 
-		/* If LCD is off, don't update LCD state or increase the LCD
-		 * ticks. Instead, keep track of the amount of time that is
-		 * being passed. */
-		if(!(gb->hram_io[IO_LCDC] & LCDC_ENABLE))
-		{
-			gb->counter.lcd_off_count += inst_cycles;
-			if(gb->counter.lcd_off_count >= LCD_FRAME_CYCLES)
-			{
-				gb->counter.lcd_off_count -= LCD_FRAME_CYCLES;
-				gb->gb_frame = true;
-			}
-			continue;
-		}
+	case 0xF6: /* OR imm */
+		WGB_INSTR_OR_R8(__gb_read(gb, gb->cpu_reg.pc.reg++));
+		break;
 
-		/* LCD Timing */
-#if WALNUT_FULL_GBC_SUPPORT
-        if (inst_cycles > 1) {
-            gb->counter.lcd_count += (inst_cycles >> gb->cgb.doubleSpeed);
-        } else {
-#endif
-		gb->counter.lcd_count += inst_cycles;
-#if WALNUT_FULL_GBC_SUPPORT
+	case 0xF7: /* PUSH AF */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		gb->cpu_reg.pc.reg = 0x0030;
+		break;
+
+	case 0xF8: /* LD HL, SP+/-imm */
+	{
+		/* Taken from SameBoy, which is released under MIT Licence. */
+		int8_t offset = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
+		gb->cpu_reg.hl.reg = gb->cpu_reg.sp.reg + offset;
+		gb->cpu_reg.f.reg = 0;
+		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
+		gb->cpu_reg.f.f_bits.c = ((gb->cpu_reg.sp.reg & 0xFF) + (offset & 0xFF) > 0xFF) ? 1 : 0;
+		break;
 	}
-#endif
 
-		/* New Scanline. HBlank -> VBlank or OAM Scan */
-		if(gb->counter.lcd_count >= LCD_LINE_CYCLES)
-		{
-			gb->counter.lcd_count -= LCD_LINE_CYCLES;
+	case 0xF9: /* LD SP, HL */
+		gb->cpu_reg.sp.reg = gb->cpu_reg.hl.reg;
+		break;
 
-			/* Next line */
-			gb->hram_io[IO_LY] = gb->hram_io[IO_LY] + 1;
-			if (gb->hram_io[IO_LY] == LCD_VERT_LINES)
-				gb->hram_io[IO_LY] = 0;
+	case 0xFA: /* LD A, (imm) */
+	{
+#if WALNUT_GB_16_BIT_DISABLED
+    uint16_t addr = __gb_read16(gb, gb->cpu_reg.pc.reg);
+    gb->cpu_reg.pc.reg += 2; // advance past the immediate
+#else
+    uint8_t l = __gb_read(gb, gb->cpu_reg.pc.reg++);
+    uint8_t h = __gb_read(gb, gb->cpu_reg.pc.reg++);
+    uint16_t addr = WALNUT_GB_U8_TO_U16(h, l);
+#endif
+		gb->cpu_reg.a = __gb_read(gb, addr);
+		break;
+	}
 
-			/* LYC Update */
-			if(gb->hram_io[IO_LY] == gb->hram_io[IO_LYC])
-			{
-				gb->hram_io[IO_STAT] |= STAT_LYC_COINC;
+	case 0xFB: /* EI */
+		gb->gb_ime = true;
+		__gb_update_irq(gb);
+		break;
 
-				if(gb->hram_io[IO_STAT] & STAT_LYC_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
-			}
-			else
-				gb->hram_io[IO_STAT] &= 0xFB;
+	case 0xFE: /* CP imm */
+	{
+		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		WGB_INSTR_CP_R8(val);
+		break;
+	}
 
-			/* Check if LCD should be in Mode 1 (VBLANK) state */
-			if(gb->hram_io[IO_LY] == LCD_HEIGHT)
-			{
-				gb->hram_io[IO_STAT] =
-					(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_VBLANK;
-				gb->gb_frame = true;
-				gb->hram_io[IO_IF] |= VBLANK_INTR;
-				gb->lcd_blank = false;
+	case 0xFF: /* RST 0x0038 */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		gb->cpu_reg.pc.reg = 0x0038;
+		break;
 
-				if(gb->hram_io[IO_STAT] & STAT_MODE_1_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
+	default:
+		/* Return address where invalid opcode that was read. */
+		(gb->gb_error)(gb, GB_INVALID_OPCODE, gb->cpu_reg.pc.reg - 1);
+		WGB_UNREACHABLE();
+	}
 
-#if ENABLE_LCD
-				/* If frame skip is activated, check if we need to draw
-				 * the frame or skip it. */
-				if(gb->direct.frame_skip)
-				{
-					gb->display.frame_skip_count =
-						!gb->display.frame_skip_count;
-				}
+	return inst_cycles;
+}
 
-				/* If interlaced is activated, change which lines get
-				 * updated. Also, only update lines on frames that are
-				 * actually drawn when frame skip is enabled. */
-				if(gb->direct.interlace &&
-						(!gb->direct.frame_skip ||
-						 gb->display.frame_skip_count))
-				{
-					gb->display.interlace_count =
-						!gb->display.interlace_count;
-				}
-#endif
-                                /* If halted forever, then return on VBLANK. */
-                                if(gb->gb_halt && !gb->hram_io[IO_IE])
-					break;
-			}
-			/* Start of normal Line (not in VBLANK) */
-			else if(gb->hram_io[IO_LY] < LCD_HEIGHT)
-			{
-				if(gb->hram_io[IO_LY] == 0)
-				{
-					/* Clear Screen */
-					gb->display.WY = gb->hram_io[IO_WY];
-					gb->display.window_clear = 0;
-				}
+/* Steps the cpu by one instruction, this is the original Peanut-GB dispatch method here for compatibility, or for burning cycles inefficiently if doing preemptive execution */
+void __gb_step_cpu_x(struct gb_s *gb)
+{
+	uint8_t opcode;
+	uint_fast16_t inst_cycles;
+	static const uint8_t op_cycles[0x100] =
+	{
+		/* *INDENT-OFF* */
+		/*0 1 2  3  4  5  6  7  8  9  A  B  C  D  E  F	*/
+		4,12, 8, 8, 4, 4, 8, 4,20, 8, 8, 8, 4, 4, 8, 4,	/* 0x00 */
+		4,12, 8, 8, 4, 4, 8, 4,12, 8, 8, 8, 4, 4, 8, 4,	/* 0x10 */
+		8,12, 8, 8, 4, 4, 8, 4, 8, 8, 8, 8, 4, 4, 8, 4,	/* 0x20 */
+		8,12, 8, 8,12,12,12, 4, 8, 8, 8, 8, 4, 4, 8, 4,	/* 0x30 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x40 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x50 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x60 */
+		8, 8, 8, 8, 8, 8, 4, 8, 4, 4, 4, 4, 4, 4, 8, 4, /* 0x70 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x80 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x90 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0xA0 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0xB0 */
+		8,12,12,16,12,16, 8,16, 8,16,12, 8,12,24, 8,16,	/* 0xC0 */
+		8,12,12, 0,12,16, 8,16, 8,16,12, 0,12, 0, 8,16,	/* 0xD0 */
+		12,12,8, 0, 0,16, 8,16,16, 4,16, 0, 0, 0, 8,16,	/* 0xE0 */
+		12,12,8, 4, 0,16, 8,16,12, 8,16, 4, 0, 0, 8,16	/* 0xF0 */
+		/* *INDENT-ON* */
+	};
 
-				/* OAM Search occurs at the start of the line. */
-				gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_OAM_SCAN;
-				gb->counter.lcd_count = 0;
+	/* Handle interrupts */
+	/* If gb_halt is positive, then an interrupt must have occurred by the
+	 * time we reach here, because on HALT, we jump to the next interrupt
+	 * immediately. */
+	if(WGB_UNLIKELY(gb->irq_pending))
+		__gb_interrupt(gb);
 
-#if WALNUT_FULL_GBC_SUPPORT
-				//DMA GBC
-				if(gb->cgb.cgbMode && !gb->cgb.dmaActive && gb->cgb.dmaMode)
-				{
-#if WALNUT_GB_32BIT_DMA
-					// Optimized 16-bit path
-					for (uint8_t i = 0; i < 0x10; i += 4)
-					{
-							uint32_t val = __gb_read32(gb, (gb->cgb.dmaSource & 0xFFF0) + i);
-							__gb_write32(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i, val);
-							// 8-bit logic if there is some cause to fall back
-							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i, val);
-							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i + 1, val >> 8);
-							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i + 2, val >> 16);
-							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i + 3, val >> 24);
-					}
-#elif WALNUT_GB_16BIT_DMA
-					// Optimized 16-bit path
-					for (uint8_t i = 0; i < 0x10; i += 2)
-					{
-							uint16_t val = __gb_read16(gb, (gb->cgb.dmaSource & 0xFFF0) + i);
-							__gb_write16(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i, val);
-							// 8-bit logic if there is some cause to fall back
-							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i, val & 0xFF);
-							// __gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i + 1, val >> 8);
-					}
-#else
-			    // Original 8-bit path
-					for (uint8_t i = 0; i < 0x10; i++)
-					{
-						__gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i,
-										__gb_read(gb, (gb->cgb.dmaSource & 0xFFF0) + i));
-					}
-#endif
+#if WALNUT_GB_IDLE_SKIP || WALNUT_GB_COPY_LOOPS
+	/* Loops are only looked for when the PC moves backwards. */
+	if(WGB_UNLIKELY(gb->cpu_reg.pc.reg <= gb->loop_prev_pc))
+		__gb_loop_check(gb);
 
-					gb->cgb.dmaSource += 0x10;
-					gb->cgb.dmaDest += 0x10;
-					if(!(--gb->cgb.dmaSize)) {gb->cgb.dmaActive = 1;
-					}
-				}
+	gb->loop_prev_pc = gb->cpu_reg.pc.reg;
 #endif
-				if(gb->hram_io[IO_STAT] & STAT_MODE_2_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
 
-				/* If halted immediately jump to next LCD mode.
-				 * From OAM Search to LCD Draw. */
-				//if(gb->counter.lcd_count < LCD_MODE2_OAM_SCAN_END)
-				//	inst_cycles = LCD_MODE2_OAM_SCAN_END - gb->counter.lcd_count;
-				inst_cycles = LCD_MODE2_OAM_SCAN_DURATION;
-			}
-		}
-		/* Go from Mode 3 (LCD Draw) to Mode 0 (HBLANK). */
-		else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_LCD_DRAW &&
-				gb->counter.lcd_count >= LCD_MODE3_LCD_DRAW_END)
-		{
-			gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_HBLANK;
+	/* Obtain opcode */
+	opcode = __gb_read(gb, gb->cpu_reg.pc.reg++);
 
-			if(gb->hram_io[IO_STAT] & STAT_MODE_0_INTR)
-				gb->hram_io[IO_IF] |= LCDC_INTR;
+	/* Execute opcode */
+	inst_cycles = __gb_execute_opcode(gb, opcode, op_cycles[opcode]);
 
-			/* If halted immediately, jump from OAM Scan to LCD Draw. */
-			if (gb->counter.lcd_count < LCD_MODE0_HBLANK_MAX_DRUATION)
-				inst_cycles = LCD_MODE0_HBLANK_MAX_DRUATION - gb->counter.lcd_count;
-		}
-		/* Go from Mode 2 (OAM Scan) to Mode 3 (LCD Draw). */
-		else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_OAM_SCAN &&
-				gb->counter.lcd_count >= LCD_MODE2_OAM_SCAN_END)
-		{
-			gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_LCD_DRAW;
-#if ENABLE_LCD
-			if(!gb->lcd_blank)
-				__gb_draw_line(gb);
-#endif
-			/* If halted immediately jump to next LCD mode. */
-			if (gb->counter.lcd_count < LCD_MODE3_LCD_DRAW_MIN_DURATION)
-				inst_cycles = LCD_MODE3_LCD_DRAW_MIN_DURATION - gb->counter.lcd_count;
-		}
-	} while(gb->gb_halt && (gb->hram_io[IO_IF] & gb->hram_io[IO_IE]) == 0);
-	/* If halted, loop until an interrupt occurs. */
+	/* Counters are only updated once the next event is due. */
+	gb->counter.pending_cycles += inst_cycles;
+	if(gb->counter.pending_cycles >= gb->counter.next_event)
+		__gb_run_events(gb);
 }
 
 /* Undefine CPU Flag helper functions. */